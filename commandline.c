@@ -1092,6 +1092,153 @@ int app_mdp_ping(const struct cli_parsed *parsed, void *context)
   return ret;
 }
 
+static void mdp_bench_frame(overlay_mdp_frame *mdp, const sid_t *sid, int port, int sequence)
+{
+  mdp->packetTypeAndFlags=MDP_TX|MDP_NOCRYPT|MDP_NOSIGN;
+  bcopy(sid->binary, mdp->out.src.sid, SID_SIZE);
+  bcopy(sid->binary, mdp->out.dst.sid, SID_SIZE);
+  mdp->out.src.port=port;
+  mdp->out.dst.port=MDP_PORT_ECHO;
+  mdp->out.queue=OQ_ORDINARY;
+  mdp->out.ttl=0;
+  mdp->out.payload_length=32;
+  bzero(mdp->out.payload, 32);
+  write_uint32(mdp->out.payload, sequence);
+}
+
+/* Send count frames to our own echo service over the socket, batch at a time, and return how many
+   echoes came back. */
+static int mdp_bench_socket(const sid_t *sid, int port, int count, int batch)
+{
+  overlay_mdp_frame mdp;
+  int sent=0, received=0;
+  while (sent<count){
+    int i;
+    for (i=0;i<batch && sent<count;i++){
+      mdp_bench_frame(&mdp, sid, port, sent++);
+      if (overlay_mdp_send(&mdp,0,0))
+	return received;
+    }
+    time_ms_t timeout=gettime_ms()+1000;
+    while (received<sent && overlay_mdp_client_poll(timeout-gettime_ms())>0){
+      int ttl=-1;
+      while (overlay_mdp_recv(&mdp, port, &ttl)==0)
+	received++;
+    }
+    if (received<sent)
+      break;
+  }
+  return received;
+}
+
+/* The same as mdp_bench_socket(), but through the shared memory rings */
+static int mdp_bench_ring(const sid_t *sid, int port, int count, int batch)
+{
+  int sent=0, received=0;
+  while (sent<count){
+    overlay_mdp_frame *mdp;
+    int i;
+    for (i=0;i<batch && sent<count && (mdp=overlay_mdp_ring_claim());i++)
+      mdp_bench_frame(mdp, sid, port, sent++);
+    if (overlay_mdp_ring_send())
+      return received;
+    time_ms_t timeout=gettime_ms()+1000;
+    while (received<sent && overlay_mdp_ring_poll(timeout-gettime_ms())>0){
+      overlay_mdp_frame *frames[MDP_RING_SLOTS];
+      int n=overlay_mdp_ring_recv(frames, MDP_RING_SLOTS);
+      overlay_mdp_ring_done(n);
+      received+=n;
+    }
+    if (received<sent)
+      break;
+  }
+  return received;
+}
+
+int app_mdp_bench(const struct cli_parsed *parsed, void *context)
+{
+  if (config.debug.verbose)
+    DEBUG_cli_parsed(parsed);
+  const char *arg;
+  if (cli_arg(parsed, "count", &arg, cli_uint, "10000") == -1)
+    return -1;
+  int count=atoi(arg);
+  
+  sid_t srcsid;
+  int port=32768+(random()&32767);
+  if (overlay_mdp_getmyaddr(0, &srcsid)) return WHY("Could not get local address");
+  if (overlay_mdp_bind(&srcsid, port)) return WHY("Could not bind to MDP socket");
+  
+  int ret=0;
+  int pass;
+  for (pass=0;pass<2;pass++){
+    const char *transport="socket";
+    int (*bench)(const sid_t *, int, int, int)=mdp_bench_socket;
+    /* The kernel won't queue more than a few datagrams (net.unix.max_dgram_qlen, 10 by default)
+       on a local socket */
+    int batch=8;
+    if (pass==1){
+      if (overlay_mdp_ring_open()){
+	printf("Shared memory rings are not available\n");
+	break;
+      }
+      transport="ring";
+      bench=mdp_bench_ring;
+      batch=64;
+    }
+    time_ms_t start=gettime_ms();
+    int received=bench(&srcsid, port, count, 1);
+    time_ms_t elapsed=gettime_ms()-start;
+    printf("%s ping-pong: %d of %d echoes, %.1fus round trip\n",
+	   transport, received, count, received ? elapsed*1000.0/received : 0);
+    if (received<count)
+      ret=-1;
+    
+    start=gettime_ms();
+    received=bench(&srcsid, port, count, batch);
+    elapsed=gettime_ms()-start;
+    printf("%s batches of %d: %d of %d echoes, %.0f frames per second\n",
+	   transport, batch, received, count, elapsed ? received*1000.0/elapsed : 0);
+    if (received<count)
+      ret=-1;
+  }
+  overlay_mdp_client_done();
+  return ret;
+}
+
+int app_mdp_bind(const struct cli_parsed *parsed, void *context)
+{
+  if (config.debug.verbose)
+    DEBUG_cli_parsed(parsed);
+  const char *port_arg, *wait_arg;
+  if (cli_arg(parsed, "port", &port_arg, cli_uint, NULL) == -1
+   || cli_arg(parsed, "wait_ms", &wait_arg, cli_uint, "0") == -1)
+    return -1;
+  int port=atoi(port_arg);
+  
+  sid_t srcsid;
+  if (overlay_mdp_getmyaddr(0, &srcsid)) return WHY("Could not get local address");
+  
+  /* Unlike overlay_mdp_bind(), don't take the port from another client that is still using it */
+  overlay_mdp_frame mdp;
+  bzero(&mdp, sizeof mdp);
+  mdp.packetTypeAndFlags=MDP_BIND;
+  bcopy(srcsid.binary, mdp.bind.sid, SID_SIZE);
+  mdp.bind.port=port;
+  if (overlay_mdp_send(&mdp,MDP_AWAITREPLY,5000)){
+    if (mdp.packetTypeAndFlags==MDP_ERROR)
+      WHYF("Could not bind to MDP port %d: error=%d, message='%s'",
+	   port,mdp.error.error,mdp.error.message);
+    overlay_mdp_client_done();
+    return WHYF("Could not bind to MDP port %d", port);
+  }
+  printf("Bound MDP port %d\n", port);
+  fflush(stdout);
+  sleep_ms(atoi(wait_arg));
+  overlay_mdp_client_done();
+  return 0;
+}
+
 int app_trace(const struct cli_parsed *parsed, void *context){
   
   const char *sidhex;
@@ -1465,6 +1612,364 @@ int app_slip_test(const struct cli_parsed *parsed, void *context)
   return 0;
 }
 
+struct sched_test_node{
+  struct sched_test_node *next;
+  struct sched_test_node *prev;
+  time_ms_t alarm;
+};
+
+static void sched_test_alarm(struct sched_ent *alarm)
+{
+}
+
+static int sched_test_runs;
+
+static void sched_test_count_alarm(struct sched_ent *alarm)
+{
+  sched_test_runs++;
+}
+
+static int sched_test_self_runs;
+
+// keeps scheduling itself with a deadline that has already passed
+static void sched_test_self_alarm(struct sched_ent *alarm)
+{
+  sched_test_self_runs++;
+  alarm->alarm = alarm->deadline = gettime_ms() - 1;
+  schedule(alarm);
+}
+
+int app_sched_test(const struct cli_parsed *parsed, void *context)
+{
+  if (config.debug.verbose)
+    DEBUG_cli_parsed(parsed);
+  const char *arg;
+  if (cli_arg(parsed, "count", &arg, cli_uint, "100000") == -1)
+    return -1;
+  int count = atoi(arg);
+  if (count < 1)
+    return WHY("Invalid count");
+  static struct profile_total test_stats={.name="sched_test_alarm"};
+  struct sched_ent *alarms = emalloc_zero(count * sizeof(struct sched_ent));
+  struct sched_test_node *nodes = emalloc_zero(count * sizeof(struct sched_test_node));
+  int *order = emalloc(count * sizeof(int));
+  if (!alarms || !nodes || !order)
+    return -1;
+  int i;
+  time_ms_t now = gettime_ms();
+  for (i = 0; i < count; i++) {
+    alarms[i].function = sched_test_alarm;
+    alarms[i].stats = &test_stats;
+    alarms[i].alarm = nodes[i].alarm = now + 60000 + random() % 3600000;
+    alarms[i].deadline = alarms[i].alarm + 1000;
+    order[i] = i;
+  }
+  // cancel in a different random order to the one we scheduled in
+  for (i = count - 1; i > 0; i--) {
+    int j = random() % (i + 1);
+    int t = order[i];
+    order[i] = order[j];
+    order[j] = t;
+  }
+
+  printf("Benchmarking scheduler with %d alarms:\n", count);
+  time_ns_t start = gettime_ns();
+  for (i = 0; i < count; i++)
+    schedule(&alarms[i]);
+  time_ns_t mid = gettime_ns();
+  for (i = 0; i < count; i++)
+    unschedule(&alarms[order[i]]);
+  time_ns_t end = gettime_ns();
+  printf("heap schedule - took %.3fms - mean time = %.1fns\n",
+	 (mid - start) / 1e6, (double) (mid - start) / count);
+  printf("heap unschedule - took %.3fms - mean time = %.1fns\n",
+	 (end - mid) / 1e6, (double) (end - mid) / count);
+
+  // the sorted, doubly linked list that fdqueue.c used to keep alarms in
+  struct sched_test_node *head = NULL;
+  start = gettime_ns();
+  for (i = 0; i < count; i++) {
+    struct sched_test_node *node = head, *last = NULL;
+    while (node && node->alarm <= nodes[i].alarm) {
+      last = node;
+      node = node->next;
+    }
+    if (last)
+      last->next = &nodes[i];
+    else
+      head = &nodes[i];
+    nodes[i].prev = last;
+    nodes[i].next = node;
+    if (node)
+      node->prev = &nodes[i];
+  }
+  mid = gettime_ns();
+  for (i = 0; i < count; i++) {
+    struct sched_test_node *node = &nodes[order[i]];
+    if (node->prev)
+      node->prev->next = node->next;
+    else
+      head = node->next;
+    if (node->next)
+      node->next->prev = node->prev;
+    node->next = node->prev = NULL;
+  }
+  end = gettime_ns();
+  printf("list schedule - took %.3fms - mean time = %.1fns\n",
+	 (mid - start) / 1e6, (double) (mid - start) / count);
+  printf("list unschedule - took %.3fms - mean time = %.1fns\n",
+	 (end - mid) / 1e6, (double) (end - mid) / count);
+  free(nodes);
+  free(order);
+
+  // an alarm that keeps rescheduling itself in the past must not starve the others that are due
+  static struct profile_total self_stats={.name="sched_test_self_alarm"};
+  struct sched_ent self;
+  bzero(&self, sizeof self);
+  self.function = sched_test_self_alarm;
+  self.stats = &self_stats;
+  int others = count < 100 ? count : 100;
+  now = gettime_ms();
+  self.alarm = self.deadline = now - 1;
+  schedule(&self);
+  for (i = 0; i < others; i++) {
+    bzero(&alarms[i], sizeof alarms[i]);
+    alarms[i].function = sched_test_count_alarm;
+    alarms[i].stats = &test_stats;
+    alarms[i].alarm = alarms[i].deadline = now;
+    schedule(&alarms[i]);
+  }
+  sched_test_runs = sched_test_self_runs = 0;
+  int polls;
+  for (polls = 0; polls <= 2 * others && sched_test_runs < others; polls++)
+    fd_poll();
+  unschedule(&self);
+  for (i = 0; i < others; i++)
+    unschedule(&alarms[i]);
+  free(alarms);
+  printf("self-rescheduling alarm - %d polls called %d of %d other alarms, and it ran %d times\n",
+	 polls, sched_test_runs, others, sched_test_self_runs);
+  if (sched_test_runs < others)
+    return WHY("Self-rescheduling alarm starved the other alarms");
+  if (sched_test_self_runs > polls)
+    return WHY("Self-rescheduling alarm ran more than once per pass");
+  return 0;
+}
+
+static double rhizome_version_test_pass(int count, unsigned char (*bids)[RHIZOME_MANIFEST_ID_BYTES], rhizome_manifest *m)
+{
+  time_ns_t start = gettime_ns();
+  int i;
+  for (i = 0; i < count; i++) {
+    // a manifest advertisement, then a BAR, for the version we already hold
+    bcopy(bids[i], m->cryptoSignPublic, RHIZOME_MANIFEST_ID_BYTES);
+    rhizome_manifest_set(m, "id", alloca_tohex(bids[i], RHIZOME_MANIFEST_ID_BYTES));
+    rhizome_manifest_set_ll(m, "version", i);
+    rhizome_manifest_version_cache_lookup(m);
+    unsigned char bar[RHIZOME_BAR_BYTES];
+    bzero(bar, sizeof bar);
+    bcopy(bids[i], &bar[RHIZOME_BAR_PREFIX_OFFSET], RHIZOME_BAR_PREFIX_BYTES);
+    int j;
+    for (j = 0; j < 7; j++)
+      bar[RHIZOME_BAR_VERSION_OFFSET + 6 - j] = ((int64_t)i >> (8 * j)) & 0xff;
+    rhizome_is_bar_interesting(bar);
+  }
+  time_ns_t end = gettime_ns();
+  return end > start ? count * 1e9 / (end - start) : 0;
+}
+
+int app_rhizome_version_test(const struct cli_parsed *parsed, void *context)
+{
+  if (config.debug.verbose)
+    DEBUG_cli_parsed(parsed);
+  const char *arg;
+  if (cli_arg(parsed, "count", &arg, cli_uint, "10000") == -1)
+    return -1;
+  int count = atoi(arg);
+  if (count < 1)
+    return WHY("Invalid count");
+  if (rhizome_opendb() == -1)
+    return -1;
+  unsigned char (*bids)[RHIZOME_MANIFEST_ID_BYTES] = emalloc(count * RHIZOME_MANIFEST_ID_BYTES);
+  if (!bids)
+    return -1;
+  rhizome_manifest *m = rhizome_new_manifest();
+  if (!m) {
+    free(bids);
+    return WHY("Out of manifests");
+  }
+  int ret = -1;
+  // the test bundles are never committed, so the store is left untouched
+  sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
+  if (sqlite_exec_void_retry(&retry, "BEGIN TRANSACTION;") == -1)
+    goto done;
+  sqlite3_stmt *statement = sqlite_prepare(&retry, "INSERT INTO MANIFESTS(id,version,inserttime) VALUES(?,?,?);");
+  if (!statement)
+    goto rollback;
+  int i;
+  for (i = 0; i < count; i++) {
+    urandombytes(bids[i], RHIZOME_MANIFEST_ID_BYTES);
+    sqlite3_bind_text(statement, 1, alloca_tohex(bids[i], RHIZOME_MANIFEST_ID_BYTES), -1, SQLITE_TRANSIENT);
+    sqlite3_bind_int64(statement, 2, i);
+    sqlite3_bind_int64(statement, 3, gettime_ms());
+    if (sqlite_step_retry(&retry, statement) == -1) {
+      sqlite3_finalize(statement);
+      goto rollback;
+    }
+    sqlite3_reset(statement);
+  }
+  sqlite3_finalize(statement);
+
+  int32_t cache_size = config.rhizome.version_cache_size;
+  printf("Benchmarking advertisement processing with %d stored bundles:\n", count);
+  config.rhizome.version_cache_size = 0;
+  printf("without version index - %.0f adverts/sec\n", rhizome_version_test_pass(count, bids, m));
+  config.rhizome.version_cache_size = cache_size ? cache_size : count;
+  printf("version index of %d, cold - %.0f adverts/sec\n", config.rhizome.version_cache_size, rhizome_version_test_pass(count, bids, m));
+  printf("version index of %d, warm - %.0f adverts/sec\n", config.rhizome.version_cache_size, rhizome_version_test_pass(count, bids, m));
+  config.rhizome.version_cache_size = cache_size;
+  ret = 0;
+rollback:
+  sqlite_exec_void_retry(&retry, "ROLLBACK;");
+done:
+  rhizome_manifest_free(m);
+  free(bids);
+  return ret;
+}
+
+int app_rhizome_signature_test(const struct cli_parsed *parsed, void *context)
+{
+  if (config.debug.verbose)
+    DEBUG_cli_parsed(parsed);
+  const char *arg;
+  if (cli_arg(parsed, "count", &arg, cli_uint, "256") == -1)
+    return -1;
+  int count = atoi(arg);
+  if (cli_arg(parsed, "repeat", &arg, cli_uint, "20") == -1)
+    return -1;
+  int repeat = atoi(arg);
+  if (count < 1 || repeat < 1)
+    return WHY("Invalid count");
+  unsigned char sign_pk[crypto_sign_edwards25519sha512batch_PUBLICKEYBYTES];
+  unsigned char sign_sk[crypto_sign_edwards25519sha512batch_SECRETKEYBYTES];
+  if (crypto_sign_edwards25519sha512batch_keypair(sign_pk, sign_sk))
+    return WHY("crypto_sign_edwards25519sha512batch_keypair() failed");
+  // a manifest hash followed by its signature block, as found after a manifest body
+  unsigned char (*adverts)[crypto_hash_sha512_BYTES + 96] = emalloc(count * (crypto_hash_sha512_BYTES + 96));
+  if (!adverts)
+    return -1;
+  int i;
+  for (i = 0; i < count; i++) {
+    unsigned char signed_hash[crypto_sign_edwards25519sha512batch_BYTES + crypto_hash_sha512_BYTES];
+    unsigned long long sig_len = 0;
+    urandombytes(adverts[i], crypto_hash_sha512_BYTES);
+    if (crypto_sign_edwards25519sha512batch(signed_hash, &sig_len, adverts[i], crypto_hash_sha512_BYTES, sign_sk)) {
+      free(adverts);
+      return WHY("crypto_sign_edwards25519sha512batch() failed");
+    }
+    bcopy(signed_hash, &adverts[i][crypto_hash_sha512_BYTES], 64);
+    bcopy(sign_pk, &adverts[i][crypto_hash_sha512_BYTES + 64], sizeof sign_pk);
+  }
+
+  printf("Benchmarking manifest signature verification with %d manifests each received %d times:\n", count, repeat);
+  rhizome_signature_cache_clear();
+  int invalid = 0;
+  time_ns_t start = gettime_ns();
+  for (i = 0; i < count; i++)
+    if (rhizome_manifest_lookup_signature_validity(adverts[i], &adverts[i][crypto_hash_sha512_BYTES], 96))
+      invalid++;
+  time_ns_t end = gettime_ns();
+  printf("first reception - %.0f verifies/sec\n", end > start ? count * 1e9 / (end - start) : 0);
+  start = gettime_ns();
+  int n;
+  for (n = 0; n < count * (repeat - 1); n++) {
+    i = random() % count;
+    if (rhizome_manifest_lookup_signature_validity(adverts[i], &adverts[i][crypto_hash_sha512_BYTES], 96))
+      invalid++;
+  }
+  end = gettime_ns();
+  printf("repeated reception - %.0f verifies/sec\n", end > start ? n * 1e9 / (end - start) : 0);
+  printf("signature cache: %u hits, %u misses, %u evictions, %d invalid\n",
+	 rhizome_signature_cache_stats.hits, rhizome_signature_cache_stats.misses,
+	 rhizome_signature_cache_stats.evictions, invalid);
+  free(adverts);
+  return invalid ? WHY("Valid signatures failed verification") : 0;
+}
+
+int app_rhizome_manifest_test(const struct cli_parsed *parsed, void *context)
+{
+  if (config.debug.verbose)
+    DEBUG_cli_parsed(parsed);
+  const char *arg;
+  if (cli_arg(parsed, "count", &arg, cli_uint, "100000") == -1)
+    return -1;
+  int count = atoi(arg);
+  if (count < 1)
+    return WHY("Invalid count");
+  // parse a rotating set of distinct manifests, so we don't just measure one that stays in cache
+  const int distinct = 1024;
+  char (*texts)[1024] = emalloc(distinct * 1024);
+  if (!texts)
+    return -1;
+  int i;
+  for (i = 0; i < distinct; i++) {
+    unsigned char id[RHIZOME_MANIFEST_ID_BYTES], hash[SHA512_DIGEST_LENGTH];
+    unsigned char sender[SID_SIZE], recipient[SID_SIZE];
+    urandombytes(id, sizeof id);
+    urandombytes(hash, sizeof hash);
+    urandombytes(sender, sizeof sender);
+    urandombytes(recipient, sizeof recipient);
+    snprintf(texts[i], sizeof texts[i],
+	     "service=file\nid=%s\nversion=%d\nfilesize=%d\nfilehash=%s\ndate=%lld\nname=file%d\nsender=%s\nrecipient=%s\n",
+	     alloca_tohex(id, sizeof id), i, 1000 + i, alloca_tohex(hash, sizeof hash),
+	     (long long)gettime_ms(), i, alloca_tohex(sender, sizeof sender), alloca_tohex(recipient, sizeof recipient));
+  }
+
+  printf("Benchmarking manifest parsing and field access with %d manifests:\n", count);
+  int invalid = 0;
+  time_ns_t start = gettime_ns();
+  for (i = 0; i < count; i++) {
+    rhizome_manifest *m = rhizome_new_manifest();
+    if (!m) {
+      free(texts);
+      return WHY("Out of manifests");
+    }
+    const char *text = texts[i % distinct];
+    if (rhizome_read_manifest_file(m, text, strlen(text) + 1) == -1 || m->errors)
+      invalid++;
+    rhizome_manifest_free(m);
+  }
+  time_ns_t end = gettime_ns();
+  printf("parse - %.0f manifests/sec\n", end > start ? count * 1e9 / (end - start) : 0);
+
+  // the fields a manifest's consumers look up, roughly as often as storing and listing bundles do
+  rhizome_manifest *m = rhizome_new_manifest();
+  if (!m) {
+    free(texts);
+    return WHY("Out of manifests");
+  }
+  if (rhizome_read_manifest_file(m, texts[0], strlen(texts[0]) + 1) == -1 || m->errors)
+    invalid++;
+  start = gettime_ns();
+  for (i = 0; i < count; i++) {
+    rhizome_manifest_get(m, "service", NULL, 0);
+    rhizome_manifest_get(m, "id", NULL, 0);
+    rhizome_manifest_get_ll(m, "version");
+    rhizome_manifest_get_ll(m, "filesize");
+    rhizome_manifest_get(m, "filehash", NULL, 0);
+    rhizome_manifest_get_ll(m, "date");
+    rhizome_manifest_get(m, "name", NULL, 0);
+    rhizome_manifest_get(m, "sender", NULL, 0);
+    rhizome_manifest_get(m, "recipient", NULL, 0);
+    rhizome_manifest_get_double(m, "min_lat", -90);
+  }
+  end = gettime_ns();
+  printf("field access - %.0f lookups/sec\n", end > start ? count * 10 * 1e9 / (end - start) : 0);
+  rhizome_manifest_free(m);
+  free(texts);
+  return invalid ? WHYF("%d manifests failed to parse", invalid) : 0;
+}
+
 int app_rhizome_import_bundle(const struct cli_parsed *parsed, void *context)
 {
   if (config.debug.verbose)
@@ -1843,6 +2348,72 @@ int app_keyring_add(const struct cli_parsed *parsed, void *context)
   return 0;
 }
 
+/* Time how long it takes to unlock keyrings of various sizes, as the server does
+   when it starts, trying every slot one at a time and then with the usual number
+   of threads. */
+int app_keyring_test(const struct cli_parsed *parsed, void *context)
+{
+  if (config.debug.verbose)
+    DEBUG_cli_parsed(parsed);
+  const char *arg;
+  if (cli_arg(parsed, "count", &arg, cli_uint, "0") == -1)
+    return -1;
+  int sizes[] = { 10, 100, 1000 };
+  int size_count = sizeof sizes / sizeof sizes[0];
+  if (atoi(arg) > 0) {
+    sizes[0] = atoi(arg);
+    size_count = 1;
+  }
+  if (create_serval_instance_dir() == -1)
+    return -1;
+  char keyringFile[1024];
+  if (!FORM_SERVAL_INSTANCE_PATH(keyringFile, "keyring-test.keyring"))
+    return -1;
+  int threads = config.keyring.unlock_threads;
+  int ret = 0;
+  int n;
+  for (n = 0; n < size_count && ret == 0; n++) {
+    unlink(keyringFile);
+    keyring_file *k = keyring_open(keyringFile);
+    if (!k)
+      return -1;
+    keyring_enter_pin(k, "");
+    int i;
+    for (i = 0; i < sizes[n]; i++)
+      if (!keyring_create_identity(k, k->contexts[0], "")) {
+	keyring_free(k);
+	unlink(keyringFile);
+	return WHY("Could not create new identity");
+      }
+    if (keyring_commit(k) == -1) {
+      keyring_free(k);
+      unlink(keyringFile);
+      return WHY("Could not write keyring file");
+    }
+    keyring_free(k);
+    printf("Benchmarking unlock of a keyring with %d identities:\n", sizes[n]);
+    int pass;
+    for (pass = 0; pass < 2; pass++) {
+      config.keyring.unlock_threads = pass ? threads : 1;
+      time_ns_t start = gettime_ns();
+      k = keyring_open(keyringFile);
+      int found = k ? keyring_enter_pin(k, "") : -1;
+      time_ns_t end = gettime_ns();
+      keyring_free(k);
+      if (found != sizes[n]) {
+	ret = WHYF("Found %d of %d identities", found, sizes[n]);
+	break;
+      }
+      printf("%s - %.3fms, %.0f identities/sec\n",
+	     pass ? "threaded" : "one thread", (end - start) / 1e6,
+	     end > start ? found * 1e9 / (end - start) : 0);
+    }
+    config.keyring.unlock_threads = threads;
+  }
+  unlink(keyringFile);
+  return ret;
+}
+
 int app_keyring_set_did(const struct cli_parsed *parsed, void *context)
 {
   if (config.debug.verbose)
@@ -2168,15 +2739,47 @@ int app_node_info(const struct cli_parsed *parsed, void *context)
   return 0;
 }
 
+/* Print the records in one frame of the routing table, and return how many there were, leaving the
+   SID of the last one in last_sid */
+static int route_print_records(const overlay_mdp_frame *rx, unsigned char *last_sid)
+{
+  int ofs=0, count=0;
+  while(ofs + sizeof(struct overlay_route_record) <= rx->out.payload_length){
+    const struct overlay_route_record *p=(const struct overlay_route_record *)&rx->out.payload[ofs];
+    ofs+=sizeof(struct overlay_route_record);
+    count++;
+    memcpy(last_sid, p->sid, SID_SIZE);
+    
+    cli_put_hexvalue(p->sid, SID_SIZE, ":");
+    char flags[32];
+    strbuf b = strbuf_local(flags, sizeof flags);
+    
+    if (p->reachable==REACHABLE_NONE)
+      strbuf_puts(b, "NONE");
+    if (p->reachable & REACHABLE_SELF)
+      strbuf_puts(b, "SELF ");
+    if (p->reachable & REACHABLE_ASSUMED)
+      strbuf_puts(b, "ASSUMED ");
+    if (p->reachable & REACHABLE_BROADCAST)
+      strbuf_puts(b, "BROADCAST ");
+    if (p->reachable & REACHABLE_UNICAST)
+      strbuf_puts(b, "UNICAST ");
+    if (p->reachable & REACHABLE_INDIRECT)
+      strbuf_puts(b, "INDIRECT ");
+    cli_put_string(strbuf_str(b), ":");
+    cli_put_string(p->interface_name, ":");
+    cli_put_hexvalue(p->neighbour, SID_SIZE, "\n");
+  }
+  return count;
+}
+
 int app_route_print(const struct cli_parsed *parsed, void *context)
 {
   if (config.debug.verbose)
     DEBUG_cli_parsed(parsed);
   overlay_mdp_frame mdp;
-  bzero(&mdp,sizeof(mdp));
-  
-  mdp.packetTypeAndFlags=MDP_ROUTING_TABLE;
-  overlay_mdp_send(&mdp,0,0);
+  unsigned char last_sid[SID_SIZE];
+  int resume=0;
   
   const char *names[]={
     "Subscriber id",
@@ -2186,39 +2789,31 @@ int app_route_print(const struct cli_parsed *parsed, void *context)
   };
   cli_columns(4, names);
   
-  while(overlay_mdp_client_poll(200)){
-    overlay_mdp_frame rx;
-    int ttl;
-    if (overlay_mdp_recv(&rx, 0, &ttl))
-      continue;
+  /* Ask for the table a page at a time, until a frame comes back short */
+  while(1){
+    bzero(&mdp,sizeof(mdp));
+    mdp.packetTypeAndFlags=MDP_ROUTING_TABLE;
+    if (resume){
+      memcpy(mdp.out.payload, last_sid, SID_SIZE);
+      mdp.out.payload_length=SID_SIZE;
+    }
+    if (overlay_mdp_send(&mdp,0,0))
+      return -1;
     
-    int ofs=0;
-    while(ofs + sizeof(struct overlay_route_record) <= rx.out.payload_length){
-      struct overlay_route_record *p=(struct overlay_route_record *)&rx.out.payload[ofs];
-      ofs+=sizeof(struct overlay_route_record);
-      
-      cli_put_hexvalue(p->sid, SID_SIZE, ":");
-      char flags[32];
-      strbuf b = strbuf_local(flags, sizeof flags);
-      
-      if (p->reachable==REACHABLE_NONE)
-	strbuf_puts(b, "NONE");
-      if (p->reachable & REACHABLE_SELF)
-	strbuf_puts(b, "SELF ");
-      if (p->reachable & REACHABLE_ASSUMED)
-	strbuf_puts(b, "ASSUMED ");
-      if (p->reachable & REACHABLE_BROADCAST)
-	strbuf_puts(b, "BROADCAST ");
-      if (p->reachable & REACHABLE_UNICAST)
-	strbuf_puts(b, "UNICAST ");
-      if (p->reachable & REACHABLE_INDIRECT)
-	strbuf_puts(b, "INDIRECT ");
-      cli_put_string(strbuf_str(b), ":");
-      cli_put_string(p->interface_name, ":");
-      cli_put_hexvalue(p->neighbour, SID_SIZE, "\n");
+    int full_frames=0;
+    while(full_frames<MDP_ROUTE_FRAMES_PER_PAGE && overlay_mdp_client_poll(200)>0){
+      overlay_mdp_frame rx;
+      int ttl;
+      if (overlay_mdp_recv(&rx, 0, &ttl) || (rx.packetTypeAndFlags&MDP_TYPE_MASK)!=MDP_TX)
+	continue;
+      if (route_print_records(&rx, last_sid)<MDP_ROUTE_RECORDS_PER_FRAME)
+	return 0;
+      full_frames++;
     }
+    if (full_frames<MDP_ROUTE_FRAMES_PER_PAGE)
+      return WHY("Timeout waiting for the routing table");
+    resume=1;
   }
-  return 0;
 }
 
 int app_reverse_lookup(const struct cli_parsed *parsed, void *context)
@@ -2387,6 +2982,10 @@ struct cli_schema command_line_options[]={
    "Display information about any running Serval Mesh node."},
   {app_mdp_ping,{"mdp","ping","<SID|broadcast>","[<count>]",NULL}, 0,
    "Attempts to ping specified node via Mesh Datagram Protocol (MDP)."},
+  {app_mdp_bench,{"mdp","bench","[<count>]",NULL}, 0,
+   "Measure round trip time and throughput of MDP frames to the local server, over its socket and over shared memory rings"},
+  {app_mdp_bind,{"mdp","bind","<port>","[<wait_ms>]",NULL}, 0,
+   "Bind an MDP port, unless another client is using it, and hold it for <wait_ms> before releasing it."},
   {app_trace,{"mdp","trace","<SID>",NULL}, 0,
    "Trace through the network to the specified node via MDP."},
   {app_config_schema,{"config","schema",NULL},CLIFLAG_PERMISSIVE_CONFIG,
@@ -2474,10 +3073,30 @@ struct cli_schema command_line_options[]={
     "Lookup the phone number (DID) and name of a given subscriber (SID)"},
   {app_monitor_cli,{"monitor",NULL}, 0,
    "Interactive servald monitor interface."},
+  {app_monitor_stats,{"stats",NULL}, 0,
+   "Show how long the running server has spent in each profiled function recently, in nanoseconds"},
   {app_crypt_test,{"test","crypt",NULL}, 0,
    "Run cryptography speed test"},
   {app_slip_test,{"test","slip",NULL}, 0,
    "Run serial encapsulation test"},
+  {app_sched_test,{"test","scheduler","[<count>]",NULL}, 0,
+   "Run alarm scheduler speed test"},
+  {app_rhizome_version_test,{"test","rhizomeversions","[<count>]",NULL}, 0,
+   "Run Rhizome advertisement processing speed test, with and without the manifest version index"},
+  {app_rhizome_signature_test,{"test","rhizomesignatures","[<count>]","[<repeat>]",NULL}, 0,
+   "Run Rhizome manifest signature verification speed test, replaying repeated adverts"},
+  {app_rhizome_manifest_test,{"test","manifests","[<count>]",NULL}, 0,
+   "Run Rhizome manifest parsing and field access speed test"},
+  {app_monitor_test,{"test","monitor","[<count>]",NULL}, 0,
+   "Run monitor interface command throughput test against the running server"},
+  {app_route_test,{"test","routing","[<count>]",NULL}, 0,
+   "Run routing table speed test over 100, 1000 and 10000 simulated nodes, or <count> nodes"},
+  {app_keyring_test,{"test","keyring","[<count>]",NULL}, 0,
+   "Run keyring unlock speed test over keyrings of 10, 100 and 1000 identities, or of <count> identities"},
+  {app_nm_cache_test,{"test","nmcache","[<count>]",NULL}, 0,
+   "Run shared secret cache speed test with 10, 500 and 5000 peers, or <count> peers"},
+  {app_crypto_batch_test,{"test","batchverify",NULL}, 0,
+   "Run signature verification speed test, checking signatures one at a time and in batches"},
 #ifdef HAVE_VOIPTEST
   {app_pa_phone,{"phone",NULL}, 0,
    "Run phone test application"},
@@ -692,6 +692,12 @@ int cf_fmt_socket_type(const char **, const short *typep);
 int cf_opt_encapsulation(short *encapp, const char *text);
 int cf_fmt_encapsulation(const char **, const short *encapp);
 
+int cf_opt_sqlite_synchronous(short *syncp, const char *text);
+int cf_fmt_sqlite_synchronous(const char **, const short *syncp);
+
+int cf_opt_monitor_slow_client(short *policyp, const char *text);
+int cf_fmt_monitor_slow_client(const char **, const short *policyp);
+
 extern int cf_limbo;
 extern struct config_main config;
 
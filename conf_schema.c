@@ -668,6 +668,10 @@ int cf_opt_socket_type(short *typep, const char *text)
     *typep = SOCK_FILE;
     return CFOK;
   }
+  if (strcasecmp(text, "ring") == 0) {
+    *typep = SOCK_RING;
+    return CFOK;
+  }
   return CFINVALID;
 }
 
@@ -678,6 +682,7 @@ int cf_fmt_socket_type(const char **textp, const short *typep)
     case SOCK_DGRAM:  t = "dgram"; break;
     case SOCK_STREAM: t = "stream"; break;
     case SOCK_FILE:   t = "file"; break;
+    case SOCK_RING:   t = "ring"; break;
   }
   if (!t)
     return CFINVALID;
@@ -721,6 +726,80 @@ int cf_cmp_encapsulation(const short *a, const short *b)
   return cf_cmp_short(a, b);
 }
 
+/* The values are those of SQLite's "PRAGMA synchronous".
+ */
+int cf_opt_sqlite_synchronous(short *syncp, const char *text)
+{
+  if (strcasecmp(text, "off") == 0) {
+    *syncp = 0;
+    return CFOK;
+  }
+  if (strcasecmp(text, "normal") == 0) {
+    *syncp = 1;
+    return CFOK;
+  }
+  if (strcasecmp(text, "full") == 0) {
+    *syncp = 2;
+    return CFOK;
+  }
+  return CFINVALID;
+}
+
+int cf_fmt_sqlite_synchronous(const char **textp, const short *syncp)
+{
+  const char *t = NULL;
+  switch (*syncp) {
+    case 0: t = "off"; break;
+    case 1: t = "normal"; break;
+    case 2: t = "full"; break;
+  }
+  if (!t)
+    return CFINVALID;
+  *textp = str_edup(t);
+  return CFOK;
+}
+
+int cf_cmp_sqlite_synchronous(const short *a, const short *b)
+{
+  return cf_cmp_short(a, b);
+}
+
+int cf_opt_monitor_slow_client(short *policyp, const char *text)
+{
+  if (strcasecmp(text, "drop_oldest") == 0) {
+    *policyp = MONITOR_SLOW_DROP_OLDEST;
+    return CFOK;
+  }
+  if (strcasecmp(text, "drop_class") == 0) {
+    *policyp = MONITOR_SLOW_DROP_CLASS;
+    return CFOK;
+  }
+  if (strcasecmp(text, "disconnect") == 0) {
+    *policyp = MONITOR_SLOW_DISCONNECT;
+    return CFOK;
+  }
+  return CFINVALID;
+}
+
+int cf_fmt_monitor_slow_client(const char **textp, const short *policyp)
+{
+  const char *t = NULL;
+  switch (*policyp) {
+    case MONITOR_SLOW_DROP_OLDEST: t = "drop_oldest"; break;
+    case MONITOR_SLOW_DROP_CLASS: t = "drop_class"; break;
+    case MONITOR_SLOW_DISCONNECT: t = "disconnect"; break;
+  }
+  if (!t)
+    return CFINVALID;
+  *textp = str_edup(t);
+  return CFOK;
+}
+
+int cf_cmp_monitor_slow_client(const short *a, const short *b)
+{
+  return cf_cmp_short(a, b);
+}
+
 int cf_opt_pattern_list(struct pattern_list *listp, const char *text)
 {
   struct pattern_list list;
@@ -307,11 +307,20 @@ STRUCT(server)
 STRING(256,                 chdir,      "/", absolute_path,, "Absolute path of chdir(2) for server process")
 STRING(256,                 interface_path, "", str_nonempty,, "Path of directory containing interface files, either absolute or relative to instance directory")
 ATOM(bool_t,                respawn_on_crash, 0, boolean,, "If true, server will exec(2) itself on fatal signals, eg SEGV")
+ATOM(bool_t,                epoll,      1, boolean,, "If true, server will use epoll(7) instead of poll(2) to watch file handles, where supported")
+ATOM(int32_t,               alarm_budget_ms, 20, int32_nonneg,, "Milliseconds to spend calling expired alarms before servicing file handles, zero calls one alarm per poll")
 END_STRUCT
 
 STRUCT(monitor)
 STRING(256,                 socket,     DEFAULT_MONITOR_SOCKET_NAME, str_nonempty,, "Name of socket for monitor interface")
 ATOM(uint32_t,              uid,        0, uint32_nonzero,, "Allowed UID for monitor socket client")
+ATOM(uint32_t,              queue_size, 65536, uint32_nonzero,, "Bytes of output to hold for each monitor client that is not keeping up")
+ATOM(short,                 slow_client, MONITOR_SLOW_DROP_OLDEST, monitor_slow_client,, "What to do when a monitor client's output queue is full; drop_oldest, drop_class or disconnect")
+END_STRUCT
+
+STRUCT(keyring)
+ATOM(int32_t,               unlock_threads, 0, int32_nonneg,, "Number of threads trying keyring slots when a PIN is entered, zero for one per CPU")
+ATOM(uint32_t,              nm_cache_size,  512, uint32_nonzero,, "Number of peers to cache Curve25519 shared secrets for")
 END_STRUCT
 
 STRUCT(mdp_iftype)
@@ -382,6 +391,7 @@ END_STRUCT
 
 STRUCT(rhizome_mdp)
 ATOM(bool_t,                enable,     1, boolean,, "If true, Rhizome MDP server is started")
+ATOM(uint32_t,              swarm_peers, 4, uint32_nonzero,, "Most nodes to fetch a payload from at once over MDP")
 END_STRUCT
 
 STRUCT(rhizome_advertise)
@@ -396,10 +406,15 @@ ATOM(bool_t,                clean_on_open,  1, boolean,, "If true, Rhizome datab
 STRING(256,                 datastore_path, "", absolute_path,, "Path of rhizome storage directory, absolute or relative to instance directory")
 ATOM(uint64_t,              database_size,  1000000, uint64_scaled,, "Size of database in bytes")
 ATOM(bool_t,                external_blobs, 0, boolean,, "Store rhizome bundles as separate files.")
+ATOM(bool_t,                database_wal,   1, boolean,, "If true, Rhizome database uses a write-ahead log instead of a rollback journal")
+ATOM(short,                 database_synchronous, 1, sqlite_synchronous,, "When Rhizome database writes are synced to disk; off, normal or full")
+ATOM(uint64_t,              database_mmap_size, 16777216, uint64_scaled,, "Bytes of Rhizome database to access through memory mapping, zero to disable")
+ATOM(uint32_t,              checkpoint_interval_ms, 10000, uint32_nonzero,, "Interval between server checkpoints of the Rhizome database write-ahead log")
 
 ATOM(uint64_t,              rhizome_mdp_block_size, 512, uint64_scaled,, "Rhizome MDP block size.")
 ATOM(uint64_t,              idle_timeout,           RHIZOME_IDLE_TIMEOUT, uint64_scaled,, "Rhizome transfer timeout if no data received.")
 ATOM(uint32_t,              fetch_delay_ms,         50, uint32_nonzero,, "Delay from receiving first bundle advert to initiating fetch")
+ATOM(int32_t,               version_cache_size,     4096, int32_nonneg,, "Number of stored manifest versions to remember in memory, zero to always ask the database")
 SUB_STRUCT(rhizome_direct,  direct,)
 SUB_STRUCT(rhizome_api,     api,)
 SUB_STRUCT(rhizome_http,    http,)
@@ -434,12 +449,15 @@ ATOM(struct in_addr,        dummy_netmask,   hton_in_addr(0xFFFFFF00), in_addr,,
 ATOM(uint16_t,              port,            PORT_DNA, uint16_nonzero,, "Port number for network interface")
 ATOM(bool_t,                drop_broadcasts, 0, boolean,, "If true, drop all incoming broadcast packets")
 ATOM(bool_t,                drop_unicasts,   0, boolean,, "If true, drop all incoming unicast packets")
+ATOM(int32_t,               drop_packets,    0, int32_nonneg,, "Percentage of incoming packets to drop at random, to simulate a lossy link on dummy or ring interfaces")
+ATOM(int32_t,               latency_ms,      0, int32_nonneg,, "Milliseconds to hold each incoming packet before delivering it, to simulate a slow link on ring interfaces")
 ATOM(short,                 type,            OVERLAY_INTERFACE_WIFI, interface_type,, "Type of network interface")
 ATOM(int32_t,               packet_interval, -1, int32_nonneg,, "Minimum interval between packets in microseconds")
 ATOM(int32_t,               mdp_tick_ms,     -1, int32_nonneg,, "Override MDP tick interval for this interface")
 ATOM(bool_t,                send_broadcasts, 1, boolean,, "If false, don't send any broadcast packets")
 ATOM(bool_t,                default_route,   0, boolean,, "If true, use this interface as a default route")
 ATOM(bool_t,                prefer_unicast,  0, boolean,, "If true, send unicast data as unicast IP packets if available")
+ATOM(uint32_t,              receive_batch,   16, uint32_nonzero,, "Maximum number of packets to read each time the socket is readable")
 END_STRUCT
 
 ARRAY(interface_list, NO_DUPLICATES)
@@ -453,6 +471,7 @@ NODE_STRUCT(interface_list, interfaces, interface_list,)
 SUB_STRUCT(log,             log,)
 SUB_STRUCT(server,          server,)
 SUB_STRUCT(monitor,         monitor,)
+SUB_STRUCT(keyring,         keyring,)
 SUB_STRUCT(mdp,             mdp,)
 SUB_STRUCT(dna,             dna,)
 SUB_STRUCT(debug,           debug,)
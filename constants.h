@@ -60,6 +60,10 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #define SID_STRLEN (SID_SIZE*2)
 
 #define OVERLAY_MAX_INTERFACES 16
+/* Upper limit on the number of packets read from an interface socket in one go */
+#define OVERLAY_MAX_RECV_BATCH 64
+/* Upper limit on the number of packets built from the queues each time we send */
+#define OVERLAY_MAX_TX_BATCH 16
 
 #define CRYPT_CIPHERED 1
 #define CRYPT_SIGNED 2
@@ -119,12 +123,24 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 */
 #define OVERLAY_MAX_OBSERVATIONS 32
 
+/* Route recalculations are queued and run from an alarm, which gives up after this long
+   and lets other work run before carrying on. */
+#define OVERLAY_ROUTE_RECALC_BUDGET_NS 5000000LL
+/* Reachability set by something other than the route calculations is checked against our
+   own observations after this long. */
+#define OVERLAY_ROUTE_RECHECK_MS 5000
+
 /* bitmask values for monitor_tell_clients */
 #define MONITOR_VOMP (1<<0)
 #define MONITOR_RHIZOME (1<<1)
 #define MONITOR_PEERS (1<<2)
 #define MONITOR_DNAHELPER (1<<3)
 
+/* what to do when a monitor client's output queue is full */
+#define MONITOR_SLOW_DROP_OLDEST 0
+#define MONITOR_SLOW_DROP_CLASS 1
+#define MONITOR_SLOW_DISCONNECT 2
+
 #define MAX_SIGNATURES 16
 
 #define MDP_PORT_KEYMAPREQUEST 1
@@ -157,6 +173,8 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #define MDP_NODEINFO 8
 #define MDP_GOODBYE 9
 #define MDP_SCAN 10
+#define MDP_RING_ATTACH 11
+#define MDP_RING_DETACH 12
 
 // These are back-compatible with the old values of 'mode' when it was 'selfP'
 #define MDP_ADDRLIST_MODE_ROUTABLE_PEERS 0
@@ -208,6 +226,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #define DEFAULT_MDP_SOCKET_NAME "org.servalproject.servald.mdp.socket"
 
 #define SOCK_FILE 0xFF
+#define SOCK_RING 0xFE
 #define SOCK_UNSPECIFIED 0
 
 #define ENCAP_OVERLAY 1
@@ -1,4 +1,9 @@
+/* internals of the Ed25519 implementation, for batch verification; these must come before log.h
+   defines T */
+#include "nacl/src/crypto_sign_edwards25519sha512batch_ref/ge.h"
+#include "nacl/src/crypto_sign_edwards25519sha512batch_ref/sc.h"
 #include "serval.h"
+#include "conf.h"
 #include "overlay_address.h"
 #include "crypto.h"
 
@@ -95,3 +100,284 @@ int crypto_sign_message(struct subscriber *source, unsigned char *content, int b
   *content_len+=sig_length;
   return ret;
 }
+
+/* Batch verification.
+
+ A signature (R,S) of content M by public key A is valid if [S]B = R + [h]A, where h is the hash of
+ R, A and M.  Rather than checking each equation on its own, we check that a random linear
+ combination of them holds:
+
+   [sum(z_i * S_i)]B - sum([z_i]R_i) - sum([z_i * h_i]A_i) = 0
+
+ with a random 128 bit z_i for each signature, so that invalid signatures can't cancel each other
+ out.  Working out that sum of scalar multiples all at once shares one set of ~256 point doublings
+ between every point in the batch, which is most of the cost of checking a signature alone.  If
+ the batch doesn't add up, we check each signature on its own to find the bad ones.
+
+ Like every Ed25519 batch verifier this can accept a signature that checking alone would reject,
+ if the signer deliberately built it with a small order component.  Only the holder of the secret
+ key can do that, and they can sign anything they like anyway.
+*/
+
+struct batch_point {
+  signed char slide[256];
+  ge_cached multiples[8]; /* P,3P,5P,...,15P */
+};
+
+/* Recode a scalar as signed odd digits, most of them zero, as ge_double_scalarmult_vartime() does */
+static void slide(signed char *r,const unsigned char *a)
+{
+  int i;
+  int b;
+  int k;
+
+  for (i = 0;i < 256;++i)
+    r[i] = 1 & (a[i >> 3] >> (i & 7));
+
+  for (i = 0;i < 256;++i)
+    if (r[i]) {
+      for (b = 1;b <= 6 && i + b < 256;++b) {
+        if (r[i + b]) {
+          if (r[i] + (r[i + b] << b) <= 15) {
+            r[i] += r[i + b] << b; r[i + b] = 0;
+          } else if (r[i] - (r[i + b] << b) >= -15) {
+            r[i] -= r[i + b] << b;
+            for (k = i + b;k < 256;++k) {
+              if (!r[k]) {
+                r[k] = 1;
+                break;
+              }
+              r[k] = 0;
+            }
+          } else
+            break;
+        }
+      }
+    }
+}
+
+static void batch_point_init(struct batch_point *p, const ge_p3 *P, const unsigned char *scalar)
+{
+  ge_p1p1 t;
+  ge_p3 u;
+  ge_p3 P2;
+  int i;
+  slide(p->slide, scalar);
+  ge_p3_to_cached(&p->multiples[0], P);
+  ge_p3_dbl(&t, P); ge_p1p1_to_p3(&P2, &t);
+  for (i = 1; i < 8; i++) {
+    ge_add(&t, &P2, &p->multiples[i-1]); ge_p1p1_to_p3(&u, &t); ge_p3_to_cached(&p->multiples[i], &u);
+  }
+}
+
+/* Return true if the sum of every point times its scalar is the identity */
+static int batch_sum_is_zero(struct batch_point *points, int count)
+{
+  ge_p2 r;
+  ge_p1p1 t;
+  ge_p3 u;
+  int i, j;
+
+  ge_p2_0(&r);
+  for (i = 255; i >= 0; --i) {
+    for (j = 0; j < count; j++)
+      if (points[j].slide[i])
+	break;
+    if (j < count)
+      break;
+  }
+  for (; i >= 0; --i) {
+    ge_p2_dbl(&t, &r);
+    for (j = 0; j < count; j++) {
+      signed char d = points[j].slide[i];
+      if (d > 0) {
+	ge_p1p1_to_p3(&u, &t);
+	ge_add(&t, &u, &points[j].multiples[d/2]);
+      } else if (d < 0) {
+	ge_p1p1_to_p3(&u, &t);
+	ge_sub(&t, &u, &points[j].multiples[(-d)/2]);
+      }
+    }
+    ge_p1p1_to_p2(&r, &t);
+  }
+
+  // the identity is (0:1:1)
+  fe y_minus_z;
+  fe_sub(y_minus_z, r.Y, r.Z);
+  return !fe_isnonzero(r.X) && !fe_isnonzero(y_minus_z);
+}
+
+static int crypto_verify_one(struct crypto_signature_check *check)
+{
+  check->result = crypto_verify_signature(check->public_key, check->content, check->content_len,
+					  check->signature, SIGNATURE_BYTES) ? -1 : 0;
+  return check->result;
+}
+
+/* Verify a batch of signatures, setting each one's result to 0 if it is valid or -1 if not.
+   Returns 0 if they are all valid.
+ */
+int crypto_verify_signature_batch(struct crypto_signature_check *checks, int count)
+{
+  IN();
+  int ret = 0;
+  int i;
+  
+  // checking one or two signatures alone is quicker than setting up a batch
+  if (count < CRYPTO_BATCH_MIN) {
+    for (i = 0; i < count; i++)
+      if (crypto_verify_one(&checks[i]))
+	ret = -1;
+    RETURN(ret);
+  }
+  
+  // one point per public key and per R, and the base point
+  struct batch_point *points = emalloc((count * 2 + 1) * sizeof(struct batch_point));
+  unsigned char *z = emalloc(count * 16);
+  if (!points || !z || urandombytes(z, count * 16) == -1) {
+    if (points) free(points);
+    if (z) free(z);
+    for (i = 0; i < count; i++)
+      if (crypto_verify_one(&checks[i]))
+	ret = -1;
+    RETURN(ret);
+  }
+  
+  unsigned char s_sum[32];
+  bzero(s_sum, sizeof s_sum);
+  int point_count = 0;
+  int batched = 0;
+  for (i = 0; i < count; i++) {
+    struct crypto_signature_check *check = &checks[i];
+    const unsigned char *R = check->signature;
+    const unsigned char *S = check->signature + 32;
+    ge_p3 minus_A, minus_R;
+    unsigned char encoded[32];
+    
+    check->result = 1; // not checked yet
+    /* Leave anything odd about the signature to the individual check, which will probably
+       reject it.  In particular, R must be encoded exactly as the signer would have encoded
+       it, since that is what the individual check compares with. */
+    if ((S[31] & 224)
+      || ge_frombytes_negate_vartime(&minus_A, check->public_key) != 0
+      || ge_frombytes_negate_vartime(&minus_R, R) != 0)
+      continue;
+    ge_p3_tobytes(encoded, &minus_R);
+    encoded[31] ^= 0x80;
+    if (memcmp(encoded, R, 32) != 0)
+      continue;
+    
+    // h = H(R,A,M), as computed by crypto_sign_open()
+    unsigned char h[crypto_hash_sha512_BYTES];
+    {
+      unsigned char message[64 + check->content_len];
+      bcopy(R, message, 32);
+      bcopy(check->public_key, &message[32], 32);
+      bcopy(check->content, &message[64], check->content_len);
+      crypto_hash_sha512(h, message, sizeof message);
+    }
+    sc_reduce(h);
+    
+    unsigned char zi[32];
+    bzero(zi, sizeof zi);
+    bcopy(&z[i * 16], zi, 16);
+    
+    unsigned char zero[32];
+    bzero(zero, sizeof zero);
+    unsigned char zh[32];
+    sc_muladd(zh, zi, h, zero);
+    sc_muladd(s_sum, zi, S, s_sum);
+    
+    batch_point_init(&points[point_count++], &minus_A, zh);
+    batch_point_init(&points[point_count++], &minus_R, zi);
+    check->result = 0;
+    batched++;
+  }
+  
+  if (batched) {
+    unsigned char one[32];
+    bzero(one, sizeof one);
+    one[0] = 1;
+    ge_p3 B;
+    ge_scalarmult_base(&B, one);
+    batch_point_init(&points[point_count++], &B, s_sum);
+    if (!batch_sum_is_zero(points, point_count)) {
+      // at least one is bad, find out which
+      for (i = 0; i < count; i++)
+	if (checks[i].result == 0)
+	  checks[i].result = 1;
+    }
+  }
+  free(points);
+  free(z);
+  
+  for (i = 0; i < count; i++) {
+    if (checks[i].result == 1)
+      crypto_verify_one(&checks[i]);
+    if (checks[i].result)
+      ret = -1;
+  }
+  RETURN(ret);
+  OUT();
+}
+
+/* Compare checking signatures one at a time against checking them in batches of various sizes */
+int app_crypto_batch_test(const struct cli_parsed *parsed, void *context)
+{
+  if (config.debug.verbose)
+    DEBUG_cli_parsed(parsed);
+#define BATCH_TEST_SIGNATURES 64
+  int sizes[] = { 1, 2, 4, 8, 16, 32, 64 };
+  int size_count = sizeof sizes / sizeof sizes[0];
+  const int rounds = 10;
+  
+  unsigned char public_keys[BATCH_TEST_SIGNATURES][crypto_sign_edwards25519sha512batch_PUBLICKEYBYTES];
+  unsigned char content[BATCH_TEST_SIGNATURES][crypto_hash_sha512_BYTES];
+  unsigned char signatures[BATCH_TEST_SIGNATURES][SIGNATURE_BYTES];
+  struct crypto_signature_check checks[BATCH_TEST_SIGNATURES];
+  int i, j, s;
+  
+  for (i = 0; i < BATCH_TEST_SIGNATURES; i++) {
+    unsigned char secret_key[crypto_sign_edwards25519sha512batch_SECRETKEYBYTES];
+    unsigned long long sig_length = SIGNATURE_BYTES;
+    crypto_sign_edwards25519sha512batch_keypair(public_keys[i], secret_key);
+    urandombytes(content[i], sizeof content[i]);
+    if (crypto_create_signature(secret_key, content[i], sizeof content[i], signatures[i], &sig_length) == -1)
+      return -1;
+    checks[i].public_key = public_keys[i];
+    checks[i].content = content[i];
+    checks[i].content_len = sizeof content[i];
+    checks[i].signature = signatures[i];
+  }
+  
+  time_ns_t start = gettime_ns();
+  for (j = 0; j < rounds; j++)
+    for (i = 0; i < BATCH_TEST_SIGNATURES; i++)
+      if (crypto_verify_signature(public_keys[i], content[i], sizeof content[i], signatures[i], SIGNATURE_BYTES))
+	return WHY("Valid signature failed to verify");
+  time_ns_t end = gettime_ns();
+  printf("One at a time - %.0fns per signature\n", (end - start) * 1.0 / (rounds * BATCH_TEST_SIGNATURES));
+  
+  for (s = 0; s < size_count; s++) {
+    start = gettime_ns();
+    for (j = 0; j < rounds; j++)
+      for (i = 0; i < BATCH_TEST_SIGNATURES; i += sizes[s])
+	if (crypto_verify_signature_batch(&checks[i], sizes[s]))
+	  return WHY("Valid signature failed to verify in a batch");
+    end = gettime_ns();
+    printf("Batches of %d - %.0fns per signature\n", sizes[s], (end - start) * 1.0 / (rounds * BATCH_TEST_SIGNATURES));
+  }
+  
+  // a bad signature must be found, without taking any good ones down with it
+  signatures[BATCH_TEST_SIGNATURES / 2][40] ^= 1;
+  start = gettime_ns();
+  if (crypto_verify_signature_batch(checks, BATCH_TEST_SIGNATURES) == 0)
+    return WHY("Invalid signature verified in a batch");
+  end = gettime_ns();
+  for (i = 0; i < BATCH_TEST_SIGNATURES; i++)
+    if (checks[i].result != (i == BATCH_TEST_SIGNATURES / 2 ? -1 : 0))
+      return WHYF("Signature %d has the wrong result %d", i, checks[i].result);
+  printf("Batch of %d with one bad signature - %.0fns per signature\n",
+	 BATCH_TEST_SIGNATURES, (end - start) * 1.0 / BATCH_TEST_SIGNATURES);
+  return 0;
+}
@@ -14,4 +14,18 @@ int crypto_create_signature(unsigned char *key,
 			    unsigned char *signature, unsigned long long *sig_length);
 int crypto_sign_message(struct subscriber *source, unsigned char *content, int buffer_len, int *content_len);
 
+/* Batches smaller than this are cheaper to verify one signature at a time */
+#define CRYPTO_BATCH_MIN 3
+
+struct crypto_signature_check {
+  unsigned char *public_key;
+  unsigned char *content;
+  unsigned long long content_len;
+  unsigned char *signature;
+  // set to 0 if the signature is valid, -1 if not
+  int result;
+};
+
+int crypto_verify_signature_batch(struct crypto_signature_check *checks, int count);
+
 #endif
\ No newline at end of file
@@ -18,67 +18,193 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 */
 
 #include <poll.h>
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
 #include "serval.h"
 #include "conf.h"
 #include "str.h"
 #include "strbuf.h"
 #include "strbuf_helpers.h"
 
-#define MAX_WATCHED_FDS 128
-struct pollfd fds[MAX_WATCHED_FDS];
-int fdcount=0;
-struct sched_ent *fd_callbacks[MAX_WATCHED_FDS];
-struct sched_ent *next_alarm=NULL;
-struct sched_ent *next_deadline=NULL;
+/* Watched file handles are kept in arrays that grow as needed.  fds[] is passed directly to poll(2)
+ * unless the epoll(7) backend is in use, in which case the kernel holds the interest list and fds[]
+ * is only used to keep track of what is being watched.
+ */
+static struct pollfd *fds=NULL;
+static struct sched_ent **fd_callbacks=NULL;
+static int fdcount=0;
+static int fdsize=0;
+
+#ifdef HAVE_SYS_EPOLL_H
+// -1 until we have decided which backend to use, then 0 for poll(2) or 1 for epoll(7)
+static int use_epoll=-1;
+static int epoll_fd=-1;
+static struct epoll_event *epoll_events=NULL;
+// the ready events that fd_poll() has not yet dispatched, so _unwatch() can cancel them
+static int epoll_dispatch_next=0;
+static int epoll_dispatch_count=0;
+// epoll(7) refuses regular files, which poll(2) always reports as ready, so we report those ourselves
+#define FD_EPOLLED 0
+#define FD_POLLED 1
+#define FD_IGNORED 2
+static char *fd_epoll_state=NULL;
+static int unpollable_count=0;
+#endif
+
 struct profile_total poll_stats={NULL,0,"Idle (in poll)",0,0,0};
 
+/* Scheduled alarms are held in two binary min-heaps; one ordered by alarm time for alarms that are
+ * still in the future, and one ordered by deadline for alarms that have elapsed and are waiting to
+ * be called.  A third heap, also ordered by deadline, holds the alarms that fd_poll() has picked
+ * to call in the current pass, and any it didn't get to before its time budget ran out.  Each sched_ent records which heap it is in and its (1-based) position, so both
+ * insertion and removal cost O(log n).  Entries with equal times are ordered by their insertion
+ * sequence, which preserves the first-in, first-out behaviour of the sorted lists this replaced.
+ */
+struct sched_heap{
+  int by_deadline;
+  struct sched_ent **entries; // entries[0] is unused
+  unsigned int count;
+  unsigned int size;
+};
+
+static struct sched_heap alarm_heap={0, NULL, 0, 0};
+static struct sched_heap deadline_heap={1, NULL, 0, 0};
+static struct sched_heap due_heap={1, NULL, 0, 0};
+static unsigned int sched_sequence=0;
+
 #define alloca_alarm_name(alarm) ((alarm)->stats ? alloca_str_toprint((alarm)->stats->name) : "Unnamed")
 
+static int sched_before(const struct sched_heap *heap, const struct sched_ent *a, const struct sched_ent *b)
+{
+  time_ms_t ta = heap->by_deadline ? a->deadline : a->alarm;
+  time_ms_t tb = heap->by_deadline ? b->deadline : b->alarm;
+  if (ta != tb)
+    return ta < tb;
+  return (int)(a->_sequence - b->_sequence) < 0;
+}
+
+static void sched_heap_set(struct sched_heap *heap, unsigned int index, struct sched_ent *alarm)
+{
+  heap->entries[index] = alarm;
+  alarm->_heap_index = index;
+}
+
+static void sched_heap_up(struct sched_heap *heap, unsigned int index)
+{
+  struct sched_ent *alarm = heap->entries[index];
+  while (index > 1) {
+    unsigned int parent = index / 2;
+    if (!sched_before(heap, alarm, heap->entries[parent]))
+      break;
+    sched_heap_set(heap, index, heap->entries[parent]);
+    index = parent;
+  }
+  sched_heap_set(heap, index, alarm);
+}
+
+static void sched_heap_down(struct sched_heap *heap, unsigned int index)
+{
+  struct sched_ent *alarm = heap->entries[index];
+  while (1) {
+    unsigned int child = index * 2;
+    if (child > heap->count)
+      break;
+    if (child < heap->count && sched_before(heap, heap->entries[child + 1], heap->entries[child]))
+      child++;
+    if (!sched_before(heap, heap->entries[child], alarm))
+      break;
+    sched_heap_set(heap, index, heap->entries[child]);
+    index = child;
+  }
+  sched_heap_set(heap, index, alarm);
+}
+
+// make sure the heap has room for one more entry
+static int sched_heap_reserve(struct sched_heap *heap)
+{
+  if (heap->count + 1 >= heap->size) {
+    unsigned int size = heap->size ? heap->size * 2 : 64;
+    struct sched_ent **entries = realloc(heap->entries, size * sizeof(struct sched_ent *));
+    if (!entries)
+      return WHYF_perror("realloc(%d)", (int)(size * sizeof(struct sched_ent *)));
+    heap->entries = entries;
+    heap->size = size;
+  }
+  return 0;
+}
+
+static int sched_heap_insert(struct sched_heap *heap, struct sched_ent *alarm)
+{
+  if (sched_heap_reserve(heap) == -1)
+    return -1;
+  alarm->_sequence = sched_sequence++;
+  alarm->_heap = heap;
+  heap->count++;
+  heap->entries[heap->count] = alarm;
+  sched_heap_up(heap, heap->count);
+  return 0;
+}
+
+static void sched_heap_remove(struct sched_heap *heap, struct sched_ent *alarm)
+{
+  unsigned int index = alarm->_heap_index;
+  struct sched_ent *last = heap->entries[heap->count];
+  heap->entries[heap->count] = NULL;
+  heap->count--;
+  if (last != alarm) {
+    sched_heap_set(heap, index, last);
+    if (index > 1 && sched_before(heap, last, heap->entries[index / 2]))
+      sched_heap_up(heap, index);
+    else
+      sched_heap_down(heap, index);
+  }
+  alarm->_heap = NULL;
+  alarm->_heap_index = 0;
+}
+
+static struct sched_ent *sched_heap_first(const struct sched_heap *heap)
+{
+  return heap->count ? heap->entries[1] : NULL;
+}
+
 void list_alarms()
 {
   DEBUG("Alarms;");
   time_ms_t now = gettime_ms();
-  struct sched_ent *alarm;
+  unsigned int i;
   
-  for (alarm = next_deadline; alarm; alarm = alarm->_next)
+  for (i = 1; i <= due_heap.count; ++i) {
+    struct sched_ent *alarm = due_heap.entries[i];
+    DEBUGF("%p %s due, deadline in %lldms", alarm->function, alloca_alarm_name(alarm), alarm->deadline - now);
+  }
+  
+  for (i = 1; i <= deadline_heap.count; ++i) {
+    struct sched_ent *alarm = deadline_heap.entries[i];
     DEBUGF("%p %s deadline in %lldms", alarm->function, alloca_alarm_name(alarm), alarm->deadline - now);
+  }
   
-  for (alarm = next_alarm; alarm; alarm = alarm->_next)
+  for (i = 1; i <= alarm_heap.count; ++i) {
+    struct sched_ent *alarm = alarm_heap.entries[i];
     DEBUGF("%p %s in %lldms, deadline in %lldms", alarm->function, alloca_alarm_name(alarm), alarm->alarm - now, alarm->deadline - now);
+  }
   
   DEBUG("File handles;");
-  int i;
-  for (i = 0; i < fdcount; ++i)
-    DEBUGF("%s watching #%d", alloca_alarm_name(fd_callbacks[i]), fds[i].fd);
+  int j;
+  for (j = 0; j < fdcount; ++j)
+    DEBUGF("%s watching #%d", alloca_alarm_name(fd_callbacks[j]), fds[j].fd);
 }
 
-int deadline(struct sched_ent *alarm)
+static int deadline(struct sched_ent *alarm)
 {
-  struct sched_ent *node = next_deadline, *last = NULL;
   if (alarm->deadline < alarm->alarm)
     alarm->deadline = alarm->alarm;
-  
-  while(node!=NULL){
-    if (node->deadline > alarm->deadline)
-      break;
-    last = node;
-    node = node->_next;
-  }
-  if (last == NULL){
-    next_deadline = alarm;
-  }else{
-    last->_next = alarm;
-  }
-  alarm->_prev = last;
-  if(node!=NULL)
-    node->_prev = alarm;
-  alarm->_next = node;
-  return 0;
+  return sched_heap_insert(&deadline_heap, alarm);
 }
 
 int is_scheduled(const struct sched_ent *alarm)
 {
-  return alarm->_next || alarm->_prev || alarm == next_alarm || alarm == next_deadline;
+  return alarm->_heap != NULL;
 }
 
 // add an alarm to the list of scheduled function calls.
@@ -94,8 +220,6 @@ int _schedule(struct __sourceloc __whence, struct sched_ent *alarm)
     WARNF("schedule() called from %s() %s:%d without supplying an alarm name", 
 	  __whence.function,__whence.file,__whence.line);
 
-  struct sched_ent *node = next_alarm, *last = NULL;
-  
   if (is_scheduled(alarm))
     FATAL("Scheduling an alarm that is already scheduled");
   
@@ -109,23 +233,7 @@ int _schedule(struct __sourceloc __whence, struct sched_ent *alarm)
   if (alarm->alarm <= gettime_ms())
     return deadline(alarm);
   
-  while(node!=NULL){
-    if (node->alarm > alarm->alarm)
-      break;
-    last = node;
-    node = node->_next;
-  }
-  if (last == NULL){
-    next_alarm = alarm;
-  }else{
-    last->_next=alarm;
-  }
-  alarm->_prev = last;
-  if(node!=NULL)
-    node->_prev = alarm;
-  alarm->_next = node;
-  
-  return 0;
+  return sched_heap_insert(&alarm_heap, alarm);
 }
 
 // remove a function from the schedule before it has fired
@@ -135,24 +243,121 @@ int _unschedule(struct __sourceloc __whence, struct sched_ent *alarm)
   if (config.debug.io)
     DEBUGF("unschedule(alarm=%s)", alloca_alarm_name(alarm));
 
-  struct sched_ent *prev = alarm->_prev;
-  struct sched_ent *next = alarm->_next;
-  
-  if (prev)
-    prev->_next = next;
-  else if(next_alarm==alarm)
-    next_alarm = next;
-  else if(next_deadline==alarm)
-    next_deadline = next;
-  
-  if (next)
-    next->_prev = prev;
-  
-  alarm->_prev = NULL;
-  alarm->_next = NULL;
+  if (alarm->_heap)
+    sched_heap_remove(alarm->_heap, alarm);
+  return 0;
+}
+
+static int fd_grow()
+{
+  int size = fdsize ? fdsize * 2 : 32;
+  struct pollfd *new_fds = realloc(fds, size * sizeof(struct pollfd));
+  if (!new_fds)
+    return WHYF_perror("realloc(%d)", (int)(size * sizeof(struct pollfd)));
+  fds = new_fds;
+  struct sched_ent **new_callbacks = realloc(fd_callbacks, size * sizeof(struct sched_ent *));
+  if (!new_callbacks)
+    return WHYF_perror("realloc(%d)", (int)(size * sizeof(struct sched_ent *)));
+  fd_callbacks = new_callbacks;
+#ifdef HAVE_SYS_EPOLL_H
+  struct epoll_event *new_events = realloc(epoll_events, size * sizeof(struct epoll_event));
+  if (!new_events)
+    return WHYF_perror("realloc(%d)", (int)(size * sizeof(struct epoll_event)));
+  epoll_events = new_events;
+  char *new_state = realloc(fd_epoll_state, size);
+  if (!new_state)
+    return WHYF_perror("realloc(%d)", size);
+  fd_epoll_state = new_state;
+#endif
+  fdsize = size;
+  return 0;
+}
+
+#ifdef HAVE_SYS_EPOLL_H
+static int epoll_add(int index)
+{
+  struct sched_ent *alarm = fd_callbacks[index];
+  // poll(2) ignores negative descriptors, so we do the same
+  if (alarm->poll.fd < 0) {
+    fd_epoll_state[index] = FD_IGNORED;
+    return 0;
+  }
+  struct epoll_event ev;
+  bzero(&ev, sizeof ev);
+  // poll(2) and epoll(7) share event bit values on Linux
+  ev.events = alarm->poll.events;
+  ev.data.ptr = alarm;
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, alarm->poll.fd, &ev) == -1) {
+    if (errno == EPERM) {
+      fd_epoll_state[index] = FD_POLLED;
+      unpollable_count++;
+      return 0;
+    }
+    fd_epoll_state[index] = FD_IGNORED;
+    return WHYF_perror("epoll_ctl(%d, EPOLL_CTL_ADD, %d)", epoll_fd, alarm->poll.fd);
+  }
+  fd_epoll_state[index] = FD_EPOLLED;
   return 0;
 }
 
+static void epoll_remove(int index)
+{
+  switch (fd_epoll_state[index]) {
+  case FD_POLLED:
+    unpollable_count--;
+    break;
+  case FD_EPOLLED:
+    // the handle may already have been closed, which removes it from the epoll set
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fds[index].fd, NULL) == -1 && errno != EBADF && errno != ENOENT)
+      WARNF_perror("epoll_ctl(%d, EPOLL_CTL_DEL, %d)", epoll_fd, fds[index].fd);
+    break;
+  }
+  fd_epoll_state[index] = FD_IGNORED;
+}
+
+static int epoll_modify(int index)
+{
+  struct sched_ent *alarm = fd_callbacks[index];
+  if (fd_epoll_state[index] == FD_EPOLLED && fds[index].fd == alarm->poll.fd) {
+    struct epoll_event ev;
+    bzero(&ev, sizeof ev);
+    ev.events = alarm->poll.events;
+    ev.data.ptr = alarm;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, alarm->poll.fd, &ev) == 0)
+      return 0;
+    // closing a descriptor removes it from the epoll set, and the number may have been reused
+    if (errno != ENOENT)
+      return WHYF_perror("epoll_ctl(%d, EPOLL_CTL_MOD, %d)", epoll_fd, alarm->poll.fd);
+    fd_epoll_state[index] = FD_IGNORED;
+  }
+  // the descriptor has changed, or was not in the epoll set
+  epoll_remove(index);
+  return epoll_add(index);
+}
+
+static int epoll_enabled()
+{
+  if (use_epoll == -1) {
+    use_epoll = 0;
+    if (config.server.epoll) {
+      epoll_fd = epoll_create(32);
+      if (epoll_fd == -1)
+	WARN_perror("epoll_create(), falling back to poll()");
+      else {
+	fcntl(epoll_fd, F_SETFD, FD_CLOEXEC);
+	use_epoll = 1;
+	int i;
+	for (i = 0; i < fdcount; i++)
+	  epoll_add(i);
+      }
+    }
+    if (config.debug.io)
+      DEBUGF("Watching file handles with %s", use_epoll ? "epoll()" : "poll()");
+  }
+  return use_epoll;
+}
+#endif
+
 // start watching a file handle, call this function again if you wish to change the event mask
 int _watch(struct __sourceloc __whence, struct sched_ent *alarm)
 {
@@ -165,21 +370,36 @@ int _watch(struct __sourceloc __whence, struct sched_ent *alarm)
   if (!alarm->function)
     return WHY("Can't watch if you haven't set the function pointer");
   
-  if (alarm->_poll_index>=0 && fd_callbacks[alarm->_poll_index]==alarm){
+#ifdef HAVE_SYS_EPOLL_H
+  epoll_enabled();
+#endif
+  
+  if (alarm->_poll_index>=0 && alarm->_poll_index<fdcount && fd_callbacks[alarm->_poll_index]==alarm){
     // updating event flags
     if (config.debug.io)
       DEBUGF("Updating watch %s, #%d for %d", alloca_alarm_name(alarm), alarm->poll.fd, alarm->poll.events);
+#ifdef HAVE_SYS_EPOLL_H
+    if (use_epoll==1 && epoll_modify(alarm->_poll_index)==-1)
+      return -1;
+#endif
+    fds[alarm->_poll_index]=alarm->poll;
   }else{
     if (config.debug.io)
       DEBUGF("Adding watch %s, #%d for %d", alloca_alarm_name(alarm), alarm->poll.fd, alarm->poll.events);
-    if (fdcount>=MAX_WATCHED_FDS)
+    if (fdcount>=fdsize && fd_grow()==-1)
       return WHY("Too many file handles to watch");
     fd_callbacks[fdcount]=alarm;
     alarm->poll.revents = 0;
     alarm->_poll_index=fdcount;
     fdcount++;
+    fds[alarm->_poll_index]=alarm->poll;
+#ifdef HAVE_SYS_EPOLL_H
+    if (use_epoll==1 && epoll_add(alarm->_poll_index)==-1){
+      unwatch(alarm);
+      return -1;
+    }
+#endif
   }
-  fds[alarm->_poll_index]=alarm->poll;
   return 0;
 }
 
@@ -190,15 +410,30 @@ int _unwatch(struct __sourceloc __whence, struct sched_ent *alarm)
     DEBUGF("unwatch(alarm=%s)", alloca_alarm_name(alarm));
 
   int index = alarm->_poll_index;
-  if (index <0 || fds[index].fd!=alarm->poll.fd)
+  if (index <0 || index>=fdcount || fds[index].fd!=alarm->poll.fd)
     return WHY("Attempted to unwatch a handle that is not being watched");
   
+#ifdef HAVE_SYS_EPOLL_H
+  if (use_epoll==1){
+    epoll_remove(index);
+    // make sure we don't call this alarm for any events that are still waiting to be dispatched
+    int i;
+    for (i = epoll_dispatch_next; i < epoll_dispatch_count; i++)
+      if (epoll_events[i].data.ptr == alarm)
+	epoll_events[i].data.ptr = NULL;
+  }
+#endif
+
   fdcount--;
   if (index!=fdcount){
     // squash fds
     fds[index] = fds[fdcount];
     fd_callbacks[index] = fd_callbacks[fdcount];
     fd_callbacks[index]->_poll_index=index;
+#ifdef HAVE_SYS_EPOLL_H
+    if (fd_epoll_state)
+      fd_epoll_state[index] = fd_epoll_state[fdcount];
+#endif
   }
   fds[fdcount].fd=-1;
   fd_callbacks[fdcount]=NULL;
@@ -231,25 +466,61 @@ static void call_alarm(struct sched_ent *alarm, int revents)
   OUT();
 }
 
+#ifdef HAVE_SYS_EPOLL_H
+static int epoll_wait_events(int ms)
+{
+  if (unpollable_count)
+    ms = 0;
+  int r = epoll_wait(epoll_fd, epoll_events, fdcount, ms);
+  if (r == -1) {
+    if (errno != EINTR)
+      WARN_perror("epoll_wait");
+    if (!unpollable_count)
+      return -1;
+    r = 0;
+  }
+  if (unpollable_count) {
+    int i;
+    for (i = 0; i < fdcount && r < fdsize; i++) {
+      if (fd_epoll_state[i] == FD_POLLED && (fds[i].events & (POLLIN|POLLOUT))) {
+	bzero(&epoll_events[r], sizeof epoll_events[r]);
+	epoll_events[r].events = fds[i].events & (POLLIN|POLLOUT);
+	epoll_events[r].data.ptr = fd_callbacks[i];
+	r++;
+      }
+    }
+  }
+  return r;
+}
+#endif
+
 int fd_poll()
 {
   IN();
   int i, r=0;
+  int alarms_run=0, overrun=0;
   int ms=60000;
   time_ms_t now = gettime_ms();
   
-  if (!next_alarm && !next_deadline && fdcount==0)
+  struct sched_ent *next_alarm = sched_heap_first(&alarm_heap);
+  struct sched_ent *next_deadline = sched_heap_first(&deadline_heap);
+  
+  if (!next_alarm && !next_deadline && !due_heap.count && fdcount==0)
     RETURN(0);
   
-  /* move alarms that have elapsed to the deadline queue */
+  /* move alarms that have elapsed to the deadline queue, making room there first so that an
+     allocation failure leaves the alarm where it was rather than in neither queue */
   while (next_alarm!=NULL&&next_alarm->alarm <=now){
-    struct sched_ent *alarm = next_alarm;
-    unschedule(alarm);
-    deadline(alarm);
+    if (sched_heap_reserve(&deadline_heap) == -1)
+      break;
+    sched_heap_remove(&alarm_heap, next_alarm);
+    deadline(next_alarm);
+    next_alarm = sched_heap_first(&alarm_heap);
   }
+  next_deadline = sched_heap_first(&deadline_heap);
   
   /* work out how long we can block in poll */
-  if (next_deadline)
+  if (next_deadline || due_heap.count)
     ms = 0;
   else if (next_alarm){
     ms = next_alarm->alarm - now;
@@ -268,7 +539,19 @@ int fd_poll()
 	sleep(ms/1000);
       else
 	usleep(ms*1000);
-    }else{
+    }
+#ifdef HAVE_SYS_EPOLL_H
+    else if (epoll_enabled()){
+      r = epoll_wait_events(ms);
+      /* Alarms called below may unwatch (and free) an alarm that has events waiting, so the
+         events must be visible to _unwatch() before any alarm runs */
+      epoll_dispatch_next = 0;
+      epoll_dispatch_count = r > 0 ? r : 0;
+      if (config.debug.io)
+	DEBUGF("epoll_wait(fdcount=%d, ms=%d) = %d", fdcount, ms, r);
+    }
+#endif
+    else{
       if (config.debug.io) DEBUGF("poll(X,%d,%d)",fdcount,ms);
       r = poll(fds, fdcount, ms);
       if (config.debug.io) {
@@ -289,16 +572,55 @@ int fd_poll()
     now=gettime_ms();
   }
   
-  /* call one alarm function, but only if its deadline time has elapsed OR there is no file activity */
-  if (next_deadline && (next_deadline->deadline <=now || (r==0))){
-    struct sched_ent *alarm = next_deadline;
-    unschedule(alarm);
-    call_alarm(alarm, 0);
-    now=gettime_ms();
+  /* call alarm functions whose deadline time has elapsed, or any that are due if there is no file
+     activity.  They are all taken out of the deadline queue before any is called, so an alarm that
+     schedules itself again, even with a deadline that has already passed, waits for the next pass
+     rather than running again ahead of the others.  We stop once the time budget is spent, so that
+     file handles are still serviced between batches, and the rest of the pass is finished before
+     any more alarms are taken.  With no budget configured, we call at most one alarm per poll. */
+  {
+    if (!due_heap.count){
+      while ((next_deadline = sched_heap_first(&deadline_heap))
+	     && (next_deadline->deadline <= now || r==0)){
+	if (sched_heap_reserve(&due_heap) == -1)
+	  break;
+	sched_heap_remove(&deadline_heap, next_deadline);
+	sched_heap_insert(&due_heap, next_deadline);
+      }
+    }
+    time_ms_t budget_end = now + config.server.alarm_budget_ms;
+    while ((next_deadline = sched_heap_first(&due_heap))){
+      unschedule(next_deadline);
+      call_alarm(next_deadline, 0);
+      alarms_run++;
+      now=gettime_ms();
+      if (now >= budget_end)
+	break;
+    }
+    if (due_heap.count && config.server.alarm_budget_ms)
+      overrun=1;
   }
   
   /* If file descriptors are ready, then call the appropriate functions */
   if (r>0) {
+#ifdef HAVE_SYS_EPOLL_H
+    if (use_epoll==1){
+      for (; epoll_dispatch_next < epoll_dispatch_count; epoll_dispatch_next++){
+	struct epoll_event *ev = &epoll_events[epoll_dispatch_next];
+	struct sched_ent *alarm = ev->data.ptr;
+	if (!alarm)
+	  continue;
+	int fd = alarm->poll.fd;
+	/* Call the alarm callback with the socket in non-blocking mode */
+	set_nonblock(fd);
+	call_alarm(alarm, ev->events);
+	/* _unwatch() clears the event if the alarm stopped watching its descriptor */
+	if (ev->data.ptr)
+	  set_block(fd);
+      }
+      epoll_dispatch_next = epoll_dispatch_count = 0;
+    }else
+#endif
     for(i=0;i<fdcount;i++)
       if (fds[i].revents) {
 	int fd = fds[i].fd;
@@ -310,6 +632,7 @@ int fd_poll()
 	  set_block(fds[i].fd);
       }
   }
+  fd_tally_loop(r>0?r:0, alarms_run, overrun);
   RETURN(1);
   OUT();
 }
@@ -17,6 +17,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 */
 
 #include <assert.h>
+#include <pthread.h>
 #include "serval.h"
 #include "str.h"
 #include "mem.h"
@@ -218,18 +219,15 @@ void keyring_free_context(keyring_context *c)
   return;
 }
 
-void keyring_free_identity(keyring_identity *id)
+/* Wipe and free the contents of an identity that was never added to a context.  This doesn't
+   log anything, so the keyring unlock threads can use it. */
+static void keyring_wipe_identity(keyring_identity *id)
 {
   int i;
   if (id->PKRPin) {
     /* Wipe pin before freeing (slightly tricky since this is a variable length string */
-    for(i=0;id->PKRPin[i];i++) {
-      if (config.debug.keyring)
-	DEBUGF("clearing PIN char '%c'", id->PKRPin[i]);
+    for(i=0;id->PKRPin[i];i++)
       id->PKRPin[i]=' ';
-    }
-    i=0;
-    
     free(id->PKRPin); id->PKRPin=NULL;
   }
 
@@ -237,12 +235,22 @@ void keyring_free_identity(keyring_identity *id)
     if (id->keypairs[i])
       keyring_free_keypair(id->keypairs[i]);
 
+  bzero(id,sizeof(keyring_identity));
+}
+
+void keyring_free_identity(keyring_identity *id)
+{
+  int i;
+  if (id->PKRPin && config.debug.keyring)
+    for(i=0;id->PKRPin[i];i++)
+      DEBUGF("clearing PIN char '%c'", id->PKRPin[i]);
+
   if (id->subscriber){
     id->subscriber->identity=NULL;
     set_reachable(id->subscriber, REACHABLE_NONE);
   }
-    
-  bzero(id,sizeof(keyring_identity));
+
+  keyring_wipe_identity(id);
   return;
 }
 
@@ -323,10 +331,12 @@ int keyring_enter_identitypin(keyring_file *k,char *pin)
   used to verify the validity of the block.  The verification occurs in a higher
   level function, and all we need to know here is that we shouldn't decrypt the
   first 96 bytes of the block.
+  Rather than logging, failures are described in *error for the caller to report,
+  since the keyring unlock threads call this.
 */
 int keyring_munge_block(unsigned char *block,int len /* includes the first 96 bytes */,
 			unsigned char *KeyRingSalt,int KeyRingSaltLen,
-			const char *KeyRingPin, const char *PKRPin)
+			const char *KeyRingPin, const char *PKRPin, const char **error)
 {
   int exit_code=1;
   unsigned char hashKey[crypto_hash_sha512_BYTES];
@@ -334,7 +344,10 @@ int keyring_munge_block(unsigned char *block,int len /* includes the first 96 by
 
   unsigned char work[65536];
 
-  if (len<96) return WHY("block too short");
+  if (len<96) {
+    *error = "block too short";
+    return -1;
+  }
 
   unsigned char *PKRSalt=&block[0];
   int PKRSaltLen=32;
@@ -352,7 +365,7 @@ int keyring_munge_block(unsigned char *block,int len /* includes the first 96 by
     assert(ofs <= sizeof work); \
     unsigned __len = (len); \
     if (__len > sizeof work - ofs) { \
-      WHY("Input too long"); \
+      *error = "Input too long"; \
       goto kmb_safeexit; \
     } \
     bcopy((buf), &work[ofs], __len); \
@@ -405,8 +418,9 @@ int keyring_pack_identity(keyring_context *c,keyring_identity *i,
   if (urandombytes(&packed[0],PKR_SALT_BYTES)) return WHY("Could not generate salt");
   ofs+=PKR_SALT_BYTES;
   /* Calculate MAC */
-  keyring_identity_mac(c,i,&packed[0] /* pkr salt */,
-		       &packed[0+PKR_SALT_BYTES] /* write mac in after salt */);
+  if (keyring_identity_mac(c,i,&packed[0] /* pkr salt */,
+			   &packed[0+PKR_SALT_BYTES] /* write mac in after salt */))
+    return WHY("Identity is too long to MAC");
   ofs+=PKR_MAC_BYTES;
 
   /* Leave 2 bytes for rotation (put zeroes for now) */
@@ -527,16 +541,23 @@ int keyring_pack_identity(keyring_context *c,keyring_identity *i,
   return exit_code;
 }
 
-keyring_identity *keyring_unpack_identity(unsigned char *slot, const char *pin)
+/* Unpack a decrypted slot into a new identity.  Returns NULL if the slot doesn't hold a valid
+   identity, describing why in *error if it is worth complaining about.  This doesn't log anything,
+   so the keyring unlock threads can use it. */
+keyring_identity *keyring_unpack_identity(unsigned char *slot, const char *pin, const char **error)
 {
   /* Skip salt and MAC */
   int i;
   unsigned ofs;
-  keyring_identity *id = emalloc_zero(sizeof(keyring_identity));
-  if (!id) { WHY("malloc of identity failed"); return NULL; }
-  if (!slot) { WHY("slot is null"); return NULL; }
+  if (!slot) { *error = "slot is null"; return NULL; }
+  keyring_identity *id = calloc(1, sizeof(keyring_identity));
+  if (!id) { *error = "malloc of identity failed"; return NULL; }
 
-  id->PKRPin = str_edup(pin);
+  if ((id->PKRPin = strdup(pin)) == NULL) {
+    *error = "malloc of PIN failed";
+    free(id);
+    return NULL;
+  }
 
   /* There was a known plain-text opportunity here:
      byte 96 must be 0x01, and some other bytes are likely deducible, e.g., the
@@ -562,14 +583,16 @@ keyring_identity *keyring_unpack_identity(unsigned char *slot, const char *pin)
       case KEYTYPE_CRYPTOBOX:
       case KEYTYPE_CRYPTOSIGN:
 	if (id->keypair_count>=PKR_MAX_KEYPAIRS) {
-	  WHY("Too many key pairs in identity");
-	  keyring_free_identity(id);
+	  *error = "Too many key pairs in identity";
+	  keyring_wipe_identity(id);
+	  free(id);
 	  return NULL;
 	}
-	keypair *kp=id->keypairs[id->keypair_count] = emalloc_zero(sizeof(keypair));
+	keypair *kp=id->keypairs[id->keypair_count] = calloc(1, sizeof(keypair));
 	if (!id->keypairs[id->keypair_count]) {
-	  WHY("malloc of key pair structure failed.");
-	  keyring_free_identity(id);
+	  *error = "malloc of key pair structure failed";
+	  keyring_wipe_identity(id);
+	  free(id);
 	  return NULL;
 	}
 	kp->type = slot_byte(ofs++);
@@ -595,14 +618,18 @@ keyring_identity *keyring_unpack_identity(unsigned char *slot, const char *pin)
 	  kp->private_key_len=32; kp->public_key_len=64;
 	  break;
 	}
-	if (kp->private_key_len && (kp->private_key = emalloc(kp->private_key_len)) == NULL) {
-	  keyring_free_identity(id);
+	if (kp->private_key_len && (kp->private_key = malloc(kp->private_key_len)) == NULL) {
+	  *error = "malloc of private key failed";
+	  keyring_wipe_identity(id);
+	  free(id);
 	  return NULL;
 	}
 	for (i = 0; i < kp->private_key_len; ++i)
 	  kp->private_key[i] = slot_byte(ofs++);
-	if (kp->public_key_len && (kp->public_key = emalloc(kp->public_key_len)) == NULL) {
-	  keyring_free_identity(id);
+	if (kp->public_key_len && (kp->public_key = malloc(kp->public_key_len)) == NULL) {
+	  *error = "malloc of public key failed";
+	  keyring_wipe_identity(id);
+	  free(id);
 	  return NULL;
 	}
 	switch(kp->type) {
@@ -644,13 +671,16 @@ keyring_identity *keyring_unpack_identity(unsigned char *slot, const char *pin)
 	/* Invalid data, so invalid record.  Free and return failure.
 	   We don't complain about this, however, as it is the natural
 	   effect of trying a pin on an incorrect keyring slot. */
-	keyring_free_identity(id);
+	keyring_wipe_identity(id);
+	free(id);
 	return NULL;
       }
     }
   return id;
 }
 
+/* Returns -1 if the identity is too long, without logging, since the keyring unlock threads call
+   this */
 int keyring_identity_mac(keyring_context *c, keyring_identity *id,
 			 unsigned char *pkrsalt,unsigned char *mac)
 {
@@ -662,7 +692,7 @@ int keyring_identity_mac(keyring_context *c, keyring_identity *id,
     unsigned __len = (len); \
     if (__len > sizeof work - ofs) { \
       bzero(work, ofs); \
-      return WHY("Input too long"); \
+      return -1; \
     } \
     bcopy((buf), &work[ofs], __len); \
     ofs += __len; \
@@ -676,55 +706,71 @@ int keyring_identity_mac(keyring_context *c, keyring_identity *id,
 }
 
 
-/* Read the slot, and try to decrypt it.
+/* Try to decrypt a slot that has already been read from the keyring file.
    Decryption is symmetric with encryption, so the same function is used
    for munging the slot before making use of it, whichever way we are going.
    Once munged, we then need to verify that the slot is valid, and if so
    unpack the details of the identity.
+   The slot is copied before munging, and nothing global is touched, so several
+   slots can be tried at once by different threads.  That includes the logger, so
+   nothing here logs; errors are left in *error for the main thread to report.
+   Returns the identity, or NULL if the slot does not open with this PIN.  Sets
+   *mac_mismatch if the slot opened but failed its MAC check.
 */
-int keyring_decrypt_pkr(keyring_file *k,keyring_context *c,
-			const char *pin,int slot_number)
+static keyring_identity *keyring_decrypt_slot(keyring_file *k, keyring_context *c, const char *pin,
+					      const unsigned char *file_slot, int slot_number,
+					      int *mac_mismatch, const char **error)
 {
-  int exit_code=1;
   unsigned char slot[KEYRING_PAGE_SIZE];
   unsigned char hash[crypto_hash_sha512_BYTES];
   keyring_identity *id=NULL;
 
-  /* 1. Read slot. */
-  if (fseeko(k->file,slot_number*KEYRING_PAGE_SIZE,SEEK_SET))
-    return WHY_perror("fseeko");
-  if (fread(&slot[0],KEYRING_PAGE_SIZE,1,k->file)!=1)
-    return WHY_perror("fread");
-  /* 2. Decrypt data from slot. */
+  /* 1. Decrypt data from slot. */
+  bcopy(file_slot, slot, KEYRING_PAGE_SIZE);
   if (keyring_munge_block(slot,KEYRING_PAGE_SIZE,
 			  k->contexts[0]->KeyRingSalt,
 			  k->contexts[0]->KeyRingSaltLen,
-			  c->KeyRingPin,pin)) {
-    WHY("keyring_munge_block() failed");
-    goto kdp_safeexit;
-  }
+			  c->KeyRingPin,pin,error))
+    goto kds_safeexit;
 
-  /* 3. Unpack contents of slot into a new identity in the provided context. */
-  if ((id = keyring_unpack_identity(slot, pin)) == NULL)
-    goto kdp_safeexit; // Not a valid slot
+  /* 2. Unpack contents of slot into a new identity. */
+  if ((id = keyring_unpack_identity(slot, pin, error)) == NULL)
+    goto kds_safeexit; // Not a valid slot
   if (id->keypair_count < 1)
-    goto kdp_safeexit; // Not a valid slot
+    goto kds_safeexit; // Not a valid slot
   id->slot = slot_number;
 
-  /* 4. Verify that slot is self-consistent (check MAC) */
+  /* 3. Verify that slot is self-consistent (check MAC) */
   if (keyring_identity_mac(k->contexts[0],id,&slot[0],hash)) {
-    WHY("could not calculate MAC for identity");
-    goto kdp_safeexit;
+    *error = "Identity is too long to MAC";
+    goto kds_safeexit;
   }
   /* compare hash to record */
-  if (memcmp(hash,&slot[32],crypto_hash_sha512_BYTES))
-    {
-      WHY("Slot is not valid (MAC mismatch)");
-      dump("computed",hash,crypto_hash_sha512_BYTES);
-      dump("stored",&slot[32],crypto_hash_sha512_BYTES);
-      goto kdp_safeexit;
-    }
-  
+  if (memcmp(hash,&slot[32],crypto_hash_sha512_BYTES)) {
+    *mac_mismatch = 1;
+    goto kds_safeexit;
+  }
+  bzero(slot,KEYRING_PAGE_SIZE);
+  bzero(hash,crypto_hash_sha512_BYTES);
+  return id;
+
+ kds_safeexit:
+  /* Clean up any potentially sensitive data before exiting */
+  bzero(slot,KEYRING_PAGE_SIZE);
+  bzero(hash,crypto_hash_sha512_BYTES);
+  if (id) {
+    keyring_wipe_identity(id);
+    free(id);
+    id = NULL;
+  }
+  return NULL;
+}
+
+/* Add an identity that has just been unlocked to its context, and make its
+   subscriber known to the overlay as one of our own.
+*/
+static void keyring_add_unlocked_identity(keyring_context *c, keyring_identity *id)
+{
   // add any unlocked subscribers to our memory table, flagged as local sid's
   int i=0;
   for (i=0;i<id->keypair_count;i++){
@@ -741,24 +787,75 @@ int keyring_decrypt_pkr(keyring_file *k,keyring_context *c,
     }
   }
   
-  /* Well, it's all fine, so add the id into the context and return */
   c->identities[c->identity_count++]=id;
-  
-  return 0;
+}
 
- kdp_safeexit:
-  /* Clean up any potentially sensitive data before exiting */
-  bzero(slot,KEYRING_PAGE_SIZE);
-  bzero(hash,crypto_hash_sha512_BYTES);
-  if (id) {
-    keyring_free_identity(id);
-    id = NULL;
+#define KEYRING_MAX_UNLOCK_THREADS 16
+
+/* One PIN to try against one occupied slot in one context. */
+struct keyring_unlock_job {
+  int slot;
+  int context;
+  keyring_identity *id;
+  int mac_mismatch;
+  const char *error;
+};
+
+struct keyring_unlock_pool {
+  keyring_file *k;
+  const char *pin;
+  const unsigned char *file;
+  struct keyring_unlock_job *jobs;
+  int job_count;
+  int next_job;
+  pthread_mutex_t mutex;
+};
+
+static void keyring_unlock_work(struct keyring_unlock_pool *pool)
+{
+  while (1) {
+    pthread_mutex_lock(&pool->mutex);
+    int i = pool->next_job++;
+    pthread_mutex_unlock(&pool->mutex);
+    if (i >= pool->job_count)
+      return;
+    struct keyring_unlock_job *job = &pool->jobs[i];
+    job->id = keyring_decrypt_slot(pool->k, pool->k->contexts[job->context], pool->pin,
+				   &pool->file[job->slot * KEYRING_PAGE_SIZE], job->slot, &job->mac_mismatch,
+				   &job->error);
   }
-  return exit_code;
+}
+
+static void *keyring_unlock_thread(void *arg)
+{
+  // leave all signals to the main thread
+  sigset_t signals;
+  sigfillset(&signals);
+  pthread_sigmask(SIG_BLOCK, &signals, NULL);
+  keyring_unlock_work(arg);
+  return NULL;
+}
+
+static int keyring_unlock_threads(int job_count)
+{
+  int threads = config.keyring.unlock_threads;
+  if (threads == 0) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    threads = cpus > 0 ? cpus : 1;
+  }
+  if (threads > KEYRING_MAX_UNLOCK_THREADS)
+    threads = KEYRING_MAX_UNLOCK_THREADS;
+  if (threads > job_count)
+    threads = job_count;
+  return threads;
 }
 
 /* Try all valid slots with the PIN and see if we find any identities with that PIN.
-   We might find more than one. */
+   We might find more than one.
+   The whole keyring file is read in one go, and the slots are tried by a pool of
+   threads, since each try can cost up to a second of CPU time on a phone.  The
+   identities found are then added to their contexts in slot order, exactly as if
+   the slots had been tried one at a time. */
 int keyring_enter_pin(keyring_file *k, const char *pin)
 {
   if (config.debug.keyring)
@@ -767,10 +864,15 @@ int keyring_enter_pin(keyring_file *k, const char *pin)
   if (!k) RETURN(-1);
   if (!pin) pin="";
 
-  int slot;
+  int slot_count = k->file_size/KEYRING_PAGE_SIZE;
   int identitiesFound=0;
+  struct keyring_unlock_pool pool;
+  bzero(&pool, sizeof pool);
+  pool.k = k;
+  pool.pin = pin;
 
-  for(slot=0;slot<k->file_size/KEYRING_PAGE_SIZE;slot++)
+  int slot;
+  for(slot=0;slot<slot_count;slot++)
     {
       /* slot zero is the BAM and salt, so skip it */
       if (slot&(KEYRING_BAM_BITS-1)) {
@@ -791,17 +893,63 @@ int keyring_enter_pin(keyring_file *k, const char *pin)
 	if (b->bitmap[byte]&(1<<bit)) {
 	  /* Slot is occupied, so check it.
 	     We have to check it for each keyring context (ie keyring pin) */
+	  if (!pool.jobs && (pool.jobs = emalloc_zero(slot_count * k->context_count * sizeof(struct keyring_unlock_job))) == NULL)
+	    RETURN(-1);
 	  int c;
-	  for(c=0;c<k->context_count;c++)
-	    {
-	      int result=keyring_decrypt_pkr(k,k->contexts[c],pin?pin:"",slot);
-	      if (!result)
-		identitiesFound++;
-		
-	    }
+	  for(c=0;c<k->context_count;c++){
+	    pool.jobs[pool.job_count].slot = slot;
+	    pool.jobs[pool.job_count].context = c;
+	    pool.job_count++;
+	  }
 	}	
       }
     }
+  if (pool.job_count == 0)
+    RETURN(0);
+
+  /* Read every slot in one pass */
+  unsigned char *file = emalloc(slot_count * KEYRING_PAGE_SIZE);
+  if (!file) {
+    free(pool.jobs);
+    RETURN(-1);
+  }
+  if (fseeko(k->file, 0, SEEK_SET) || fread(file, KEYRING_PAGE_SIZE, slot_count, k->file) != slot_count) {
+    WHY_perror("fread");
+    free(file);
+    free(pool.jobs);
+    RETURN(-1);
+  }
+  pool.file = file;
+
+  pthread_mutex_init(&pool.mutex, NULL);
+  pthread_t threads[KEYRING_MAX_UNLOCK_THREADS];
+  int thread_count = keyring_unlock_threads(pool.job_count);
+  int started;
+  for (started = 0; started < thread_count - 1; started++)
+    if (pthread_create(&threads[started], NULL, keyring_unlock_thread, &pool)) {
+      WARN("pthread_create() failed, trying keyring slots with fewer threads");
+      break;
+    }
+  keyring_unlock_work(&pool);
+  while (started > 0)
+    pthread_join(threads[--started], NULL);
+  pthread_mutex_destroy(&pool.mutex);
+
+  /* Add what we found to the contexts, in the same order as trying each slot in turn would */
+  int i;
+  for (i = 0; i < pool.job_count; i++) {
+    struct keyring_unlock_job *job = &pool.jobs[i];
+    if (job->error)
+      WHYF("Slot %d: %s", job->slot, job->error);
+    if (job->mac_mismatch)
+      WHYF("Slot %d is not valid (MAC mismatch)", job->slot);
+    if (job->id) {
+      keyring_add_unlocked_identity(k->contexts[job->context], job->id);
+      identitiesFound++;
+    }
+  }
+  free(file);
+  free(pool.jobs);
   
   /* Tell the caller how many identities we found */
   RETURN(identitiesFound);
@@ -985,6 +1133,7 @@ int keyring_commit(keyring_file *k)
     for(in=0;in<k->contexts[cn]->identity_count;in++)
       {
 	unsigned char pkr[KEYRING_PAGE_SIZE];
+	const char *error = NULL;
 	if (keyring_pack_identity(k->contexts[cn],
 				  k->contexts[cn]->identities[in],
 				  pkr))
@@ -997,8 +1146,9 @@ int keyring_commit(keyring_file *k)
 				  k->contexts[cn]->KeyRingSalt, 
 				  k->contexts[cn]->KeyRingSaltLen, 
 				  k->contexts[cn]->KeyRingPin,
-				  k->contexts[cn]->identities[in]->PKRPin)) {
-	    WHY("keyring_munge_block() failed");
+				  k->contexts[cn]->identities[in]->PKRPin,
+				  &error)) {
+	    WHYF("keyring_munge_block() failed: %s", error);
 	    errorCount++;
 	  } else {
 	    /* Store */
@@ -1448,36 +1598,112 @@ int keyring_seed(keyring_file *k)
   can indeed be reused.
 */
 
-/* XXX We need a more efficient implementation than a linear list, but it will
-   do for now. */
+/* The cache is a hash table keyed on both keys, so a lookup only compares the few records that
+   share a bucket.  When it is full, we choose a record to replace using the CLOCK algorithm: every
+   hit marks a record as recently used, and we sweep a hand around the records clearing those marks
+   until we reach one that hasn't been used since the hand last passed it.  Peers that we are still
+   talking to are never evicted to make room for a new one, unless every peer in the cache is busy.
+*/
 struct nm_record {
-  /* 96 bytes per record */
+  /* 96 bytes per record, plus a few for the hash chain and CLOCK */
   unsigned char known_key[crypto_box_curve25519xsalsa20poly1305_PUBLICKEYBYTES];
   unsigned char unknown_key[crypto_box_curve25519xsalsa20poly1305_PUBLICKEYBYTES];
   unsigned char nm_bytes[crypto_box_curve25519xsalsa20poly1305_BEFORENMBYTES];
+  int next; /* next record in the same bucket, or -1 */
+  char used;
 };
 
-int nm_slots_used=0;
-/* 512 x 96 bytes = 48KB, not too big */
-#define NM_CACHE_SLOTS 512
-struct nm_record nm_cache[NM_CACHE_SLOTS];
+static struct nm_record *nm_cache=NULL;
+static int *nm_buckets=NULL;
+static unsigned nm_cache_size=0;
+static unsigned nm_bucket_mask=0;
+static unsigned nm_slots_used=0;
+static unsigned nm_clock_hand=0;
+static unsigned nm_hits=0;
+static unsigned nm_misses=0;
+static unsigned nm_evictions=0;
+
+static unsigned nm_hash(const unsigned char *known_sid, const unsigned char *unknown_sid)
+{
+  /* SIDs are public keys, so any of their bytes are as good a hash as we could compute */
+  uint32_t k, u;
+  memcpy(&k, known_sid, sizeof k);
+  memcpy(&u, unknown_sid, sizeof u);
+  return (k * 0x9E3779B1) ^ u;
+}
+
+/* (Re)allocate an empty cache of the configured size */
+static int nm_cache_init()
+{
+  unsigned size = config.keyring.nm_cache_size;
+  unsigned buckets = 1;
+  while (buckets < size)
+    buckets <<= 1;
+  struct nm_record *cache = emalloc(size * sizeof(struct nm_record));
+  if (!cache)
+    return -1;
+  int *bucket_heads = emalloc(buckets * sizeof(int));
+  if (!bucket_heads) {
+    free(cache);
+    return -1;
+  }
+  unsigned i;
+  for (i = 0; i < buckets; i++)
+    bucket_heads[i] = -1;
+  if (nm_cache)
+    free(nm_cache);
+  if (nm_buckets)
+    free(nm_buckets);
+  nm_cache = cache;
+  nm_buckets = bucket_heads;
+  nm_cache_size = size;
+  nm_bucket_mask = buckets - 1;
+  nm_slots_used = 0;
+  nm_clock_hand = 0;
+  return 0;
+}
 
-unsigned char *keyring_get_nm_bytes(unsigned char *known_sid, unsigned char *unknown_sid)
+/* Remove the least recently used record (near enough) from the hash table and return its index */
+static int nm_cache_evict()
+{
+  while (nm_cache[nm_clock_hand].used) {
+    nm_cache[nm_clock_hand].used = 0;
+    nm_clock_hand = (nm_clock_hand + 1) % nm_cache_size;
+  }
+  int i = nm_clock_hand;
+  nm_clock_hand = (nm_clock_hand + 1) % nm_cache_size;
+
+  int *p = &nm_buckets[nm_hash(nm_cache[i].known_key, nm_cache[i].unknown_key) & nm_bucket_mask];
+  while (*p != i)
+    p = &nm_cache[*p].next;
+  *p = nm_cache[i].next;
+  nm_evictions++;
+  return i;
+}
+
+unsigned char *keyring_get_nm_bytes(const unsigned char *known_sid, const unsigned char *unknown_sid)
 {
   IN();
   if (!known_sid) { RETURNNULL(WHYNULL("known pub key is null")); }
   if (!unknown_sid) { RETURNNULL(WHYNULL("unknown pub key is null")); }
   if (!keyring) { RETURNNULL(WHYNULL("keyring is null")); }
 
+  if (nm_cache_size != config.keyring.nm_cache_size && nm_cache_init() == -1)
+    { RETURNNULL(NULL); }
+
+  int *bucket = &nm_buckets[nm_hash(known_sid, unknown_sid) & nm_bucket_mask];
   int i;
 
   /* See if we have it cached already */
-  for(i=0;i<nm_slots_used;i++)
+  for (i = *bucket; i != -1; i = nm_cache[i].next)
     {
       if (memcmp(nm_cache[i].known_key,known_sid,SID_SIZE)) continue;
       if (memcmp(nm_cache[i].unknown_key,unknown_sid,SID_SIZE)) continue;
+      nm_cache[i].used = 1;
+      nm_hits++;
       RETURN(nm_cache[i].nm_bytes);
     }
+  nm_misses++;
 
   /* Not in the cache, so prepare to cache it (or return failure if known is not
      in fact a known key */
@@ -1486,10 +1712,10 @@ unsigned char *keyring_get_nm_bytes(unsigned char *known_sid, unsigned char *unk
     { RETURNNULL(WHYNULL("known key is not in fact known.")); }
 
   /* work out where to store it */
-  if (nm_slots_used<NM_CACHE_SLOTS) {
+  if (nm_slots_used<nm_cache_size) {
     i=nm_slots_used; nm_slots_used++; 
   } else {
-    i=random()%NM_CACHE_SLOTS;
+    i=nm_cache_evict();
   }
 
   /* calculate and store */
@@ -1501,7 +1727,103 @@ unsigned char *keyring_get_nm_bytes(unsigned char *known_sid, unsigned char *unk
 						 ->contexts[cn]
 						 ->identities[in]
 						 ->keypairs[kp]->private_key);
+  nm_cache[i].used = 1;
+  nm_cache[i].next = *bucket;
+  *bucket = i;
 						 
   RETURN(nm_cache[i].nm_bytes);
   OUT();
 }
+
+void keyring_nm_showstats()
+{
+  if (nm_hits || nm_misses)
+    INFOF("Shared secret cache: %u hits, %u misses, %u evictions, %u of %u records used",
+	  nm_hits, nm_misses, nm_evictions, nm_slots_used, nm_cache_size);
+}
+
+void keyring_nm_clearstats()
+{
+  nm_hits = 0;
+  nm_misses = 0;
+  nm_evictions = 0;
+}
+
+int app_nm_cache_test(const struct cli_parsed *parsed, void *context)
+{
+  if (config.debug.verbose)
+    DEBUG_cli_parsed(parsed);
+  const char *arg;
+  if (cli_arg(parsed, "count", &arg, cli_uint, "0") == -1)
+    return -1;
+  int sizes[] = { 10, 500, 5000 };
+  int size_count = sizeof sizes / sizeof sizes[0];
+  if (atoi(arg) > 0) {
+    sizes[0] = atoi(arg);
+    size_count = 1;
+  }
+  if (create_serval_instance_dir() == -1)
+    return -1;
+  char keyringFile[1024];
+  if (!FORM_SERVAL_INSTANCE_PATH(keyringFile, "nmcache-test.keyring"))
+    return -1;
+  unlink(keyringFile);
+  if (!(keyring = keyring_open(keyringFile)))
+    return -1;
+  keyring_enter_pin(keyring, "");
+  keyring_identity *id = keyring_create_identity(keyring, keyring->contexts[0], "");
+  if (!id || !id->subscriber) {
+    keyring_free(keyring);
+    keyring = NULL;
+    unlink(keyringFile);
+    return WHY("Could not create identity");
+  }
+  
+  const int frames = 20000;
+  int ret = 0;
+  int s;
+  for (s = 0; s < size_count && ret == 0; s++) {
+    int count = sizes[s];
+    unsigned char *peers = emalloc(count * SID_SIZE);
+    if (!peers) {
+      ret = -1;
+      break;
+    }
+    // any 32 bytes will do as a simulated peer's public key
+    urandombytes(peers, count * SID_SIZE);
+    if (nm_cache_init() == -1) {
+      free(peers);
+      ret = -1;
+      break;
+    }
+    
+    printf("Benchmarking shared secret lookups for %d peers, with a %u record cache:\n",
+	   count, nm_cache_size);
+    int i;
+    for (i = 0; i < count && i < (int)nm_cache_size; i++)
+      keyring_get_nm_bytes(id->subscriber->sid, &peers[i * SID_SIZE]);
+    keyring_nm_clearstats();
+    
+    // every miss costs a whole crypto_box_beforenm(), so give up after a couple of seconds
+    time_ns_t start = gettime_ns();
+    time_ns_t end = start;
+    for (i = 0; i < frames && end - start < 2000000000LL; i++) {
+      if (!keyring_get_nm_bytes(id->subscriber->sid, &peers[(random() % count) * SID_SIZE])) {
+	ret = WHY("Shared secret lookup failed");
+	break;
+      }
+      if ((i & 63) == 63)
+	end = gettime_ns();
+    }
+    end = gettime_ns();
+    printf("%d frames - %.3fms, %.0fns per frame, %u hits, %u misses, %u evictions\n",
+	   i, (end - start) / 1e6, i ? (end - start) * 1.0 / i : 0,
+	   nm_hits, nm_misses, nm_evictions);
+    free(peers);
+  }
+  keyring_nm_clearstats();
+  keyring_free(keyring);
+  keyring = NULL;
+  unlink(keyringFile);
+  return ret;
+}
@@ -17,6 +17,9 @@
  */
 
 #include <sys/stat.h>
+#ifdef HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#endif
 #include "serval.h"
 #include "conf.h"
 #include "str.h"
@@ -46,10 +49,8 @@ int overlay_mdp_send(overlay_mdp_frame *mdp,int flags,int timeout_ms)
   if (!FORM_SERVAL_INSTANCE_PATH(name.sun_path, "mdp.socket"))
     return -1;
   
-  set_nonblock(mdp_client_socket);
   int result=sendto(mdp_client_socket, mdp, len, 0,
 		    (struct sockaddr *)&name, sizeof(struct sockaddr_un));
-  set_block(mdp_client_socket);
   if (result<0) {
     mdp->packetTypeAndFlags=MDP_ERROR;
     mdp->error.error=1;
@@ -135,6 +136,9 @@ int overlay_mdp_client_init()
     if (setsockopt(mdp_client_socket, SOL_SOCKET, SO_RCVBUF, 
 		   &send_buffer_size, sizeof(send_buffer_size)) == -1)
       WARN_perror("setsockopt");
+    
+    /* We only ever send and receive when we know we won't block, or don't want to */
+    set_nonblock(mdp_client_socket);
   }
   
   return 0;
@@ -142,6 +146,7 @@ int overlay_mdp_client_init()
 
 int overlay_mdp_client_done()
 {
+  overlay_mdp_ring_close();
   if (mdp_client_socket!=-1) {
     /* Tell MDP server to release all our bindings */
     overlay_mdp_frame mdp;
@@ -190,9 +195,7 @@ int overlay_mdp_recv(overlay_mdp_frame *mdp, int port, int *ttl)
   mdp->packetTypeAndFlags=0;
   
   /* Check if reply available */
-  set_nonblock(mdp_client_socket);
   ssize_t len = recvwithttl(mdp_client_socket,(unsigned char *)mdp, sizeof(overlay_mdp_frame),ttl,recvaddr,&recvaddrlen);
-  set_block(mdp_client_socket);
   
   recvaddr_un=(struct sockaddr_un *)recvaddr;
   /* Null terminate received address so that the stat() call below can succeed */
@@ -278,11 +281,16 @@ int overlay_mdp_relevant_bytes(overlay_mdp_frame *mdp)
   int len;
   switch(mdp->packetTypeAndFlags&MDP_TYPE_MASK)
   {
-    case MDP_ROUTING_TABLE:
     case MDP_GOODBYE:
+    case MDP_RING_ATTACH:
+    case MDP_RING_DETACH:
       /* no arguments for saying goodbye */
       len=&mdp->raw[0]-(char *)mdp;
       break;
+    case MDP_ROUTING_TABLE:
+      /* the SID to carry on after, if any */
+      len=(&mdp->out.payload[0]-(unsigned char *)mdp) + mdp->out.payload_length;
+      break;
     case MDP_ADDRLIST: 
       len=(&mdp->addrlist.sids[0][0]-(unsigned char *)mdp) + mdp->addrlist.frame_sid_count*SID_SIZE;
       break;
@@ -312,3 +320,251 @@ int overlay_mdp_relevant_bytes(overlay_mdp_frame *mdp)
   }
   return len;
 }
+
+overlay_mdp_frame *mdp_ring_claim(struct mdp_ring *ring, int *pending)
+{
+  uint32_t head = ring->head + *pending;
+  if ((uint32_t)(head - ring->tail) >= MDP_RING_SLOTS)
+    return NULL;
+  (*pending)++;
+  return &ring->slots[head % MDP_RING_SLOTS].frame;
+}
+
+void mdp_ring_publish(struct mdp_ring *ring, int *pending)
+{
+  uint32_t head = ring->head;
+  int i;
+  for (i = 0; i < *pending; i++) {
+    struct mdp_ring_slot *slot = &ring->slots[(head + i) % MDP_RING_SLOTS];
+    int len = overlay_mdp_relevant_bytes(&slot->frame);
+    slot->length = len < 0 ? 0 : len;
+  }
+  __sync_synchronize();
+  ring->head = head + *pending;
+  *pending = 0;
+}
+
+overlay_mdp_frame *mdp_ring_peek(struct mdp_ring *ring, int n, int *length)
+{
+  uint32_t available = ring->head - ring->tail;
+  // the other end may be broken or hostile, so don't trust its counters
+  if (n < 0 || (uint32_t)n >= available || available > MDP_RING_SLOTS)
+    return NULL;
+  __sync_synchronize();
+  struct mdp_ring_slot *slot = &ring->slots[(ring->tail + n) % MDP_RING_SLOTS];
+  *length = slot->length;
+  return &slot->frame;
+}
+
+void mdp_ring_consume(struct mdp_ring *ring, int count)
+{
+  __sync_synchronize();
+  ring->tail += count;
+}
+
+#ifdef HAVE_MDP_RINGS
+static struct mdp_ring_pair *mdp_client_rings=NULL;
+static int mdp_ring_to_server_fd=-1;
+static int mdp_ring_to_client_fd=-1;
+static int mdp_ring_pending=0;
+
+/* Tell the server to stop using our rings, and send us everything through the socket again */
+static void overlay_mdp_ring_detach_server()
+{
+  overlay_mdp_frame mdp;
+  mdp.packetTypeAndFlags=MDP_RING_DETACH;
+  overlay_mdp_send(&mdp,0,0);
+}
+#endif
+
+/* Ask the server to exchange frames with us through shared memory from now on.  Returns -1 if
+   it can't, in which case we can carry on using the socket. */
+int overlay_mdp_ring_open()
+{
+#ifdef HAVE_MDP_RINGS
+  if (mdp_client_rings)
+    return 0;
+  if (mdp_client_socket==-1 && overlay_mdp_client_init() != 0)
+    return -1;
+  
+  int fds[3]={-1,-1,-1};
+  int shm_fd=memfd_create("mdp-ring", MFD_CLOEXEC|MFD_ALLOW_SEALING);
+  if (shm_fd==-1)
+    return WHY_perror("memfd_create");
+  fds[0]=shm_fd;
+  
+  struct mdp_ring_pair *rings=MAP_FAILED;
+  if (ftruncate(shm_fd, sizeof(struct mdp_ring_pair)) == -1) {
+    WHY_perror("ftruncate");
+    goto error;
+  }
+  /* The server won't map memory that we could still shrink under it */
+  if (fcntl(shm_fd, F_ADD_SEALS, F_SEAL_SHRINK|F_SEAL_GROW|F_SEAL_SEAL) == -1) {
+    WHY_perror("fcntl(F_ADD_SEALS)");
+    goto error;
+  }
+  rings=mmap(NULL, sizeof(struct mdp_ring_pair), PROT_READ|PROT_WRITE, MAP_SHARED, shm_fd, 0);
+  if (rings==MAP_FAILED) {
+    WHY_perror("mmap");
+    goto error;
+  }
+  rings->magic=MDP_RING_MAGIC;
+  rings->version=MDP_RING_VERSION;
+  rings->slot_count=MDP_RING_SLOTS;
+  rings->slot_size=sizeof(struct mdp_ring_slot);
+  
+  if ((fds[1]=eventfd(0, EFD_NONBLOCK))==-1 || (fds[2]=eventfd(0, EFD_NONBLOCK))==-1) {
+    WHY_perror("eventfd");
+    goto error;
+  }
+  
+  overlay_mdp_frame mdp;
+  mdp.packetTypeAndFlags=MDP_RING_ATTACH;
+  struct sockaddr_un name;
+  name.sun_family = AF_UNIX;
+  if (!FORM_SERVAL_INSTANCE_PATH(name.sun_path, "mdp.socket"))
+    goto error;
+  if (sendwithfds(mdp_client_socket, (unsigned char *)&mdp, overlay_mdp_relevant_bytes(&mdp),
+		  (struct sockaddr *)&name, sizeof name, fds, 3) == -1)
+    goto error;
+  
+  /* The server has its own copies of the descriptors now */
+  close(shm_fd);
+  fds[0]=-1;
+  /* Frames for our existing bindings may already be queued on the socket ahead of the reply.
+     There's nobody to hand them to while we wait, so they are dropped, just as they would be if
+     the socket's queue had been full. */
+  time_ms_t timeout = gettime_ms() + 5000;
+  while (overlay_mdp_client_poll(timeout - gettime_ms()) > 0) {
+    int ttl=-1;
+    if (overlay_mdp_recv(&mdp, 0, &ttl) != 0)
+      continue;
+    if ((mdp.packetTypeAndFlags&MDP_TYPE_MASK) != MDP_ERROR) {
+      if (config.debug.mdprequests)
+	DEBUGF("Dropping MDP frame of type %d while waiting for rings to attach",
+	       mdp.packetTypeAndFlags&MDP_TYPE_MASK);
+      continue;
+    }
+    if (mdp.error.error) {
+      WHYF("MDP server would not attach rings: %s", mdp.error.message);
+      goto detach;
+    }
+    mdp_client_rings=rings;
+    mdp_ring_to_server_fd=fds[1];
+    mdp_ring_to_client_fd=fds[2];
+    mdp_ring_pending=0;
+    return 0;
+  }
+  WHY("Timeout waiting for MDP server to attach rings");
+  
+detach:
+  /* The server may still have attached the rings, or be about to, and it must not carry on
+     delivering our frames into rings that nobody is reading */
+  overlay_mdp_ring_detach_server();
+error:
+  if (rings!=MAP_FAILED)
+    munmap(rings, sizeof(struct mdp_ring_pair));
+  int i;
+  for (i=0;i<3;i++)
+    if (fds[i]!=-1)
+      close(fds[i]);
+  return -1;
+#else
+  return WHY("MDP rings are not supported on this platform");
+#endif
+}
+
+void overlay_mdp_ring_close()
+{
+#ifdef HAVE_MDP_RINGS
+  if (!mdp_client_rings)
+    return;
+  overlay_mdp_ring_detach_server();
+  munmap(mdp_client_rings, sizeof(struct mdp_ring_pair));
+  close(mdp_ring_to_server_fd);
+  close(mdp_ring_to_client_fd);
+  mdp_client_rings=NULL;
+  mdp_ring_to_server_fd=-1;
+  mdp_ring_to_client_fd=-1;
+#endif
+}
+
+/* Return a frame to fill in and pass to the server with the next overlay_mdp_ring_send(), or NULL
+   if there is no room left in the ring. */
+overlay_mdp_frame *overlay_mdp_ring_claim()
+{
+#ifdef HAVE_MDP_RINGS
+  if (mdp_client_rings)
+    return mdp_ring_claim(&mdp_client_rings->to_server, &mdp_ring_pending);
+#endif
+  return NULL;
+}
+
+/* Pass every frame claimed since the last call to the server, and wake it up once for all of them */
+int overlay_mdp_ring_send()
+{
+#ifdef HAVE_MDP_RINGS
+  if (!mdp_client_rings)
+    return WHY("MDP rings are not open");
+  if (!mdp_ring_pending)
+    return 0;
+  mdp_ring_publish(&mdp_client_rings->to_server, &mdp_ring_pending);
+  uint64_t one=1;
+  if (write(mdp_ring_to_server_fd, &one, sizeof one) == -1 && errno != EAGAIN)
+    return WHY_perror("write");
+  return 0;
+#else
+  return WHY("MDP rings are not supported on this platform");
+#endif
+}
+
+/* Wait until the server has passed us at least one frame.  Returns the number waiting, or 0 if
+   we timed out. */
+int overlay_mdp_ring_poll(time_ms_t timeout_ms)
+{
+#ifdef HAVE_MDP_RINGS
+  if (!mdp_client_rings)
+    return WHY("MDP rings are not open");
+  time_ms_t timeout = gettime_ms() + timeout_ms;
+  struct mdp_ring *ring = &mdp_client_rings->to_client;
+  while(1){
+    uint32_t available = ring->head - ring->tail;
+    if (available)
+      return available;
+    time_ms_t wait = timeout - gettime_ms();
+    if (wait < 0)
+      return 0;
+    struct pollfd fds={.fd=mdp_ring_to_client_fd, .events=POLLIN};
+    if (poll(&fds, 1, wait) == -1 && errno != EINTR)
+      return WHY_perror("poll");
+    uint64_t count;
+    if (read(mdp_ring_to_client_fd, &count, sizeof count) == -1 && errno != EAGAIN)
+      return WHY_perror("read");
+  }
+#else
+  return WHY("MDP rings are not supported on this platform");
+#endif
+}
+
+/* Point frames at up to max of the frames the server has passed us, without copying them.  They
+   stay valid until they are handed back with overlay_mdp_ring_done(). */
+int overlay_mdp_ring_recv(overlay_mdp_frame **frames, int max)
+{
+  int count=0;
+#ifdef HAVE_MDP_RINGS
+  if (!mdp_client_rings)
+    return WHY("MDP rings are not open");
+  int length;
+  while (count < max && (frames[count] = mdp_ring_peek(&mdp_client_rings->to_client, count, &length)))
+    count++;
+#endif
+  return count;
+}
+
+void overlay_mdp_ring_done(int count)
+{
+#ifdef HAVE_MDP_RINGS
+  if (mdp_client_rings)
+    mdp_ring_consume(&mdp_client_rings->to_client, count);
+#endif
+}
@@ -28,10 +28,69 @@ struct overlay_route_record{
   unsigned char neighbour[SID_SIZE];
 };
 
+/* The server packs as many records as will fit into each MDP_ROUTING_TABLE reply, and sends at most
+   a page of frames per request, so that they never overflow the client's socket queue
+   (net.unix.max_dgram_qlen, 10 by default).  Every frame is full except the last one in the table,
+   which may be empty.  To read the next page, the client repeats the request with the SID of the
+   last record it received as the out.payload. */
+#define MDP_ROUTE_RECORDS_PER_FRAME \
+  ((int)(sizeof(((overlay_mdp_data_frame *)0)->payload) / sizeof(struct overlay_route_record)))
+#define MDP_ROUTE_FRAMES_PER_PAGE 8
+
 struct overlay_mdp_scan{
   struct in_addr addr;
 };
 
+/* A client can exchange MDP frames with the server through a pair of rings in shared memory
+   instead of its socket.  Each ring has a single producer and a single consumer, so they need no
+   locks; the producer only moves head and the consumer only moves tail.  After adding a batch of
+   frames to a ring, the producer writes once to that ring's eventfd to wake the consumer.  The
+   socket is still used to set up the rings and as the frame's return address, and remains the
+   way to talk to a server that can't do rings.
+   The rings are in a memfd that the client seals before passing it to the server, so the client
+   can't shrink it under the server's mapping afterwards.
+*/
+#if defined(HAVE_SYS_EVENTFD_H) && defined(HAVE_MEMFD_CREATE)
+#define HAVE_MDP_RINGS 1
+#endif
+#define MDP_RING_MAGIC 0x4d445052
+#define MDP_RING_VERSION 1
+#define MDP_RING_SLOTS 256
+
+struct mdp_ring_slot{
+  uint32_t length;
+  overlay_mdp_frame frame;
+};
+
+struct mdp_ring{
+  /* keep the two counters, which are written by different processes, on separate cache lines */
+  volatile uint32_t head;
+  unsigned char pad1[60];
+  volatile uint32_t tail;
+  unsigned char pad2[60];
+  struct mdp_ring_slot slots[MDP_RING_SLOTS];
+};
+
+struct mdp_ring_pair{
+  uint32_t magic;
+  uint32_t version;
+  uint32_t slot_count;
+  uint32_t slot_size;
+  unsigned char pad[48];
+  struct mdp_ring to_server;
+  struct mdp_ring to_client;
+};
+
+/* Claim the next free slot in a ring, without making it visible to the consumer.  *pending is the
+   number of slots already claimed by earlier calls; returns NULL if the ring is full. */
+overlay_mdp_frame *mdp_ring_claim(struct mdp_ring *ring, int *pending);
+/* Make the claimed slots visible to the consumer */
+void mdp_ring_publish(struct mdp_ring *ring, int *pending);
+/* Return the frame in the ring's nth unconsumed slot, or NULL if there isn't one */
+overlay_mdp_frame *mdp_ring_peek(struct mdp_ring *ring, int n, int *length);
+/* Free the first count unconsumed slots */
+void mdp_ring_consume(struct mdp_ring *ring, int count);
+
 /* Client-side MDP function */
 extern int mdp_client_socket;
 int overlay_mdp_client_init();
@@ -41,4 +100,12 @@ int overlay_mdp_recv(overlay_mdp_frame *mdp, int port, int *ttl);
 int overlay_mdp_send(overlay_mdp_frame *mdp,int flags,int timeout_ms);
 int overlay_mdp_relevant_bytes(overlay_mdp_frame *mdp);
 
+int overlay_mdp_ring_open();
+void overlay_mdp_ring_close();
+overlay_mdp_frame *overlay_mdp_ring_claim();
+int overlay_mdp_ring_send();
+int overlay_mdp_ring_poll(time_ms_t timeout_ms);
+int overlay_mdp_ring_recv(overlay_mdp_frame **frames, int max);
+void overlay_mdp_ring_done(int count);
+
 #endif
\ No newline at end of file
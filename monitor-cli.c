@@ -103,3 +103,150 @@ int app_monitor_cli(const struct cli_parsed *parsed, void *context)
   return 0;
 }
 
+static int monitor_test_status(char *cmd, int argc, char **argv, unsigned char *data, int dataLen, void *context)
+{
+  (*(int *)context)++;
+  return 1;
+}
+
+/* Flood the monitor interface of a running daemon with pipelined commands, half of them carrying
+ * binary data, and report how fast the daemon works through them.
+ */
+int app_monitor_test(const struct cli_parsed *parsed, void *context)
+{
+  if (config.debug.verbose)
+    DEBUG_cli_parsed(parsed);
+  const char *arg;
+  if (cli_arg(parsed, "count", &arg, cli_uint, "100000") == -1)
+    return -1;
+  int count = atoi(arg);
+  if (count < 1)
+    return WHY("Invalid count");
+
+  // each batch is written with one write(), and answered before the next is sent
+  const char command[] = "monitor peers\n";
+  const char data_command[] = "*8:monitor peers\n01234567";
+  const int batch = 64;
+  char buffer[batch * sizeof data_command];
+  
+  struct monitor_state *state;
+  int fd = monitor_client_open(&state);
+  if (fd == -1)
+    return WHY("Could not connect to the monitor interface, is the server running?");
+  
+  int replies = 0;
+  struct monitor_command_handler handlers[] = {
+    {.command="MONITORSTATUS", .context=&replies, .handler=monitor_test_status},
+  };
+  
+  int sent = 0;
+  int ret = 0;
+  time_ms_t start = gettime_ms();
+  while (sent < count && ret == 0) {
+    int n = 0, len = 0;
+    for (; n < batch && sent + n < count; n++) {
+      const char *cmd = (sent + n) & 1 ? data_command : command;
+      size_t cmd_len = ((sent + n) & 1 ? sizeof data_command : sizeof command) - 1;
+      bcopy(cmd, &buffer[len], cmd_len);
+      len += cmd_len;
+    }
+    set_block(fd);
+    if (write_all(fd, buffer, len) == -1) {
+      ret = -1;
+      break;
+    }
+    set_nonblock(fd);
+    sent += n;
+    while (replies < sent) {
+      struct pollfd pfd = { .fd = fd, .events = POLLIN };
+      if (poll(&pfd, 1, 5000) < 1) {
+	ret = WHYF("Timed out waiting for replies, got %d of %d", replies, sent);
+	break;
+      }
+      if (monitor_client_read(fd, state, handlers, 1) < 0) {
+	ret = -1;
+	break;
+      }
+    }
+  }
+  time_ms_t end = gettime_ms();
+  monitor_client_close(fd, state);
+  
+  printf("%d monitor commands in %lldms - %.0f commands/sec\n", replies, (long long)(end - start),
+	 end > start ? replies * 1000.0 / (end - start) : 0);
+  return ret;
+}
+
+struct monitor_stats_state {
+  int rows;
+  int done;
+};
+
+static int monitor_stats_row(char *cmd, int argc, char **argv, unsigned char *data, int dataLen, void *context)
+{
+  struct monitor_stats_state *state = context;
+  // STATSEND also starts with STATS
+  if (argc != 8)
+    return 1;
+  cli_put_string(argv[0], ":");
+  int i;
+  for (i = 1; i < 8; i++)
+    cli_put_long(atoll(argv[i]), i == 7 ? "\n" : ":");
+  state->rows++;
+  return 1;
+}
+
+static int monitor_stats_end(char *cmd, int argc, char **argv, unsigned char *data, int dataLen, void *context)
+{
+  struct monitor_stats_state *state = context;
+  state->done = 1;
+  return 1;
+}
+
+/* Fetch the running daemon's profiling stats over the monitor interface, as a table with times in
+ * nanoseconds.
+ */
+int app_monitor_stats(const struct cli_parsed *parsed, void *context)
+{
+  if (config.debug.verbose)
+    DEBUG_cli_parsed(parsed);
+  struct monitor_state *state;
+  int fd = monitor_client_open(&state);
+  if (fd == -1)
+    return WHY("Could not connect to the monitor interface, is the server running?");
+  
+  const char *names[]={
+    "function",
+    "calls",
+    "total ns",
+    "child ns",
+    "max ns",
+    "p50 ns",
+    "p90 ns",
+    "p99 ns"
+  };
+  cli_columns(8, names);
+  
+  struct monitor_stats_state stats = {0, 0};
+  struct monitor_command_handler handlers[] = {
+    {.command="STATS", .context=&stats, .handler=monitor_stats_row},
+    {.command="STATSEND", .context=&stats, .handler=monitor_stats_end},
+  };
+  int ret = 0;
+  if (write_str(fd, "stats\n") == -1)
+    ret = -1;
+  set_nonblock(fd);
+  while (ret == 0 && !stats.done) {
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    if (poll(&pfd, 1, 5000) < 1) {
+      ret = WHY("Timed out waiting for stats");
+      break;
+    }
+    if (monitor_client_read(fd, state, handlers, 2) < 0)
+      ret = -1;
+  }
+  monitor_client_close(fd, state);
+  if (ret == 0)
+    cli_row_count(stats.rows);
+  return ret;
+}
@@ -24,6 +24,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 */
 
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include "serval.h"
 #include "conf.h"
 #include "rhizome.h"
@@ -44,6 +45,17 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 
 #define MONITOR_LINE_LENGTH 160
 #define MONITOR_DATA_SIZE MAX_AUDIO_BYTES
+#define MONITOR_READ_BUFFER_SIZE 4096
+#define MONITOR_QUEUE_MESSAGES 256
+
+/* A message waiting in a client's output queue.  The length is what is left to send, and the mask
+ * is the class of event it belongs to, zero for replies to the client's own commands.
+ */
+struct monitor_queued_message {
+  int length;
+  int mask;
+};
+
 struct monitor_context {
   struct sched_ent alarm;
   // monitor interest bitmask
@@ -60,6 +72,20 @@ struct monitor_context {
   unsigned char buffer[MONITOR_DATA_SIZE];
   int data_expected;
   int data_offset;
+  
+  // output the client hasn't read yet, as a ring of bytes and a ring of message boundaries
+  unsigned char *out_buffer;
+  int out_size;
+  int out_head;
+  int out_length;
+  struct monitor_queued_message out_messages[MONITOR_QUEUE_MESSAGES];
+  int out_first;
+  int out_count;
+  // part of the first message has been written, so it can no longer be dropped
+  int out_started;
+  uint64_t bytes_queued;
+  uint64_t bytes_dropped;
+  unsigned int messages_dropped;
 };
 
 #define MAX_MONITOR_SOCKETS 8
@@ -69,6 +95,8 @@ struct monitor_context monitor_sockets[MAX_MONITOR_SOCKETS];
 int monitor_process_command(struct monitor_context *c);
 int monitor_process_data(struct monitor_context *c);
 static void monitor_new_client(int s);
+static int monitor_write(struct monitor_context *c, const char *msg, int len, int mask);
+static int monitor_write_str(struct monitor_context *c, const char *msg);
 
 struct sched_ent named_socket;
 struct profile_total named_stats;
@@ -131,7 +159,7 @@ int monitor_setup_sockets()
 int monitor_write_error(struct monitor_context *c, const char *error){
   char msg[256];
   snprintf(msg, sizeof(msg), "\nERROR:%s\n", error);
-  write_str(c->alarm.poll.fd, msg);
+  monitor_write_str(c, msg);
   return -1;
 }
 
@@ -167,11 +195,16 @@ void monitor_poll(struct sched_ent *alarm)
 static void monitor_close(struct monitor_context *c){
   struct monitor_context *last;
   
-  INFO("Tearing down monitor client");
+  INFOF("Tearing down monitor client, %llu bytes queued, %llu bytes in %u messages dropped",
+	(unsigned long long)c->bytes_queued, (unsigned long long)c->bytes_dropped, c->messages_dropped);
   
   unwatch(&c->alarm);
   close(c->alarm.poll.fd);
   c->alarm.poll.fd=-1;
+  if (c->out_buffer){
+    free(c->out_buffer);
+    c->out_buffer=NULL;
+  }
   
   monitor_socket_count--;
   last = &monitor_sockets[monitor_socket_count];
@@ -183,107 +216,269 @@ static void monitor_close(struct monitor_context *c){
   }
 }
 
-void monitor_client_poll(struct sched_ent *alarm)
+/* Remove the i'th queued message by moving the bytes of the messages ahead of it forward over it.
+ * Usually only the first message, if any, is ahead of it, so little is copied.
+ */
+static void monitor_queue_remove(struct monitor_context *c, int i)
 {
-  /* Read available data from a monitor socket */
-  struct monitor_context *c=(struct monitor_context *)alarm;
-  errno=0;
-  int bytes;
-  
-  if (alarm->poll.revents & POLLIN) {
-    switch(c->state) {
-    case MONITOR_STATE_COMMAND:
-      bytes = 1;
-      while(bytes == 1) {
-	if (c->line_length >= MONITOR_LINE_LENGTH) {
-	  c->line_length=0;
-	  monitor_write_error(c,"Command too long");
-	  monitor_close(c);
-	  return;
-	}
-	bytes = read(c->alarm.poll.fd, &c->line[c->line_length], 1);
-	if (bytes < 1) {
-	  switch(errno) {
-	  case EINTR:
-	  case ENOTRECOVERABLE:
-	    /* transient errors */
-	    WHY_perror("read");
-	    break;
-	  case EAGAIN:
-	    break;
-	  default:
-	    WHY_perror("read");
-	    /* all other errors; close socket */
-	    monitor_close(c);
-	    return;
-	  }
-	}
-	
-	// silently skip all \r characters
-	if (c->line[c->line_length] == '\r')
-	  continue;
-	
-	// parse data length as soon as we see the : delimiter, 
-	// so we can read the rest of the line into the start of the buffer
-	if (c->data_expected==0 && c->line[0]=='*' && c->line[c->line_length]==':'){
-	  c->line[c->line_length]=0;
-	  c->data_expected=atoi(c->line +1);
-	  c->line_length=0;
-	  continue;
-	}
-	
-	if (c->line[c->line_length] == '\n') {
-	  /* got whole command line, start reading data if required */
-	  c->line[c->line_length]=0;
-	  c->state=MONITOR_STATE_DATA;
-	  c->data_offset=0;
-	  break;
-	}
-	
-	c->line_length += bytes;
-      }
-	
-      if (c->state!=MONITOR_STATE_DATA)
+  int len = c->out_messages[(c->out_first + i) % MONITOR_QUEUE_MESSAGES].length;
+  int prefix = 0;
+  int j;
+  for (j = 0; j < i; j++)
+    prefix += c->out_messages[(c->out_first + j) % MONITOR_QUEUE_MESSAGES].length;
+  for (j = prefix - 1; j >= 0; j--)
+    c->out_buffer[(c->out_head + j + len) % c->out_size] = c->out_buffer[(c->out_head + j) % c->out_size];
+  for (j = i; j > 0; j--)
+    c->out_messages[(c->out_first + j) % MONITOR_QUEUE_MESSAGES] =
+      c->out_messages[(c->out_first + j - 1) % MONITOR_QUEUE_MESSAGES];
+  c->out_head = (c->out_head + len) % c->out_size;
+  c->out_length -= len;
+  c->out_first = (c->out_first + 1) % MONITOR_QUEUE_MESSAGES;
+  c->out_count--;
+  c->bytes_dropped += len;
+  c->messages_dropped++;
+}
+
+/* Make room in a client's output queue for a new message, according to the monitor.slow_client
+ * policy.  Replies to the client's own commands may displace queued events of any class, but are
+ * never displaced themselves, and each reply is queued as one message, so a client never sees part
+ * of one.  Returns 0 if there is now room, 1 if the new message must be dropped instead, or -1 if
+ * the client should be disconnected.
+ */
+static int monitor_queue_make_room(struct monitor_context *c, int len, int mask)
+{
+  while (c->out_size - c->out_length < len || c->out_count >= MONITOR_QUEUE_MESSAGES) {
+    if (config.monitor.slow_client == MONITOR_SLOW_DISCONNECT)
+      return -1;
+    int i;
+    for (i = c->out_started ? 1 : 0; i < c->out_count; i++) {
+      int queued_mask = c->out_messages[(c->out_first + i) % MONITOR_QUEUE_MESSAGES].mask;
+      if (queued_mask == 0)
+	continue;
+      if (config.monitor.slow_client == MONITOR_SLOW_DROP_OLDEST || mask == 0 || (queued_mask & mask))
 	break;
-	
-      // else fall through
-    case MONITOR_STATE_DATA:
-	
-      if (c->data_expected - c->data_offset >0){
-	bytes = read(c->alarm.poll.fd,
-		     &c->buffer[c->data_offset],
-		     c->data_expected - c->data_offset);
-	if (bytes < 1) {
-	  switch(errno) {
-	  case EAGAIN: case EINTR: 
-	    /* transient errors */
-	    break;
-	  default:
-	    /* all other errors; close socket */
-	      WHYF("Tearing down monitor client due to errno=%d",
-		   errno);
-	      monitor_close(c);
-	      return;
-	  }
-	}
-	
-	c->data_offset += bytes;
+    }
+    if (i >= c->out_count)
+      return 1;
+    monitor_queue_remove(c, i);
+  }
+  return 0;
+}
+
+/* Write as much queued output as the client will take, gathering both halves of the ring into one
+ * sendmsg() call.  Watches for POLLOUT while anything is left over.  We are often called outside the
+ * client's own callback, when fd_poll() has left its socket in blocking mode, so the send itself must
+ * never block.
+ */
+static int monitor_flush(struct monitor_context *c)
+{
+  while (c->out_length) {
+    struct iovec iov[2];
+    int iovcnt = 1;
+    iov[0].iov_base = &c->out_buffer[c->out_head];
+    iov[0].iov_len = c->out_length;
+    if (c->out_head + c->out_length > c->out_size) {
+      iov[0].iov_len = c->out_size - c->out_head;
+      iov[1].iov_base = c->out_buffer;
+      iov[1].iov_len = c->out_length - iov[0].iov_len;
+      iovcnt = 2;
+    }
+    struct msghdr msg;
+    bzero(&msg, sizeof msg);
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iovcnt;
+    ssize_t written = sendmsg(c->alarm.poll.fd, &msg, MSG_DONTWAIT);
+    if (written == -1) {
+      if (errno == EINTR)
+	continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+	break;
+      return WHYF_perror("sendmsg(%d)", c->alarm.poll.fd);
+    }
+    c->out_head = (c->out_head + written) % c->out_size;
+    c->out_length -= written;
+    while (written > 0) {
+      struct monitor_queued_message *m = &c->out_messages[c->out_first];
+      if (written < m->length) {
+	m->length -= written;
+	c->out_started = 1;
+	break;
+      }
+      written -= m->length;
+      c->out_first = (c->out_first + 1) % MONITOR_QUEUE_MESSAGES;
+      c->out_count--;
+      c->out_started = 0;
+    }
+  }
+  int events = c->out_length ? POLLIN | POLLOUT : POLLIN;
+  if (c->alarm.poll.events != events) {
+    c->alarm.poll.events = events;
+    watch(&c->alarm);
+  }
+  return 0;
+}
+
+/* Queue a message for a monitor client, and send it straight away unless the client is already
+ * behind, in which case it goes out with the rest of the queue when the socket becomes writable.
+ * Returns -1 if the client was closed.
+ */
+static int monitor_write(struct monitor_context *c, const char *msg, int len, int mask)
+{
+  switch (monitor_queue_make_room(c, len, mask)) {
+  case -1:
+    INFO("Monitor client is not reading its output");
+    monitor_close(c);
+    return -1;
+  case 1:
+    if (mask == 0) {
+      // the client would be left waiting for a reply that we dropped
+      INFO("Monitor client is not reading its replies");
+      monitor_close(c);
+      return -1;
+    }
+    c->bytes_dropped += len;
+    c->messages_dropped++;
+    return 0;
+  }
+  int was_empty = c->out_length == 0;
+  int tail = (c->out_head + c->out_length) % c->out_size;
+  int first = c->out_size - tail;
+  if (first > len)
+    first = len;
+  bcopy(msg, &c->out_buffer[tail], first);
+  bcopy(msg + first, c->out_buffer, len - first);
+  c->out_length += len;
+  struct monitor_queued_message *m = &c->out_messages[(c->out_first + c->out_count) % MONITOR_QUEUE_MESSAGES];
+  m->length = len;
+  m->mask = mask;
+  c->out_count++;
+  c->bytes_queued += len;
+  if (was_empty && monitor_flush(c) == -1) {
+    monitor_close(c);
+    return -1;
+  }
+  return 0;
+}
+
+static int monitor_write_str(struct monitor_context *c, const char *msg)
+{
+  return monitor_write(c, msg, strlen(msg), 0);
+}
+
+/* Parse commands out of bytes read from a monitor client, processing each one as soon as its line
+ * and any binary data have arrived.  A partial command is kept in the client context until the rest
+ * of it arrives.  Returns -1 if the client was closed, 0 otherwise.
+ */
+static int monitor_client_parse(struct monitor_context *c, const unsigned char *bytes, int length)
+{
+  int fd = c->alarm.poll.fd;
+  int ofs = 0;
+  while (1) {
+    if (c->state == MONITOR_STATE_DATA) {
+      int count = c->data_expected - c->data_offset;
+      if (count > length - ofs)
+	count = length - ofs;
+      if (count > 0) {
+	bcopy(&bytes[ofs], &c->buffer[c->data_offset], count);
+	c->data_offset += count;
+	ofs += count;
       }
-      
       if (c->data_offset < c->data_expected)
-	break;
-	
+	return 0;
       /* we have the next command and all of the binary data we were expecting. Now we can process it */
       monitor_process_command(c);
-	
-      // fall through
-    default:
+      // the command may have closed this client, and another may have taken over its context
+      if (c->alarm.poll.fd != fd)
+	return -1;
       // reset parsing state
       c->state = MONITOR_STATE_COMMAND;
       c->data_expected = 0;
       c->data_offset = 0;
       c->line_length = 0;
     }
+    if (ofs >= length)
+      return 0;
+    char ch = bytes[ofs++];
+    
+    // silently skip all \r characters
+    if (ch == '\r')
+      continue;
+    
+    // parse data length as soon as we see the : delimiter, 
+    // so we can read the rest of the line into the start of the buffer
+    if (c->data_expected==0 && c->line_length && c->line[0]=='*' && ch==':'){
+      c->line[c->line_length]=0;
+      c->data_expected=atoi(c->line +1);
+      c->line_length=0;
+      if (c->data_expected < 0 || c->data_expected > MONITOR_DATA_SIZE) {
+	monitor_write_error(c,"Data too long");
+	// a failed write has already closed the client
+	if (c->alarm.poll.fd == fd)
+	  monitor_close(c);
+	return -1;
+      }
+      continue;
+    }
+    
+    if (ch == '\n') {
+      /* got whole command line, start reading data if required */
+      c->line[c->line_length]=0;
+      c->state=MONITOR_STATE_DATA;
+      c->data_offset=0;
+      continue;
+    }
+    
+    if (c->line_length >= MONITOR_LINE_LENGTH - 1) {
+      c->line_length=0;
+      monitor_write_error(c,"Command too long");
+      // a failed write has already closed the client
+      if (c->alarm.poll.fd == fd)
+	monitor_close(c);
+      return -1;
+    }
+    c->line[c->line_length++] = ch;
+  }
+}
+
+void monitor_client_poll(struct sched_ent *alarm)
+{
+  /* Read available data from a monitor socket */
+  struct monitor_context *c=(struct monitor_context *)alarm;
+  
+  if (alarm->poll.revents & POLLIN) {
+    // read as much as is available at once, so that pipelined commands cost one read() between them
+    unsigned char buffer[MONITOR_READ_BUFFER_SIZE];
+    ssize_t bytes;
+    do {
+      errno=0;
+      bytes = read(c->alarm.poll.fd, buffer, sizeof buffer);
+      if (bytes < 1) {
+	switch(errno) {
+	case EINTR:
+	case ENOTRECOVERABLE:
+	  /* transient errors */
+	  WHY_perror("read");
+	  break;
+	case EAGAIN:
+	  break;
+	default:
+	  WHY_perror("read");
+	  /* all other errors; close socket */
+	  monitor_close(c);
+	  return;
+	}
+	break;
+      }
+      if (monitor_client_parse(c, buffer, bytes) == -1)
+	return;
+    } while (bytes == sizeof buffer);
+  }
+  
+  if (alarm->poll.revents & POLLOUT) {
+    if (monitor_flush(c) == -1) {
+      monitor_close(c);
+      return;
+    }
   }
   
   if (alarm->poll.revents & (POLLHUP | POLLERR)) {
@@ -352,7 +547,14 @@ static void monitor_new_client(int s) {
     goto error;
   }
   
+  unsigned char *out_buffer = emalloc(config.monitor.queue_size);
+  if (!out_buffer)
+    goto error;
+  
   c = &monitor_sockets[monitor_socket_count++];
+  bzero(c, sizeof(struct monitor_context));
+  c->out_buffer = out_buffer;
+  c->out_size = config.monitor.queue_size;
   c->alarm.function = monitor_client_poll;
   client_stats.name = "monitor_client_poll";
   c->alarm.stats=&client_stats;
@@ -360,9 +562,9 @@ static void monitor_new_client(int s) {
   c->alarm.poll.events=POLLIN;
   c->line_length = 0;
   c->state = MONITOR_STATE_COMMAND;
-  write_str(s,"\nINFO:You are talking to servald\n");
   INFOF("Got %d clients", monitor_socket_count);
   watch(&c->alarm);  
+  monitor_write_str(c, "\nINFO:You are talking to servald\n");
   
   return;
   
@@ -406,7 +608,7 @@ static int monitor_set(const struct cli_parsed *parsed, void *context)
 
   char msg[1024];
   snprintf(msg,sizeof(msg),"\nMONITORSTATUS:%d\n",c->flags);
-  write_str(c->alarm.poll.fd,msg);
+  monitor_write_str(c, msg);
   
   return 0;
 }
@@ -427,7 +629,7 @@ static int monitor_clear(const struct cli_parsed *parsed, void *context)
   
   char msg[1024];
   snprintf(msg,sizeof(msg),"\nINFO:%d\n",c->flags);
-  write_str(c->alarm.poll.fd,msg);
+  monitor_write_str(c, msg);
   
   return 0;
 }
@@ -544,6 +746,32 @@ static int monitor_call_dtmf(const struct cli_parsed *parsed, void *context)
 
 static int monitor_help(const struct cli_parsed *parsed, void *context);
 
+/* Report the time spent in each profiled function since the stats were last cleared, one STATS
+ * line per function with times in nanoseconds, followed by a STATSEND line giving the length of the
+ * period they cover in milliseconds.  The whole report is queued as one message, so that a client
+ * that is falling behind gets all of it or none of it.
+ */
+static int monitor_stats(const struct cli_parsed *parsed, void *context)
+{
+  struct monitor_context *c=context;
+  struct profile_total *s;
+  size_t size = 64;
+  for (s = stats_head; s; s = s->_next)
+    if (s->calls)
+      size += strlen(s->name) + 200;
+  strbuf b = strbuf_alloca(size);
+  for (s = stats_head; s; s = s->_next) {
+    if (!s->calls)
+      continue;
+    strbuf_sprintf(b, "\nSTATS:%s:%d:%lld:%lld:%lld:%lld:%lld:%lld\n",
+	     s->name, s->calls, s->total_time, s->child_time, s->max_time,
+	     fd_stat_percentile(s, 50), fd_stat_percentile(s, 90), fd_stat_percentile(s, 99));
+  }
+  strbuf_sprintf(b, "\nSTATSEND:%lld\n", gettime_ms() - stats_since);
+  monitor_write(c, strbuf_str(b), strbuf_len(b), 0);
+  return 0;
+}
+
 struct cli_schema monitor_commands[] = {
   {monitor_help,{"help",NULL},0,""},
   {monitor_set,{"monitor","vomp","<codec>","...",NULL},0,""},
@@ -556,6 +784,7 @@ struct cli_schema monitor_commands[] = {
   {monitor_call_audio,{"audio","<token>","<type>","[<time>]","[<sequence>]",NULL},0,""},
   {monitor_call_hangup, {"hangup","<token>",NULL},0,""},
   {monitor_call_dtmf, {"dtmf","<token>","<digits>",NULL},0,""},
+  {monitor_stats, {"stats",NULL},0,""},
   {NULL},
 };
 
@@ -577,13 +806,12 @@ static int monitor_help(const struct cli_parsed *parsed, void *context)
   strbuf b = strbuf_alloca(16384);
   strbuf_puts(b, "\nINFO:Usage\n");
   cli_usage(monitor_commands, XPRINTF_STRBUF(b));
-  (void)write_all(c->alarm.poll.fd, strbuf_str(b), strbuf_len(b));
+  monitor_write(c, strbuf_str(b), strbuf_len(b), 0);
   return 0;
 }
 
 int monitor_announce_bundle(rhizome_manifest *m)
 {
-  int i;
   char msg[1024];
   const char *service = rhizome_manifest_get(m, "service", NULL, 0);
   const char *sender = rhizome_manifest_get(m, "sender", NULL, 0);
@@ -597,17 +825,7 @@ int monitor_announce_bundle(rhizome_manifest *m)
 	   sender ? sender : "",
 	   recipient ? recipient : "",
 	   m->dataFileName?m->dataFileName:"");
-  for(i=monitor_socket_count -1;i>=0;i--) {
-    if (monitor_sockets[i].flags & MONITOR_RHIZOME) {
-      if ( set_nonblock(monitor_sockets[i].alarm.poll.fd) == -1
-	|| write_str_nonblock(monitor_sockets[i].alarm.poll.fd, msg) == -1
-	|| set_block(monitor_sockets[i].alarm.poll.fd) == -1
-      ) {
-	INFO("Tearing down monitor client");
-	monitor_close(&monitor_sockets[i]);
-      }
-    }
-  }
+  monitor_tell_clients(msg, strlen(msg), MONITOR_RHIZOME);
   return 0;
 }
 
@@ -636,16 +854,8 @@ int monitor_tell_clients(char *msg, int msglen, int mask)
   int i;
   IN();
   for(i=monitor_socket_count -1;i>=0;i--) {
-    if (monitor_sockets[i].flags & mask) {
-      // DEBUG("Writing AUDIOPACKET to client");
-      if ( set_nonblock(monitor_sockets[i].alarm.poll.fd) == -1
-	|| write_all_nonblock(monitor_sockets[i].alarm.poll.fd, msg, msglen) == -1
-	|| set_block(monitor_sockets[i].alarm.poll.fd) == -1
-      ) {
-	INFOF("Tearing down monitor client #%d", i);
-	monitor_close(&monitor_sockets[i]);
-      }
-    }
+    if (monitor_sockets[i].flags & mask)
+      monitor_write(&monitor_sockets[i], msg, msglen, mask);
   }
   RETURN(0);
 }
@@ -123,6 +123,39 @@ ssize_t _write_str_nonblock(int fd, const char *str, struct __sourceloc __whence
   return _write_all_nonblock(fd, str, strlen(str), __whence);
 }
 
+/* Pick the TTL, and the socket's count of datagrams dropped for want of buffer space, out of
+ * the control messages received with a datagram.
+ */
+static void recv_control(struct msghdr *msg, int *ttl, uint32_t *dropped)
+{
+  struct cmsghdr *cmsg;
+  for (cmsg = CMSG_FIRSTHDR(msg); 
+       cmsg != NULL; 
+       cmsg = CMSG_NXTHDR(msg,cmsg)) {
+    
+    if ((cmsg->cmsg_level == IPPROTO_IP) && 
+	((cmsg->cmsg_type == IP_RECVTTL) ||(cmsg->cmsg_type == IP_TTL))
+	&&(cmsg->cmsg_len) ){
+      if (config.debug.packetrx)
+	DEBUGF("  TTL (%p) data location resolves to %p", ttl,CMSG_DATA(cmsg));
+      if (CMSG_DATA(cmsg)) {
+	*ttl = *(unsigned char *) CMSG_DATA(cmsg);
+	if (config.debug.packetrx)
+	  DEBUGF("  TTL of packet is %d", *ttl);
+      } 
+#ifdef SO_RXQ_OVFL
+    } else if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_RXQ_OVFL) {
+      if (dropped)
+	memcpy(dropped, CMSG_DATA(cmsg), sizeof *dropped);
+#endif
+    } else {
+      if (config.debug.packetrx)
+	DEBUGF("I didn't expect to see level=%02x, type=%02x",
+	       cmsg->cmsg_level,cmsg->cmsg_type);
+    }	 
+  }
+}
+
 ssize_t recvwithttl(int sock,unsigned char *buffer, size_t bufferlen,int *ttl,
 		    struct sockaddr *recvaddr, socklen_t *recvaddrlen)
 {
@@ -154,31 +187,167 @@ ssize_t recvwithttl(int sock,unsigned char *buffer, size_t bufferlen,int *ttl,
     dump("received data", buffer, len);
   }
   
-  struct cmsghdr *cmsg;
   if (len>0)
-  {
-    for (cmsg = CMSG_FIRSTHDR(&msg); 
-	 cmsg != NULL; 
-	 cmsg = CMSG_NXTHDR(&msg,cmsg)) {
-      
-      if ((cmsg->cmsg_level == IPPROTO_IP) && 
-	  ((cmsg->cmsg_type == IP_RECVTTL) ||(cmsg->cmsg_type == IP_TTL))
-	  &&(cmsg->cmsg_len) ){
-	if (config.debug.packetrx)
-	  DEBUGF("  TTL (%p) data location resolves to %p", ttl,CMSG_DATA(cmsg));
-	if (CMSG_DATA(cmsg)) {
-	  *ttl = *(unsigned char *) CMSG_DATA(cmsg);
-	  if (config.debug.packetrx)
-	    DEBUGF("  TTL of packet is %d", *ttl);
-	} 
-      } else {
-	if (config.debug.packetrx)
-	  DEBUGF("I didn't expect to see level=%02x, type=%02x",
-		 cmsg->cmsg_level,cmsg->cmsg_type);
-      }	 
+    recv_control(&msg, ttl, NULL);
+  *recvaddrlen=msg.msg_namelen;
+  
+  return len;
+}
+
+/* Receive a datagram from a local socket, along with any file descriptors sent with it.  Up to
+ * *fd_count descriptors are stored in fds and *fd_count is set to how many were; any beyond that
+ * are closed, so that a misbehaving sender can't use up our descriptors.
+ */
+ssize_t recvwithfds(int sock, unsigned char *buffer, size_t bufferlen, struct sockaddr *recvaddr, socklen_t *recvaddrlen,
+		    int *fds, int *fd_count)
+{
+  struct msghdr msg;
+  struct iovec iov[1];
+  union {
+    struct cmsghdr header;
+    unsigned char buf[CMSG_SPACE(sizeof(int) * 8)];
+  } control;
+  
+  iov[0].iov_base=buffer;
+  iov[0].iov_len=bufferlen;
+  bzero(&msg,sizeof(msg));
+  msg.msg_name = recvaddr;
+  msg.msg_namelen = *recvaddrlen;
+  msg.msg_iov = &iov[0];
+  msg.msg_iovlen = 1;
+  msg.msg_control = &control;
+  msg.msg_controllen = sizeof control;
+  
+  int max = *fd_count;
+  *fd_count = 0;
+  ssize_t len = recvmsg(sock,&msg,0);
+  if (len == -1 && errno != EAGAIN && errno != EWOULDBLOCK)
+    return WHY_perror("recvmsg");
+  
+  if (len >= 0) {
+    struct cmsghdr *cmsg;
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg,cmsg)) {
+      if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+	continue;
+      int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      int i;
+      for (i = 0; i < count; i++) {
+	int fd;
+	memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof fd);
+	if (*fd_count < max)
+	  fds[(*fd_count)++] = fd;
+	else
+	  close(fd);
+      }
     }
   }
   *recvaddrlen=msg.msg_namelen;
-  
   return len;
 }
+
+/* Send a datagram on a local socket, passing the given file descriptors to the receiver.
+ */
+ssize_t sendwithfds(int sock, const unsigned char *buffer, size_t len, const struct sockaddr *addr, socklen_t addrlen,
+		    const int *fds, int fd_count)
+{
+  struct msghdr msg;
+  struct iovec iov[1];
+  union {
+    struct cmsghdr header;
+    unsigned char buf[CMSG_SPACE(sizeof(int) * 8)];
+  } control;
+  
+  if (fd_count > 8)
+    return WHYF("Cannot send %d file descriptors", fd_count);
+  iov[0].iov_base=(void *)buffer;
+  iov[0].iov_len=len;
+  bzero(&msg,sizeof(msg));
+  bzero(&control,sizeof(control));
+  msg.msg_name = (void *)addr;
+  msg.msg_namelen = addrlen;
+  msg.msg_iov = &iov[0];
+  msg.msg_iovlen = 1;
+  msg.msg_control = &control;
+  msg.msg_controllen = CMSG_SPACE(sizeof(int) * fd_count);
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fd_count);
+  memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * fd_count);
+  
+  ssize_t ret = sendmsg(sock, &msg, 0);
+  if (ret == -1)
+    return WHY_perror("sendmsg");
+  return ret;
+}
+
+/* Receive as many as count datagrams that are already waiting on the socket, without blocking,
+ * using a single recvmmsg(2) call where we can.  If the socket has SO_RXQ_OVFL set, *dropped is
+ * updated with the number of datagrams it has ever dropped because its buffer was full.
+ * Returns the number of datagrams received, which is zero if none were waiting, or -1 on error.
+ */
+int recvwithttl_batch(int sock, struct recv_packet *packets, int count, uint32_t *dropped)
+{
+  int i;
+#ifdef HAVE_RECVMMSG
+  // kernels older than 2.6.33 don't have it, even if the C library does
+  static int recvmmsg_missing=0;
+  if (!recvmmsg_missing){
+    struct mmsghdr msgs[count];
+    struct iovec iov[count];
+    bzero(msgs, sizeof msgs);
+    for (i=0;i<count;i++){
+      iov[i].iov_base=packets[i].buffer;
+      iov[i].iov_len=packets[i].bufferlen;
+      msgs[i].msg_hdr.msg_name=&packets[i].addr;
+      msgs[i].msg_hdr.msg_namelen=sizeof packets[i].addr;
+      msgs[i].msg_hdr.msg_iov=&iov[i];
+      msgs[i].msg_hdr.msg_iovlen=1;
+      msgs[i].msg_hdr.msg_control=packets[i].control;
+      msgs[i].msg_hdr.msg_controllen=sizeof packets[i].control;
+    }
+    int received = recvmmsg(sock, msgs, count, MSG_DONTWAIT, NULL);
+    if (received == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      return 0;
+    if (received == -1 && errno == ENOSYS)
+      recvmmsg_missing=1;
+    else if (received == -1)
+      return WHY_perror("recvmmsg");
+    else {
+      for (i=0;i<received;i++){
+	packets[i].len=msgs[i].msg_len;
+	packets[i].addrlen=msgs[i].msg_hdr.msg_namelen;
+	recv_control(&msgs[i].msg_hdr, &packets[i].ttl, dropped);
+      }
+      return received;
+    }
+  }
+#endif
+  for (i=0;i<count;i++){
+    struct msghdr msg;
+    struct iovec iov;
+    iov.iov_base=packets[i].buffer;
+    iov.iov_len=packets[i].bufferlen;
+    bzero(&msg,sizeof(msg));
+    msg.msg_name=&packets[i].addr;
+    msg.msg_namelen=sizeof packets[i].addr;
+    msg.msg_iov=&iov;
+    msg.msg_iovlen=1;
+    msg.msg_control=packets[i].control;
+    msg.msg_controllen=sizeof packets[i].control;
+    
+    ssize_t len = recvmsg(sock, &msg, MSG_DONTWAIT);
+    if (len == -1){
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+	break;
+      // hand over what we have, the error will still be there next time
+      if (i)
+	break;
+      return WHY_perror("recvmsg");
+    }
+    packets[i].len=len;
+    packets[i].addrlen=msg.msg_namelen;
+    recv_control(&msg, &packets[i].ttl, dropped);
+  }
+  return i;
+}
@@ -20,6 +20,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #define __SERVALD_NET_H
 
 #include <sys/types.h> // for size_t, ssize_t
+#include <stdint.h> // for uint32_t
 #include <sys/socket.h> // for struct sockaddr, socklen_t
 #include <netinet/in.h> // for struct in_addr
 #include <arpa/inet.h> // for in_addr_t
@@ -49,5 +50,24 @@ ssize_t _write_all_nonblock(int fd, const void *buf, size_t len, struct __source
 ssize_t _write_str(int fd, const char *str, struct __sourceloc __whence);
 ssize_t _write_str_nonblock(int fd, const char *str, struct __sourceloc __whence);
 ssize_t recvwithttl(int sock, unsigned char *buffer, size_t bufferlen, int *ttl, struct sockaddr *recvaddr, socklen_t *recvaddrlen);
+ssize_t recvwithfds(int sock, unsigned char *buffer, size_t bufferlen, struct sockaddr *recvaddr, socklen_t *recvaddrlen,
+		    int *fds, int *fd_count);
+ssize_t sendwithfds(int sock, const unsigned char *buffer, size_t len, const struct sockaddr *addr, socklen_t addrlen,
+		    const int *fds, int fd_count);
+
+/* A datagram received by recvwithttl_batch().  The caller supplies the buffer, and the TTL to
+ * assume if the datagram doesn't say.
+ */
+struct recv_packet {
+  unsigned char *buffer;
+  size_t bufferlen;
+  ssize_t len;
+  int ttl;
+  struct sockaddr addr;
+  socklen_t addrlen;
+  struct cmsghdr control[4];
+};
+
+int recvwithttl_batch(int sock, struct recv_packet *packets, int count, uint32_t *dropped);
 
 #endif // __SERVALD_NET_H
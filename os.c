@@ -133,6 +133,19 @@ time_ms_t gettime_ms()
   return nowtv.tv_sec * 1000LL + nowtv.tv_usec / 1000;
 }
 
+time_ns_t gettime_ns()
+{
+#ifdef CLOCK_MONOTONIC
+  struct timespec nowts;
+  if (clock_gettime(CLOCK_MONOTONIC, &nowts) == 0)
+    return nowts.tv_sec * 1000000000LL + nowts.tv_nsec;
+#endif
+  struct timeval nowtv;
+  if (gettimeofday(&nowtv, NULL) == -1)
+    FATAL_perror("gettimeofday");
+  return nowtv.tv_sec * 1000000000LL + nowtv.tv_usec * 1000LL;
+}
+
 // Returns sleep time remaining.
 time_ms_t sleep_ms(time_ms_t milliseconds)
 {
@@ -57,6 +57,15 @@ typedef long long time_ms_t;
 time_ms_t gettime_ms();
 time_ms_t sleep_ms(time_ms_t milliseconds);
 
+/* Intervals too short to measure in milliseconds, such as the time spent in one
+ * function call, are measured in nanoseconds by gettime_ns(), which reads a
+ * monotonic clock where the system has one.  Its value has no relation to wall
+ * clock time, so it is only useful for subtracting from another gettime_ns().
+ */
+typedef long long time_ns_t;
+
+time_ns_t gettime_ns();
+
 #ifndef HAVE_BZERO
 __SERVALDNA_OS_INLINE void bzero(void *buf, size_t len) {
     memset(buf, 0, len);
@@ -149,12 +149,12 @@ schedule(&_sched_##X); }
   /* Periodically check for new interfaces */
   SCHEDULE(overlay_interface_discover, 1, 100);
 
-  /* Periodically update route table. */
-  SCHEDULE(overlay_route_tick, 100, 100);
-
   /* Periodically advertise bundles */
   SCHEDULE(overlay_rhizome_advertise, 1000, 10000);
   
+  /* Periodically checkpoint the Rhizome database write-ahead log */
+  SCHEDULE(rhizome_checkpoint_db, config.rhizome.checkpoint_interval_ms, 1000);
+  
   /* Calculate (and possibly show) CPU usage stats periodically */
   SCHEDULE(fd_periodicstats, 3000, 500);
 
@@ -62,6 +62,11 @@ struct subscriber{
   // result of routing calculations;
   int reachable;
   
+  // how many route observations of other nodes were reported by this subscriber
+  int route_reports;
+  // has its reachability changed since those nodes were last recalculated
+  char route_reports_changed;
+  
   // if indirect, who is the next hop?
   struct subscriber *next_hop;
   
@@ -63,6 +63,7 @@ int overlay_route_please_advertise(overlay_node *n)
 struct advertisement_state{
   struct overlay_buffer *payload;
   struct subscriber *next_advertisement;
+  time_ms_t now;
 };
 
 int advertise(struct advertisement_state *state, struct subscriber *subscriber, char score, char gateways){
@@ -89,11 +90,12 @@ int add_advertisement(struct subscriber *subscriber, void *context){
 
   if (subscriber->node){
     overlay_node *n=subscriber->node;
+    int score=overlay_route_node_score(n, state->now);
     
     if ((subscriber->reachable&REACHABLE) && (!(subscriber->reachable&REACHABLE_ASSUMED)) 
-	&& n->best_link_score>0 && n->observations[n->best_observation].gateways_en_route < 64){
+	&& score>0 && n->observations[n->best_observation].gateways_en_route < 64){
       
-      return advertise(state, subscriber, n->best_link_score -1, 
+      return advertise(state, subscriber, score -1, 
              n->observations[n->best_observation].gateways_en_route +1);
     }
   }
@@ -143,7 +145,7 @@ int overlay_route_queue_advertisements(overlay_interface *interface)
   frame->payload = ob_new();
   ob_limitsize(frame->payload, 400);
   
-  struct advertisement_state state={.payload = frame->payload,};
+  struct advertisement_state state={.payload = frame->payload, .now = gettime_ms(),};
   
   // TODO high priority advertisements first....
   /*
@@ -65,8 +65,16 @@ static void
 overlay_interface_close(overlay_interface *interface){
   enum_subscribers(NULL, mark_subscriber_down, interface);
   INFOF("Interface %s addr %s is down", interface->name, inet_ntoa(interface->broadcast_address.sin_addr));
+  if (interface->recv_wakeups)
+    INFOF("Interface %s read %u packets in %u wakeups, %u of them full batches, and dropped %u",
+	  interface->name, interface->recv_packets, interface->recv_wakeups,
+	  interface->recv_full_batches, interface->recv_dropped);
+  if (interface->tx_batches)
+    INFOF("Interface %s sent %u packets in %u batches",
+	  interface->name, interface->tx_packets, interface->tx_batches);
   unschedule(&interface->alarm);
   unwatch(&interface->alarm);
+  overlay_ring_close(interface);
   close(interface->alarm.poll.fd);
   interface->alarm.poll.fd=-1;
   interface->state=INTERFACE_STATE_DOWN;
@@ -124,6 +132,14 @@ overlay_bind_socket(const struct sockaddr *addr, size_t addr_size, char *interfa
   }
 #endif
 
+#ifdef SO_RXQ_OVFL
+  /* Ask to be told how many packets the kernel has dropped because we didn't read them in time.
+   Not essential, so just log it if this fails. */
+  int rxq_ovflP = 1;
+  if (setsockopt(fd, SOL_SOCKET, SO_RXQ_OVFL, &rxq_ovflP, sizeof(rxq_ovflP)) < 0)
+    WHY_perror("setsockopt(SO_RXQ_OVFL)");
+#endif
+
   if (bind(fd, addr, addr_size)) {
     WHY_perror("Bind failed");
     goto error;
@@ -175,52 +191,87 @@ overlay_interface * overlay_interface_find_name(const char *name){
   return NULL;
 }
 
+/* Packets read from a socket in one go, and buffers to read them into, allocated as the
+ configured batch sizes require */
+#define RECV_PACKET_SIZE 16384
+static struct recv_packet recv_packets[OVERLAY_MAX_RECV_BATCH];
+static int recv_packet_buffers=0;
+
+/* Read up to batch packets that are waiting on the socket into recv_packets[] */
+static int interface_recv(int fd, int batch, uint32_t *dropped)
+{
+  if (batch>OVERLAY_MAX_RECV_BATCH)
+    batch=OVERLAY_MAX_RECV_BATCH;
+  if (batch<1)
+    batch=1;
+  for (;recv_packet_buffers<batch;recv_packet_buffers++){
+    unsigned char *buffer=emalloc(RECV_PACKET_SIZE);
+    if (!buffer)
+      break;
+    recv_packets[recv_packet_buffers].buffer=buffer;
+    recv_packets[recv_packet_buffers].bufferlen=RECV_PACKET_SIZE;
+  }
+  if (batch>recv_packet_buffers)
+    batch=recv_packet_buffers;
+  if (batch<1)
+    return -1;
+  int i;
+  for (i=0;i<batch;i++)
+    recv_packets[i].ttl=1;
+  return recvwithttl_batch(fd, recv_packets, batch, dropped);
+}
+
 // OSX doesn't recieve broadcast packets on sockets bound to an interface's address
 // So we have to bind a socket to INADDR_ANY to receive these packets.
 static void
 overlay_interface_read_any(struct sched_ent *alarm){
   if (alarm->poll.revents & POLLIN) {
-    int plen=0;
-    int recvttl=1;
-    unsigned char packet[16384];
-    overlay_interface *interface=NULL;
-    struct sockaddr src_addr;
-    socklen_t addrlen = sizeof(src_addr);
+    static uint32_t sock_any_dropped=0;
+    uint32_t dropped=sock_any_dropped;
     
-    /* Read only one UDP packet per call to share resources more fairly, and also
-     enable stats to accurately count packets received */
-    plen = recvwithttl(alarm->poll.fd, packet, sizeof(packet), &recvttl, &src_addr, &addrlen);
-    if (plen == -1) {
-      WHY_perror("recvwithttl(c)");
+    /* Read as many packets as are waiting, up to the largest batch any interface allows */
+    int i, batch=1;
+    for (i=0;i<overlay_interface_count;i++)
+      if (overlay_interfaces[i].state==INTERFACE_STATE_UP && overlay_interfaces[i].recv_batch>batch)
+	batch=overlay_interfaces[i].recv_batch;
+    int count = interface_recv(alarm->poll.fd, batch, &dropped);
+    if (count == -1) {
       unwatch(alarm);
       close(alarm->poll.fd);
       return;
     }
-    
-    struct in_addr src = ((struct sockaddr_in *)&src_addr)->sin_addr;
-    
-    /* Try to identify the real interface that the packet arrived on */
-    interface = overlay_interface_find(src, 0);
-    
-    /* Drop the packet if we don't find a match */
-    if (!interface){
-      if (config.debug.overlayinterfaces)
-	DEBUGF("Could not find matching interface for packet received from %s", inet_ntoa(src));
-      return;
+    if (dropped!=sock_any_dropped){
+      WARNF("Broadcast socket dropped %u packets that we didn't read in time", dropped - sock_any_dropped);
+      sock_any_dropped=dropped;
     }
     
-    /* We have a frame from this interface */
-    if (config.debug.packetrx)
-      DEBUG_packet_visualise("Read from real interface", packet,plen);
-    if (config.debug.overlayinterfaces)
-      DEBUGF("Received %d bytes from %s on interface %s (ANY)",plen, 
-	     inet_ntoa(src),
-	     interface->name);
-    
-    if (packetOkOverlay(interface, packet, plen, recvttl, &src_addr, addrlen)) {
-      if (config.debug.rejecteddata) {
-	WHYF("Malformed packet (length = %d)",plen);
-	dump("the malformed packet",packet,plen);
+    for (i=0;i<count;i++){
+      struct recv_packet *packet=&recv_packets[i];
+      struct in_addr src = ((struct sockaddr_in *)&packet->addr)->sin_addr;
+      
+      /* Try to identify the real interface that the packet arrived on */
+      overlay_interface *interface = overlay_interface_find(src, 0);
+      
+      /* Drop the packet if we don't find a match */
+      if (!interface){
+	if (config.debug.overlayinterfaces)
+	  DEBUGF("Could not find matching interface for packet received from %s", inet_ntoa(src));
+	continue;
+      }
+      
+      /* We have a frame from this interface */
+      if (config.debug.packetrx)
+	DEBUG_packet_visualise("Read from real interface", packet->buffer,packet->len);
+      if (config.debug.overlayinterfaces)
+	DEBUGF("Received %d bytes from %s on interface %s (ANY)",(int)packet->len, 
+	       inet_ntoa(src),
+	       interface->name);
+      
+      if (packetOkOverlay(interface, packet->buffer, packet->len, packet->ttl, &packet->addr, packet->addrlen)) {
+	if (config.debug.rejecteddata) {
+	  WHYF("Malformed packet (length = %d)",(int)packet->len);
+	  dump("the malformed packet",packet->buffer,packet->len);
+	}
       }
     }
   }
@@ -291,6 +342,7 @@ overlay_interface_init_socket(int interface_index)
     interface->state=INTERFACE_STATE_DOWN;
     return WHYF("Failed to bind interface %s", interface->name);
   }
+  interface->recv_socket_dropped=0;
   
   if (config.debug.packetrx || config.debug.io) {
     char srctxt[INET_ADDRSTRLEN];
@@ -335,6 +387,8 @@ overlay_interface_init(const char *name, struct in_addr src_addr, struct in_addr
   // copy ifconfig values
   interface->drop_broadcasts = ifconfig->drop_broadcasts;
   interface->drop_unicasts = ifconfig->drop_unicasts;
+  interface->drop_packets = ifconfig->drop_packets;
+  interface->latency_ms = ifconfig->latency_ms;
   interface->port = ifconfig->port;
   interface->type = ifconfig->type;
   interface->send_broadcasts = ifconfig->send_broadcasts;
@@ -342,6 +396,7 @@ overlay_interface_init(const char *name, struct in_addr src_addr, struct in_addr
   interface->default_route = ifconfig->default_route;
   interface->socket_type = ifconfig->socket_type;
   interface->encapsulation = ifconfig->encapsulation;
+  interface->recv_batch = ifconfig->receive_batch;
 
   /* Pick a reasonable default MTU.
      This will ultimately get tuned by the bandwidth and other properties of the interface */
@@ -458,6 +513,9 @@ overlay_interface_init(const char *name, struct in_addr src_addr, struct in_addr
     }else if(ifconfig->socket_type==SOCK_FILE){
       /* Seek to end of file as initial reading point */
       interface->recv_offset = lseek(interface->alarm.poll.fd,0,SEEK_END);
+    }else if(ifconfig->socket_type==SOCK_RING){
+      if (overlay_ring_open(interface))
+	goto cleanup;
     }
   }
   
@@ -487,36 +545,47 @@ cleanup:
 }
 
 static void interface_read_dgram(struct overlay_interface *interface){
-  int plen=0;
-  unsigned char packet[8096];
-  
-  struct sockaddr src_addr;
-  socklen_t addrlen = sizeof(src_addr);
-  
-  
-  /* Read only one UDP packet per call to share resources more fairly, and also
-   enable stats to accurately count packets received */
-  int recvttl=1;
-  plen = recvwithttl(interface->alarm.poll.fd,packet, sizeof(packet), &recvttl, &src_addr, &addrlen);
-  if (plen == -1) {
-    WHY_perror("recvwithttl(c)");
+  /* Read all the packets that are waiting, up to the configured limit, rather than paying for
+   a whole trip around the poll loop for each one on a busy network.  The limit stops one
+   interface from starving everything else. */
+  uint32_t dropped=interface->recv_socket_dropped;
+  int count = interface_recv(interface->alarm.poll.fd, interface->recv_batch, &dropped);
+  if (count == -1) {
     overlay_interface_close(interface);
     return;
   }
   
-  /* We have a frame from this interface */
-  if (config.debug.packetrx)
-    DEBUG_packet_visualise("Read from real interface", packet,plen);
-  if (config.debug.overlayinterfaces) {
-    struct in_addr src = ((struct sockaddr_in *)&src_addr)->sin_addr; // avoid strict-alias warning on Solaris (gcc 4.4)
-    DEBUGF("Received %d bytes from %s on interface %s",plen,
-	   inet_ntoa(src),
-	   interface->name);
+  interface->recv_wakeups++;
+  interface->recv_packets+=count;
+  if (count>=interface->recv_batch)
+    interface->recv_full_batches++;
+  if (dropped!=interface->recv_socket_dropped){
+    WARNF("Interface %s dropped %u packets that we didn't read in time", 
+	  interface->name, dropped - interface->recv_socket_dropped);
+    interface->recv_dropped+=dropped - interface->recv_socket_dropped;
+    interface->recv_socket_dropped=dropped;
   }
-  if (packetOkOverlay(interface, packet, plen, recvttl, &src_addr, addrlen)) {
-    if (config.debug.rejecteddata) {
-      WHYF("Malformed packet (length = %d)",plen);
-      dump("the malformed packet",packet,plen);
+  if (config.debug.overlayinterfaces)
+    DEBUGF("Read %d packets from interface %s", count, interface->name);
+  
+  int i;
+  for (i=0;i<count && interface->state==INTERFACE_STATE_UP;i++){
+    struct recv_packet *packet=&recv_packets[i];
+    
+    /* We have a frame from this interface */
+    if (config.debug.packetrx)
+      DEBUG_packet_visualise("Read from real interface", packet->buffer,packet->len);
+    if (config.debug.overlayinterfaces) {
+      struct in_addr src = ((struct sockaddr_in *)&packet->addr)->sin_addr; // avoid strict-alias warning on Solaris (gcc 4.4)
+      DEBUGF("Received %d bytes from %s on interface %s",(int)packet->len,
+	     inet_ntoa(src),
+	     interface->name);
+    }
+    if (packetOkOverlay(interface, packet->buffer, packet->len, packet->ttl, &packet->addr, packet->addrlen)) {
+      if (config.debug.rejecteddata) {
+	WHYF("Malformed packet (length = %d)",(int)packet->len);
+	dump("the malformed packet",packet->buffer,packet->len);
+      }
     }
   }
 }
@@ -544,6 +613,59 @@ struct file_packet{
   unsigned char payload[1400];
 };
 
+/* Dummy file and ring interfaces can't wake us up when a packet arrives, so we check them from
+   the interface alarm. */
+static void interface_schedule_read(struct overlay_interface *interface, int more, time_ms_t now)
+{
+  /* if there's no input, while we want to check for more soon,
+   we need to allow all other low priority alarms to fire first,
+   otherwise we'll dominate the scheduler without accomplishing anything */
+  if (!more){
+    if (interface->alarm.alarm == -1 || now + 5 < interface->alarm.alarm){
+      interface->alarm.alarm = now + 5;
+      interface->alarm.deadline = interface->alarm.alarm + 10000;
+    }
+  }else{
+    /* keep reading new packets as fast as possible, 
+     but don't completely prevent other high priority alarms */
+    if (interface->alarm.alarm == -1 || now < interface->alarm.alarm){
+      interface->alarm.alarm = now;
+      interface->alarm.deadline = interface->alarm.alarm + 10000;
+    }
+  }
+}
+
+/* Deliver a packet read from a simulated link (a dummy file or ring interface), which carries
+   every packet to every node, so we have to ignore those that were not addressed to us. */
+void overlay_interface_receive_simulated(struct overlay_interface *interface,
+					 struct sockaddr_in *src_addr, struct sockaddr_in *dst_addr,
+					 unsigned char *payload, int payload_length)
+{
+  if (interface->drop_packets && random()%100 < interface->drop_packets){
+    if (config.debug.packetrx)
+      DEBUGF("Simulating loss of %d byte packet on interface %s", payload_length, interface->name);
+    return;
+  }
+  
+  if (config.debug.packetrx)
+    DEBUG_packet_visualise("Read from dummy interface", payload, payload_length);
+  
+  if (((!interface->drop_unicasts) && memcmp(dst_addr, &interface->address, sizeof(*dst_addr))==0) ||
+      ((!interface->drop_broadcasts) &&
+       memcmp(dst_addr, &interface->broadcast_address, sizeof(*dst_addr))==0)){
+	
+    if (packetOkOverlay(interface, payload, payload_length, -1, 
+			(struct sockaddr*)src_addr, sizeof(*src_addr))<0) {
+      if (config.debug.rejecteddata) {
+	WARN("Unsupported packet from dummy interface");
+	WHYF("Malformed packet (length = %d)",payload_length);
+	dump("the malformed packet",payload,payload_length);
+      }
+    }
+  }else if (config.debug.packetrx)
+    DEBUGF("Ignoring packet addressed to %s:%d", inet_ntoa(dst_addr->sin_addr), ntohs(dst_addr->sin_port));
+}
+
 static void interface_read_file(struct overlay_interface *interface)
 {
   IN();
@@ -578,42 +700,37 @@ static void interface_read_file(struct overlay_interface *interface)
     if (nread == sizeof packet) {
       interface->recv_offset += nread;
       
-      if (config.debug.packetrx)
-	DEBUG_packet_visualise("Read from dummy interface", packet.payload, packet.payload_length);
-      
-      if (((!interface->drop_unicasts) && memcmp(&packet.dst_addr, &interface->address, sizeof(packet.dst_addr))==0) ||
-	  ((!interface->drop_broadcasts) &&
-	   memcmp(&packet.dst_addr, &interface->broadcast_address, sizeof(packet.dst_addr))==0)){
-	    
-	if (packetOkOverlay(interface, packet.payload, packet.payload_length, -1, 
-			    (struct sockaddr*)&packet.src_addr, sizeof(packet.src_addr))<0) {
-	  if (config.debug.rejecteddata) {
-	    WARN("Unsupported packet from dummy interface");
-	    WHYF("Malformed packet (length = %d)",packet.payload_length);
-	    dump("the malformed packet",packet.payload,packet.payload_length);
-	  }
-	}
-      }else if (config.debug.packetrx)
-	DEBUGF("Ignoring packet addressed to %s:%d", inet_ntoa(packet.dst_addr.sin_addr), ntohs(packet.dst_addr.sin_port));
+      overlay_interface_receive_simulated(interface, &packet.src_addr, &packet.dst_addr,
+					  packet.payload, packet.payload_length);
     }
   }
   
-  /* if there's no input, while we want to check for more soon,
-   we need to allow all other low priority alarms to fire first,
-   otherwise we'll dominate the scheduler without accomplishing anything */
-  if (interface->recv_offset>=length){
-    if (interface->alarm.alarm == -1 || now + 5 < interface->alarm.alarm){
-      interface->alarm.alarm = now + 5;
-      interface->alarm.deadline = interface->alarm.alarm + 10000;
-    }
-  }else{
-    /* keep reading new packets as fast as possible, 
-     but don't completely prevent other high priority alarms */
-    if (interface->alarm.alarm == -1 || now < interface->alarm.alarm){
-      interface->alarm.alarm = now;
-      interface->alarm.deadline = interface->alarm.alarm + 10000;
-    }
+  interface_schedule_read(interface, interface->recv_offset<length, now);
+  OUT();
+}
+
+static void interface_read_ring(struct overlay_interface *interface)
+{
+  IN();
+  time_ms_t now = gettime_ms();
+  unsigned int dropped=0;
+  int count = overlay_ring_read(interface, &dropped);
+  
+  if (count || dropped){
+    interface->recv_wakeups++;
+    interface->recv_packets+=count;
+    if (count>=interface->recv_batch)
+      interface->recv_full_batches++;
+  }
+  if (dropped){
+    WARNF("Interface %s dropped %u packets that we didn't read in time", interface->name, dropped);
+    interface->recv_dropped+=dropped;
   }
+  if (count && config.debug.overlayinterfaces)
+    DEBUGF("Read %d packets from interface %s", count, interface->name);
+  
+  if (interface->state==INTERFACE_STATE_UP)
+    interface_schedule_read(interface, count>=interface->recv_batch, now);
   OUT();
 }
 
@@ -707,6 +824,9 @@ static void overlay_interface_poll(struct sched_ent *alarm)
       case SOCK_FILE:
 	interface_read_file(interface);
 	break;
+      case SOCK_RING:
+	interface_read_ring(interface);
+	break;
     }
     if (alarm->alarm!=-1) {
       schedule(alarm);
@@ -720,6 +840,7 @@ static void overlay_interface_poll(struct sched_ent *alarm)
 	break;
       case SOCK_DGRAM:
       case SOCK_FILE:
+      case SOCK_RING:
 	//XXX error? fatal?
 	break;
     }
@@ -736,6 +857,9 @@ static void overlay_interface_poll(struct sched_ent *alarm)
       case SOCK_FILE:
 	interface_read_file(interface);
 	break;
+      case SOCK_RING:
+	interface_read_ring(interface);
+	break;
     }
   }
   
@@ -828,6 +952,9 @@ overlay_broadcast_ensemble(overlay_interface *interface,
       return 0;
     }
       
+    case SOCK_RING:
+      return overlay_ring_send(interface, recipientaddr, bytes, len);
+      
     case SOCK_DGRAM:
     {
       if (config.debug.overlayinterfaces) 
@@ -849,6 +976,100 @@ overlay_broadcast_ensemble(overlay_interface *interface,
   }
 }
 
+#ifdef HAVE_SENDMMSG
+/* Send all the packets with as few sendmmsg(2) calls as we can.  Returns the number sent, or -1
+   if this kernel can't do it and they have to be sent one at a time. */
+static int
+overlay_send_dgram_batch(overlay_interface *interface, struct overlay_tx_packet *packets, int count)
+{
+  static int sendmmsg_missing=0;
+  if (sendmmsg_missing)
+    return -1;
+  
+  struct mmsghdr msgs[count];
+  struct iovec iov[count];
+  bzero(msgs, sizeof msgs);
+  int i;
+  for (i=0;i<count;i++){
+    if (config.debug.packettx){
+      DEBUGF("Sending this packet via interface %s (len=%d)",interface->name,packets[i].len);
+      DEBUG_packet_visualise(NULL,packets[i].bytes,packets[i].len);
+    }
+    if (config.debug.overlayinterfaces) 
+      DEBUGF("Sending %d byte overlay frame on %s to %s",packets[i].len,interface->name,inet_ntoa(packets[i].recipientaddr.sin_addr));
+    iov[i].iov_base=packets[i].bytes;
+    iov[i].iov_len=packets[i].len;
+    msgs[i].msg_hdr.msg_name=&packets[i].recipientaddr;
+    msgs[i].msg_hdr.msg_namelen=sizeof(struct sockaddr_in);
+    msgs[i].msg_hdr.msg_iov=&iov[i];
+    msgs[i].msg_hdr.msg_iovlen=1;
+    packets[i].result=-1;
+  }
+  
+  int sent=0;
+  i=0;
+  while (i<count && interface->state==INTERFACE_STATE_UP){
+    int n=sendmmsg(interface->alarm.poll.fd, &msgs[i], count-i, 0);
+    if (n==-1){
+      int e=errno;
+      if (e==ENOSYS && i==0){
+	sendmmsg_missing=1;
+	return -1;
+      }
+      WHY_perror("sendmmsg(c)");
+      // only close the interface on some kinds of errors
+      if (e==ENETDOWN || e==EINVAL)
+	overlay_interface_close(interface);
+      // the first packet failed, carry on with the rest
+      i++;
+      continue;
+    }
+    int j;
+    for (j=i;j<i+n;j++){
+      if (msgs[j].msg_len==packets[j].len){
+	packets[j].result=0;
+	sent++;
+      }else
+	WHYF("sendmmsg(c) only sent %u of %d bytes", msgs[j].msg_len, packets[j].len);
+    }
+    i+=n;
+  }
+  return sent;
+}
+#endif
+
+/* Send several packets out the same interface.  Datagram sockets send them together where the
+   system lets us, anything else sends them one at a time.  Each packet's result says whether it
+   was sent.  Returns the number of packets sent. */
+int
+overlay_broadcast_ensemble_batch(overlay_interface *interface, struct overlay_tx_packet *packets, int count)
+{
+  int i, sent=-1;
+  
+  if (interface->state!=INTERFACE_STATE_UP){
+    for (i=0;i<count;i++)
+      packets[i].result=-1;
+    WHYF("Cannot send to interface %s as it is down", interface->name);
+    return 0;
+  }
+  
+#ifdef HAVE_SENDMMSG
+  if (interface->socket_type==SOCK_DGRAM && count>1)
+    sent=overlay_send_dgram_batch(interface, packets, count);
+#endif
+  if (sent==-1){
+    sent=0;
+    for (i=0;i<count;i++){
+      packets[i].result=overlay_broadcast_ensemble(interface, &packets[i].recipientaddr, packets[i].bytes, packets[i].len);
+      if (!packets[i].result)
+	sent++;
+    }
+  }
+  interface->tx_batches++;
+  interface->tx_packets+=sent;
+  return sent;
+}
+
 /* Register the real interface, or update the existing interface registration. */
 int
 overlay_interface_register(char *name,
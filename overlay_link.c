@@ -137,7 +137,8 @@ int set_reachable(struct subscriber *subscriber, int reachable){
     monitor_announce_unreachable_peer(subscriber->sid);
   if ((!(old_value & REACHABLE)) && (reachable & REACHABLE))
     monitor_announce_peer(subscriber->sid);
-  
+
+  overlay_route_reachable_changed(subscriber, old_value);
   return 0;
 }
 
@@ -119,10 +119,21 @@ int overlay_mdp_setup_sockets()
   
 }
 
-#define MDP_MAX_BINDINGS 100
+/* Port bindings are kept in a hash table that doubles in size as it fills, so finding the client
+   for a frame costs the same however many clients are bound.  Bindings are hashed on their port
+   alone, so that every binding that might accept a frame for a port, whether to one of our
+   identities or to any of them, is found in the same chain.  We still refuse to grow past
+   MDP_MAX_BINDINGS, but before growing at all we drop bindings whose client has gone away.  That
+   probes every client's socket, so it is done at most once every MDP_BINDING_SWEEP_INTERVAL_MS;
+   a full table refuses new bindings until the next sweep rather than probing on every request.
+*/
+#define MDP_MAX_BINDINGS 4096
+#define MDP_BINDING_BUCKETS 64
+#define MDP_BINDING_SWEEP_INTERVAL_MS 1000
 #define MDP_MAX_SOCKET_NAME_LEN 110
 
 struct mdp_binding{
+  struct mdp_binding *next;
   struct subscriber *subscriber;
   int port;
   char socket_name[MDP_MAX_SOCKET_NAME_LEN];
@@ -130,8 +141,112 @@ struct mdp_binding{
   time_ms_t binding_time;
 };
 
-struct mdp_binding mdp_bindings[MDP_MAX_BINDINGS];
-int mdp_bindings_initialised=0;
+static struct mdp_binding **mdp_binding_buckets=NULL;
+static unsigned mdp_binding_bucket_count=0;
+static unsigned mdp_binding_count=0;
+static time_ms_t mdp_binding_last_sweep=0;
+
+static struct mdp_binding **mdp_binding_bucket(int port)
+{
+  return &mdp_binding_buckets[((unsigned)port * 2654435761u) & (mdp_binding_bucket_count - 1)];
+}
+
+static int mdp_binding_resize(unsigned bucket_count)
+{
+  struct mdp_binding **old_buckets=mdp_binding_buckets;
+  unsigned old_count=mdp_binding_bucket_count;
+  struct mdp_binding **buckets=emalloc_zero(bucket_count * sizeof(struct mdp_binding *));
+  if (!buckets)
+    return -1;
+  mdp_binding_buckets=buckets;
+  mdp_binding_bucket_count=bucket_count;
+  unsigned i;
+  for (i=0;i<old_count;i++){
+    while(old_buckets[i]){
+      struct mdp_binding *binding=old_buckets[i];
+      old_buckets[i]=binding->next;
+      struct mdp_binding **bucket=mdp_binding_bucket(binding->port);
+      binding->next=*bucket;
+      *bucket=binding;
+    }
+  }
+  if (old_buckets)
+    free(old_buckets);
+  return 0;
+}
+
+static int mdp_binding_name_matches(struct mdp_binding *binding, struct sockaddr_un *recvaddr, int recvaddrlen)
+{
+  return binding->name_len == recvaddrlen - (int)sizeof(short)
+    && memcmp(binding->socket_name, recvaddr->sun_path, binding->name_len) == 0;
+}
+
+/* A client that died without saying goodbye leaves its bindings behind.  connect() on a datagram
+   socket tells us whether anyone is still listening on the client's socket, without sending
+   them anything. */
+int overlay_mdp_client_is_gone(const char *socket_name, int name_len)
+{
+  struct sockaddr_un addr;
+  if (name_len > (int)sizeof addr.sun_path)
+    return 0;
+  bzero(&addr, sizeof addr);
+  addr.sun_family=AF_UNIX;
+  bcopy(socket_name, addr.sun_path, name_len);
+  int fd=socket(AF_UNIX, SOCK_DGRAM, 0);
+  if (fd==-1)
+    return 0;
+  int gone=connect(fd, (struct sockaddr *)&addr, name_len + sizeof(short))==-1
+    && (errno==ENOENT || errno==ECONNREFUSED);
+  close(fd);
+  return gone;
+}
+
+static int mdp_binding_is_stale(struct mdp_binding *binding)
+{
+  return overlay_mdp_client_is_gone(binding->socket_name, binding->name_len);
+}
+
+static void mdp_binding_remove_stale()
+{
+  time_ms_t now=gettime_ms();
+  if (mdp_binding_last_sweep && now - mdp_binding_last_sweep < MDP_BINDING_SWEEP_INTERVAL_MS)
+    return;
+  mdp_binding_last_sweep=now;
+  unsigned i;
+  for (i=0;i<mdp_binding_bucket_count;i++){
+    struct mdp_binding **binding=&mdp_binding_buckets[i];
+    while(*binding){
+      if (mdp_binding_is_stale(*binding)){
+	struct mdp_binding *stale=*binding;
+	INFOF("Dropping stale MDP binding to port %d for '%s'", stale->port, stale->socket_name);
+	*binding=stale->next;
+	free(stale);
+	mdp_binding_count--;
+      }else
+	binding=&(*binding)->next;
+    }
+  }
+}
+
+/* Find the binding that should receive a frame for this identity and port.  A binding for that
+   identity is preferred to one for any identity.  A NULL subscriber (eg for a broadcast) matches
+   the first binding for the port. */
+static struct mdp_binding *mdp_binding_find(struct subscriber *subscriber, int port)
+{
+  if (!mdp_binding_bucket_count)
+    return NULL;
+  struct mdp_binding *binding=*mdp_binding_bucket(port);
+  struct mdp_binding *any=NULL;
+  for (;binding;binding=binding->next){
+    if (binding->port!=port)
+      continue;
+    if (!subscriber || binding->subscriber==subscriber)
+      return binding;
+    if (!binding->subscriber)
+      any=binding;
+  }
+  return any;
+}
 
 int overlay_mdp_reply_error(int sock,
 			    struct sockaddr_un *recvaddr,int recvaddrlen,
@@ -164,9 +279,14 @@ int overlay_mdp_reply(int sock,struct sockaddr_un *recvaddr,int recvaddrlen,
   replylen=overlay_mdp_relevant_bytes(mdpreply);
   if (replylen<0) return WHY("Invalid MDP frame (could not compute length)");
 
+  /* Clients that have attached rings get their replies through them */
+  int r=overlay_mdp_ring_deliver(recvaddr,recvaddrlen,mdpreply);
+  if (r!=1)
+    return r;
+
   errno=0;
-  int r=sendto(sock,(char *)mdpreply,replylen,0,
-	       (struct sockaddr *)recvaddr,recvaddrlen);
+  r=sendto(sock,(char *)mdpreply,replylen,0,
+	   (struct sockaddr *)recvaddr,recvaddrlen);
   if (r<replylen) { 
     WHY_perror("sendto(d)"); 
     return WHYF("sendto() failed when sending MDP reply, sock=%d, r=%d", sock, r); 
@@ -184,80 +304,84 @@ int overlay_mdp_reply_ok(int sock,
 
 int overlay_mdp_releasebindings(struct sockaddr_un *recvaddr,int recvaddrlen)
 {
-  /* Free up any MDP bindings held by this client. */
-  int i;
-  for(i=0;i<MDP_MAX_BINDINGS;i++)
-    if (mdp_bindings[i].name_len==recvaddrlen)
-      if (!memcmp(mdp_bindings[i].socket_name,recvaddr->sun_path,recvaddrlen))
-	mdp_bindings[i].port=0;
-
+  /* Free up any MDP bindings and rings held by this client. */
+  overlay_mdp_ring_detach(recvaddr, recvaddrlen);
+  unsigned i;
+  int released_count=0;
+  for (i=0;i<mdp_binding_bucket_count;i++){
+    struct mdp_binding **binding=&mdp_binding_buckets[i];
+    while(*binding){
+      if (mdp_binding_name_matches(*binding, recvaddr, recvaddrlen)){
+	struct mdp_binding *released=*binding;
+	*binding=released->next;
+	free(released);
+	mdp_binding_count--;
+	released_count++;
+      }else
+	binding=&(*binding)->next;
+    }
+  }
+  if (config.debug.mdprequests && released_count)
+    DEBUGF("Released %d MDP binding(s) for %s", released_count, alloca_toprint(-1, recvaddr->sun_path, recvaddrlen - sizeof(short)));
   return 0;
-
 }
 
 int overlay_mdp_process_bind_request(int sock, struct subscriber *subscriber, int port,
 				     int flags, struct sockaddr_un *recvaddr, int recvaddrlen)
 {
-  int i;
-  
   if (port<=0){
     return WHYF("Port %d cannot be bound", port);
   }
-  if (!mdp_bindings_initialised) {
-    /* Mark all slots as unused */
-    for(i=0;i<MDP_MAX_BINDINGS;i++)
-      mdp_bindings[i].port=0;
-    mdp_bindings_initialised=1;
+  if (recvaddrlen - (int)sizeof(short) > MDP_MAX_SOCKET_NAME_LEN || recvaddrlen <= (int)sizeof(short)){
+    return WHYF("Invalid socket address length %d", recvaddrlen);
   }
+  if (!mdp_binding_bucket_count && mdp_binding_resize(MDP_BINDING_BUCKETS))
+    return -1;
 
   /* See if binding already exists */
-  int free=-1;
-  for(i=0;i<MDP_MAX_BINDINGS;i++) {
-    /* Look for duplicate bindings */
-    if (mdp_bindings[i].port == port && mdp_bindings[i].subscriber == subscriber) {
-      if (mdp_bindings[i].name_len==recvaddrlen &&
-	  !memcmp(mdp_bindings[i].socket_name,recvaddr->sun_path,recvaddrlen)) {
-	// this client already owns this port binding?
-	INFO("Identical binding exists");
-	return 0;
-      }else if(flags&MDP_FORCE){
-	// steal the port binding
-	free=i;
-	break;
-      }else{
+  struct mdp_binding *binding;
+  for (binding=*mdp_binding_bucket(port);binding;binding=binding->next){
+    if (binding->port == port && binding->subscriber == subscriber)
+      break;
+  }
+  if (binding){
+    if (mdp_binding_name_matches(binding, recvaddr, recvaddrlen)) {
+      // this client already owns this port binding?
+      INFO("Identical binding exists");
+      return 0;
+    }else if(!(flags&MDP_FORCE)){
+      if (!mdp_binding_is_stale(binding))
 	return WHY("Port already in use");
-      }
+      INFOF("Taking over stale MDP binding to port %d from %s", port, alloca_toprint(-1, binding->socket_name, binding->name_len));
     }
-    /* Look for free slots in case we need one */
-    if ((free==-1)&&(mdp_bindings[i].port==0)) free=i;
-  }
- 
-  /* Okay, so no binding exists.  Make one, and return success.
-     If we have too many bindings, we should return an error.
-     XXX - We don't find out when the socket responsible for a binding has died,
-     so stale bindings can hang around.  We really need a solution to this, e.g., 
-     probing the sockets periodically (by sending an MDP NOOP frame perhaps?) and
-     destroying any socket that reports an error.
-  */
-  if (free==-1) {
-    /* XXX Should we probe for stale bindings here and now, since this is when
-       we want the spare slots ?
-
-       Picking one at random is as good a policy as any.
-       Call listeners don't have a port binding, so are unaffected by this.
-    */
-    free=random()%MDP_MAX_BINDINGS;
+    // steal the port binding
+  }else{
+    if (mdp_binding_count >= mdp_binding_bucket_count){
+      /* Only make room for more once we know that every binding we have is still in use */
+      mdp_binding_remove_stale();
+      if (mdp_binding_count >= MDP_MAX_BINDINGS)
+	return WHYF("Too many MDP bindings (%u)", mdp_binding_count);
+      if (mdp_binding_count >= mdp_binding_bucket_count
+	&& mdp_binding_resize(mdp_binding_bucket_count * 2))
+	return -1;
+    }
+    binding=emalloc_zero(sizeof(struct mdp_binding));
+    if (!binding)
+      return -1;
+    struct mdp_binding **bucket=mdp_binding_bucket(port);
+    binding->next=*bucket;
+    *bucket=binding;
+    mdp_binding_count++;
   }
   if (config.debug.mdprequests) 
     DEBUGF("Binding %s:%d", subscriber ? alloca_tohex_sid(subscriber->sid) : "NULL", port);
   /* Okay, record binding and report success */
-  mdp_bindings[free].port=port;
-  mdp_bindings[free].subscriber=subscriber;
+  binding->port=port;
+  binding->subscriber=subscriber;
   
-  mdp_bindings[free].name_len=recvaddrlen-2;
-  memcpy(mdp_bindings[free].socket_name,recvaddr->sun_path,
-	 mdp_bindings[free].name_len);
-  mdp_bindings[free].binding_time=gettime_ms();
+  binding->name_len=recvaddrlen-sizeof(short);
+  memcpy(binding->socket_name,recvaddr->sun_path,binding->name_len);
+  binding->binding_time=gettime_ms();
   return 0;
 }
 
@@ -412,8 +536,6 @@ int overlay_mdp_swap_src_dst(overlay_mdp_frame *mdp)
 static int overlay_saw_mdp_frame(struct overlay_frame *frame, overlay_mdp_frame *mdp, time_ms_t now)
 {
   IN();
-  int i;
-  int match=-1;
 
   switch(mdp->packetTypeAndFlags&MDP_TYPE_MASK) {
   case MDP_TX: 
@@ -436,37 +558,29 @@ static int overlay_saw_mdp_frame(struct overlay_frame *frame, overlay_mdp_frame
       destination = find_subscriber(mdp->out.dst.sid, SID_SIZE, 1);
     }
     
-    for(i=0;i<MDP_MAX_BINDINGS;i++)
-      {
-	if (mdp_bindings[i].port!=mdp->out.dst.port)
-	  continue;
-	
-	if ((!destination) || mdp_bindings[i].subscriber == destination){
-	  /* exact match, so stop searching */
-	  match=i;
-	  break;
-	}else if (!mdp_bindings[i].subscriber){
-	  /* If we find an "ANY" binding, remember it. But we will prefer an exact match if we find one */
-	  match=i;
-	}
-      }
-    
-    if (match>-1) {
+    struct mdp_binding *binding=mdp_binding_find(destination, mdp->out.dst.port);
+    if (binding) {
       struct sockaddr_un addr;
 
-      bcopy(mdp_bindings[match].socket_name,addr.sun_path,mdp_bindings[match].name_len);
+      bcopy(binding->socket_name,addr.sun_path,binding->name_len);
       addr.sun_family=AF_UNIX;
+      switch (overlay_mdp_ring_deliver(&addr,binding->name_len+sizeof(short),mdp)) {
+      case 0:
+	RETURN(0);
+      case -1:
+	RETURN(WHY("Failed to pass received MDP frame to client"));
+      }
       errno=0;
       int len=overlay_mdp_relevant_bytes(mdp);
-      int r=sendto(mdp_named.poll.fd,mdp,len,0,(struct sockaddr*)&addr,sizeof(addr));
+      int r=sendto(mdp_named.poll.fd,mdp,len,0,(struct sockaddr*)&addr,binding->name_len+sizeof(short));
       if (r==overlay_mdp_relevant_bytes(mdp)) {	
 	RETURN(0);
       }
       WHY("didn't send mdp packet");
-      if (errno==ENOENT) {
+      if (errno==ENOENT || errno==ECONNREFUSED) {
 	/* far-end of socket has died, so drop binding */
-	INFOF("Closing dead MDP client '%s'",mdp_bindings[match].socket_name);
-	overlay_mdp_releasebindings(&addr,mdp_bindings[match].name_len);
+	INFOF("Closing dead MDP client '%s'",binding->socket_name);
+	overlay_mdp_releasebindings(&addr,binding->name_len+sizeof(short));
       }
       WHY_perror("sendto(e)");
       RETURN(WHY("Failed to pass received MDP frame to client"));
@@ -514,15 +628,13 @@ int overlay_mdp_check_binding(struct subscriber *subscriber, int port, int userG
   /* Check if the address is in the list of bound addresses,
      and that the recvaddr matches. */
   
-  int i;
-  for(i = 0; i < MDP_MAX_BINDINGS; ++i) {
-    if (mdp_bindings[i].port != port)
+  struct mdp_binding *binding;
+  for (binding = mdp_binding_bucket_count ? *mdp_binding_bucket(port) : NULL; binding; binding = binding->next) {
+    if (binding->port != port)
       continue;
-    if ((!mdp_bindings[i].subscriber) || mdp_bindings[i].subscriber == subscriber) {
+    if ((!binding->subscriber) || binding->subscriber == subscriber) {
       /* Binding matches, now make sure the sockets match */
-      if (  mdp_bindings[i].name_len == recvaddrlen - sizeof(short)
-	&&  memcmp(mdp_bindings[i].socket_name, recvaddr->sun_path, recvaddrlen - sizeof(short)) == 0
-      ) {
+      if (mdp_binding_name_matches(binding, recvaddr, recvaddrlen)) {
 	/* Everything matches, so this unix socket and MDP address combination is valid */
 	return 0;
       }
@@ -826,16 +938,28 @@ struct routing_state{
   struct sockaddr_un *recvaddr_un;
   socklen_t recvaddrlen;
   int fd;
+  /* the last subscriber the client has already been sent */
+  struct subscriber *resume;
+  overlay_mdp_frame reply;
+  int records;
+  int frames;
 };
 
+static void routing_table_send(struct routing_state *state){
+  state->reply.packetTypeAndFlags=MDP_TX;
+  state->reply.out.payload_length=state->records*sizeof(struct overlay_route_record);
+  overlay_mdp_reply(mdp_named.poll.fd, state->recvaddr_un, state->recvaddrlen, &state->reply);
+  bzero(&state->reply, sizeof(overlay_mdp_frame));
+  state->records=0;
+  state->frames++;
+}
+
 static int routing_table(struct subscriber *subscriber, void *context){
   struct routing_state *state = (struct routing_state *)context;
-  overlay_mdp_frame reply;
-  bzero(&reply, sizeof(overlay_mdp_frame));
+  if (subscriber==state->resume)
+    return 0;
   
-  struct overlay_route_record *r=(struct overlay_route_record *)&reply.out.payload;
-  reply.packetTypeAndFlags=MDP_TX;
-  reply.out.payload_length=sizeof(struct overlay_route_record);
+  struct overlay_route_record *r=&((struct overlay_route_record *)state->reply.out.payload)[state->records++];
   memcpy(r->sid, subscriber->sid, SID_SIZE);
   r->reachable = subscriber->reachable;
   if (subscriber->reachable==REACHABLE_INDIRECT && subscriber->next_hop)
@@ -844,7 +968,12 @@ static int routing_table(struct subscriber *subscriber, void *context){
     strcpy(r->interface_name, subscriber->interface->name);
   else
     r->interface_name[0]=0;
-  overlay_mdp_reply(mdp_named.poll.fd, state->recvaddr_un, state->recvaddrlen, &reply);
+  if (state->records>=MDP_ROUTE_RECORDS_PER_FRAME){
+    routing_table_send(state);
+    // the client will ask for the rest once it has read this page
+    if (state->frames>=MDP_ROUTE_FRAMES_PER_PAGE)
+      return 1;
+  }
   return 0;
 }
 
@@ -887,170 +1016,201 @@ static void overlay_mdp_scan(struct sched_ent *alarm)
   }
 }
 
+/* Act on a request from a local client, which came in on our socket or through the client's
+   shared memory ring.  Replies go back the same way. */
+void overlay_mdp_process_request(int sock, overlay_mdp_frame *mdp, struct sockaddr_un *recvaddr_un, int recvaddrlen)
+{
+  unsigned int mdp_type = mdp->packetTypeAndFlags & MDP_TYPE_MASK;
+
+  switch (mdp_type) {
+  case MDP_GOODBYE:
+    if (config.debug.mdprequests) DEBUG("MDP_GOODBYE");
+    overlay_mdp_releasebindings(recvaddr_un,recvaddrlen);
+    return;
+      
+  case MDP_RING_DETACH:
+    if (config.debug.mdprequests) DEBUG("MDP_RING_DETACH");
+    overlay_mdp_ring_detach(recvaddr_un,recvaddrlen);
+    return;
+      
+  /* Deprecated. We can replace with a more generic dump of the routing table */
+  case MDP_NODEINFO:
+    if (config.debug.mdprequests) DEBUG("MDP_NODEINFO");
+      
+    if (!overlay_route_node_info(&mdp->nodeinfo))
+      overlay_mdp_reply(mdp_named.poll.fd,recvaddr_un,recvaddrlen,mdp);
+    return;
+      
+  case MDP_ROUTING_TABLE:
+    {
+      struct routing_state state={
+	.recvaddr_un=recvaddr_un,
+	.recvaddrlen=recvaddrlen,
+      };
+      
+      if (mdp->out.payload_length==SID_SIZE){
+	state.resume=find_subscriber(mdp->out.payload, SID_SIZE, 0);
+	if (!state.resume){
+	  // we never forget subscribers, so it can't be in the table
+	  routing_table_send(&state);
+	  return;
+	}
+      }
+      enum_subscribers(state.resume, routing_table, &state);
+      // finish with a short frame, so the client knows there is no more
+      if (state.frames<MDP_ROUTE_FRAMES_PER_PAGE)
+	routing_table_send(&state);
+    }
+    return;
+  
+  case MDP_GETADDRS:
+    {
+      overlay_mdp_frame mdpreply;
+      bzero(&mdpreply, sizeof(overlay_mdp_frame));
+      mdpreply.packetTypeAndFlags = MDP_ADDRLIST;
+      if (!overlay_mdp_address_list(&mdp->addrlist, &mdpreply.addrlist))
+      /* Send back to caller */
+	overlay_mdp_reply(sock,
+			  recvaddr_un,recvaddrlen,
+			  &mdpreply);
+        
+      return;
+    }
+    break;
+      
+  case MDP_TX: /* Send payload (and don't treat it as system privileged) */
+    if (config.debug.mdprequests) DEBUG("MDP_TX");
+      
+    // Dont allow mdp clients to send very high priority payloads
+    if (mdp->out.queue<=OQ_MESH_MANAGEMENT)
+      mdp->out.queue=OQ_ORDINARY;
+    overlay_mdp_dispatch(mdp,1,recvaddr_un,recvaddrlen);
+    return;
+    break;
+      
+  case MDP_BIND: /* Bind to port */
+    {
+      if (config.debug.mdprequests) DEBUG("MDP_BIND");
+      
+      struct subscriber *subscriber=NULL;
+      /* Make sure source address is either all zeros (listen on all), or a valid
+       local address */
+      
+      if (!is_sid_any(mdp->bind.sid)){
+	subscriber = find_subscriber(mdp->bind.sid, SID_SIZE, 0);
+	if ((!subscriber) || subscriber->reachable != REACHABLE_SELF){
+	  WHYF("Invalid bind request for sid=%s", alloca_tohex_sid(mdp->bind.sid));
+	  /* Source address is invalid */
+	  overlay_mdp_reply_error(sock, recvaddr_un, recvaddrlen, 7,
+					 "Bind address is not valid (must be a local MDP address, or all zeroes).");
+	  return;
+	}
+        
+      }
+      if (overlay_mdp_process_bind_request(sock, subscriber, mdp->bind.port,
+					   mdp->packetTypeAndFlags, recvaddr_un, recvaddrlen))
+	overlay_mdp_reply_error(sock,recvaddr_un,recvaddrlen,3, "Port already in use");
+      else
+	overlay_mdp_reply_ok(sock,recvaddr_un,recvaddrlen,"Port bound");
+      return;
+    }
+    break;
+      
+  case MDP_SCAN:
+    {
+      struct overlay_mdp_scan *scan = (struct overlay_mdp_scan *)&mdp->raw;
+      time_ms_t start=gettime_ms();
+      
+      if (scan->addr.s_addr==0){
+	int i=0;
+	for (i=0;i<OVERLAY_MAX_INTERFACES;i++){
+	  // skip any interface that is already being scanned
+	  if (scans[i].interface)
+	    continue;
+          
+	  struct overlay_interface *interface = &overlay_interfaces[i];
+	  if (interface->state!=INTERFACE_STATE_UP)
+	    continue;
+          
+	  scans[i].interface = interface;
+	  scans[i].current = ntohl(interface->address.sin_addr.s_addr & interface->netmask.s_addr)+1;
+	  scans[i].last = ntohl(interface->broadcast_address.sin_addr.s_addr)-1;
+	  if (scans[i].last - scans[i].current>0x10000){
+	    INFOF("Skipping scan on interface %s as the address space is too large",interface->name);
+	    continue;
+	  }
+	  scans[i].alarm.alarm=start;
+	  scans[i].alarm.function=overlay_mdp_scan;
+	  start+=100;
+	  schedule(&scans[i].alarm);
+	}
+      }else{
+	struct overlay_interface *interface = overlay_interface_find(scan->addr, 1);
+	if (!interface){
+	  overlay_mdp_reply_error(sock,recvaddr_un,recvaddrlen, 1, "Unable to find matching interface");
+	  return;
+	}
+	int i = interface - overlay_interfaces;
+        
+	if (!scans[i].interface){
+	  scans[i].interface = interface;
+	  scans[i].current = ntohl(scan->addr.s_addr);
+	  scans[i].last = ntohl(scan->addr.s_addr);
+	  scans[i].alarm.alarm=start;
+	  scans[i].alarm.function=overlay_mdp_scan;
+	  schedule(&scans[i].alarm);
+	}
+      }
+      
+      overlay_mdp_reply_ok(sock,recvaddr_un,recvaddrlen,"Scan initiated");
+    }
+    break;
+    
+  default:
+    /* Client is not allowed to send any other frame type */
+    WARNF("Unsupported MDP frame type: %d", mdp_type);
+    mdp->packetTypeAndFlags=MDP_ERROR;
+    mdp->error.error=2;
+    snprintf(mdp->error.message,128,"Illegal request type.  Clients may use only MDP_TX or MDP_BIND.");
+    /* We ignore the result of the following, because it is just sending an
+       error message back to the client.  If this fails, where would we report
+       the error to? My point exactly. */
+    overlay_mdp_reply(sock,recvaddr_un,recvaddrlen,mdp);
+  }
+}
+
 void overlay_mdp_poll(struct sched_ent *alarm)
 {
   if (alarm->poll.revents & POLLIN) {
     unsigned char buffer[16384];
-    int ttl;
     unsigned char recvaddrbuffer[1024];
     struct sockaddr *recvaddr=(struct sockaddr *)&recvaddrbuffer[0];
     socklen_t recvaddrlen=sizeof(recvaddrbuffer);
-    struct sockaddr_un *recvaddr_un=NULL;
+    int fds[3];
+    int fd_count=3;
 
-    ttl=-1;
     bzero((void *)recvaddrbuffer,sizeof(recvaddrbuffer));
     
-    ssize_t len = recvwithttl(alarm->poll.fd,buffer,sizeof(buffer),&ttl, recvaddr, &recvaddrlen);
-    recvaddr_un=(struct sockaddr_un *)recvaddr;
+    ssize_t len = recvwithfds(alarm->poll.fd,buffer,sizeof(buffer),recvaddr,&recvaddrlen,fds,&fd_count);
 
     if (len>0) {
       /* Look at overlay_mdp_frame we have received */
       overlay_mdp_frame *mdp=(overlay_mdp_frame *)&buffer[0];      
-      unsigned int mdp_type = mdp->packetTypeAndFlags & MDP_TYPE_MASK;
-
-      switch (mdp_type) {
-      case MDP_GOODBYE:
-	if (config.debug.mdprequests) DEBUG("MDP_GOODBYE");
-	overlay_mdp_releasebindings(recvaddr_un,recvaddrlen);
-	return;
-	  
-      /* Deprecated. We can replace with a more generic dump of the routing table */
-      case MDP_NODEINFO:
-	if (config.debug.mdprequests) DEBUG("MDP_NODEINFO");
-	  
-	if (!overlay_route_node_info(&mdp->nodeinfo))
-	  overlay_mdp_reply(mdp_named.poll.fd,recvaddr_un,recvaddrlen,mdp);
-	return;
-	  
-      case MDP_ROUTING_TABLE:
-	{
-	  struct routing_state state={
-	    .recvaddr_un=recvaddr_un,
-	    .recvaddrlen=recvaddrlen,
-	  };
-	  
-	  enum_subscribers(NULL, routing_table, &state);
-	  
-	}
-	return;
+      struct sockaddr_un *recvaddr_un=(struct sockaddr_un *)recvaddr;
       
-      case MDP_GETADDRS:
-	{
-	  overlay_mdp_frame mdpreply;
-	  bzero(&mdpreply, sizeof(overlay_mdp_frame));
-	  mdpreply.packetTypeAndFlags = MDP_ADDRLIST;
-	  if (!overlay_mdp_address_list(&mdp->addrlist, &mdpreply.addrlist))
-	  /* Send back to caller */
-	    overlay_mdp_reply(alarm->poll.fd,
-			      (struct sockaddr_un *)recvaddr,recvaddrlen,
-			      &mdpreply);
-	    
-	  return;
-	}
-	break;
-	  
-      case MDP_TX: /* Send payload (and don't treat it as system privileged) */
-	if (config.debug.mdprequests) DEBUG("MDP_TX");
-	  
-	// Dont allow mdp clients to send very high priority payloads
-	if (mdp->out.queue<=OQ_MESH_MANAGEMENT)
-	  mdp->out.queue=OQ_ORDINARY;
-	overlay_mdp_dispatch(mdp,1,(struct sockaddr_un*)recvaddr,recvaddrlen);
-	return;
-	break;
-	  
-      case MDP_BIND: /* Bind to port */
-	{
-	  if (config.debug.mdprequests) DEBUG("MDP_BIND");
-	  
-	  struct subscriber *subscriber=NULL;
-	  /* Make sure source address is either all zeros (listen on all), or a valid
-	   local address */
-	  
-	  if (!is_sid_any(mdp->bind.sid)){
-	    subscriber = find_subscriber(mdp->bind.sid, SID_SIZE, 0);
-	    if ((!subscriber) || subscriber->reachable != REACHABLE_SELF){
-	      WHYF("Invalid bind request for sid=%s", alloca_tohex_sid(mdp->bind.sid));
-	      /* Source address is invalid */
-	      overlay_mdp_reply_error(alarm->poll.fd, recvaddr_un, recvaddrlen, 7,
-					     "Bind address is not valid (must be a local MDP address, or all zeroes).");
-	      return;
-	    }
-	    
-	  }
-	  if (overlay_mdp_process_bind_request(alarm->poll.fd, subscriber, mdp->bind.port,
-					       mdp->packetTypeAndFlags, recvaddr_un, recvaddrlen))
-	    overlay_mdp_reply_error(alarm->poll.fd,recvaddr_un,recvaddrlen,3, "Port already in use");
-	  else
-	    overlay_mdp_reply_ok(alarm->poll.fd,recvaddr_un,recvaddrlen,"Port bound");
-	  return;
-	}
-	break;
-	  
-      case MDP_SCAN:
-	{
-	  struct overlay_mdp_scan *scan = (struct overlay_mdp_scan *)&mdp->raw;
-	  time_ms_t start=gettime_ms();
-	  
-	  if (scan->addr.s_addr==0){
-	    int i=0;
-	    for (i=0;i<OVERLAY_MAX_INTERFACES;i++){
-	      // skip any interface that is already being scanned
-	      if (scans[i].interface)
-		continue;
-	      
-	      struct overlay_interface *interface = &overlay_interfaces[i];
-	      if (interface->state!=INTERFACE_STATE_UP)
-		continue;
-	      
-	      scans[i].interface = interface;
-	      scans[i].current = ntohl(interface->address.sin_addr.s_addr & interface->netmask.s_addr)+1;
-	      scans[i].last = ntohl(interface->broadcast_address.sin_addr.s_addr)-1;
-	      if (scans[i].last - scans[i].current>0x10000){
-		INFOF("Skipping scan on interface %s as the address space is too large",interface->name);
-		continue;
-	      }
-	      scans[i].alarm.alarm=start;
-	      scans[i].alarm.function=overlay_mdp_scan;
-	      start+=100;
-	      schedule(&scans[i].alarm);
-	    }
-	  }else{
-	    struct overlay_interface *interface = overlay_interface_find(scan->addr, 1);
-	    if (!interface){
-	      overlay_mdp_reply_error(alarm->poll.fd,recvaddr_un,recvaddrlen, 1, "Unable to find matching interface");
-	      return;
-	    }
-	    int i = interface - overlay_interfaces;
-	    
-	    if (!scans[i].interface){
-	      scans[i].interface = interface;
-	      scans[i].current = ntohl(scan->addr.s_addr);
-	      scans[i].last = ntohl(scan->addr.s_addr);
-	      scans[i].alarm.alarm=start;
-	      scans[i].alarm.function=overlay_mdp_scan;
-	      schedule(&scans[i].alarm);
-	    }
-	  }
-	  
-	  overlay_mdp_reply_ok(alarm->poll.fd,recvaddr_un,recvaddrlen,"Scan initiated");
-	}
-	break;
-	
-      default:
-	/* Client is not allowed to send any other frame type */
-	WARNF("Unsupported MDP frame type: %d", mdp_type);
-	mdp->packetTypeAndFlags=MDP_ERROR;
-	mdp->error.error=2;
-	snprintf(mdp->error.message,128,"Illegal request type.  Clients may use only MDP_TX or MDP_BIND.");
-	int len=4+4+strlen(mdp->error.message)+1;
-	errno=0;
-	/* We ignore the result of the following, because it is just sending an
-	   error message back to the client.  If this fails, where would we report
-	   the error to? My point exactly. */
-	sendto(alarm->poll.fd,mdp,len,0,(struct sockaddr *)recvaddr,recvaddrlen);
-      }
+      if ((mdp->packetTypeAndFlags & MDP_TYPE_MASK) == MDP_RING_ATTACH) {
+	if (config.debug.mdprequests) DEBUG("MDP_RING_ATTACH");
+	// the rings own the descriptors now
+	if (overlay_mdp_ring_attach(recvaddr_un, recvaddrlen, fds, fd_count))
+	  overlay_mdp_reply_error(alarm->poll.fd, recvaddr_un, recvaddrlen, 8, "Could not attach rings");
+	else
+	  fd_count=0;
+      }else
+	overlay_mdp_process_request(alarm->poll.fd, mdp, recvaddr_un, recvaddrlen);
     }
+    // only ring requests should come with descriptors
+    while (fd_count>0)
+      close(fds[--fd_count]);
   }
   
   if (alarm->poll.revents & (POLLHUP | POLLERR)) {
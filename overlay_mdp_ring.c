@@ -0,0 +1,289 @@
+/*
+Copyright (C) 2013 Serval Project, Inc.
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/*
+  The server's end of the shared memory rings that MDP clients can attach (see mdp_client.h).
+
+  A client attaches by sending MDP_RING_ATTACH on its socket, along with a descriptor for the
+  memfd holding the rings and an eventfd for each direction.  The memfd must be sealed against
+  shrinking, otherwise the client could truncate it and our next look at the rings would raise
+  SIGBUS.  From then on, we treat each frame in its to_server ring exactly as if it had arrived
+  on our socket from the client's address, and anything we would have sent to that address goes
+  into its to_client ring instead.
+
+  Frames for a client are published, and the client woken, by an alarm that runs once the
+  current pass through the event loop is done, so a burst of frames costs the client one wakeup.
+*/
+
+#ifdef HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#endif
+#include "serval.h"
+#include "conf.h"
+#include "str.h"
+#include "mdp_client.h"
+
+#ifdef HAVE_MDP_RINGS
+
+#define MDP_MAX_RING_CLIENTS 16
+
+struct mdp_ring_client{
+  /* watches the client's to_server eventfd */
+  struct sched_ent alarm;
+  /* publishes our frames and wakes the client */
+  struct sched_ent notify;
+  struct mdp_ring_pair *rings;
+  int to_client_fd;
+  /* slots claimed in the to_client ring but not yet published */
+  int pending;
+  unsigned int dropped;
+  int closed;
+  struct sockaddr_un addr;
+  int addrlen;
+};
+
+static struct mdp_ring_client *ring_clients[MDP_MAX_RING_CLIENTS];
+/* the client whose requests we are working through, which must not be freed under us */
+static struct mdp_ring_client *polling_client=NULL;
+
+struct profile_total mdp_ring_stats={.name="mdp_ring_poll"};
+struct profile_total mdp_ring_notify_stats={.name="mdp_ring_notify"};
+
+static struct mdp_ring_client **find_client(struct sockaddr_un *addr, int addrlen)
+{
+  int i;
+  for (i=0;i<MDP_MAX_RING_CLIENTS;i++){
+    struct mdp_ring_client *client=ring_clients[i];
+    if (client && client->addrlen==addrlen
+      && memcmp(client->addr.sun_path, addr->sun_path, addrlen - sizeof(short))==0)
+      return &ring_clients[i];
+  }
+  return NULL;
+}
+
+static void free_client(struct mdp_ring_client *client)
+{
+  unwatch(&client->alarm);
+  close(client->alarm.poll.fd);
+  if (is_scheduled(&client->notify))
+    unschedule(&client->notify);
+  close(client->to_client_fd);
+  munmap(client->rings, sizeof(struct mdp_ring_pair));
+  free(client);
+}
+
+static void mdp_ring_notify(struct sched_ent *alarm)
+{
+  struct mdp_ring_client *client=alarm->context;
+  if (!client->pending)
+    return;
+  mdp_ring_publish(&client->rings->to_client, &client->pending);
+  uint64_t one=1;
+  if (write(client->to_client_fd, &one, sizeof one) == -1 && errno != EAGAIN)
+    WHY_perror("write");
+}
+
+static void mdp_ring_poll(struct sched_ent *alarm)
+{
+  struct mdp_ring_client *client=alarm->context;
+  if (!(alarm->poll.revents & POLLIN))
+    return;
+  uint64_t count;
+  if (read(alarm->poll.fd, &count, sizeof count) == -1 && errno != EAGAIN)
+    WHY_perror("read");
+  
+  struct mdp_ring *ring=&client->rings->to_server;
+  polling_client=client;
+  int processed;
+  for (processed=0; processed<MDP_RING_SLOTS && !client->closed; processed++){
+    int length;
+    overlay_mdp_frame *slot=mdp_ring_peek(ring, 0, &length);
+    if (!slot)
+      break;
+    /* The client can still write to the slot, so work on our own copy */
+    overlay_mdp_frame mdp;
+    if (length < 0 || length > (int)sizeof mdp)
+      length = 0;
+    bcopy(slot, &mdp, length);
+    mdp_ring_consume(ring, 1);
+    if (length < (int)sizeof mdp.packetTypeAndFlags)
+      continue;
+    int expected=overlay_mdp_relevant_bytes(&mdp);
+    if (expected < 0 || expected > length){
+      WARNF("Ignoring malformed %d byte frame from MDP client '%s'", length, client->addr.sun_path);
+      continue;
+    }
+    overlay_mdp_process_request(mdp_named.poll.fd, &mdp, &client->addr, client->addrlen);
+  }
+  polling_client=NULL;
+  if (client->closed){
+    free_client(client);
+    return;
+  }
+  // don't let one busy client starve everything else, come back to the rest later
+  int length;
+  if (mdp_ring_peek(ring, 0, &length)){
+    uint64_t one=1;
+    if (write(alarm->poll.fd, &one, sizeof one) == -1 && errno != EAGAIN)
+      WHY_perror("write");
+  }
+}
+
+int overlay_mdp_ring_attach(struct sockaddr_un *recvaddr, int recvaddrlen, int *fds, int fd_count)
+{
+  if (fd_count!=3)
+    return WHYF("Expected 3 file descriptors with ring attach request, got %d", fd_count);
+  if (recvaddrlen <= (int)sizeof(short) || recvaddrlen > (int)sizeof(struct sockaddr_un))
+    return WHYF("Invalid socket address length %d", recvaddrlen);
+  
+  int seals=fcntl(fds[0], F_GET_SEALS);
+  if (seals == -1)
+    return WHY_perror("fcntl(F_GET_SEALS)");
+  if (!(seals & F_SEAL_SHRINK) || !(seals & F_SEAL_SEAL))
+    return WHY("Ring memory is not sealed against shrinking");
+  struct stat st;
+  if (fstat(fds[0], &st) == -1)
+    return WHY_perror("fstat");
+  if (st.st_size != sizeof(struct mdp_ring_pair))
+    return WHYF("Ring file is %lld bytes, expected %lld",
+		(long long)st.st_size, (long long)sizeof(struct mdp_ring_pair));
+  
+  struct mdp_ring_client **free_slot=find_client(recvaddr, recvaddrlen);
+  if (free_slot){
+    // the client is starting again
+    overlay_mdp_ring_detach(recvaddr, recvaddrlen);
+    free_slot=NULL;
+  }
+  int i;
+  for (i=0;i<MDP_MAX_RING_CLIENTS && !free_slot;i++){
+    if (!ring_clients[i])
+      free_slot=&ring_clients[i];
+    else if (overlay_mdp_client_is_gone(ring_clients[i]->addr.sun_path, ring_clients[i]->addrlen - sizeof(short))){
+      INFOF("Closing dead MDP client '%s'", ring_clients[i]->addr.sun_path);
+      overlay_mdp_releasebindings(&ring_clients[i]->addr, ring_clients[i]->addrlen);
+      if (!ring_clients[i])
+	free_slot=&ring_clients[i];
+    }
+  }
+  if (!free_slot)
+    return WHYF("Too many MDP clients with rings (%d)", MDP_MAX_RING_CLIENTS);
+  
+  struct mdp_ring_pair *rings=mmap(NULL, sizeof(struct mdp_ring_pair), PROT_READ|PROT_WRITE, MAP_SHARED, fds[0], 0);
+  if (rings==MAP_FAILED)
+    return WHY_perror("mmap");
+  if (rings->magic!=MDP_RING_MAGIC || rings->version!=MDP_RING_VERSION
+    || rings->slot_count!=MDP_RING_SLOTS || rings->slot_size!=sizeof(struct mdp_ring_slot)){
+    munmap(rings, sizeof(struct mdp_ring_pair));
+    return WHY("Client's rings are not compatible with ours");
+  }
+  
+  struct mdp_ring_client *client=emalloc_zero(sizeof(struct mdp_ring_client));
+  if (!client){
+    munmap(rings, sizeof(struct mdp_ring_pair));
+    return -1;
+  }
+  
+  /* Tell the client over its socket before we start sending it everything through the rings */
+  overlay_mdp_reply_ok(mdp_named.poll.fd, recvaddr, recvaddrlen, "Rings attached");
+  
+  close(fds[0]);
+  client->rings=rings;
+  bcopy(recvaddr, &client->addr, recvaddrlen);
+  client->addrlen=recvaddrlen;
+  client->to_client_fd=fds[2];
+  client->alarm.function=mdp_ring_poll;
+  client->alarm.context=client;
+  client->alarm.stats=&mdp_ring_stats;
+  client->alarm.poll.fd=fds[1];
+  client->alarm.poll.events=POLLIN;
+  client->notify.function=mdp_ring_notify;
+  client->notify.context=client;
+  client->notify.stats=&mdp_ring_notify_stats;
+  watch(&client->alarm);
+  *free_slot=client;
+  if (config.debug.mdprequests)
+    DEBUGF("Attached rings for MDP client '%s'", client->addr.sun_path);
+  
+  // the client may have queued frames before we were watching
+  client->alarm.poll.revents=POLLIN;
+  mdp_ring_poll(&client->alarm);
+  return 0;
+}
+
+void overlay_mdp_ring_detach(struct sockaddr_un *recvaddr, int recvaddrlen)
+{
+  struct mdp_ring_client **slot=find_client(recvaddr, recvaddrlen);
+  if (!slot)
+    return;
+  struct mdp_ring_client *client=*slot;
+  *slot=NULL;
+  if (config.debug.mdprequests)
+    DEBUGF("Detached rings for MDP client '%s', %u frames dropped", client->addr.sun_path, client->dropped);
+  if (client==polling_client)
+    client->closed=1;
+  else
+    free_client(client);
+}
+
+/* If this address belongs to a client with rings, queue the frame in its to_client ring.
+   Returns 1 if it doesn't, so the frame should go to the client's socket as usual, 0 if the
+   frame is queued and -1 if the client's ring is full. */
+int overlay_mdp_ring_deliver(struct sockaddr_un *recvaddr, int recvaddrlen, overlay_mdp_frame *mdp)
+{
+  struct mdp_ring_client **slot=find_client(recvaddr, recvaddrlen);
+  if (!slot)
+    return 1;
+  struct mdp_ring_client *client=*slot;
+  int len=overlay_mdp_relevant_bytes(mdp);
+  if (len<0)
+    return WHY("Invalid MDP frame (could not compute length)");
+  overlay_mdp_frame *frame=mdp_ring_claim(&client->rings->to_client, &client->pending);
+  if (!frame){
+    client->dropped++;
+    if (overlay_mdp_client_is_gone(client->addr.sun_path, client->addrlen - sizeof(short))){
+      INFOF("Closing dead MDP client '%s'", client->addr.sun_path);
+      overlay_mdp_releasebindings(recvaddr, recvaddrlen);
+    }
+    return WHY("MDP client's ring is full");
+  }
+  bcopy(mdp, frame, len);
+  if (!is_scheduled(&client->notify)){
+    client->notify.alarm=gettime_ms();
+    client->notify.deadline=client->notify.alarm;
+    schedule(&client->notify);
+  }
+  return 0;
+}
+
+#else
+
+int overlay_mdp_ring_attach(struct sockaddr_un *recvaddr, int recvaddrlen, int *fds, int fd_count)
+{
+  return WHY("MDP rings are not supported on this platform");
+}
+
+void overlay_mdp_ring_detach(struct sockaddr_un *recvaddr, int recvaddrlen)
+{
+}
+
+int overlay_mdp_ring_deliver(struct sockaddr_un *recvaddr, int recvaddrlen, overlay_mdp_frame *mdp)
+{
+  return 1;
+}
+
+#endif
@@ -507,9 +507,9 @@ overlay_stuff_packet(struct outgoing_packet *packet, overlay_txqueue *queue, tim
   }
 }
 
-// fill a packet from our outgoing queues and send it
+// fill a packet from our outgoing queues, returns 1 if there is anything to send
 static int
-overlay_fill_send_packet(struct outgoing_packet *packet, time_ms_t now) {
+overlay_fill_packet(struct outgoing_packet *packet, time_ms_t now) {
   int i;
   IN();
   // while we're looking at queues, work out when to schedule another packet
@@ -523,31 +523,72 @@ overlay_fill_send_packet(struct outgoing_packet *packet, time_ms_t now) {
     overlay_stuff_packet(packet, queue, now);
   }
   
-  if(packet->buffer){
-    if (ob_position(packet->buffer) > packet->header_length){
-    
-      if (config.debug.packetconstruction)
-	ob_dump(packet->buffer,"assembled packet");
-      
-      if (overlay_broadcast_ensemble(packet->interface, &packet->dest, ob_ptr(packet->buffer), ob_position(packet->buffer))){
-	// sendto failed. We probably don't have a valid route
-	if (packet->unicast_subscriber){
-	  set_reachable(packet->unicast_subscriber, REACHABLE_NONE);
-	}
-      }
-    }else
-      WARN("No payloads were sent?");
+  if(!packet->buffer)
+    RETURN(0);
+  if (ob_position(packet->buffer) <= packet->header_length){
+    WARN("No payloads were sent?");
     ob_free(packet->buffer);
-    RETURN(1);
+    packet->buffer=NULL;
+    RETURN(0);
   }
-  RETURN(0);
+  if (config.debug.packetconstruction)
+    ob_dump(packet->buffer,"assembled packet");
+  RETURN(1);
   OUT();
 }
 
-// when the queue timer elapses, send a packet
+// send filled packets, grouped by the interface they are going out of
+static void
+overlay_send_packets(struct outgoing_packet *packets, int count) {
+  struct overlay_tx_packet tx[count];
+  int i, j, n;
+  for (i=0;i<count;i++){
+    if (!packets[i].buffer)
+      continue;
+    overlay_interface *interface=packets[i].interface;
+    for (j=i, n=0;j<count;j++){
+      if (packets[j].buffer && packets[j].interface==interface){
+	tx[n].recipientaddr=packets[j].dest;
+	tx[n].bytes=ob_ptr(packets[j].buffer);
+	tx[n].len=ob_position(packets[j].buffer);
+	n++;
+      }
+    }
+    int sent=overlay_broadcast_ensemble_batch(interface, tx, n);
+    if (config.debug.overlayinterfaces && n>1)
+      DEBUGF("Sent %d of %d packets on %s in one batch", sent, n, interface->name);
+    for (j=i, n=0;j<count;j++){
+      if (packets[j].buffer && packets[j].interface==interface){
+	// sendto failed. We probably don't have a valid route
+	if (tx[n].result && packets[j].unicast_subscriber)
+	  set_reachable(packets[j].unicast_subscriber, REACHABLE_NONE);
+	ob_free(packets[j].buffer);
+	packets[j].buffer=NULL;
+	n++;
+      }
+    }
+  }
+}
+
+/* When the queue timer elapses, keep filling packets while there are frames we are allowed
+   to send, and then send them all together.  Interfaces that write to a stream or a file are
+   sent to as each packet is filled, as they can only take one at a time.
+ */
 static void overlay_send_packet(struct sched_ent *alarm){
-  struct outgoing_packet packet;
-  bzero(&packet, sizeof(struct outgoing_packet));
+  struct outgoing_packet packets[OVERLAY_MAX_TX_BATCH];
+  int filled, count=0;
+  time_ms_t now = gettime_ms();
   
-  overlay_fill_send_packet(&packet, gettime_ms());
+  for (filled=0;filled<OVERLAY_MAX_TX_BATCH;filled++){
+    struct outgoing_packet *packet=&packets[count];
+    bzero(packet, sizeof(struct outgoing_packet));
+    if (!overlay_fill_packet(packet, now))
+      break;
+    if (packet->interface->socket_type==SOCK_DGRAM)
+      count++;
+    else
+      overlay_send_packets(packet, 1);
+  }
+  if (count)
+    overlay_send_packets(packets, count);
 }
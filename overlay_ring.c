@@ -0,0 +1,254 @@
+/*
+Copyright (C) 2013 Serval Project, Inc.
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/*
+  A ring interface is a simulated network link made out of a file that every attached node maps
+  into memory.  It does the same job as the dummy file interface, but reading and writing a packet
+  costs a memcpy instead of a handful of system calls, and the file doesn't grow forever.
+
+  The file holds a small header followed by a fixed number of packet slots.  To send, a node
+  atomically increments the header's head counter to claim a sequence number, copies its packet
+  into the slot that number maps to, and then publishes the slot by storing the sequence number
+  in it.  Any number of processes can send at once without taking a lock.
+
+  Every reader keeps its own cursor and reads every packet published since it attached, so the
+  ring behaves like a broadcast medium; unicast packets are filtered by address just like the
+  dummy file interface's.  A reader that falls a whole ring behind has lost the packets it skips,
+  and counts them as dropped.
+
+  Each packet is stamped with the time it was sent, so a reader configured with some latency can
+  leave it in the ring until it is due.  The interface alarm looks at the ring every few
+  milliseconds while there is nothing to read, which is as fine as the latency gets.
+
+  Sequence numbers are 32 bits so that we only need 32 bit atomic operations, which every
+  platform we build on has.  They are always compared by their signed difference.
+*/
+
+#include <sys/mman.h>
+#include <sys/file.h>
+#include "serval.h"
+#include "conf.h"
+
+#define RING_MAGIC 0x53524e47
+#define RING_VERSION 2
+#define RING_SLOTS 1024
+#define RING_MTU 4096
+/* Keep the header and the head counter that everyone hammers on its own cache line */
+#define RING_HEADER_SIZE 64
+
+struct ring_header{
+  uint32_t magic;
+  uint32_t version;
+  uint32_t slot_count;
+  uint32_t slot_size;
+  /* sequence number of the next packet to be sent */
+  volatile uint32_t head;
+};
+
+struct ring_slot{
+  /* one more than the sequence number of the packet in this slot, or zero while it is being written */
+  volatile uint32_t sequence;
+  int32_t pid;
+  time_ms_t sent_ms;
+  struct sockaddr_in src_addr;
+  struct sockaddr_in dst_addr;
+  int32_t payload_length;
+  unsigned char payload[RING_MTU];
+};
+
+struct overlay_ring{
+  struct ring_header *header;
+  size_t size;
+  /* sequence number of the next packet we will read */
+  uint32_t next;
+};
+
+static struct ring_slot *ring_slot(struct overlay_ring *ring, uint32_t sequence)
+{
+  return (struct ring_slot *)((unsigned char *)ring->header + RING_HEADER_SIZE
+    + (size_t)(sequence % ring->header->slot_count) * ring->header->slot_size);
+}
+
+int overlay_ring_open(overlay_interface *interface)
+{
+  int fd = interface->alarm.poll.fd;
+  size_t size = RING_HEADER_SIZE + (size_t)RING_SLOTS * sizeof(struct ring_slot);
+
+  /* Whoever attaches to an empty file first lays out the ring, everyone else checks that they
+   agree with its layout */
+  if (flock(fd, LOCK_EX) == -1)
+    return WHY_perror("flock");
+
+  struct stat st;
+  if (fstat(fd, &st) == -1){
+    WHY_perror("fstat");
+    goto unlock;
+  }
+
+  int empty = st.st_size == 0;
+  if (empty){
+    if (ftruncate(fd, size) == -1){
+      WHY_perror("ftruncate");
+      goto unlock;
+    }
+  }else if (st.st_size != size){
+    WHYF("Interface file %s is %lld bytes, not a ring of %lld bytes",
+	 interface->name, (long long)st.st_size, (long long)size);
+    goto unlock;
+  }
+
+  void *map = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED){
+    WHY_perror("mmap");
+    goto unlock;
+  }
+
+  /* The interface file is opened O_APPEND, so write the header through the mapping rather
+   than with pwrite(), which would append it */
+  struct ring_header *header = map;
+  if (empty){
+    header->magic = RING_MAGIC;
+    header->version = RING_VERSION;
+    header->slot_count = RING_SLOTS;
+    header->slot_size = sizeof(struct ring_slot);
+    header->head = 0;
+  }
+  flock(fd, LOCK_UN);
+
+  if (header->magic != RING_MAGIC || header->version != RING_VERSION
+    || header->slot_count != RING_SLOTS || header->slot_size != sizeof(struct ring_slot)){
+    WHYF("Interface file %s does not contain a compatible ring", interface->name);
+    munmap(map, size);
+    return -1;
+  }
+
+  struct overlay_ring *ring = emalloc_zero(sizeof(struct overlay_ring));
+  if (!ring){
+    munmap(map, size);
+    return -1;
+  }
+  ring->header = header;
+  ring->size = size;
+  ring->next = header->head;
+  interface->ring = ring;
+  interface->mtu = RING_MTU;
+  return 0;
+
+unlock:
+  flock(fd, LOCK_UN);
+  return -1;
+}
+
+void overlay_ring_close(overlay_interface *interface)
+{
+  struct overlay_ring *ring = interface->ring;
+  if (!ring)
+    return;
+  munmap(ring->header, ring->size);
+  free(ring);
+  interface->ring = NULL;
+}
+
+int overlay_ring_send(overlay_interface *interface, struct sockaddr_in *recipientaddr,
+		      unsigned char *bytes, int len)
+{
+  struct overlay_ring *ring = interface->ring;
+  if (len > RING_MTU)
+    return WHYF("Cannot send %d byte packet on ring interface %s, the limit is %d",
+		len, interface->name, RING_MTU);
+
+  uint32_t sequence = __sync_fetch_and_add(&ring->header->head, 1);
+  struct ring_slot *slot = ring_slot(ring, sequence);
+
+  slot->sequence = 0;
+  __sync_synchronize();
+  slot->pid = getpid();
+  slot->sent_ms = gettime_ms();
+  slot->src_addr = interface->address;
+  slot->dst_addr = *recipientaddr;
+  slot->payload_length = len;
+  bcopy(bytes, slot->payload, len);
+  __sync_synchronize();
+  slot->sequence = sequence + 1;
+
+  if (config.debug.overlayinterfaces)
+    DEBUGF("Wrote %d bytes to ring interface %s at sequence %u", len, interface->name, sequence);
+  return 0;
+}
+
+/* Read up to interface->recv_batch packets from the ring.  Returns the number of packets read,
+   and adds the number of packets we lost because we weren't reading fast enough to *dropped. */
+int overlay_ring_read(overlay_interface *interface, unsigned int *dropped)
+{
+  struct overlay_ring *ring = interface->ring;
+  struct ring_header *header = ring->header;
+  struct ring_slot packet;
+  int count=0;
+  time_ms_t now = interface->latency_ms ? gettime_ms() : 0;
+
+  while (count < interface->recv_batch && interface->state==INTERFACE_STATE_UP){
+    struct ring_slot *slot = ring_slot(ring, ring->next);
+    uint32_t want = ring->next + 1;
+
+    if (slot->sequence != want){
+      int32_t waiting = header->head - ring->next;
+      if (waiting <= 0)
+	break;
+      if (waiting > (int32_t)header->slot_count){
+	/* we've been lapped, skip to the oldest packet that might still be there */
+	*dropped += waiting - header->slot_count;
+	ring->next = header->head - header->slot_count;
+	continue;
+      }
+      if (waiting > (int32_t)header->slot_count/2){
+	/* Someone claimed this slot and never published it, probably because they died
+	 half way through.  Don't let that stop us from reading everything after it. */
+	(*dropped)++;
+	ring->next++;
+	continue;
+      }
+      /* still being written, try again next time */
+      break;
+    }
+
+    __sync_synchronize();
+    /* Packets arrive in the order they were sent, so nothing after this one is due either */
+    if (interface->latency_ms && slot->sent_ms + interface->latency_ms > now)
+      break;
+    int len = slot->payload_length;
+    if (len < 0 || len > RING_MTU)
+      len = 0;
+    packet.src_addr = slot->src_addr;
+    packet.dst_addr = slot->dst_addr;
+    packet.payload_length = len;
+    bcopy(slot->payload, packet.payload, len);
+    __sync_synchronize();
+    ring->next++;
+
+    /* a writer may have wrapped around and started overwriting the slot while we copied it */
+    if (slot->sequence != want){
+      (*dropped)++;
+      continue;
+    }
+
+    count++;
+    overlay_interface_receive_simulated(interface, &packet.src_addr, &packet.dst_addr,
+					packet.payload, packet.payload_length);
+  }
+  return count;
+}
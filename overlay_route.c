@@ -144,9 +144,13 @@ struct overlay_neighbour_observation {
 struct overlay_neighbour {
   time_ms_t last_observation_time_ms;
   time_ms_t last_metric_update;
+  /* When an observation will next fall out of the window it was counted in, and so change
+     the scores, 0=never */
+  time_ms_t next_metric_change;
   int most_recent_observation_id;
   struct overlay_neighbour_observation observations[OVERLAY_MAX_OBSERVATIONS];
   overlay_node *node;
+  int table_index; // where this neighbour is in overlay_neighbours[]
   
   /* Scores of visibility from each of the neighbours interfaces.
    This is so that the sender knows which interface to use to reach us.
@@ -156,17 +160,42 @@ struct overlay_neighbour {
 
 /* We need to keep track of which nodes are our direct neighbours.
    This means we need to keep an eye on how recently we received DIRECT announcements
-   from nodes, and keep a list of the most recent ones.  The challenge is to keep the
-   list ordered without having to do copies or have nasty linked-list structures that
-   require lots of random memory reads to resolve.
-
-   The simplest approach is to maintain a cache of neighbours and practise random
-   replacement.  It is however succecptible to cache flushing attacks by adversaries, so
-   we will need something smarter in the long term.
+   from nodes.  Dense meshes can have hundreds of direct neighbours, so the table of
+   neighbours grows as needed.  Each node points at its own neighbour structure, so finding
+   it never needs a search.  A neighbour is forgotten again once all of its observations
+   have aged out, so nodes we only heard briefly (or SIDs that were never real) don't stay
+   in the table.
 */
-#define overlay_max_neighbours 128
 int overlay_neighbour_count=0;
-struct overlay_neighbour overlay_neighbours[overlay_max_neighbours];
+static int overlay_neighbour_alloc=0;
+static struct overlay_neighbour **overlay_neighbours=NULL;
+
+/* Nodes whose score will change at some known time, as their observations age, or which
+   have been marked dirty by a new observation and need recalculating now.  They are kept
+   in a binary min-heap ordered by that time, so the route alarm only ever looks at the
+   nodes that are due.  A node that is not queued has no observations left that could give
+   it a score, and anything that does give it one will queue it again.
+*/
+static int overlay_recalc_count=0;
+static int overlay_recalc_alloc=0;
+static overlay_node **overlay_recalc_queue=NULL; // overlay_recalc_queue[0] is unused
+
+/* Subscribers whose reachability has changed, which changes whether the observations they
+   reported count.  The nodes they reported are recalculated together, once the queue has
+   caught up, so that a lot of them changing at once doesn't sweep the queue for each one.
+*/
+static int overlay_changed_sender_count=0;
+static int overlay_changed_sender_alloc=0;
+static struct subscriber **overlay_changed_senders=NULL;
+
+static void overlay_route_tick(struct sched_ent *alarm);
+static struct profile_total route_tick_stats={
+  .name="overlay_route_tick",
+};
+static struct sched_ent route_tick_alarm={
+  .function=overlay_route_tick,
+  .stats=&route_tick_stats,
+};
 
 int overlay_route_recalc_node_metrics(overlay_node *n, time_ms_t now);
 int overlay_route_recalc_neighbour_metrics(struct overlay_neighbour *n, time_ms_t now);
@@ -279,33 +308,248 @@ int overlay_route_make_neighbour(overlay_node *n)
   if (!n) return WHY("n is NULL");
 
   /* If it is already a neighbour, then return */
-  if (n->neighbour_id) return 0;
-
-  /* It isn't yet a neighbour, so find or free a neighbour slot */
-  /* slot 0 is reserved, so skip it */
-  if (!overlay_neighbour_count) overlay_neighbour_count=1;
-  if (overlay_neighbour_count<overlay_max_neighbours) {
-    /* Use next free neighbour slot */
-    n->neighbour_id=overlay_neighbour_count++;
-  } else {
-    /* Evict an old neighbour */
-    int nid=1+random()%(overlay_max_neighbours-1);
-    if (overlay_neighbours[nid].node) overlay_neighbours[nid].node->neighbour_id=0;
-    n->neighbour_id=nid;
+  if (n->neighbour) return 0;
+
+  /* It isn't yet a neighbour, so make room for it in the table */
+  if (overlay_neighbour_count>=overlay_neighbour_alloc) {
+    int alloc = overlay_neighbour_alloc ? overlay_neighbour_alloc*2 : 32;
+    struct overlay_neighbour **table = realloc(overlay_neighbours, alloc*sizeof(struct overlay_neighbour *));
+    if (!table)
+      return WHY_perror("realloc");
+    overlay_neighbours=table;
+    overlay_neighbour_alloc=alloc;
   }
-  bzero(&overlay_neighbours[n->neighbour_id],sizeof(struct overlay_neighbour));
-  overlay_neighbours[n->neighbour_id].node=n;
+  struct overlay_neighbour *neighbour = emalloc_zero(sizeof(struct overlay_neighbour));
+  if (!neighbour)
+    return -1;
+  neighbour->node=n;
+  neighbour->table_index=overlay_neighbour_count;
+  overlay_neighbours[overlay_neighbour_count++]=neighbour;
+  n->neighbour=neighbour;
   
   return 0;
 }
 
+/* Stop treating the node as a direct neighbour, moving the last neighbour into its place in
+   the table */
+static void overlay_route_forget_neighbour(overlay_node *n)
+{
+  struct overlay_neighbour *neighbour=n->neighbour;
+  if (!neighbour)
+    return;
+  if (config.debug.overlayrouting)
+    DEBUGF("Forgetting neighbour %s", alloca_tohex_sid(n->subscriber->sid));
+  struct overlay_neighbour *last=overlay_neighbours[--overlay_neighbour_count];
+  overlay_neighbours[neighbour->table_index]=last;
+  last->table_index=neighbour->table_index;
+  n->neighbour=NULL;
+  free(neighbour);
+}
+
+static void overlay_recalc_set(int index, overlay_node *n)
+{
+  overlay_recalc_queue[index]=n;
+  n->recalc_index=index;
+}
+
+static void overlay_recalc_up(int index)
+{
+  overlay_node *n=overlay_recalc_queue[index];
+  while (index>1) {
+    overlay_node *parent=overlay_recalc_queue[index/2];
+    if (parent->recalc_at <= n->recalc_at)
+      break;
+    overlay_recalc_set(index, parent);
+    index/=2;
+  }
+  overlay_recalc_set(index, n);
+}
+
+static void overlay_recalc_down(int index)
+{
+  overlay_node *n=overlay_recalc_queue[index];
+  while (1) {
+    int child=index*2;
+    if (child>overlay_recalc_count)
+      break;
+    if (child<overlay_recalc_count 
+	&& overlay_recalc_queue[child+1]->recalc_at < overlay_recalc_queue[child]->recalc_at)
+      child++;
+    if (overlay_recalc_queue[child]->recalc_at >= n->recalc_at)
+      break;
+    overlay_recalc_set(index, overlay_recalc_queue[child]);
+    index=child;
+  }
+  overlay_recalc_set(index, n);
+}
+
+/* Queue the node to be recalculated at the given time, replacing any time it was queued for
+   before.  A time of zero takes it out of the queue. */
+static int overlay_route_requeue(overlay_node *n, time_ms_t when)
+{
+  if (!when) {
+    if (n->recalc_index) {
+      int index=n->recalc_index;
+      overlay_node *last=overlay_recalc_queue[overlay_recalc_count--];
+      n->recalc_index=0;
+      if (last!=n) {
+	overlay_recalc_set(index, last);
+	overlay_recalc_up(index);
+	overlay_recalc_down(last->recalc_index);
+      }
+    }
+    return 0;
+  }
+  if (n->recalc_index) {
+    time_ms_t was=n->recalc_at;
+    n->recalc_at=when;
+    if (when<was)
+      overlay_recalc_up(n->recalc_index);
+    else
+      overlay_recalc_down(n->recalc_index);
+    return 0;
+  }
+  if (overlay_recalc_count+1>=overlay_recalc_alloc) {
+    int alloc = overlay_recalc_alloc ? overlay_recalc_alloc*2 : 64;
+    overlay_node **queue = realloc(overlay_recalc_queue, alloc*sizeof(overlay_node *));
+    if (!queue)
+      return WHY_perror("realloc");
+    overlay_recalc_queue=queue;
+    overlay_recalc_alloc=alloc;
+  }
+  n->recalc_at=when;
+  overlay_recalc_set(++overlay_recalc_count, n);
+  overlay_recalc_up(overlay_recalc_count);
+  return 0;
+}
+
+/* Make sure the node is recalculated no later than the given time */
+static int overlay_route_mark_dirty(overlay_node *n, time_ms_t when)
+{
+  if (n->recalc_index && n->recalc_at<=when)
+    return 0;
+  return overlay_route_requeue(n, when);
+}
+
+/* Make sure the route alarm goes off when the first queued node is due, or straight away
+   if there are nodes to recalculate for senders that have changed */
+static void overlay_route_schedule_tick()
+{
+  time_ms_t when;
+  if (overlay_changed_sender_count)
+    when=gettime_ms();
+  else if (overlay_recalc_count)
+    when=overlay_recalc_queue[1]->recalc_at;
+  else {
+    unschedule(&route_tick_alarm);
+    return;
+  }
+  if (is_scheduled(&route_tick_alarm)) {
+    if (route_tick_alarm.alarm<=when && (overlay_changed_sender_count || route_tick_alarm.alarm==when))
+      return;
+    unschedule(&route_tick_alarm);
+  }
+  route_tick_alarm.alarm=when;
+  route_tick_alarm.deadline=when+100;
+  schedule(&route_tick_alarm);
+}
+
+/* The score an observation gives, discounted by a point for every second since we heard it */
+static int overlay_route_observation_score(const overlay_node_observation *ob, time_ms_t now)
+{
+  int score=ob->observed_score - (now - ob->rx_time)/1000;
+  return score<0 ? 0 : score;
+}
+
+/* The node's score as it stands now.  A score learnt from an observation decays as that
+   observation ages, but it stays the best observation until it expires, so there is no need
+   to recalculate the node every second to keep up. */
+int overlay_route_node_score(overlay_node *n, time_ms_t now)
+{
+  if (!n->best_link_score || n->best_observation<0)
+    return n->best_link_score;
+  return overlay_route_observation_score(&n->observations[n->best_observation], now);
+}
+
+/* When will recalculating this node's score next give a different answer, without some new
+   observation arriving first?  0 if it never will. */
+static time_ms_t overlay_route_next_change(overlay_node *n, time_ms_t now)
+{
+  time_ms_t next=0;
+  if (n->neighbour && n->neighbour->next_metric_change) {
+    next=n->neighbour->next_metric_change;
+    // neighbour scores are not recalculated more than once every half second
+    if (next < n->neighbour->last_metric_update+500)
+      next = n->neighbour->last_metric_update+500;
+  }
+  int i;
+  for(i=0;i<OVERLAY_MAX_OBSERVATIONS;i++) {
+    if (!n->observations[i].observed_score)
+      continue;
+    time_ms_t expires = n->observations[i].rx_time + n->observations[i].observed_score*1000;
+    if (expires>now && (!next || expires<next))
+      next=expires;
+  }
+  return next;
+}
+
+static int overlay_route_sender_usable(int reachable)
+{
+  return (reachable&REACHABLE) && !(reachable&REACHABLE_ASSUMED);
+}
+
+/* Called whenever a subscriber's reachability changes, by us or anyone else */
+void overlay_route_reachable_changed(struct subscriber *subscriber, int old_value)
+{
+  // check anything we didn't work out for ourselves against our own observations, in time
+  if (subscriber->node && subscriber->reachable!=REACHABLE_SELF)
+    overlay_route_mark_dirty(subscriber->node, gettime_ms()+OVERLAY_ROUTE_RECHECK_MS);
+  
+  // observations reported by this subscriber only count while we can reach it
+  if (subscriber->route_reports && !subscriber->route_reports_changed
+      && overlay_route_sender_usable(old_value)!=overlay_route_sender_usable(subscriber->reachable)) {
+    if (overlay_changed_sender_count>=overlay_changed_sender_alloc) {
+      int alloc = overlay_changed_sender_alloc ? overlay_changed_sender_alloc*2 : 16;
+      struct subscriber **senders = realloc(overlay_changed_senders, alloc*sizeof(struct subscriber *));
+      if (!senders) {
+	WHY_perror("realloc");
+	return;
+      }
+      overlay_changed_senders=senders;
+      overlay_changed_sender_alloc=alloc;
+    }
+    overlay_changed_senders[overlay_changed_sender_count++]=subscriber;
+    subscriber->route_reports_changed=1;
+  }
+  overlay_route_schedule_tick();
+}
+
+/* Mark every node reported by a sender whose reachability has changed as dirty.  Any node
+   with a live observation is queued.  Marking one dirty only moves it towards the front of
+   the queue, past nodes we have already looked at, so each node is looked at once. */
+static void overlay_route_mark_reported(time_ms_t now)
+{
+  int i, o;
+  for (i=1;i<=overlay_recalc_count;i++) {
+    overlay_node *n=overlay_recalc_queue[i];
+    for (o=0;o<OVERLAY_MAX_OBSERVATIONS;o++)
+      if (n->observations[o].observed_score && n->observations[o].sender->route_reports_changed) {
+	overlay_route_mark_dirty(n, now);
+	break;
+      }
+  }
+  for (i=0;i<overlay_changed_sender_count;i++)
+    overlay_changed_senders[i]->route_reports_changed=0;
+  overlay_changed_sender_count=0;
+}
+
 struct overlay_neighbour *overlay_route_get_neighbour_structure(overlay_node *node, int createP)
 {
   if (!node)
     return NULL;
   
   /* Check if node is already a neighbour, or if not, make it one */
-  if (!node->neighbour_id){
+  if (!node->neighbour){
     if (!createP)
       return NULL;
     
@@ -314,7 +558,7 @@ struct overlay_neighbour *overlay_route_get_neighbour_structure(overlay_node *no
   }
 
   /* Get neighbour structure */
-  return &overlay_neighbours[node->neighbour_id];
+  return node->neighbour;
 }
 
 int overlay_route_node_can_hear_me(struct subscriber *subscriber, int sender_interface,
@@ -371,6 +615,7 @@ int overlay_route_node_can_hear_me(struct subscriber *subscriber, int sender_int
   /* Update reachability metrics for node */
   if (overlay_route_recalc_neighbour_metrics(neh,now))
     return -1;
+  overlay_route_schedule_tick();
 
   if (config.debug.overlayroutemonitor) overlay_route_dump();
   return 0;
@@ -393,13 +638,10 @@ int overlay_route_recalc_node_metrics(overlay_node *n, time_ms_t now)
     interface=n->subscriber->interface;
   }
   
-  if (n->neighbour_id)
+  if (n->neighbour)
   {
     /* Node is also a direct neighbour, so check score that way */
-    if (n->neighbour_id>overlay_max_neighbours||n->neighbour_id<0)
-      return WHY("n->neighbour_id is invalid.");
-    
-    struct overlay_neighbour *neighbour=&overlay_neighbours[n->neighbour_id];
+    struct overlay_neighbour *neighbour=n->neighbour;
     
     int i;
     for(i=0;i<overlay_interface_count;i++)
@@ -425,9 +667,7 @@ int overlay_route_recalc_node_metrics(overlay_node *n, time_ms_t now)
 	if (n->observations[o].observed_score && n->observations[o].sender->reachable&REACHABLE
 	    && !(n->observations[o].sender->reachable&REACHABLE_ASSUMED))
 	  {
-	    int discounted_score=n->observations[o].observed_score;
-	    discounted_score-=(now-n->observations[o].rx_time)/1000;
-	    if (discounted_score<0) discounted_score=0;
+	    int discounted_score=overlay_route_observation_score(&n->observations[o], now);
 	    n->observations[o].corrected_score=discounted_score;
 	    if (discounted_score>best_score)  {
 	      best_score=discounted_score;
@@ -476,7 +716,7 @@ int overlay_route_recalc_node_metrics(overlay_node *n, time_ms_t now)
     overlay_route_please_advertise(n);
   }
   
-  return 0;
+  return overlay_route_requeue(n, overlay_route_next_change(n, now));
 }
 
 /* Recalculate node reachability metric, but only for directly connected nodes,
@@ -529,6 +769,7 @@ int overlay_route_recalc_neighbour_metrics(struct overlay_neighbour *n, time_ms_
   /* Somewhere to remember how many milliseconds we have seen */
   int ms_observed_5sec[OVERLAY_MAX_INTERFACES];
   int ms_observed_200sec[OVERLAY_MAX_INTERFACES];
+  time_ms_t next_change=0;
   for(i=0;i<OVERLAY_MAX_INTERFACES;i++) {
     ms_observed_5sec[i]=0;
     ms_observed_200sec[i]=0;
@@ -581,10 +822,17 @@ int overlay_route_recalc_neighbour_metrics(struct overlay_neighbour *n, time_ms_
     if (obs_age<=short_interval){
       ms_observed_5sec[interface_number]+=(interval>short_interval?short_interval:interval);
     }
+    
+    /* The scores will change again once this observation falls out of the window */
+    time_ms_t change=n->observations[i].time_ms + (obs_age<=short_interval?short_interval:long_interval) + 1;
+    if (!next_change || change<next_change)
+      next_change=change;
 
     if (n->observations[i].time_ms>most_recent_observation) most_recent_observation=n->observations[i].time_ms;
   }
 
+  n->next_metric_change=next_change;
+
   /* From the sum of observations calculate the metrics.
      We want the score to climb quickly and then plateu.
   */
@@ -624,7 +872,7 @@ int overlay_route_recalc_neighbour_metrics(struct overlay_neighbour *n, time_ms_
       DEBUGF("Neighbour score on interface #%d = %d (observations for %dms)",i,score,ms_observed_200sec[i]);
   }
   if (scoreChanged)
-    overlay_route_recalc_node_metrics(n->node, now);
+    overlay_route_mark_dirty(n->node, now);
   
   RETURN(0);
   OUT();
@@ -685,7 +933,8 @@ int overlay_route_record_link(time_ms_t now, struct subscriber *to,
 	score, gateways_en_route
       );
  
-  if (sender_interface>OVERLAY_MAX_INTERFACES || score == 0) {
+  // observed_score is a byte, and zero marks an empty slot
+  if (sender_interface>OVERLAY_MAX_INTERFACES || score <= 0 || score > 255) {
     if (config.debug.overlayrouting)
       DEBUG("invalid report");
     RETURN(0);
@@ -726,6 +975,13 @@ int overlay_route_record_link(time_ms_t now, struct subscriber *to,
 	);
   }
 
+  /* route_reports counts the live observations reported by each sender, so it only changes when
+     this slot starts holding a report from a different sender */
+  if (!n->observations[slot].observed_score || n->observations[slot].sender != via) {
+    if (n->observations[slot].observed_score && n->observations[slot].sender)
+      n->observations[slot].sender->route_reports--;
+    via->route_reports++;
+  }
   n->observations[slot].observed_score=0;
   n->observations[slot].gateways_en_route=gateways_en_route;
   n->observations[slot].rx_time=now;
@@ -746,7 +1002,10 @@ int overlay_route_record_link(time_ms_t now, struct subscriber *to,
   if (s2>n->last_first_hand_observation_time_millisec)
     n->last_first_hand_observation_time_millisec=s2;
 
-  overlay_route_recalc_node_metrics(n,now);
+  /* Lots of links usually arrive together in one advertisement, and a node may be in
+     several of them, so recalculate it once they have all been recorded */
+  overlay_route_mark_dirty(n,now);
+  overlay_route_schedule_tick();
   
   if (config.debug.overlayroutemonitor)
     overlay_route_dump();
@@ -804,17 +1063,17 @@ int overlay_route_dump()
   strbuf_reset(b);
   strbuf_sprintf(b,"\nOverlay Neighbour Table\n------------------------\n");
   for(n=0;n<overlay_neighbour_count;n++)
-    if (overlay_neighbours[n].node)
-      {
-	strbuf_sprintf(b,"  %s* : %lldms ago :",
-		alloca_tohex(overlay_neighbours[n].node->subscriber->sid, 7),
-		(long long)(now - overlay_neighbours[n].last_observation_time_ms));
-	for(i=0;i<OVERLAY_MAX_INTERFACES;i++)
-	  if (overlay_neighbours[n].scores[i]) 
-	    strbuf_sprintf(b," %d(via #%d)",
-		    overlay_neighbours[n].scores[i],i);
-	strbuf_sprintf(b,"\n");
-      }
+    {
+      struct overlay_neighbour *neighbour=overlay_neighbours[n];
+      strbuf_sprintf(b,"  %s* : %lldms ago :",
+	      alloca_tohex(neighbour->node->subscriber->sid, 7),
+	      (long long)(now - neighbour->last_observation_time_ms));
+      for(i=0;i<OVERLAY_MAX_INTERFACES;i++)
+	if (neighbour->scores[i]) 
+	  strbuf_sprintf(b," %d(via #%d)",
+		  neighbour->scores[i],i);
+      strbuf_sprintf(b,"\n");
+    }
   DEBUG(strbuf_str(b));
   
   strbuf_reset(b);
@@ -826,52 +1085,46 @@ int overlay_route_dump()
   return 0;
 }
 
-/* Ticking neighbours is easy; we just pretend we have heard from them again,
-   and recalculate the score that way, which already includes a mechanism for
-   taking into account the age of the most recent observation */
-int overlay_route_tick_neighbour(int neighbour_id, time_ms_t now)
+/* Recalculate the nodes that are due, giving up once we have spent budget_ns (if not zero).
+   Neighbours are ticked by pretending we have heard from them again, and recalculating
+   their score that way, which already takes into account the age of the most recent
+   observation.  Returns the number of nodes recalculated. */
+static int overlay_route_recalc_due(time_ms_t now, time_ns_t budget_ns)
 {
-  if (neighbour_id>0 && overlay_neighbours[neighbour_id].node)
-    if (overlay_route_recalc_neighbour_metrics(&overlay_neighbours[neighbour_id],now)) 
-      WHY("overlay_route_recalc_neighbour_metrics() failed");
+  time_ns_t start = gettime_ns();
+  int recalculated = 0;
   
-  return 0;
-}
-
-/* Updating the route score to get to a node it trickier, as they might not be a
-   neighbour.  Even if they are a neighbour, all we have to go on is the node's
-   observations.
-   From these we can work out a discounted score based on their age.
-
-   XXX This is where the discounting should be modified for nodes that are 
-   updated less often as they exhibit score stability.  Actually, for the
-   most part we can tolerate these without any special action, as their high
-   scores will keep them reachable for longer anyway.
-*/
-int overlay_route_tick_node(struct subscriber *subscriber, void *context)
-{
-  if (subscriber->node)
-    overlay_route_recalc_node_metrics(subscriber->node, gettime_ms());
-  return 0;
+  while (1) {
+    if (!overlay_recalc_count || overlay_recalc_queue[1]->recalc_at > now) {
+      /* Now we have caught up, recalculate everything reported by senders that have
+         changed in the meantime */
+      if (!overlay_changed_sender_count)
+	break;
+      overlay_route_mark_reported(now);
+      continue;
+    }
+    overlay_node *n = overlay_recalc_queue[1];
+    if (n->neighbour) {
+      if (overlay_route_recalc_neighbour_metrics(n->neighbour, now))
+	WHY("overlay_route_recalc_neighbour_metrics() failed");
+      // no observation still counts towards its scores, so it has dropped off the network
+      else if (!n->neighbour->next_metric_change)
+	overlay_route_forget_neighbour(n);
+    }
+    // always requeues the node for some time after now, or takes it out of the queue
+    if (overlay_route_recalc_node_metrics(n, now))
+      overlay_route_requeue(n, 0);
+    recalculated++;
+    if (budget_ns && gettime_ns() - start >= budget_ns)
+      break;
+  }
+  return recalculated;
 }
 
-void overlay_route_tick(struct sched_ent *alarm)
+static void overlay_route_tick(struct sched_ent *alarm)
 {
-  int n;
-  time_ms_t now = gettime_ms();
-  
-  /* Go through some of neighbour list */
-  for (n=0;n<overlay_max_neighbours;n++)
-    overlay_route_tick_neighbour(n,now);
-  
-  /* Go through the node list */
-  enum_subscribers(NULL, overlay_route_tick_node, NULL);
-  
-  /* Update callback interval based on how much work we have to do */
-  alarm->alarm = gettime_ms()+5000;
-  alarm->deadline = alarm->alarm+100;
-  schedule(alarm);
-  return;
+  overlay_route_recalc_due(gettime_ms(), OVERLAY_ROUTE_RECALC_BUDGET_NS);
+  overlay_route_schedule_tick();
 }
 
 int overlay_route_node_info(overlay_mdp_nodeinfo *node_info)
@@ -924,16 +1177,16 @@ int overlay_route_node_info(overlay_mdp_nodeinfo *node_info)
     bcopy(subscriber->sid,
 	  node_info->sid,SID_SIZE);
     
-    if (subscriber->node->neighbour_id){
-      int n = subscriber->node->neighbour_id;
+    if (subscriber->node->neighbour){
+      struct overlay_neighbour *neighbour = subscriber->node->neighbour;
       node_info->neighbourP=1;
-      node_info->time_since_last_observation = now - overlay_neighbours[n].last_observation_time_ms;
+      node_info->time_since_last_observation = now - neighbour->last_observation_time_ms;
       
       int i;
       for(i=0;i<OVERLAY_MAX_INTERFACES;i++)
-	if (overlay_neighbours[n].scores[i]>node_info->score)
+	if (neighbour->scores[i]>node_info->score)
 	{
-	  node_info->score=overlay_neighbours[n].scores[i];
+	  node_info->score=neighbour->scores[i];
 	  node_info->interface_number=i;
 	}
       
@@ -946,8 +1199,10 @@ int overlay_route_node_info(overlay_mdp_nodeinfo *node_info)
 	{
 	  overlay_node_observation *ob
 	  =&node->observations[o];
-	  if (ob->corrected_score>node_info->score) {
-	    node_info->score=ob->corrected_score;
+	  // only observations that counted when we last recalculated, but as they stand now
+	  int score=ob->corrected_score?overlay_route_observation_score(ob, now):0;
+	  if (score>node_info->score) {
+	    node_info->score=score;
 	  }
 	  if (node_info->time_since_last_observation == -1 || now - ob->rx_time < node_info->time_since_last_observation)
 	    node_info->time_since_last_observation = now - ob->rx_time;
@@ -957,3 +1212,90 @@ int overlay_route_node_info(overlay_mdp_nodeinfo *node_info)
 
   return 0;
 }
+
+/* Fill the routing table with simulated nodes, a quarter of them direct neighbours heard on
+   one interface and the rest reported by those neighbours, then tick it through five minutes
+   of simulated time, as the nodes' scores decay and they become unreachable.  Only the
+   nodes whose scores have changed since the last tick should need recalculating.
+ */
+int app_route_test(const struct cli_parsed *parsed, void *context)
+{
+  if (config.debug.verbose)
+    DEBUG_cli_parsed(parsed);
+  const char *arg;
+  if (cli_arg(parsed, "count", &arg, cli_uint, "0") == -1)
+    return -1;
+  int sizes[] = { 100, 1000, 10000 };
+  int size_count = sizeof sizes / sizeof sizes[0];
+  if (atoi(arg) > 0) {
+    sizes[0] = atoi(arg);
+    size_count = 1;
+  }
+  
+  // pretend we have an interface up, which the neighbours are heard on
+  overlay_interface *interface = &overlay_interfaces[0];
+  if (overlay_interface_count < 1)
+    overlay_interface_count = 1;
+  strcpy(interface->name, "test");
+  interface->state = INTERFACE_STATE_UP;
+  interface->tick_ms = 500;
+  
+  time_ms_t now = gettime_ms();
+  int s;
+  for (s = 0; s < size_count; s++) {
+    int count = sizes[s];
+    int neighbours = count / 4 ? count / 4 : 1;
+    struct subscriber **subscribers = emalloc(count * sizeof(struct subscriber *));
+    if (!subscribers)
+      return -1;
+    int i;
+    for (i = 0; i < count; i++) {
+      unsigned char sid[SID_SIZE];
+      urandombytes(sid, sizeof sid);
+      if ((subscribers[i] = find_subscriber(sid, SID_SIZE, 1)) == NULL) {
+	free(subscribers);
+	return WHY("Could not create subscriber");
+      }
+      // we can't really ask simulated nodes for their signing keys
+      subscribers[i]->sas_valid = 1;
+    }
+    
+    printf("Benchmarking routing table of %d nodes, %d of them neighbours:\n", count, neighbours);
+    time_ns_t start = gettime_ns();
+    for (i = 0; i < neighbours; i++)
+      overlay_route_node_can_hear_me(subscribers[i], 0, now - 1000, now, now);
+    for (; i < count; i++)
+      overlay_route_record_link(now, subscribers[i], subscribers[random() % neighbours], 0,
+				now - 1000, now, 200, 1);
+    time_ns_t end = gettime_ns();
+    printf("filled in %.3fms\n", (end - start) / 1e6);
+    start = gettime_ns();
+    int recalculated = overlay_route_recalc_due(now, 0);
+    end = gettime_ns();
+    int reachable = 0;
+    for (i = 0; i < count; i++)
+      if (subscribers[i]->reachable & REACHABLE)
+	reachable++;
+    printf("first recalculation - %.3fms, %d nodes recalculated, %d nodes reachable\n",
+	   (end - start) / 1e6, recalculated, reachable);
+    
+    // one tick every five seconds, for five minutes
+    int tick;
+    for (tick = 1; tick <= 60; tick++) {
+      now += 5000;
+      start = gettime_ns();
+      recalculated = overlay_route_recalc_due(now, 0);
+      end = gettime_ns();
+      if (tick == 1 || tick % 10 == 0) {
+	reachable = 0;
+	for (i = 0; i < count; i++)
+	  if (subscribers[i]->reachable & REACHABLE)
+	    reachable++;
+	printf("tick at %3ds - %.3fms, %d nodes recalculated, %d nodes reachable\n",
+	       tick * 5, (end - start) / 1e6, recalculated, reachable);
+      }
+    }
+    free(subscribers);
+  }
+  return 0;
+}
@@ -19,15 +19,90 @@
 
 #include "serval.h"
 #include "conf.h"
+#include "rhizome.h"
 
 struct profile_total *stats_head=NULL;
 struct call_stats *current_call=NULL;
+// when the stats were last cleared
+time_ms_t stats_since=0;
+
+// what each pass through fd_poll() did after it woke up
+struct poll_loop_stats{
+  int iterations;
+  int idle_iterations;
+  int fds_serviced;
+  int max_fds_serviced;
+  int alarms_run;
+  int max_alarms_run;
+  int budget_overruns;
+};
+static struct poll_loop_stats loop_stats;
+
+void fd_tally_loop(int ready, int alarms_run, int overrun)
+{
+  loop_stats.iterations++;
+  if (ready==0 && alarms_run==0)
+    loop_stats.idle_iterations++;
+  loop_stats.fds_serviced+=ready;
+  if (ready>loop_stats.max_fds_serviced)
+    loop_stats.max_fds_serviced=ready;
+  loop_stats.alarms_run+=alarms_run;
+  if (alarms_run>loop_stats.max_alarms_run)
+    loop_stats.max_alarms_run=alarms_run;
+  if (overrun)
+    loop_stats.budget_overruns++;
+}
 
 void fd_clearstat(struct profile_total *s){
   s->max_time = 0;
   s->total_time = 0;
   s->child_time = 0;
   s->calls = 0;
+  bzero(s->histogram, sizeof s->histogram);
+}
+
+// the histogram bucket for a call that took this many nanoseconds
+static int histogram_bucket(time_ns_t elapsed)
+{
+  if (elapsed < 4)
+    return elapsed < 0 ? 0 : elapsed;
+  int power;
+#ifdef __GNUC__
+  power = 63 - __builtin_clzll(elapsed);
+#else
+  for (power = 2; elapsed >> (power + 1); power++)
+    ;
+#endif
+  int bucket = (power - 1) * 4 + ((elapsed >> (power - 2)) & 3);
+  return bucket < PROFILE_HISTOGRAM_BUCKETS ? bucket : PROFILE_HISTOGRAM_BUCKETS - 1;
+}
+
+// the longest time that would be counted in a histogram bucket
+static time_ns_t histogram_bucket_limit(int bucket)
+{
+  if (bucket < 4)
+    return bucket;
+  int power = bucket / 4 + 1;
+  return ((4LL + (bucket & 3) + 1) << (power - 2)) - 1;
+}
+
+/* Estimate the time within which the given percentage of calls completed, from the histogram.
+   The answer is the upper bound of the bucket holding that call, so is at most 25% high. */
+time_ns_t fd_stat_percentile(const struct profile_total *s, int percent)
+{
+  if (s->calls <= 0)
+    return 0;
+  long long wanted = ((long long)s->calls * percent + 99) / 100;
+  long long count = 0;
+  int i;
+  for (i = 0; i < PROFILE_HISTOGRAM_BUCKETS; i++) {
+    count += s->histogram[i];
+    if (count >= wanted) {
+      time_ns_t limit = histogram_bucket_limit(i);
+      return limit < s->max_time ? limit : s->max_time;
+    }
+  }
+  return s->max_time;
 }
 
 int fd_tallystats(struct profile_total *total,struct profile_total *a)
@@ -35,18 +110,24 @@ int fd_tallystats(struct profile_total *total,struct profile_total *a)
   total->total_time+=a->total_time;
   total->calls+=a->calls;
   if (a->max_time>total->max_time) total->max_time=a->max_time;
+  int i;
+  for (i = 0; i < PROFILE_HISTOGRAM_BUCKETS; i++)
+    total->histogram[i]+=a->histogram[i];
   return 0;
 }
 
 int fd_showstat(struct profile_total *total, struct profile_total *a)
 {
-  INFOF("%lldms (%2.1f%%) in %d calls (max %lldms, avg %.1fms, +child avg %.1fms) : %s",
-       (long long) a->total_time,
+  INFOF("%.3fms (%2.1f%%) in %d calls (max %.3fms, avg %.3fms, +child avg %.3fms, p50 %.3fms, p90 %.3fms, p99 %.3fms) : %s",
+       a->total_time / 1e6,
        a->total_time*100.0/total->total_time,
        a->calls,
-       (long long) a->max_time,
-       a->total_time*1.00/a->calls,
-       (a->total_time+a->child_time)*1.00/a->calls,
+       a->max_time / 1e6,
+       a->total_time / 1e6 / a->calls,
+       (a->total_time+a->child_time) / 1e6 / a->calls,
+       fd_stat_percentile(a, 50) / 1e6,
+       fd_stat_percentile(a, 90) / 1e6,
+       fd_stat_percentile(a, 99) / 1e6,
        a->name);
   return 0;
 }
@@ -133,6 +214,10 @@ int fd_clearstats()
     fd_clearstat(stats);
     stats = stats->_next;
   }
+  bzero(&loop_stats, sizeof loop_stats);
+  sqlite_clearstats();
+  keyring_nm_clearstats();
+  stats_since = gettime_ms();
   return 0;
 }
 
@@ -170,7 +255,7 @@ int fd_showstats()
       while(stats!=NULL){
 	/* If a function spends more than 1 second in any 
 	   notionally 3 second period, then dob on it */
-	if (stats->total_time>1000
+	if (stats->total_time>1000000000LL
 	    &&strcmp(stats->name,"Idle (in poll)"))
 	  fd_showstat(&total,stats);
 	stats = stats->_next;
@@ -186,6 +271,19 @@ int fd_showstats()
       stats = stats->_next;
     }    
     fd_showstat(&total,&total);
+    if (loop_stats.iterations)
+      INFOF("%d poll iterations (%d idle) : %d file handles serviced (max %d, avg %.1f), %d alarms run (max %d, avg %.1f), %d alarm budget overruns",
+	    loop_stats.iterations,
+	    loop_stats.idle_iterations,
+	    loop_stats.fds_serviced,
+	    loop_stats.max_fds_serviced,
+	    loop_stats.fds_serviced*1.0/loop_stats.iterations,
+	    loop_stats.alarms_run,
+	    loop_stats.max_alarms_run,
+	    loop_stats.alarms_run*1.0/loop_stats.iterations,
+	    loop_stats.budget_overruns);
+    sqlite_showstats();
+    keyring_nm_showstats();
   }
   
   return 0;
@@ -216,7 +314,7 @@ int fd_func_enter(struct __sourceloc __whence, struct call_stats *this_call)
     DEBUGF("%s called from %s() %s:%d",
 	   __FUNCTION__,__whence.function,__whence.file,__whence.line); 
  
-  this_call->enter_time=gettime_ms();
+  this_call->enter_time=gettime_ns();
   this_call->child_time=0;
   this_call->prev = current_call;
   current_call = this_call;
@@ -236,8 +334,8 @@ int fd_func_exit(struct __sourceloc __whence, struct call_stats *this_call)
   if (current_call != this_call)
     FATAL("performance timing stack trace corrupted");
   
-  time_ms_t now = gettime_ms();
-  time_ms_t elapsed = now - this_call->enter_time;
+  time_ns_t now = gettime_ns();
+  time_ns_t elapsed = now - this_call->enter_time;
   current_call = this_call->prev;
   
   if (this_call->totals && !this_call->totals->_initialised){
@@ -256,6 +354,7 @@ int fd_func_exit(struct __sourceloc __whence, struct call_stats *this_call)
     this_call->totals->total_time+=elapsed;
     this_call->totals->child_time+=this_call->child_time;
     this_call->totals->calls++;
+    this_call->totals->histogram[histogram_bucket(elapsed)]++;
     
     if (elapsed>this_call->totals->max_time) this_call->totals->max_time=elapsed;
   }
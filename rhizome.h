@@ -95,6 +95,24 @@ typedef struct rhizome_signature {
 
 #define MAX_MANIFEST_VARS 256
 #define MAX_MANIFEST_BYTES 8192
+
+/* Manifest fields that are decoded as soon as they are read or set, so that looking them up
+   doesn't have to search the variable list. */
+enum rhizome_manifest_field {
+  RHIZOME_FIELD_ID,
+  RHIZOME_FIELD_VERSION,
+  RHIZOME_FIELD_FILESIZE,
+  RHIZOME_FIELD_FILEHASH,
+  RHIZOME_FIELD_SERVICE,
+  RHIZOME_FIELD_SENDER,
+  RHIZOME_FIELD_RECIPIENT,
+  RHIZOME_FIELD_DATE,
+  RHIZOME_FIELD_NAME,
+  RHIZOME_FIELD_BK,
+  RHIZOME_FIELD_CRYPT,
+  RHIZOME_FIELD_COUNT
+};
+
 typedef struct rhizome_manifest {
   int manifest_record_number;
   int manifest_bytes;
@@ -113,6 +131,23 @@ typedef struct rhizome_manifest {
   char *vars[MAX_MANIFEST_VARS];
   char *values[MAX_MANIFEST_VARS];
 
+  /* One more than the index in vars[] of each well known field, or zero if it is absent */
+  unsigned short field_index[RHIZOME_FIELD_COUNT];
+  /* Bit f is set if the value of field f is a decimal number, which is kept in field_ll[f] */
+  unsigned int field_ll_valid;
+  long long field_ll[RHIZOME_FIELD_COUNT];
+  /* The sender and recipient fields in binary, if they are valid subscriber ids */
+  int have_sender;
+  int have_recipient;
+  unsigned char sender[SID_SIZE];
+  unsigned char recipient[SID_SIZE];
+  /* Indexes in vars[] of all the other fields, which are found by searching this list */
+  int unknown_count;
+  unsigned short unknown_vars[MAX_MANIFEST_VARS];
+  /* The names and values of the fields read from the manifest text point into this copy of it,
+     those set afterwards are allocated separately */
+  char fieldtext[MAX_MANIFEST_BYTES + 1];
+
   int sig_count;
   /* Parties who have signed this manifest (raw byte format) */
   unsigned char *signatories[MAX_MANIFEST_VARS];
@@ -243,6 +278,7 @@ int rhizome_read_manifest_file(rhizome_manifest *m, const char *filename, int bu
 int rhizome_hash_file(rhizome_manifest *m, const char *filename,char *hash_out);
 char *rhizome_manifest_get(const rhizome_manifest *m, const char *var, char *out, int maxlen);
 long long  rhizome_manifest_get_ll(rhizome_manifest *m, const char *var);
+const unsigned char *rhizome_manifest_get_sid(const rhizome_manifest *m, const char *var);
 int rhizome_manifest_set_ll(rhizome_manifest *m,char *var,long long value);
 int rhizome_manifest_set(rhizome_manifest *m, const char *var, const char *value);
 int rhizome_manifest_del(rhizome_manifest *m, const char *var);
@@ -288,6 +324,10 @@ int is_debug_rhizome_ads();
 
 sqlite3_stmt *_sqlite_prepare(struct __sourceloc, sqlite_retry_state *retry, const char *sqlformat, ...);
 sqlite3_stmt *_sqlite_prepare_loglevel(struct __sourceloc, int log_level, sqlite_retry_state *retry, strbuf stmt);
+sqlite3_stmt *_sqlite_prepare_cached(struct __sourceloc, sqlite_retry_state *retry, const char *sql);
+void _sqlite_release(struct __sourceloc, sqlite3_stmt *statement);
+void sqlite_showstats();
+void sqlite_clearstats();
 int _sqlite_retry(struct __sourceloc, sqlite_retry_state *retry, const char *action);
 void _sqlite_retry_done(struct __sourceloc, sqlite_retry_state *retry, const char *action);
 int _sqlite_step_retry(struct __sourceloc, int log_level, sqlite_retry_state *retry, sqlite3_stmt *statement);
@@ -297,12 +337,16 @@ int _sqlite_exec_void_retry(struct __sourceloc, sqlite_retry_state *retry, const
 int _sqlite_exec_void_retry_loglevel(struct __sourceloc, int log_level, sqlite_retry_state *retry, const char *sqlformat, ...);
 int _sqlite_exec_int64(struct __sourceloc, long long *result, const char *sqlformat, ...);
 int _sqlite_exec_int64_retry(struct __sourceloc, sqlite_retry_state *retry, long long *result, const char *sqlformat, ...);
+int _sqlite_exec_int64_prepared(struct __sourceloc, sqlite_retry_state *retry, long long *result, sqlite3_stmt *statement);
 int _sqlite_exec_strbuf(struct __sourceloc, strbuf sb, const char *sqlformat, ...);
 int _sqlite_exec_strbuf_retry(struct __sourceloc, sqlite_retry_state *retry, strbuf sb, const char *sqlformat, ...);
 int _sqlite_vexec_strbuf_retry(struct __sourceloc, sqlite_retry_state *retry, strbuf sb, const char *sqlformat, va_list ap);
+int _sqlite_exec_strbuf_prepared(struct __sourceloc, sqlite_retry_state *retry, strbuf sb, sqlite3_stmt *statement);
 
 #define sqlite_prepare(rs,fmt,...)              _sqlite_prepare(__WHENCE__, (rs), (fmt), ##__VA_ARGS__)
 #define sqlite_prepare_loglevel(ll,rs,sb)       _sqlite_prepare_loglevel(__WHENCE__, (ll), (rs), (sb))
+#define sqlite_prepare_cached(rs,sql)           _sqlite_prepare_cached(__WHENCE__, (rs), (sql))
+#define sqlite_release(stmt)                    _sqlite_release(__WHENCE__, (stmt))
 #define sqlite_retry(rs,action)                 _sqlite_retry(__WHENCE__, (rs), (action))
 #define sqlite_retry_done(rs,action)            _sqlite_retry_done(__WHENCE__, (rs), (action))
 #define sqlite_step(stmt)                       _sqlite_step_retry(__WHENCE__, LOG_LEVEL_ERROR, NULL, (stmt))
@@ -313,11 +357,28 @@ int _sqlite_vexec_strbuf_retry(struct __sourceloc, sqlite_retry_state *retry, st
 #define sqlite_exec_void_retry_loglevel(ll,rs,fmt,...) _sqlite_exec_void_retry_loglevel(__WHENCE__, (ll), (rs), (fmt), ##__VA_ARGS__)
 #define sqlite_exec_int64(res,fmt,...)          _sqlite_exec_int64(__WHENCE__, (res), (fmt), ##__VA_ARGS__)
 #define sqlite_exec_int64_retry(rs,res,fmt,...) _sqlite_exec_int64_retry(__WHENCE__, (rs), (res), (fmt), ##__VA_ARGS__)
+#define sqlite_exec_int64_prepared(rs,res,stmt) _sqlite_exec_int64_prepared(__WHENCE__, (rs), (res), (stmt))
 #define sqlite_exec_strbuf(sb,fmt,...)          _sqlite_exec_strbuf(__WHENCE__, (sb), (fmt), ##__VA_ARGS__)
 #define sqlite_exec_strbuf_retry(rs,sb,fmt,...) _sqlite_exec_strbuf_retry(__WHENCE__, (rs), (sb), (fmt), ##__VA_ARGS__)
+#define sqlite_exec_strbuf_prepared(rs,sb,stmt) _sqlite_exec_strbuf_prepared(__WHENCE__, (rs), (sb), (stmt))
 
 double rhizome_manifest_get_double(rhizome_manifest *m,char *var,double default_value);
 int rhizome_manifest_extract_signature(rhizome_manifest *m,int *ofs);
+int rhizome_manifest_lookup_signature_validity(unsigned char *hash,unsigned char *sig,int sig_len);
+void rhizome_signature_cache_clear();
+
+/* The most manifest signatures we check in one batch.  Every manifest in a batch is held in memory
+   until it has been checked, so this must stay well below MAX_RHIZOME_MANIFESTS. */
+#define RHIZOME_VERIFY_BATCH_MAX 8
+void rhizome_manifest_verify_batch(rhizome_manifest **manifests, int count);
+
+struct rhizome_signature_cache_stats {
+  unsigned int hits;
+  unsigned int misses;
+  unsigned int evictions;
+};
+extern struct rhizome_signature_cache_stats rhizome_signature_cache_stats;
+
 int rhizome_update_file_priority(const char *fileid);
 int rhizome_find_duplicate(const rhizome_manifest *m, rhizome_manifest **found, int check_author);
 int rhizome_manifest_to_bar(rhizome_manifest *m,unsigned char *bar);
@@ -340,6 +401,10 @@ int rhizome_delete_file(const char *fileid);
 int rhizome_fetching_get_fds(struct pollfd *fds,int *fdcount,int fdmax);
 int rhizome_manifest_version_cache_lookup(rhizome_manifest *m);
 int rhizome_manifest_version_cache_store(rhizome_manifest *m);
+int rhizome_version_cache_lookup(const unsigned char *bid, size_t len, int64_t *version);
+void rhizome_version_cache_store(const unsigned char *bid, int64_t version);
+void rhizome_version_cache_forget(const unsigned char *bid);
+void rhizome_version_cache_validate();
 int monitor_announce_bundle(rhizome_manifest *m);
 int rhizome_find_secret(const unsigned char *authorSid, int *rs_len, const unsigned char **rs);
 int rhizome_bk_xor_stream(
@@ -515,11 +580,17 @@ struct http_response {
   const char * content_type;
   unsigned long long content_length;
   const char * body;
+  // only used for 206 Partial Content responses
+  unsigned long long range_start;
+  unsigned long long range_end;
+  unsigned long long total_length;
 };
 
 int rhizome_received_content(unsigned char *bidprefix,uint64_t version, 
 			     uint64_t offset,int count,unsigned char *bytes,
-			     int type);
+			     int type, const unsigned char *peersid);
+int rhizome_fetch_add_swarm_peer(const unsigned char *bid_prefix, int prefix_length, int64_t version,
+				 const unsigned char *peersid);
 int64_t rhizome_database_create_blob_for(const char *filehashhex_or_tempid,
 					 int64_t fileLength,int priority);
 int rhizome_server_set_response(rhizome_http_request *r, const struct http_response *h);
@@ -528,6 +599,7 @@ int rhizome_server_http_send_bytes(rhizome_http_request *r);
 int rhizome_server_parse_http_request(rhizome_http_request *r);
 int rhizome_server_simple_http_response(rhizome_http_request *r, int result, const char *response);
 int rhizome_server_http_response_header(rhizome_http_request *r, int result, const char *mime_type, unsigned long long bytes);
+int rhizome_server_http_range_response_header(rhizome_http_request *r, const char *mime_type, unsigned long long start, unsigned long long end, unsigned long long total);
 int rhizome_server_sql_query_fill_buffer(rhizome_http_request *r, char *table, char *column);
 int rhizome_http_server_start(int (*http_parse_func)(rhizome_http_request *),
 			      const char *http_parse_func_description,
@@ -661,6 +733,7 @@ struct http_response_parts {
   int code;
   char *reason;
   long long content_length;
+  long long range_start; // from Content-Range header, -1 if none
   char *content_start;
 };
 
@@ -673,6 +746,8 @@ int rhizome_open_write(struct rhizome_write *write, char *expectedFileHash, int6
 int rhizome_flush(struct rhizome_write *write);
 int rhizome_write_file(struct rhizome_write *write, const char *filename);
 int rhizome_fail_write(struct rhizome_write *write);
+int rhizome_suspend_write(struct rhizome_write *write);
+int rhizome_resume_write(struct rhizome_write *write, const char *expectedFileHash, int64_t file_length);
 int rhizome_finish_write(struct rhizome_write *write);
 int rhizome_import_file(rhizome_manifest *m, const char *filepath);
 int rhizome_stat_file(rhizome_manifest *m, const char *filepath);
@@ -682,6 +757,8 @@ int rhizome_crypt_xor_block(unsigned char *buffer, int buffer_size, int64_t stre
 			    const unsigned char *key, const unsigned char *nonce);
 int rhizome_open_read(struct rhizome_read *read, const char *fileid, int hash);
 int rhizome_read(struct rhizome_read *read, unsigned char *buffer, int buffer_length);
+int rhizome_read_can_sendfile(struct rhizome_read *read_state);
+int rhizome_read_sendfile(struct rhizome_read *read_state, int fd, int64_t length);
 int rhizome_read_close(struct rhizome_read *read);
 int rhizome_store_delete(const char *id);
 int rhizome_open_decrypt_read(rhizome_manifest *m, rhizome_bk_t *bsk, struct rhizome_read *read_state, int hash);
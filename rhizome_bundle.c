@@ -84,6 +84,141 @@ int rhizome_manifest_verify(rhizome_manifest *m)
   else return 0;
 }
 
+static const char *rhizome_manifest_field_names[RHIZOME_FIELD_COUNT] = {
+  [RHIZOME_FIELD_ID] = "id",
+  [RHIZOME_FIELD_VERSION] = "version",
+  [RHIZOME_FIELD_FILESIZE] = "filesize",
+  [RHIZOME_FIELD_FILEHASH] = "filehash",
+  [RHIZOME_FIELD_SERVICE] = "service",
+  [RHIZOME_FIELD_SENDER] = "sender",
+  [RHIZOME_FIELD_RECIPIENT] = "recipient",
+  [RHIZOME_FIELD_DATE] = "date",
+  [RHIZOME_FIELD_NAME] = "name",
+  [RHIZOME_FIELD_BK] = "BK",
+  [RHIZOME_FIELD_CRYPT] = "crypt",
+};
+
+/* Return the well known field that var names, ignoring case, or -1 if it isn't one. */
+static int rhizome_manifest_field_lookup(const char *var)
+{
+  int f;
+  switch (tolower(var[0])) {
+  case 'b': f = RHIZOME_FIELD_BK; break;
+  case 'c': f = RHIZOME_FIELD_CRYPT; break;
+  case 'd': f = RHIZOME_FIELD_DATE; break;
+  case 'i': f = RHIZOME_FIELD_ID; break;
+  case 'n': f = RHIZOME_FIELD_NAME; break;
+  case 'r': f = RHIZOME_FIELD_RECIPIENT; break;
+  case 'v': f = RHIZOME_FIELD_VERSION; break;
+  case 'f':
+    f = strcasecmp(var, "filehash") == 0 ? RHIZOME_FIELD_FILEHASH : RHIZOME_FIELD_FILESIZE;
+    break;
+  case 's':
+    f = strcasecmp(var, "sender") == 0 ? RHIZOME_FIELD_SENDER : RHIZOME_FIELD_SERVICE;
+    break;
+  default:
+    return -1;
+  }
+  return strcasecmp(var, rhizome_manifest_field_names[f]) == 0 ? f : -1;
+}
+
+/* Like rhizome_manifest_field_lookup(), but only an exact match counts, because variable
+   names are case sensitive everywhere except in the parser's validity checks. */
+static int rhizome_manifest_field_exact(const char *var)
+{
+  int f;
+  switch (var[0]) {
+  case 'B': f = RHIZOME_FIELD_BK; break;
+  case 'c': f = RHIZOME_FIELD_CRYPT; break;
+  case 'd': f = RHIZOME_FIELD_DATE; break;
+  case 'i': f = RHIZOME_FIELD_ID; break;
+  case 'n': f = RHIZOME_FIELD_NAME; break;
+  case 'r': f = RHIZOME_FIELD_RECIPIENT; break;
+  case 'v': f = RHIZOME_FIELD_VERSION; break;
+  case 'f':
+    if (strcmp(var, "filehash") == 0)
+      return RHIZOME_FIELD_FILEHASH;
+    f = RHIZOME_FIELD_FILESIZE;
+    break;
+  case 's': f = var[1] == 'e' && var[2] == 'n' ? RHIZOME_FIELD_SENDER : RHIZOME_FIELD_SERVICE; break;
+  default:
+    return -1;
+  }
+  return strcmp(var, rhizome_manifest_field_names[f]) == 0 ? f : -1;
+}
+
+static void rhizome_manifest_decode_field(rhizome_manifest *m, int f, const char *value)
+{
+  switch (f) {
+  case RHIZOME_FIELD_VERSION:
+  case RHIZOME_FIELD_FILESIZE:
+  case RHIZOME_FIELD_DATE:
+  case RHIZOME_FIELD_CRYPT: {
+      char *ep = (char *)value;
+      long long val = strtoll(value, &ep, 10);
+      if (ep != value && *ep == '\0') {
+	m->field_ll[f] = val;
+	m->field_ll_valid |= 1 << f;
+      } else
+	m->field_ll_valid &= ~(1 << f);
+    }
+    break;
+  case RHIZOME_FIELD_SENDER:
+    m->have_sender = fromhexstr(m->sender, value, SID_SIZE) == 0;
+    break;
+  case RHIZOME_FIELD_RECIPIENT:
+    m->have_recipient = fromhexstr(m->recipient, value, SID_SIZE) == 0;
+    break;
+  }
+}
+
+/* Add vars[i] to the index, f being the well known field it names exactly, or -1. */
+static void rhizome_manifest_index_var(rhizome_manifest *m, int i, int f)
+{
+  if (f == -1) {
+    m->unknown_vars[m->unknown_count++] = i;
+  } else {
+    m->field_index[f] = i + 1;
+    rhizome_manifest_decode_field(m, f, m->values[i]);
+  }
+}
+
+static void rhizome_manifest_reindex(rhizome_manifest *m)
+{
+  bzero(m->field_index, sizeof m->field_index);
+  m->field_ll_valid = 0;
+  m->have_sender = m->have_recipient = 0;
+  m->unknown_count = 0;
+  int i;
+  for (i = 0; i < m->var_count; ++i)
+    rhizome_manifest_index_var(m, i, rhizome_manifest_field_exact(m->vars[i]));
+}
+
+/* Return the index in vars[] of the named variable, or -1 if the manifest doesn't have it.  f is
+   the well known field that var names exactly, or -1. */
+static int rhizome_manifest_find_field(const rhizome_manifest *m, int f, const char *var)
+{
+  if (f != -1)
+    return m->field_index[f] - 1;
+  int i;
+  for (i = 0; i < m->unknown_count; ++i)
+    if (strcmp(m->vars[m->unknown_vars[i]], var) == 0)
+      return m->unknown_vars[i];
+  return -1;
+}
+
+static int rhizome_manifest_find_var(const rhizome_manifest *m, const char *var)
+{
+  return rhizome_manifest_find_field(m, rhizome_manifest_field_exact(var), var);
+}
+
+/* Names and values read by the parser live in m->fieldtext, everything else was strdup()ed */
+static void rhizome_manifest_free_text(rhizome_manifest *m, char *text)
+{
+  if (text < m->fieldtext || text >= m->fieldtext + sizeof m->fieldtext)
+    free(text);
+}
+
 int rhizome_read_manifest_file(rhizome_manifest *m, const char *filename, int bufferP)
 {
   IN();
@@ -109,7 +244,8 @@ int rhizome_read_manifest_file(rhizome_manifest *m, const char *filename, int bu
 
   m->manifest_all_bytes=m->manifest_bytes;
 
-  /* Parse out variables, signature etc */
+  /* Parse out variables, signature etc.  The text is copied once and split up in place, so the
+     variable names and values point into m->fieldtext rather than being allocated one by one. */
   int have_service = 0;
   int have_id = 0;
   int have_version = 0;
@@ -117,18 +253,17 @@ int rhizome_read_manifest_file(rhizome_manifest *m, const char *filename, int bu
   int have_filesize = 0;
   int have_filehash = 0;
   int ofs = 0;
+  bcopy(m->manifestdata, m->fieldtext, m->manifest_bytes);
+  m->fieldtext[m->manifest_bytes] = '\0';
   while (ofs < m->manifest_bytes && m->manifestdata[ofs]) {
-    char line[1024];
-    int limit = ofs + sizeof line - 1;
-    if (limit > m->manifest_bytes)
-      limit = m->manifest_bytes;
-    char *p = line;
-    while (ofs < limit && !(m->manifestdata[ofs] == '\0' || m->manifestdata[ofs] == '\n' || m->manifestdata[ofs] == '\r'))
-	  *p++ = m->manifestdata[ofs++];
+    char *line = &m->fieldtext[ofs];
+    while (ofs < m->manifest_bytes && !(m->manifestdata[ofs] == '\0' || m->manifestdata[ofs] == '\n' || m->manifestdata[ofs] == '\r'))
+      ++ofs;
+    char *p = &m->fieldtext[ofs];
     *p = '\0';
-    if (m->manifestdata[ofs] == '\r')
+    if (ofs < m->manifest_bytes && m->manifestdata[ofs] == '\r')
       ++ofs;
-    if (m->manifestdata[ofs] == '\n')
+    if (ofs < m->manifest_bytes && m->manifestdata[ofs] == '\n')
       ++ofs;
     /* Ignore blank lines */
     if (line[0] == '\0')
@@ -148,7 +283,9 @@ int rhizome_read_manifest_file(rhizome_manifest *m, const char *filename, int bu
       *p++ = '\0';
       char *var = line;
       char *value = p;
-      if (rhizome_manifest_get(m, var, NULL, 0)) {
+      int field = rhizome_manifest_field_lookup(var);
+      int exact = field == -1 ? -1 : rhizome_manifest_field_exact(var);
+      if (rhizome_manifest_find_field(m, exact, var) != -1) {
 	if (config.debug.rejecteddata)
 	  WARNF("Ill formed manifest file, duplicate variable \"%s\"", var);
 	m->errors++;
@@ -157,9 +294,10 @@ int rhizome_read_manifest_file(rhizome_manifest *m, const char *filename, int bu
 	  WARN("Ill formed manifest file, too many variables");
 	m->errors++;
       } else {
-	m->vars[m->var_count] = strdup(var);
-	m->values[m->var_count] = strdup(value);
-	if (strcasecmp(var, "id") == 0) {
+	m->vars[m->var_count] = var;
+	m->values[m->var_count] = value;
+	switch (field) {
+	case RHIZOME_FIELD_ID:
 	  have_id = 1;
 	  if (fromhexstr(m->cryptoSignPublic, value, RHIZOME_MANIFEST_ID_BYTES) == -1) {
 	    if (config.debug.rejecteddata)
@@ -167,9 +305,10 @@ int rhizome_read_manifest_file(rhizome_manifest *m, const char *filename, int bu
 	    m->errors++;
 	  } else {
 	    /* Force to upper case to avoid case sensitive comparison problems later. */
-	    str_toupper_inplace(m->values[m->var_count]);
+	    str_toupper_inplace(value);
 	  }
-	} else if (strcasecmp(var, "filehash") == 0) {
+	  break;
+	case RHIZOME_FIELD_FILEHASH:
 	  have_filehash = 1;
 	  if (!rhizome_str_is_file_hash(value)) {
 	    if (config.debug.rejecteddata)
@@ -177,19 +316,21 @@ int rhizome_read_manifest_file(rhizome_manifest *m, const char *filename, int bu
 	    m->errors++;
 	  } else {
 	    /* Force to upper case to avoid case sensitive comparison problems later. */
-	    str_toupper_inplace(m->values[m->var_count]);
-	    strcpy(m->fileHexHash, m->values[m->var_count]);
+	    str_toupper_inplace(value);
+	    strcpy(m->fileHexHash, value);
 	  }
-	} else if (strcasecmp(var, "BK") == 0) {
+	  break;
+	case RHIZOME_FIELD_BK:
 	  if (!rhizome_str_is_bundle_key(value)) {
 	    if (config.debug.rejecteddata)
 	      WARNF("Invalid BK: %s", value);
 	    m->errors++;
 	  } else {
 	    /* Force to upper case to avoid case sensitive comparison problems later. */
-	    str_toupper_inplace(m->values[m->var_count]);
+	    str_toupper_inplace(value);
 	  }
-	} else if (strcasecmp(var, "filesize") == 0) {
+	  break;
+	case RHIZOME_FIELD_FILESIZE: {
 	  have_filesize = 1;
 	  char *ep = value;
 	  long long filesize = strtoll(value, &ep, 10);
@@ -200,7 +341,9 @@ int rhizome_read_manifest_file(rhizome_manifest *m, const char *filename, int bu
 	  } else {
 	    m->fileLength = filesize;
 	  }
-	} else if (strcasecmp(var, "service") == 0) {
+	  break;
+	}
+	case RHIZOME_FIELD_SERVICE:
 	  have_service = 1;
 	  if ( strcasecmp(value, RHIZOME_SERVICE_FILE) == 0
 	    || strcasecmp(value, RHIZOME_SERVICE_MESHMS) == 0) {
@@ -208,7 +351,8 @@ int rhizome_read_manifest_file(rhizome_manifest *m, const char *filename, int bu
 	    INFOF("Unsupported service: %s", value);
 	    // This is not an error... older rhizome nodes must carry newer manifests.
 	  }
-	} else if (strcasecmp(var, "version") == 0) {
+	  break;
+	case RHIZOME_FIELD_VERSION: {
 	  have_version = 1;
 	  char *ep = value;
 	  long long version = strtoll(value, &ep, 10);
@@ -219,7 +363,9 @@ int rhizome_read_manifest_file(rhizome_manifest *m, const char *filename, int bu
 	  } else {
 	    m->version = version;
 	  }
-	} else if (strcasecmp(var, "date") == 0) {
+	  break;
+	}
+	case RHIZOME_FIELD_DATE: {
 	  have_date = 1;
 	  char *ep = value;
 	  long long date = strtoll(value, &ep, 10);
@@ -228,24 +374,28 @@ int rhizome_read_manifest_file(rhizome_manifest *m, const char *filename, int bu
 	      WARNF("Invalid date: %s", value);
 	    m->errors++;
 	  }
-	  // TODO: store date in manifest struct
-	} else if (strcasecmp(var, "sender") == 0 || strcasecmp(var, "recipient") == 0) {
+	  break;
+	}
+	case RHIZOME_FIELD_SENDER:
+	case RHIZOME_FIELD_RECIPIENT:
 	  if (!str_is_subscriber_id(value)) {
 	    if (config.debug.rejecteddata)
 	      WARNF("Invalid %s: %s", var, value);
 	    m->errors++;
 	  } else {
 	    /* Force to upper case to avoid case sensitive comparison problems later. */
-	    str_toupper_inplace(m->values[m->var_count]);
+	    str_toupper_inplace(value);
 	  }
-	} else if (strcasecmp(var, "name") == 0) {
+	  break;
+	case RHIZOME_FIELD_NAME:
 	  if (value[0] == '\0') {
 	    if (config.debug.rejecteddata)
 	      WARNF("Empty name", value);
 	    m->errors++;
 	  }
 	  // TODO: complain if service is not MeshMS
-	} else if (strcasecmp(var, "crypt") == 0) {
+	  break;
+	case RHIZOME_FIELD_CRYPT:
 	  if (!(strcmp(value, "0") == 0 || strcmp(value, "1") == 0)) {
 	    if (config.debug.rejecteddata)
 	      WARNF("Invalid crypt: %s", value);
@@ -253,10 +403,13 @@ int rhizome_read_manifest_file(rhizome_manifest *m, const char *filename, int bu
 	  } else {
 	    m->payloadEncryption = atoi(value);
 	  }
-	} else {
+	  break;
+	default:
 	  INFOF("Unsupported field: %s=%s", var, value);
 	  // This is not an error... older rhizome nodes must carry newer manifests.
+	  break;
 	}
+	rhizome_manifest_index_var(m, m->var_count, exact);
 	m->var_count++;
       }
     }
@@ -359,84 +512,97 @@ char *rhizome_manifest_get(const rhizome_manifest *m, const char *var, char *out
 
   if (!m) return NULL;
 
-  for(i=0;i<m->var_count;i++)
-    if (!strcmp(m->vars[i],var)) {
-      if (out) {
-	for(j=0;(j<maxlen);j++) {
-	  out[j]=m->values[i][j];
-	  if (!out[j]) break;
-	}
-      }
-      return m->values[i];
+  i = rhizome_manifest_find_var(m, var);
+  if (i == -1)
+    return NULL;
+  if (out) {
+    for(j=0;(j<maxlen);j++) {
+      out[j]=m->values[i][j];
+      if (!out[j]) break;
     }
-  return NULL;
+  }
+  return m->values[i];
 }
 
 long long rhizome_manifest_get_ll(rhizome_manifest *m, const char *var)
 {
   if (!m)
     return -1;
-  int i;
-  for (i = 0; i < m->var_count; ++i)
-    if (!strcmp(m->vars[i], var)) {
-      char *vp = m->values[i];
-      char *ep = vp;
-      long long val = strtoll(vp, &ep, 10);
-      return (ep != vp && *ep == '\0') ? val : -1;
-    }
-  return -1;
+  int f = rhizome_manifest_field_exact(var);
+  if (f != -1)
+    return m->field_index[f] && (m->field_ll_valid & (1 << f)) ? m->field_ll[f] : -1;
+  int i = rhizome_manifest_find_var(m, var);
+  if (i == -1)
+    return -1;
+  char *vp = m->values[i];
+  char *ep = vp;
+  long long val = strtoll(vp, &ep, 10);
+  return (ep != vp && *ep == '\0') ? val : -1;
 }
 
-double rhizome_manifest_get_double(rhizome_manifest *m,char *var,double default_value)
+/* Return the sender or recipient of the manifest in binary, or NULL if the manifest doesn't
+   contain a valid one. */
+const unsigned char *rhizome_manifest_get_sid(const rhizome_manifest *m, const char *var)
 {
-  int i;
+  if (!m)
+    return NULL;
+  switch (rhizome_manifest_field_exact(var)) {
+  case RHIZOME_FIELD_SENDER:
+    return m->field_index[RHIZOME_FIELD_SENDER] && m->have_sender ? m->sender : NULL;
+  case RHIZOME_FIELD_RECIPIENT:
+    return m->field_index[RHIZOME_FIELD_RECIPIENT] && m->have_recipient ? m->recipient : NULL;
+  }
+  return NULL;
+}
 
+double rhizome_manifest_get_double(rhizome_manifest *m,char *var,double default_value)
+{
   if (!m) return default_value;
 
-  for(i=0;i<m->var_count;i++)
-    if (!strcmp(m->vars[i],var))
-      return strtod(m->values[i],NULL);
-  return default_value;
+  int i = rhizome_manifest_find_var(m, var);
+  if (i == -1)
+    return default_value;
+  return strtod(m->values[i],NULL);
 }
 
 /* @author Andrew Bettison <andrew@servalproject.com>
  */
 int rhizome_manifest_del(rhizome_manifest *m, const char *var)
 {
-  int ret = 0;
-  int i;
-  for (i = 0; i < m->var_count; ++i)
-    if (strcmp(m->vars[i], var) == 0) {
-      free(m->vars[i]); 
-      free(m->values[i]); 
-      --m->var_count;
-      m->finalised = 0;
-      ret = 1;
-      break;
-    }
+  int i = rhizome_manifest_find_var(m, var);
+  if (i == -1)
+    return 0;
+  rhizome_manifest_free_text(m, m->vars[i]);
+  rhizome_manifest_free_text(m, m->values[i]);
+  --m->var_count;
+  m->finalised = 0;
   for (; i < m->var_count; ++i) {
     m->vars[i] = m->vars[i + 1];
     m->values[i] = m->values[i + 1];
   }
-  return ret;
+  rhizome_manifest_reindex(m);
+  return 1;
 }
 
 int rhizome_manifest_set(rhizome_manifest *m, const char *var, const char *value)
 {
   if (!m)
     return WHY("m == NULL");
-  int i;
-  for(i=0;i<m->var_count;i++)
-    if (!strcmp(m->vars[i],var)) {
-      free(m->values[i]); 
-      m->values[i]=strdup(value);
-      m->finalised=0;
-      return 0;
-    }
+  int i = rhizome_manifest_find_var(m, var);
+  if (i != -1) {
+    rhizome_manifest_free_text(m, m->values[i]);
+    m->values[i]=strdup(value);
+    m->finalised=0;
+    int f = rhizome_manifest_field_exact(var);
+    if (f != -1)
+      rhizome_manifest_decode_field(m, f, m->values[i]);
+    return 0;
+  }
   if (m->var_count >= MAX_MANIFEST_VARS)
     return WHY("no more manifest vars");
   m->vars[m->var_count]=strdup(var);
   m->values[m->var_count]=strdup(value);
+  rhizome_manifest_index_var(m, m->var_count, rhizome_manifest_field_exact(var));
   m->var_count++;
   m->finalised=0;
   return 0;
@@ -542,7 +708,7 @@ void _rhizome_manifest_free(struct __sourceloc __whence, rhizome_manifest *m)
   /* Free variable and signature blocks.
      XXX These should be moved to malloc-free storage eventually */
   for(i=0;i<m->var_count;i++)
-    { free(m->vars[i]); free(m->values[i]); 
+    { rhizome_manifest_free_text(m, m->vars[i]); rhizome_manifest_free_text(m, m->values[i]);
       m->vars[i]=NULL; m->values[i]=NULL; }
   for(i=0;i<m->sig_count;i++)
     { free(m->signatories[i]);
@@ -731,8 +897,10 @@ int rhizome_fill_manifest(rhizome_manifest *m, const char *filepath, const sid_t
   }else{
     const char *sender = rhizome_manifest_get(m, "sender", NULL, 0);
     if (sender){
-      if (fromhexstr(m->author, sender, SID_SIZE) == -1)
+      const unsigned char *sender_sid = rhizome_manifest_get_sid(m, "sender");
+      if (!sender_sid)
 	return WHYF("invalid sender: %s", sender);
+      memcpy(m->author, sender_sid, SID_SIZE);
     }
   }
 
@@ -24,6 +24,8 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "conf.h"
 #include "str.h"
 #include "rhizome.h"
+#include "overlay_address.h"
+#include "crypto.h"
 #include <stdlib.h>
 #include <ctype.h>
 
@@ -422,68 +424,165 @@ int rhizome_sign_hash_with_key(rhizome_manifest *m,const unsigned char *sk,
   OUT();
 }
 
+/* Cache of manifest signature verification results, so that a manifest that is received again
+ * (which happens constantly, as neighbours re-advertise their bundles) does not cost another
+ * Ed25519 verification.  The cache is keyed on the manifest hash and the whole signature block, and
+ * is set associative: the first bytes of the manifest hash (a SHA-512 digest, so uniformly
+ * distributed) select a bin, and the least recently used entry in a full bin is replaced.
+ */
 typedef struct manifest_signature_block_cache {
   unsigned char manifest_hash[crypto_hash_sha512_BYTES];
-  unsigned char signature_bytes[256];
+  unsigned char signature_bytes[96];
   int signature_length;
   int signature_valid;
+  // when this entry was last used, zero if the entry is empty
+  unsigned int used;
 } manifest_signature_block_cache;
 
 #define SIG_CACHE_SIZE 1024
-manifest_signature_block_cache sig_cache[SIG_CACHE_SIZE];
+#define SIG_CACHE_ASSOCIATIVITY 8
+#define SIG_CACHE_BINS (SIG_CACHE_SIZE / SIG_CACHE_ASSOCIATIVITY)
+
+static manifest_signature_block_cache sig_cache[SIG_CACHE_SIZE];
+static unsigned int sig_cache_tick = 0;
+struct rhizome_signature_cache_stats rhizome_signature_cache_stats;
+
+static int rhizome_verify_signature_block(const unsigned char *hash, const unsigned char *sig)
+{
+  unsigned char sigBuf[256];
+  unsigned char verifyBuf[256];
+  unsigned char publicKey[256];
+
+  /* Reconstitute signature by putting manifest hash between the two
+     32-byte halves */
+  bcopy(&sig[0],&sigBuf[0],64);
+  bcopy(hash,&sigBuf[64],crypto_hash_sha512_BYTES);
 
+  /* Get public key of signatory */
+  bcopy(&sig[64],&publicKey[0],crypto_sign_edwards25519sha512batch_PUBLICKEYBYTES);
+
+  unsigned long long mlen=0;
+  return crypto_sign_edwards25519sha512batch_open(verifyBuf,&mlen,&sigBuf[0],128,publicKey) ? -1 : 0;
+}
+
+/* Find the cache entry for this signature block, or if there isn't one, return NULL and set *victim to the
+ * entry it should replace.
+ */
+static manifest_signature_block_cache *sig_cache_find(const unsigned char *hash, const unsigned char *sig, int sig_len,
+						      manifest_signature_block_cache **victim)
+{
+  uint32_t slot = (hash[0] << 24) | (hash[1] << 16) | (hash[2] << 8) | hash[3];
+  manifest_signature_block_cache *bin = &sig_cache[(slot % SIG_CACHE_BINS) * SIG_CACHE_ASSOCIATIVITY];
+  manifest_signature_block_cache *entry = &bin[0];
+  int i;
+  for (i = 0; i < SIG_CACHE_ASSOCIATIVITY; ++i) {
+    if (bin[i].used
+      && bin[i].signature_length == sig_len
+      && memcmp(bin[i].manifest_hash, hash, crypto_hash_sha512_BYTES) == 0
+      && memcmp(bin[i].signature_bytes, sig, sig_len) == 0
+    )
+      return &bin[i];
+    // remember the empty or least recently used entry, in case we need to replace it
+    if (entry->used && bin[i].used < entry->used)
+      entry = &bin[i];
+  }
+  *victim = entry;
+  return NULL;
+}
+
+static void sig_cache_store(manifest_signature_block_cache *entry, const unsigned char *hash,
+			    const unsigned char *sig, int sig_len, int valid)
+{
+  rhizome_signature_cache_stats.misses++;
+  if (entry->used)
+    rhizome_signature_cache_stats.evictions++;
+  bcopy(hash, entry->manifest_hash, crypto_hash_sha512_BYTES);
+  bcopy(sig, entry->signature_bytes, sig_len);
+  entry->signature_length = sig_len;
+  entry->signature_valid = valid;
+  entry->used = ++sig_cache_tick;
+}
+
+/* Return 0 if the signature block is a valid signature of the manifest hash, -1 if not.
+ */
 int rhizome_manifest_lookup_signature_validity(unsigned char *hash,unsigned char *sig,int sig_len)
 {
   IN();
-  unsigned int slot=0;
-  int i;
+  if (sig_len < 64 + crypto_sign_edwards25519sha512batch_PUBLICKEYBYTES || sig_len > (int) sizeof sig_cache[0].signature_bytes)
+    RETURN(WHYF("Invalid signature block length %d", sig_len));
+
+  manifest_signature_block_cache *victim = NULL;
+  manifest_signature_block_cache *entry = sig_cache_find(hash, sig, sig_len, &victim);
+  if (entry) {
+    entry->used = ++sig_cache_tick;
+    rhizome_signature_cache_stats.hits++;
+    RETURN(entry->signature_valid);
+  }
+  sig_cache_store(victim, hash, sig, sig_len, rhizome_verify_signature_block(hash, sig));
+  RETURN(victim->signature_valid);
+  OUT();
+}
 
-  for(i=0;i<crypto_hash_sha512_BYTES;i++) {
-    slot=(slot<<1)+(slot&0x80000000?1:0);
-    slot+=hash[i];
+/* Check the signatures of several manifests in one batch, which is much cheaper than checking them
+ * one at a time, and remember the results in the signature cache, so that rhizome_manifest_verify()
+ * will find them there.  Used when a burst of new manifests arrives in one advertisement.
+ */
+void rhizome_manifest_verify_batch(rhizome_manifest **manifests, int count)
+{
+  IN();
+  struct crypto_signature_check checks[RHIZOME_VERIFY_BATCH_MAX];
+  int check_count = 0;
+  int i;
+  for (i = 0; i < count; i++) {
+    rhizome_manifest *m = manifests[i];
+    int ofs = 0;
+    while (ofs < m->manifest_all_bytes && m->manifestdata[ofs])
+      ofs++;
+    ofs++;
+    crypto_hash_sha512(m->manifesthash, m->manifestdata, ofs);
+    
+    while (ofs < m->manifest_all_bytes && check_count < RHIZOME_VERIFY_BATCH_MAX) {
+      int sig_type = m->manifestdata[ofs];
+      int len = (sig_type & 0x3f) * 4 + 4 + 1;
+      unsigned char *sig = &m->manifestdata[ofs + 1];
+      manifest_signature_block_cache *victim;
+      if (sig_type == 0x17 && ofs + len <= m->manifest_all_bytes
+	&& !sig_cache_find(m->manifesthash, sig, 96, &victim)) {
+	struct crypto_signature_check *check = &checks[check_count++];
+	check->content = m->manifesthash;
+	check->content_len = crypto_hash_sha512_BYTES;
+	check->signature = sig;
+	check->public_key = sig + 64;
+      }
+      ofs += len;
+    }
   }
-  for(i=0;i<sig_len;i++) {
-    slot=(slot<<1)+(slot&0x80000000?1:0);
-    slot+=sig[i];
+  if (check_count == 0) {
+    OUT(); return;
   }
-  slot%=SIG_CACHE_SIZE;
-
-  int replace=0;
-  if (sig_cache[slot].signature_length!=sig_len) replace=1;
-  for(i=0;i<crypto_hash_sha512_BYTES;i++)
-    if (hash[i]!=sig_cache[i].manifest_hash[i]) { replace=1; break; }
-  for(i=0;i<sig_len;i++)
-    if (sig[i]!=sig_cache[i].signature_bytes[i]) { replace=1; break; }
-
-  if (replace) {
-    for(i=0;i<crypto_hash_sha512_BYTES;i++)
-      sig_cache[i].manifest_hash[i]=hash[i];
-    for(i=0;i<sig_len;i++)
-      sig_cache[i].signature_bytes[i]=sig[i];
-    sig_cache[i].signature_length=sig_len;
-
-    unsigned char sigBuf[256];
-    unsigned char verifyBuf[256];
-    unsigned char publicKey[256];
-
-    /* Reconstitute signature by putting manifest hash between the two
-       32-byte halves */
-    bcopy(&sig[0],&sigBuf[0],64);
-    bcopy(hash,&sigBuf[64],crypto_hash_sha512_BYTES);
-
-    /* Get public key of signatory */
-    bcopy(&sig[64],&publicKey[0],crypto_sign_edwards25519sha512batch_PUBLICKEYBYTES);
-
-    unsigned long long mlen=0;
-    sig_cache[i].signature_valid=
-      crypto_sign_edwards25519sha512batch_open(verifyBuf,&mlen,&sigBuf[0],128,
-					       publicKey)
-      ? -1 : 0;
+  
+  crypto_verify_signature_batch(checks, check_count);
+  if (config.debug.rhizome)
+    DEBUGF("Verified %d manifest signatures in one batch", check_count);
+  
+  for (i = 0; i < check_count; i++) {
+    manifest_signature_block_cache *victim = NULL;
+    // the same signature may appear twice in the batch
+    if (!sig_cache_find(checks[i].content, checks[i].signature, 96, &victim))
+      sig_cache_store(victim, checks[i].content, checks[i].signature, 96, checks[i].result);
   }
-  RETURN(sig_cache[i].signature_valid);
   OUT();
 }
 
+/* Empty the signature cache and reset its counters.
+ */
+void rhizome_signature_cache_clear()
+{
+  bzero(sig_cache, sizeof sig_cache);
+  bzero(&rhizome_signature_cache_stats, sizeof rhizome_signature_cache_stats);
+  sig_cache_tick = 0;
+}
+
 int rhizome_manifest_extract_signature(rhizome_manifest *m,int *ofs)
 {
   IN();
@@ -620,22 +719,23 @@ int rhizome_derive_key(rhizome_manifest *m, rhizome_bk_t *bsk)
   char *recipient = rhizome_manifest_get(m, "recipient", NULL, 0);
   
   if (sender && recipient){
-    sid_t sender_sid, recipient_sid;
-    if (cf_opt_sid(&sender_sid, sender)!=CFOK)
+    const unsigned char *sender_sid = rhizome_manifest_get_sid(m, "sender");
+    if (!sender_sid)
       return WHYF("Unable to parse sender sid");
-    if (cf_opt_sid(&recipient_sid, recipient)!=CFOK)
+    const unsigned char *recipient_sid = rhizome_manifest_get_sid(m, "recipient");
+    if (!recipient_sid)
       return WHYF("Unable to parse recipient sid");
     
     unsigned char *nm_bytes=NULL;
     int cn=0,in=0,kp=0;
-    if (!keyring_find_sid(keyring,&cn,&in,&kp,sender_sid.binary)){
+    if (!keyring_find_sid(keyring,&cn,&in,&kp,sender_sid)){
       cn=in=kp=0;
-      if (!keyring_find_sid(keyring,&cn,&in,&kp,recipient_sid.binary)){
+      if (!keyring_find_sid(keyring,&cn,&in,&kp,recipient_sid)){
 	return WHYF("Neither the sender %s nor the recipient %s appears in our keyring", sender, recipient);
       }
-      nm_bytes=keyring_get_nm_bytes(recipient_sid.binary, sender_sid.binary);
+      nm_bytes=keyring_get_nm_bytes(recipient_sid, sender_sid);
     }else{
-      nm_bytes=keyring_get_nm_bytes(sender_sid.binary, recipient_sid.binary);
+      nm_bytes=keyring_get_nm_bytes(sender_sid, recipient_sid);
     }
     
     if (!nm_bytes)
@@ -20,6 +20,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #define __RHIZOME_INLINE
 #include <stdlib.h>
 #include <time.h>
+#include <sys/time.h>
 #include "serval.h"
 #include "conf.h"
 #include "rhizome.h"
@@ -293,12 +294,41 @@ int rhizome_opendb()
     sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "PRAGMA user_version=3;");
   }
   
+  if (version<4){
+    // count manifest deletions, so that other processes know to forget the versions they remember
+    sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "CREATE TABLE IF NOT EXISTS GENERATION(count integer);");
+    sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "INSERT INTO GENERATION(count) SELECT 0 WHERE NOT EXISTS (SELECT 1 FROM GENERATION);");
+    sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "CREATE TRIGGER IF NOT EXISTS MANIFESTS_DELETED AFTER DELETE ON MANIFESTS BEGIN UPDATE GENERATION SET count=count+1; END;");
+    sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "PRAGMA user_version=4;");
+  }
+  
   // TODO recreate tables with collate nocase on hex columns
   
   /* Future schema updates should be performed here. 
    The above schema can be assumed to exist.
    All changes should attempt to preserve any existing data */
   
+  /* With a write-ahead log, readers in other processes are not blocked by a writer, and commits do
+     not have to sync the database file.  The journal mode is stored in the database, so it is
+     switched back if the option is turned off.  Leaving WAL mode fails while another connection
+     has the database open, so only the server switches modes, as it starts, and other processes
+     use whatever mode the database is in.  The server checkpoints the log from an alarm, see
+     rhizome_checkpoint_db(), so that no writer stalls on an automatic checkpoint. */
+  if (serverMode) {
+    char journal_mode[10];
+    strbuf mode = strbuf_local(journal_mode, sizeof journal_mode);
+    if (sqlite_exec_strbuf_retry(&retry, mode, "PRAGMA journal_mode=%s;", config.rhizome.database_wal ? "WAL" : "DELETE") == -1)
+      WARNF("Could not set Rhizome database journal mode to %s", config.rhizome.database_wal ? "WAL" : "DELETE");
+    else if (strcasecmp(journal_mode, config.rhizome.database_wal ? "wal" : "delete") != 0)
+      WARNF("Rhizome database journal mode is %s, not %s", journal_mode, config.rhizome.database_wal ? "WAL" : "DELETE");
+  }
+  long long pragma_result;
+  if (config.rhizome.database_wal && serverMode)
+    sqlite_exec_int64_retry(&retry, &pragma_result, "PRAGMA wal_autocheckpoint=0;");
+  sqlite_exec_void_retry_loglevel(LOG_LEVEL_WARN, &retry, "PRAGMA synchronous=%d;", config.rhizome.database_synchronous);
+  // older SQLite versions do not memory map the database, and return no row
+  sqlite_exec_int64_retry(&retry, &pragma_result, "PRAGMA mmap_size=%llu;", (unsigned long long) config.rhizome.database_mmap_size);
+  
   // We can't delete a file that is being transferred in another process at this very moment...
   if (config.rhizome.clean_on_open)
     rhizome_cleanup(NULL);
@@ -306,6 +336,27 @@ int rhizome_opendb()
   OUT();
 }
 
+/* Alarm that copies the write-ahead log back into the Rhizome database.  A passive checkpoint does
+   not wait for readers or writers, so it does what it can and leaves the rest for the next one.
+ */
+void rhizome_checkpoint_db(struct sched_ent *alarm)
+{
+  if (rhizome_db && config.rhizome.database_wal) {
+    int log_frames = 0;
+    int checkpointed_frames = 0;
+    int r = sqlite3_wal_checkpoint_v2(rhizome_db, NULL, SQLITE_CHECKPOINT_PASSIVE, &log_frames, &checkpointed_frames);
+    if (r != SQLITE_OK && !sqlite_code_busy(r))
+      WARNF("Rhizome database checkpoint failed, %s", sqlite3_errmsg(rhizome_db));
+    else if (config.debug.rhizome && log_frames > 0)
+      DEBUGF("Checkpointed %d of %d write-ahead log frames", checkpointed_frames, log_frames);
+  }
+  alarm->alarm = gettime_ms() + config.rhizome.checkpoint_interval_ms;
+  alarm->deadline = alarm->alarm + 1000;
+  schedule(alarm);
+}
+
+static void sqlite_cached_statements_finalise();
+
 int rhizome_close_db()
 {
   IN();
@@ -314,6 +365,7 @@ int rhizome_close_db()
       WHY("Uncommitted transaction!");
       sqlite_exec_void("ROLLBACK;");
     }
+    sqlite_cached_statements_finalise();
     sqlite3_stmt *stmt = NULL;
     while ((stmt = sqlite3_next_stmt(rhizome_db, stmt))) {
       const char *sql = sqlite3_sql(stmt);
@@ -464,6 +516,141 @@ sqlite3_stmt *_sqlite_prepare_loglevel(struct __sourceloc __whence, int log_leve
   }
 }
 
+/* Cache of prepared statements for the queries that are run often, such as the version checks
+   made for every received advertisement.  A cached statement is prepared once from a constant SQL
+   text containing '?' parameters, then reset and reused by later callers, who bind their own
+   parameter values:
+
+      sqlite3_stmt *statement = sqlite_prepare_cached(&retry, "SELECT version FROM MANIFESTS WHERE id = ?;");
+      if (!statement)
+	return -1;
+      sqlite3_bind_text(statement, 1, id, -1, SQLITE_STATIC);
+      while (sqlite_step_retry(&retry, statement) == SQLITE_ROW) {
+	...
+      }
+      sqlite_release(statement);
+
+   sqlite_release() resets a cached statement and returns it to the cache, and finalises any other
+   statement, so every statement obtained from sqlite_prepare() or sqlite_prepare_cached() may be
+   released the same way.  If a cached statement is already in use (eg, by an outer loop over its
+   rows), then an uncached one is prepared instead.
+
+   Each cached statement counts its executions and the time spent between preparing and releasing
+   it, which is logged with the other timing stats when debug.timing is set.
+ */
+#define SQLITE_STATEMENT_CACHE_SIZE 32
+
+struct sqlite_cached_statement {
+  const char *sql;
+  sqlite3_stmt *statement;
+  int in_use;
+  int64_t started;
+  unsigned int executions;
+  int64_t total_time;
+};
+
+static struct sqlite_cached_statement sqlite_statement_cache[SQLITE_STATEMENT_CACHE_SIZE];
+static int sqlite_statement_cache_count = 0;
+
+static int64_t sqlite_gettime_us()
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1000000LL + tv.tv_usec;
+}
+
+sqlite3_stmt *_sqlite_prepare_cached(struct __sourceloc __whence, sqlite_retry_state *retry, const char *sql)
+{
+  struct sqlite_cached_statement *entry = NULL;
+  int i;
+  for (i = 0; i < sqlite_statement_cache_count; ++i) {
+    if (sqlite_statement_cache[i].sql == sql || strcmp(sqlite_statement_cache[i].sql, sql) == 0) {
+      entry = &sqlite_statement_cache[i];
+      break;
+    }
+  }
+  if (!entry && sqlite_statement_cache_count < SQLITE_STATEMENT_CACHE_SIZE) {
+    entry = &sqlite_statement_cache[sqlite_statement_cache_count++];
+    bzero(entry, sizeof *entry);
+    entry->sql = sql;
+  }
+  if (!entry || entry->in_use) {
+    if (!entry)
+      WARNF("SQL statement cache full, not caching: %s", sql);
+    return _sqlite_prepare(__whence, retry, "%s", sql);
+  }
+  if (!entry->statement) {
+    strbuf stmt = strbuf_alloca(strlen(sql) + 1);
+    strbuf_puts(stmt, sql);
+    if (!(entry->statement = _sqlite_prepare_loglevel(__whence, LOG_LEVEL_ERROR, retry, stmt)))
+      return NULL;
+  }
+  entry->in_use = 1;
+  entry->executions++;
+  entry->started = sqlite_gettime_us();
+  return entry->statement;
+}
+
+void _sqlite_release(struct __sourceloc __whence, sqlite3_stmt *statement)
+{
+  if (!statement)
+    return;
+  int i;
+  for (i = 0; i < sqlite_statement_cache_count; ++i) {
+    struct sqlite_cached_statement *entry = &sqlite_statement_cache[i];
+    if (entry->statement == statement) {
+      sqlite3_reset(statement);
+      sqlite3_clear_bindings(statement);
+      if (entry->in_use)
+	entry->total_time += sqlite_gettime_us() - entry->started;
+      entry->in_use = 0;
+      return;
+    }
+  }
+  sqlite3_finalize(statement);
+}
+
+/* Finalise all cached statements, before the database is closed.  Their stats are kept, and they
+   will be prepared again when next used.
+ */
+static void sqlite_cached_statements_finalise()
+{
+  int i;
+  for (i = 0; i < sqlite_statement_cache_count; ++i) {
+    struct sqlite_cached_statement *entry = &sqlite_statement_cache[i];
+    if (entry->statement) {
+      if (entry->in_use)
+	WARNF("finalising cached statement that is still in use: %s", entry->sql);
+      sqlite3_finalize(entry->statement);
+      entry->statement = NULL;
+      entry->in_use = 0;
+    }
+  }
+}
+
+void sqlite_showstats()
+{
+  int i;
+  for (i = 0; i < sqlite_statement_cache_count; ++i) {
+    struct sqlite_cached_statement *entry = &sqlite_statement_cache[i];
+    if (entry->executions)
+      INFOF("% 8u executions, % 10.3fms total, % 8.1fus mean: %s",
+	  entry->executions,
+	  entry->total_time / 1e3,
+	  entry->total_time * 1.0 / entry->executions,
+	  entry->sql);
+  }
+}
+
+void sqlite_clearstats()
+{
+  int i;
+  for (i = 0; i < sqlite_statement_cache_count; ++i) {
+    sqlite_statement_cache[i].executions = 0;
+    sqlite_statement_cache[i].total_time = 0;
+  }
+}
+
 int _sqlite_step_retry(struct __sourceloc __whence, int log_level, sqlite_retry_state *retry, sqlite3_stmt *statement)
 {
   int ret = -1;
@@ -499,7 +686,7 @@ int _sqlite_step_retry(struct __sourceloc __whence, int log_level, sqlite_retry_
 
 /*
  * Convenience wrapper for executing a prepared SQL statement where the row outputs are not wanted.
- * Always finalises the statement before returning.
+ * Always releases the statement before returning.
  *
  * If an error occurs then logs it at the given level and returns -1.
  *
@@ -520,7 +707,7 @@ static int _sqlite_exec_prepared(struct __sourceloc __whence, int log_level, sql
   int stepcode;
   while ((stepcode = _sqlite_step_retry(__whence, log_level, retry, statement)) == SQLITE_ROW)
     ++rowcount;
-  sqlite3_finalize(statement);
+  _sqlite_release(__whence, statement);
   if (sqlite_trace_func())
     DEBUGF("rowcount=%d changes=%d", rowcount, sqlite3_changes(rhizome_db));
   return sqlite_code_ok(stepcode) ? rowcount : -1;
@@ -601,7 +788,14 @@ static int _sqlite_vexec_int64(struct __sourceloc __whence, sqlite_retry_state *
 {
   strbuf stmt = strbuf_alloca(8192);
   strbuf_vsprintf(stmt, sqlformat, ap);
-  sqlite3_stmt *statement = _sqlite_prepare_loglevel(__whence, LOG_LEVEL_ERROR, retry, stmt);
+  return _sqlite_exec_int64_prepared(__whence, retry, result, _sqlite_prepare_loglevel(__whence, LOG_LEVEL_ERROR, retry, stmt));
+}
+
+/* Same as sqlite_exec_int64_retry(), but executes a statement that has already been prepared and
+ * bound, eg, by sqlite_prepare_cached().  Always releases the statement before returning.
+ */
+int _sqlite_exec_int64_prepared(struct __sourceloc __whence, sqlite_retry_state *retry, long long *result, sqlite3_stmt *statement)
+{
   if (!statement)
     return -1;
   int ret = 0;
@@ -616,7 +810,7 @@ static int _sqlite_vexec_int64(struct __sourceloc __whence, sqlite_retry_state *
   }
   if (rowcount > 1)
     WARNF("query unexpectedly returned %d rows, ignored all but first", rowcount);
-  sqlite3_finalize(statement);
+  _sqlite_release(__whence, statement);
   if (!sqlite_code_ok(stepcode) || ret == -1)
     return -1;
   if (sqlite_trace_func())
@@ -691,7 +885,14 @@ int _sqlite_vexec_strbuf_retry(struct __sourceloc __whence, sqlite_retry_state *
 {
   strbuf stmt = strbuf_alloca(8192);
   strbuf_vsprintf(stmt, sqlformat, ap);
-  sqlite3_stmt *statement = _sqlite_prepare_loglevel(__whence, LOG_LEVEL_ERROR, retry, stmt);
+  return _sqlite_exec_strbuf_prepared(__whence, retry, sb, _sqlite_prepare_loglevel(__whence, LOG_LEVEL_ERROR, retry, stmt));
+}
+
+/* Same as sqlite_exec_strbuf_retry(), but executes a statement that has already been prepared and
+ * bound, eg, by sqlite_prepare_cached().  Always releases the statement before returning.
+ */
+int _sqlite_exec_strbuf_prepared(struct __sourceloc __whence, sqlite_retry_state *retry, strbuf sb, sqlite3_stmt *statement)
+{
   if (!statement)
     return -1;
   int ret = 0;
@@ -700,13 +901,13 @@ int _sqlite_vexec_strbuf_retry(struct __sourceloc __whence, sqlite_retry_state *
   while ((stepcode = _sqlite_step_retry(__whence, LOG_LEVEL_ERROR, retry, statement)) == SQLITE_ROW) {
     int columncount = sqlite3_column_count(statement);
     if (columncount != 1)
-      ret - WHYF("incorrect column count %d (should be 1): %s", columncount, sqlite3_sql(statement));
+      ret = WHYF("incorrect column count %d (should be 1): %s", columncount, sqlite3_sql(statement));
     else if (++rowcount == 1)
       strbuf_puts(sb, (const char *)sqlite3_column_text(statement, 0));
   }
   if (rowcount > 1)
     WARNF("query unexpectedly returned %d rows, ignored all but first", rowcount);
-  sqlite3_finalize(statement);
+  _sqlite_release(__whence, statement);
   return sqlite_code_ok(stepcode) && ret != -1 ? rowcount : -1;
 }
 
@@ -728,8 +929,13 @@ int rhizome_database_filehash_from_id(const char *id, uint64_t version, char has
   IN();
   
   strbuf hash_sb = strbuf_local(hash, SHA512_DIGEST_STRING_LENGTH);
-  RETURN(sqlite_exec_strbuf(hash_sb, "SELECT filehash FROM MANIFESTS WHERE manifests.version=%lld AND manifests.id='%s';",
-			    version,id));
+  sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
+  sqlite3_stmt *statement = sqlite_prepare_cached(&retry, "SELECT filehash FROM MANIFESTS WHERE manifests.version = ? AND manifests.id = ?;");
+  if (!statement)
+    RETURN(-1);
+  sqlite3_bind_int64(statement, 1, version);
+  sqlite3_bind_text(statement, 2, id, -1, SQLITE_STATIC);
+  RETURN(sqlite_exec_strbuf_prepared(&retry, hash_sb, statement));
   OUT();
 }
 
@@ -863,6 +1069,9 @@ int rhizome_drop_stored_file(const char *id,int maximum_priority)
       if (config.debug.rhizome)
 	DEBUGF("removing stale manifests, groupmemberships");
       sqlite_exec_void_retry(&retry, "delete from manifests where id='%s';", manifestId);
+      unsigned char bid[RHIZOME_MANIFEST_ID_BYTES];
+      if (fromhexstr(bid, manifestId, sizeof bid) == 0)
+	rhizome_version_cache_forget(bid);
       sqlite_exec_void_retry(&retry, "delete from keypairs where public='%s';", manifestId);
       sqlite_exec_void_retry(&retry, "delete from groupmemberships where manifestid='%s';", manifestId);
     }
@@ -1014,6 +1223,7 @@ int rhizome_store_bundle(rhizome_manifest *m)
 	  alloca_tohex_sid(m->cryptoSignPublic),
 	  m->version
 	  );
+    rhizome_manifest_version_cache_store(m);
     monitor_announce_bundle(m);
     return 0;
   }
@@ -1459,6 +1669,9 @@ int rhizome_delete_manifest_retry(sqlite_retry_state *retry, const char *manifes
   sqlite3_bind_text(statement, 1, manifestid, -1, SQLITE_STATIC);
   if (_sqlite_exec_prepared(__WHENCE__, LOG_LEVEL_ERROR, retry, statement) == -1)
     return -1;
+  unsigned char bid[RHIZOME_MANIFEST_ID_BYTES];
+  if (fromhexstr(bid, manifestid, sizeof bid) == 0)
+    rhizome_version_cache_forget(bid);
   return sqlite3_changes(rhizome_db) ? 0 : 1;
 }
 
@@ -1593,23 +1806,34 @@ int rhizome_is_bar_interesting(unsigned char *bar){
   if (m && m->version >= version)
     RETURN(0);
   
+  // do we already know that we have this bundle [or later]?
+  int64_t cached_version;
+  if (rhizome_version_cache_lookup(&bar[RHIZOME_BAR_PREFIX_OFFSET], RHIZOME_BAR_PREFIX_BYTES, &cached_version)
+      && cached_version >= version)
+    RETURN(0);
+  
   // do we have this bundle [or later]?
   sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
-  sqlite3_stmt *statement = sqlite_prepare(&retry, 
+  sqlite3_stmt *statement = sqlite_prepare_cached(&retry, 
     "SELECT id, version FROM manifests WHERE id like ? and version >= ?");
+  if (!statement)
+    RETURN(-1);
   
   sqlite3_bind_text(statement, 1, id_hex, -1, SQLITE_STATIC);
   sqlite3_bind_int64(statement, 2, version);
   
   if (sqlite_step_retry(&retry, statement) == SQLITE_ROW){
+    const char *q_id = (const char *) sqlite3_column_text(statement, 0);
+    long long q_version = (long long) sqlite3_column_int64(statement, 1);
     if (0){
-      const char *q_id = (const char *) sqlite3_column_text(statement, 0);
-      long long q_version = (long long) sqlite3_column_int64(statement, 1);
       DEBUGF("Already have %s, %lld (vs %s, %lld)", q_id, q_version, id_hex, version);
     }
+    unsigned char q_bid[RHIZOME_MANIFEST_ID_BYTES];
+    if (q_id && fromhexstr(q_bid, q_id, sizeof q_bid) == 0)
+      rhizome_version_cache_store(q_bid, q_version);
     ret=0;
   }  
-  sqlite3_finalize(statement);
+  sqlite_release(statement);
 
   time_ms_t end_time=gettime_ms();
   lookup_time=end_time-start_time;
@@ -27,6 +27,10 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "strbuf_helpers.h"
 #include "overlay_address.h"
 
+/* The most nodes that a payload will be fetched from at once over MDP.
+ */
+#define RHIZOME_FETCH_MAX_PEERS 8
+
 /* Represents a queued fetch of a bundle payload, for which the manifest is already known.
  */
 struct rhizome_fetch_candidate {
@@ -38,9 +42,25 @@ struct rhizome_fetch_candidate {
   struct sockaddr_in peer_ipandport;
   unsigned char peer_sid[SID_SIZE];
 
+  /* Other nodes that have offered the same version, and can be fetched from over MDP as well. */
+  unsigned char swarm_sids[RHIZOME_FETCH_MAX_PEERS - 1][SID_SIZE];
+  int swarm_count;
+
   int priority;
 };
 
+/* A node that a payload is being fetched from over MDP.  Each is asked for a different set of
+ * blocks of the receive window, sized according to how fast it has been delivering them.
+ */
+struct rhizome_fetch_peer {
+  unsigned char sid[SID_SIZE];
+  uint32_t requested; // blocks of the receive window asked of this peer and not yet received
+  time_ms_t request_time; // when blocks were last requested from this peer
+  int request_bytes; // bytes received from this peer since request_time
+  int rate; // bytes per second received from this peer, zero if not known yet
+  int64_t bytes; // total bytes received from this peer
+};
+
 /* Represents an active fetch (in progress) of a bundle payload (.manifest != NULL) or of a bundle
  * manifest (.manifest == NULL).
  */
@@ -69,6 +89,8 @@ struct rhizome_fetch_slot {
   char request[1024];
   int request_len;
   int request_ofs;
+  /* Bytes of the response body we already have, if the server ignored our Range request */
+  int64_t http_skip;
 
   /* HTTP streaming reception of manifests */
   char manifest_buffer[1024];
@@ -81,15 +103,18 @@ struct rhizome_fetch_slot {
   unsigned char prefix[RHIZOME_MANIFEST_ID_BYTES];
   int prefix_length;
   int mdpIdleTimeout;
-  int mdpResponsesOutstanding;
   int mdpRXBlockLength;
-  uint32_t mdpRXBitmap;
-  unsigned char mdpRXWindow[32*200];
+  uint32_t mdpRXBitmap; // blocks of the receive window that arrived ahead of the ones before them
+  int64_t mdpRXWindowOrigin; // payload offset at which the window ring buffer starts
+  unsigned char mdpRXWindow[32*1024];
+  struct rhizome_fetch_peer swarm[RHIZOME_FETCH_MAX_PEERS];
+  int swarm_size;
 };
 
 static int rhizome_fetch_switch_to_mdp(struct rhizome_fetch_slot *slot);
 static int rhizome_fetch_mdp_requestblocks(struct rhizome_fetch_slot *slot);
 static int rhizome_fetch_mdp_requestmanifest(struct rhizome_fetch_slot *slot);
+static void rhizome_fetch_swarm_add(struct rhizome_fetch_slot *slot, const unsigned char *sid);
 
 /* Represents a queue of fetch candidates and a single active fetch for bundle payloads whose size
  * is less than a given threshold.
@@ -256,57 +281,150 @@ int rhizome_any_fetch_queued()
   return 0;
 }
 
-/* As defined below uses 64KB */
-#define RHIZOME_VERSION_CACHE_NYBLS 2 /* 256=2^8=2nybls */
-#define RHIZOME_VERSION_CACHE_SHIFT 1
-#define RHIZOME_VERSION_CACHE_SIZE 128
+/* In-memory index of the versions of the manifests held in the Rhizome database, so that advertised
+ * manifests and BARs can usually be checked without a database query.  The index is keyed on the
+ * bundle ID, and is set associative: the first bytes of the bundle ID (a public key, so uniformly
+ * distributed) select a bin, and the least recently used entry in a full bin is replaced.
+ *
+ * Only stored bundles are remembered; a miss falls back to the database and remembers the result.
+ * rhizome_store_bundle() and rhizome_delete_manifest_retry() keep the index coherent with this
+ * process' own changes.  Another process may store a newer version, so a remembered version that is
+ * older than an advertised one is always confirmed from the database.  Another process may also
+ * delete a bundle, so rhizome_version_cache_validate() empties the index whenever the count of
+ * deleted manifests in the database has changed.
+ *
+ * The number of entries is set by the rhizome.version_cache_size config option; zero disables it.
+ */
 #define RHIZOME_VERSION_CACHE_ASSOCIATIVITY 16
 
 struct rhizome_manifest_version_cache_slot {
-  unsigned char idprefix[24];
-  long long version;
+  unsigned char bid[RHIZOME_MANIFEST_ID_BYTES];
+  int64_t version;
+  // when this slot was last used, zero if the slot is empty
+  unsigned int used;
 };
 
-struct rhizome_manifest_version_cache_slot rhizome_manifest_version_cache[RHIZOME_VERSION_CACHE_SIZE][RHIZOME_VERSION_CACHE_ASSOCIATIVITY];
+static struct rhizome_manifest_version_cache_slot *version_cache = NULL;
+static unsigned int version_cache_bins = 0;
+static unsigned int version_cache_tick = 0;
+static long long version_cache_generation = -1;
 
-int rhizome_manifest_version_cache_store(rhizome_manifest *m)
+static int rhizome_version_cache_enabled()
 {
-  int bin=0;
-  int slot;
-  int i;
+  unsigned int bins = config.rhizome.version_cache_size / RHIZOME_VERSION_CACHE_ASSOCIATIVITY;
+  if (bins != version_cache_bins) {
+    if (version_cache)
+      free(version_cache);
+    version_cache = NULL;
+    version_cache_bins = 0;
+    if (bins) {
+      version_cache = emalloc_zero(bins * RHIZOME_VERSION_CACHE_ASSOCIATIVITY * sizeof(struct rhizome_manifest_version_cache_slot));
+      if (version_cache)
+	version_cache_bins = bins;
+    }
+  }
+  return version_cache_bins != 0;
+}
 
-  char *id=rhizome_manifest_get(m,"id",NULL,0);
-  if (!id) return 1; // dodgy manifest, so don't suggest that we want to RX it.
+static struct rhizome_manifest_version_cache_slot *rhizome_version_cache_bin(const unsigned char *bid)
+{
+  uint32_t hash = (bid[0] << 24) | (bid[1] << 16) | (bid[2] << 8) | bid[3];
+  return &version_cache[(hash % version_cache_bins) * RHIZOME_VERSION_CACHE_ASSOCIATIVITY];
+}
 
-  /* Work out bin number in cache */
-  for(i=0;i<RHIZOME_VERSION_CACHE_NYBLS;i++)
-    {
-      int nybl=hexvalue(id[i]);
-      bin=(bin<<4)|nybl;
+/* Find the index entry whose bundle ID starts with the given bytes.  At least the first
+ * RHIZOME_BAR_PREFIX_BYTES must be given.
+ */
+static struct rhizome_manifest_version_cache_slot *rhizome_version_cache_find(const unsigned char *bid, size_t len)
+{
+  if (!rhizome_version_cache_enabled())
+    return NULL;
+  struct rhizome_manifest_version_cache_slot *bin = rhizome_version_cache_bin(bid);
+  int i;
+  for (i = 0; i < RHIZOME_VERSION_CACHE_ASSOCIATIVITY; ++i) {
+    if (bin[i].used && memcmp(bin[i].bid, bid, len) == 0) {
+      bin[i].used = ++version_cache_tick;
+      return &bin[i];
     }
-  bin=bin>>RHIZOME_VERSION_CACHE_SHIFT;
+  }
+  return NULL;
+}
 
-  slot=random()%RHIZOME_VERSION_CACHE_ASSOCIATIVITY;
-  struct rhizome_manifest_version_cache_slot *entry
-    =&rhizome_manifest_version_cache[bin][slot];
-  unsigned long long manifest_version = rhizome_manifest_get_ll(m,"version");
+/* Return 1 and set *version if the index holds the version of a stored bundle whose ID starts with
+ * the given bytes, 0 if it is not known.
+ */
+int rhizome_version_cache_lookup(const unsigned char *bid, size_t len, int64_t *version)
+{
+  struct rhizome_manifest_version_cache_slot *entry = rhizome_version_cache_find(bid, len);
+  if (!entry)
+    return 0;
+  *version = entry->version;
+  return 1;
+}
 
-  entry->version=manifest_version;
-  for(i=0;i<24;i++)
-    {
-      int byte=(hexvalue(id[(i*2)])<<4)|hexvalue(id[(i*2)+1]);
-      entry->idprefix[i]=byte;
-    }
+/* Remember that the given version of a bundle is stored in the database.
+ */
+void rhizome_version_cache_store(const unsigned char *bid, int64_t version)
+{
+  struct rhizome_manifest_version_cache_slot *entry = rhizome_version_cache_find(bid, RHIZOME_MANIFEST_ID_BYTES);
+  if (!entry) {
+    if (!version_cache_bins)
+      return;
+    struct rhizome_manifest_version_cache_slot *bin = rhizome_version_cache_bin(bid);
+    int i;
+    entry = &bin[0];
+    for (i = 0; i < RHIZOME_VERSION_CACHE_ASSOCIATIVITY && entry->used; ++i)
+      if (bin[i].used < entry->used)
+	entry = &bin[i];
+    bcopy(bid, entry->bid, RHIZOME_MANIFEST_ID_BYTES);
+    entry->used = ++version_cache_tick;
+  }
+  entry->version = version;
+}
+
+/* Forget any version of the given bundle, once its manifest has been removed from the database.
+ */
+void rhizome_version_cache_forget(const unsigned char *bid)
+{
+  struct rhizome_manifest_version_cache_slot *entry = rhizome_version_cache_find(bid, RHIZOME_MANIFEST_ID_BYTES);
+  if (entry)
+    entry->used = 0;
+}
 
+/* Forget every remembered version if any manifest has been deleted from the database since the
+ * index was last checked, by this process or another.  A trigger counts the deletions in the
+ * GENERATION table, so this is a single cheap query; it is done once per advertisement frame and
+ * before starting a fetch, rather than on every lookup.
+ */
+void rhizome_version_cache_validate()
+{
+  if (!rhizome_db || !rhizome_version_cache_enabled())
+    return;
+  long long generation = -1;
+  sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
+  sqlite3_stmt *statement = sqlite_prepare_cached(&retry, "SELECT count FROM GENERATION;");
+  if (!statement || sqlite_exec_int64_prepared(&retry, &generation, statement) != 1)
+    generation = -1;
+  // if we can't tell, trust nothing we remember
+  if (generation == -1 || generation != version_cache_generation) {
+    if (config.debug.rhizome && version_cache_generation != -1)
+      DEBUGF("Manifests have been deleted, forgetting all remembered versions");
+    bzero(version_cache, version_cache_bins * RHIZOME_VERSION_CACHE_ASSOCIATIVITY * sizeof(struct rhizome_manifest_version_cache_slot));
+    version_cache_generation = generation;
+  }
+}
+
+int rhizome_manifest_version_cache_store(rhizome_manifest *m)
+{
+  rhizome_version_cache_store(m->cryptoSignPublic, m->version);
   return 0;
 }
 
+/* Return -1 if we already hold the given version of the manifest or a newer one, 0 if the manifest
+ * is newer than what we hold, or if we do not hold it at all.
+ */
 int rhizome_manifest_version_cache_lookup(rhizome_manifest *m)
 {
-  int bin=0;
-  int slot;
-  int i;
-
   char id[RHIZOME_MANIFEST_ID_STRLEN + 1];
   if (!rhizome_manifest_get(m, "id", id, sizeof id))
     // dodgy manifest, we don't want to receive it
@@ -314,122 +432,28 @@ int rhizome_manifest_version_cache_lookup(rhizome_manifest *m)
   str_toupper_inplace(id);
   m->version = rhizome_manifest_get_ll(m, "version");
   
-  // TODO, work out why the cache was failing and fix it, then prove that it is faster than accessing the database.
+  int64_t cached_version;
+  if (rhizome_version_cache_lookup(m->cryptoSignPublic, RHIZOME_MANIFEST_ID_BYTES, &cached_version)
+      && cached_version >= m->version)
+    return -1;
   
-  // skip the cache for now
   long long dbVersion = -1;
-  if (sqlite_exec_int64(&dbVersion, "SELECT version FROM MANIFESTS WHERE id='%s';", id) == -1)
+  sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
+  sqlite3_stmt *statement = sqlite_prepare_cached(&retry, "SELECT version FROM MANIFESTS WHERE id = ?;");
+  if (!statement)
     return WHY("Select failure");
-  if (dbVersion >= m->version) {
-    if (0) WHYF("We already have %s (%lld vs %lld)", id, dbVersion, m->version);
-    return -1;
-  }
-  return 0;
-
-  /* Work out bin number in cache */
-  for(i=0;i<RHIZOME_VERSION_CACHE_NYBLS;i++)
-    {
-      int nybl=hexvalue(id[i]);
-      bin=(bin<<4)|nybl;
-    }
-  bin=bin>>RHIZOME_VERSION_CACHE_SHIFT;
-  
-  for(slot=0;slot<RHIZOME_VERSION_CACHE_ASSOCIATIVITY;slot++)
-    {
-      struct rhizome_manifest_version_cache_slot *entry
-	=&rhizome_manifest_version_cache[bin][slot];
-      for(i=0;i<24;i++)
-	{
-	  int byte=
-	    (hexvalue(id[(i*2)])<<4)
-	    |hexvalue(id[(i*2)+1]);
-	  if (byte!=entry->idprefix[i]) break;
-	}
-      if (i==24) {
-	/* Entries match -- so check version */
-	long long rev = rhizome_manifest_get_ll(m,"version");
-	if (1) DEBUGF("cached version %lld vs manifest version %lld", entry->version,rev);
-	if (rev > entry->version) {
-	  /* If we only have an old version, try refreshing the cache
-	     by querying the database */
-	  if (sqlite_exec_int64(&entry->version, "select version from manifests where id='%s'", id) != 1)
-	    return WHY("failed to select stored manifest version");
-	  DEBUGF("Refreshed stored version from database: entry->version=%lld", entry->version);
-	}
-	if (rev < entry->version) {
-	  /* the presented manifest is older than we have.
-	     This allows the caller to know that they can tell whoever gave them the
-	     manifest it's time to get with the times.  May or not ever be
-	     implemented, but it would be nice. XXX */
-	  WHYF("cached version is NEWER than presented version (%lld is newer than %lld)",
-	      entry->version,rev);
-	  return -2;
-	} else if (rev<=entry->version) {
-	  /* the presented manifest is already stored. */	   
-	  if (1) DEBUG("cached version is NEWER/SAME as presented version");
-	  return -1;
-	} else {
-	  /* the presented manifest is newer than we have */
-	  DEBUG("cached version is older than presented version");
-	  return 0;
-	}
-      }
-    }
-
-  DEBUG("Not in manifest cache");
-
-  /* Not in cache, so all is well, well, maybe.
-     What we do know is that it is unlikely to be in the database, so it probably
-     doesn't hurt to try to receive it.  
-
-     Of course, we can just ask the database if it is there already, and populate
-     the cache in the process if we find it.  The tradeoff is that the whole point
-     of the cache is to AVOID database lookups, not incurr them whenever the cache
-     has a negative result.  But if we don't ask the database, then we can waste
-     more effort fetching the file associated with the manifest, and will ultimately
-     incurr a database lookup (and more), so while it seems a little false economy
-     we need to do the lookup now.
-
-     What this all suggests is that we need fairly high associativity so that misses
-     are rare events. But high associativity then introduces a linear search cost,
-     although that is unlikely to be nearly as much cost as even thinking about a
-     database query.
-
-     It also says that on a busy network that things will eventually go pear-shaped
-     and require regular database queries, and that memory allowing, we should use
-     a fairly large cache here.
- */
-  long long manifest_version = rhizome_manifest_get_ll(m, "version");
-  long long count;
-  switch (sqlite_exec_int64(&count, "select count(*) from manifests where id='%s' and version>=%lld", id, manifest_version)) {
+  sqlite3_bind_text(statement, 1, id, -1, SQLITE_STATIC);
+  switch (sqlite_exec_int64_prepared(&retry, &dbVersion, statement)) {
     case -1:
-      return WHY("database error reading stored manifest version");
+      return WHY("Select failure");
     case 1:
-      if (count) {
-	/* Okay, we have a stored version which is newer, so update the cache
-	  using a random replacement strategy. */
-	long long stored_version;
-	if (sqlite_exec_int64(&stored_version, "select version from manifests where id='%s'", id) < 1)
-	  return WHY("database error reading stored manifest version"); // database is broken, we can't confirm that it is here
-	DEBUGF("stored version=%lld, manifest_version=%lld (not fetching; remembering in cache)",
-	    stored_version,manifest_version);
-	slot=random()%RHIZOME_VERSION_CACHE_ASSOCIATIVITY;
-	struct rhizome_manifest_version_cache_slot *entry = &rhizome_manifest_version_cache[bin][slot];
-	entry->version=stored_version;
-	for(i=0;i<24;i++)
-	  {
-	    int byte=(hexvalue(id[(i*2)])<<4)|hexvalue(id[(i*2)+1]);
-	    entry->idprefix[i]=byte;
-	  }
-	/* Finally, say that it isn't worth RXing this manifest */
-	return stored_version > manifest_version ? -2 : -1;
-      }
+      rhizome_version_cache_store(m->cryptoSignPublic, dbVersion);
       break;
-    default:
-      return WHY("bad select result");
   }
-  /* At best we hold an older version of this manifest, and at worst we
-     don't hold any copy. */
+  if (dbVersion >= m->version) {
+    if (0) WHYF("We already have %s (%lld vs %lld)", id, dbVersion, m->version);
+    return -1;
+  }
   return 0;
 }
 
@@ -518,13 +542,25 @@ static int schedule_fetch(struct rhizome_fetch_slot *slot)
 {
   IN();
   int sock = -1;
-  /* TODO Don't forget to implement resume */
   slot->start_time=gettime_ms();
+  slot->http_skip=0;
   if (create_rhizome_import_dir() == -1)
     RETURN(WHY("Unable to create import directory"));
   if (slot->manifest) {
-    if (rhizome_open_write(&slot->write_state, slot->manifest->fileHexHash, slot->manifest->fileLength, RHIZOME_PRIORITY_DEFAULT))
+    // carry on from where an earlier, interrupted fetch of the same payload stopped
+    int resumed = rhizome_resume_write(&slot->write_state, slot->manifest->fileHexHash, slot->manifest->fileLength);
+    if (resumed == -1)
+      RETURN(-1);
+    if (resumed == 1 && rhizome_open_write(&slot->write_state, slot->manifest->fileHexHash, slot->manifest->fileLength, RHIZOME_PRIORITY_DEFAULT))
       RETURN(-1);
+    if (slot->write_state.file_offset > 0) {
+      strbuf r = strbuf_local(slot->request, sizeof slot->request);
+      strbuf_sprintf(r, "GET /rhizome/file/%s HTTP/1.0\r\nRange: bytes=%lld-\r\n\r\n",
+	  slot->manifest->fileHexHash, (long long)slot->write_state.file_offset);
+      if (strbuf_overrun(r))
+	RETURN(WHY("request overrun"));
+      slot->request_len = strbuf_len(r);
+    }
   } else {
     slot->write_state.blob_rowid=-1;
     slot->write_state.file_offset=0;
@@ -670,6 +706,7 @@ rhizome_fetch(struct rhizome_fetch_slot *slot, rhizome_manifest *m, const struct
   }
 
   // If we already have this version or newer, do not fetch.
+  rhizome_version_cache_validate();
   if (rhizome_manifest_version_cache_lookup(m)) {
     if (config.debug.rhizome_rx)
       DEBUG("   fetch not started -- already have that version or newer");
@@ -742,6 +779,9 @@ rhizome_fetch(struct rhizome_fetch_slot *slot, rhizome_manifest *m, const struct
   bcopy(m->cryptoSignPublic,slot->bid,RHIZOME_MANIFEST_ID_BYTES);
   slot->bidVersion=m->version;
   slot->bidP=1;
+  bzero(&slot->swarm[0], sizeof slot->swarm[0]);
+  bcopy(peersid,slot->swarm[0].sid,SID_SIZE);
+  slot->swarm_size=1;
 
   /* Don't provide a filename, because we will stream the file straight into
      the database. */
@@ -817,6 +857,11 @@ static void rhizome_start_next_queued_fetch(struct rhizome_fetch_slot *slot)
       case SLOTBUSY:
 	OUT(); return;
       case STARTED:
+	{
+	  int k;
+	  for (k = 0; k < c->swarm_count; ++k)
+	    rhizome_fetch_swarm_add(slot, c->swarm_sids[k]);
+	}
 	c->manifest = NULL;
 	rhizome_fetch_unqueue(q, i);
 	OUT(); return;
@@ -913,6 +958,14 @@ int rhizome_suggest_queue_manifest_import(rhizome_manifest *m, const struct sock
     RETURN(-1);
   }
 
+  // If we are already fetching this version, the sender can help.
+  if (rhizome_fetch_add_swarm_peer(m->cryptoSignPublic, RHIZOME_MANIFEST_ID_BYTES, m->version, peersid)) {
+    if (config.debug.rhizome_rx)
+      DEBUG("   already fetching or queued that version");
+    rhizome_manifest_free(m);
+    RETURN(0);
+  }
+
   if (config.debug.rhizome_rx) {
     long long stored_version;
     if (sqlite_exec_int64(&stored_version, "select version from manifests where id='%s'", bid) > 0)
@@ -996,6 +1049,7 @@ int rhizome_suggest_queue_manifest_import(rhizome_manifest *m, const struct sock
   c->priority = priority;
   c->peer_ipandport = *peerip;
   bcopy(peersid,c->peer_sid,SID_SIZE);
+  c->swarm_count = 0;
 
   if (config.debug.rhizome_rx) {
     DEBUG("Rhizome fetch queues:");
@@ -1048,8 +1102,9 @@ static int rhizome_fetch_close(struct rhizome_fetch_slot *slot)
     rhizome_manifest_free(slot->manifest);
   slot->manifest = NULL;
 
+  // keep whatever we received, so a later fetch of the same payload can resume
   if (slot->write_state.buffer)
-    rhizome_fail_write(&slot->write_state);
+    rhizome_suspend_write(&slot->write_state);
 
   // Release the fetch slot.
   slot->state = RHIZOME_FETCH_FREE;
@@ -1110,21 +1165,82 @@ static int rhizome_fetch_mdp_touch_timeout(struct rhizome_fetch_slot *slot)
   return 0;
 }
 
-static int rhizome_fetch_mdp_requestblocks(struct rhizome_fetch_slot *slot)
+#define WINDOW_BLOCK(i) (0x80000000u >> (i))
+
+static int count_blocks(uint32_t blocks)
+{
+  int n = 0;
+  for (; blocks; blocks &= blocks - 1)
+    ++n;
+  return n;
+}
+
+/* Pick up to 'count' of the given blocks, starting from the front of the window, or from the back if
+ * 'from_end' is set.
+ */
+static uint32_t pick_blocks(uint32_t blocks, int count, int from_end)
+{
+  uint32_t picked = 0;
+  int i;
+  for (i = 0; i < 32 && count > 0; ++i) {
+    uint32_t block = WINDOW_BLOCK(from_end ? 31 - i : i);
+    if (blocks & block) {
+      picked |= block;
+      --count;
+    }
+  }
+  return picked;
+}
+
+/* Return the blocks of the receive window that we still need, ie, that lie within the payload and
+ * have not arrived yet.
+ */
+static uint32_t rhizome_fetch_mdp_missing(struct rhizome_fetch_slot *slot)
+{
+  int64_t remaining = slot->write_state.file_length - (slot->write_state.file_offset + slot->write_state.data_size);
+  int64_t blocks = (remaining + slot->mdpRXBlockLength - 1) / slot->mdpRXBlockLength;
+  uint32_t window = blocks <= 0 ? 0 : blocks >= 32 ? 0xFFFFFFFF : ~(0xFFFFFFFFu >> blocks);
+  return window & ~slot->mdpRXBitmap;
+}
+
+static struct rhizome_fetch_peer *rhizome_fetch_find_peer(struct rhizome_fetch_slot *slot, const unsigned char *sid)
+{
+  int i;
+  for (i = 0; i < slot->swarm_size; ++i)
+    if (memcmp(slot->swarm[i].sid, sid, SID_SIZE) == 0)
+      return &slot->swarm[i];
+  return NULL;
+}
+
+/* How many blocks of the window to ask a peer for at once.  The window is shared out in proportion to
+ * the rate that each peer has been delivering.  Peers we know nothing about yet get an average share.
+ */
+static int rhizome_fetch_mdp_share(struct rhizome_fetch_slot *slot, struct rhizome_fetch_peer *peer)
+{
+  int64_t total = 0;
+  int known = 0;
+  int i;
+  for (i = 0; i < slot->swarm_size; ++i) {
+    if (slot->swarm[i].rate) {
+      total += slot->swarm[i].rate;
+      ++known;
+    }
+  }
+  int64_t average = known ? total / known : 1;
+  total += average * (slot->swarm_size - known);
+  int64_t rate = peer->rate ? peer->rate : average;
+  int share = 32 * rate / total;
+  return share < 1 ? 1 : share;
+}
+
+static int rhizome_fetch_mdp_request_peer(struct rhizome_fetch_slot *slot, struct rhizome_fetch_peer *peer)
 {
-  IN();
-  // only issue new requests every 133ms.  
-  // we automatically re-issue once we have received all packets in this
-  // request also, so if there is no packet loss, we can go substantially
-  // faster.  Optimising behaviour when there is no packet loss is an
-  // outstanding task.
-  
   overlay_mdp_frame mdp;
 
   bzero(&mdp,sizeof(mdp));
   bcopy(my_subscriber->sid,mdp.out.src.sid,SID_SIZE);
   mdp.out.src.port=MDP_PORT_RHIZOME_RESPONSE;
-  bcopy(slot->peer_sid,mdp.out.dst.sid,SID_SIZE);
+  bcopy(peer->sid,mdp.out.dst.sid,SID_SIZE);
   mdp.out.dst.port=MDP_PORT_RHIZOME_REQUEST;
   mdp.out.ttl=1;
   mdp.packetTypeAndFlags=MDP_TX;
@@ -1133,28 +1249,154 @@ static int rhizome_fetch_mdp_requestblocks(struct rhizome_fetch_slot *slot)
   mdp.out.payload_length=RHIZOME_MANIFEST_ID_BYTES+8+8+4+2;
   bcopy(slot->bid,&mdp.out.payload[0],RHIZOME_MANIFEST_ID_BYTES);
 
+  // the bitmap tells the peer which blocks NOT to send
   write_uint64(&mdp.out.payload[RHIZOME_MANIFEST_ID_BYTES],slot->bidVersion);
   write_uint64(&mdp.out.payload[RHIZOME_MANIFEST_ID_BYTES+8],slot->write_state.file_offset + slot->write_state.data_size);
-  write_uint32(&mdp.out.payload[RHIZOME_MANIFEST_ID_BYTES+8+8],slot->mdpRXBitmap);
+  write_uint32(&mdp.out.payload[RHIZOME_MANIFEST_ID_BYTES+8+8],~peer->requested);
   write_uint16(&mdp.out.payload[RHIZOME_MANIFEST_ID_BYTES+8+8+4],slot->mdpRXBlockLength);  
 
   if (config.debug.rhizome_tx)
-    DEBUGF("src sid=%s, dst sid=%s, mdpRXWindowStart=0x%x",
+    DEBUGF("src sid=%s, dst sid=%s, mdpRXWindowStart=0x%x, blocks=0x%08x",
 	   alloca_tohex_sid(mdp.out.src.sid),alloca_tohex_sid(mdp.out.dst.sid),
-	   slot->write_state.file_offset + slot->write_state.data_size);
+	   slot->write_state.file_offset + slot->write_state.data_size, peer->requested);
 
-  overlay_mdp_dispatch(&mdp,0 /* system generated */,NULL,0);
-  
-  // remember when we sent the request so that we can adjust the inter-request
-  // interval based on how fast the packets arrive.
-  slot->mdpResponsesOutstanding=32; // TODO: set according to bitmap
+  // remember when we sent the request so that we can work out how fast this peer delivers
+  peer->request_time = gettime_ms();
+  peer->request_bytes = 0;
+  return overlay_mdp_dispatch(&mdp,0 /* system generated */,NULL,0);
+}
+
+/* Share out all the blocks of the window that we are still missing among the peers in the swarm, and
+ * ask each for its share.  Called when starting, and whenever the transfer stalls.
+ */
+static int rhizome_fetch_mdp_requestblocks(struct rhizome_fetch_slot *slot)
+{
+  IN();
+  uint32_t missing = rhizome_fetch_mdp_missing(slot);
+  int i;
+  for (i = 0; i < slot->swarm_size; ++i) {
+    struct rhizome_fetch_peer *peer = &slot->swarm[i];
+    // a peer that has not delivered anything since we last asked is holding us up
+    if (peer->requested && peer->request_bytes == 0 && peer->rate > 1)
+      peer->rate /= 2;
+    peer->requested = 0;
+  }
+  for (i = 0; i < slot->swarm_size && missing; ++i) {
+    struct rhizome_fetch_peer *peer = &slot->swarm[i];
+    peer->requested = pick_blocks(missing, rhizome_fetch_mdp_share(slot, peer), 0);
+    missing &= ~peer->requested;
+  }
+  // rounding may leave some over
+  slot->swarm[0].requested |= missing;
+  for (i = 0; i < slot->swarm_size; ++i)
+    if (slot->swarm[i].requested)
+      rhizome_fetch_mdp_request_peer(slot, &slot->swarm[i]);
 
   rhizome_fetch_mdp_touch_timeout(slot);
-  
   RETURN(0);
   OUT();
 }
 
+/* Give a peer that has delivered everything we asked of it something more to do: blocks of the
+ * window that nobody has been asked for yet, or failing that, half of those we are still waiting on
+ * from the slowest peer.
+ */
+static void rhizome_fetch_mdp_peer_ready(struct rhizome_fetch_slot *slot, struct rhizome_fetch_peer *peer)
+{
+  time_ms_t now = gettime_ms();
+  if (peer->request_bytes && now > peer->request_time) {
+    int rate = (int64_t)peer->request_bytes * 1000 / (now - peer->request_time);
+    peer->rate = peer->rate ? (peer->rate * 3 + rate) / 4 : rate;
+    if (peer->rate < 1)
+      peer->rate = 1;
+  }
+  uint32_t pending = 0;
+  int i;
+  for (i = 0; i < slot->swarm_size; ++i)
+    pending |= slot->swarm[i].requested;
+  uint32_t blocks = pick_blocks(rhizome_fetch_mdp_missing(slot) & ~pending, rhizome_fetch_mdp_share(slot, peer), 0);
+  if (!blocks) {
+    struct rhizome_fetch_peer *straggler = NULL;
+    int most = 0;
+    for (i = 0; i < slot->swarm_size; ++i) {
+      int n = count_blocks(slot->swarm[i].requested);
+      if (&slot->swarm[i] != peer && n > most) {
+	straggler = &slot->swarm[i];
+	most = n;
+      }
+    }
+    if (straggler) {
+      if (most > 1) {
+	blocks = pick_blocks(straggler->requested, most / 2, 1);
+	straggler->requested &= ~blocks;
+      } else {
+	// ask both for the last block, and take whichever arrives first
+	blocks = straggler->requested;
+      }
+    }
+  }
+  peer->requested = blocks;
+  if (blocks)
+    rhizome_fetch_mdp_request_peer(slot, peer);
+}
+
+/* Start fetching from another node that has offered the payload this slot is fetching, if the swarm
+ * is not already full.
+ */
+static void rhizome_fetch_swarm_add(struct rhizome_fetch_slot *slot, const unsigned char *sid)
+{
+  int limit = config.rhizome.mdp.swarm_peers;
+  if (limit > RHIZOME_FETCH_MAX_PEERS)
+    limit = RHIZOME_FETCH_MAX_PEERS;
+  if (slot->swarm_size >= limit || rhizome_fetch_find_peer(slot, sid))
+    return;
+  struct rhizome_fetch_peer *peer = &slot->swarm[slot->swarm_size++];
+  bzero(peer, sizeof *peer);
+  bcopy(sid, peer->sid, SID_SIZE);
+  if (config.debug.rhizome_rx)
+    DEBUGF("Adding %s to swarm for slot=%d (%d peers)", alloca_tohex_sid(sid), slotno(slot), slot->swarm_size);
+  if (slot->state == RHIZOME_FETCH_RXFILEMDP)
+    rhizome_fetch_mdp_peer_ready(slot, peer);
+}
+
+/* Called whenever a node advertises a bundle.  If we are already fetching or about to fetch that
+ * version of the bundle, then remember the node so that it can help with the fetch.  Returns 1 if
+ * the bundle is already being fetched or queued, 0 otherwise.
+ */
+int rhizome_fetch_add_swarm_peer(const unsigned char *bid_prefix, int prefix_length, int64_t version,
+				 const unsigned char *peersid)
+{
+  int i, j;
+  for (i = 0; i < NQUEUES; ++i) {
+    struct rhizome_fetch_queue *q = &rhizome_fetch_queues[i];
+    struct rhizome_fetch_slot *slot = &q->active;
+    if (slot->state != RHIZOME_FETCH_FREE && slot->manifest
+	&& slot->manifest->version == version
+	&& memcmp(bid_prefix, slot->manifest->cryptoSignPublic, prefix_length) == 0) {
+      rhizome_fetch_swarm_add(slot, peersid);
+      return 1;
+    }
+    for (j = 0; j < q->candidate_queue_size; ++j) {
+      struct rhizome_fetch_candidate *c = &q->candidate_queue[j];
+      if (!c->manifest)
+	break;
+      if (c->manifest->version == version
+	  && memcmp(bid_prefix, c->manifest->cryptoSignPublic, prefix_length) == 0) {
+	if (memcmp(c->peer_sid, peersid, SID_SIZE) == 0)
+	  return 1;
+	int k;
+	for (k = 0; k < c->swarm_count; ++k)
+	  if (memcmp(c->swarm_sids[k], peersid, SID_SIZE) == 0)
+	    return 1;
+	if (c->swarm_count < RHIZOME_FETCH_MAX_PEERS - 1)
+	  bcopy(peersid, c->swarm_sids[c->swarm_count++], SID_SIZE);
+	return 1;
+      }
+    }
+  }
+  return 0;
+}
+
 static int rhizome_fetch_mdp_requestmanifest(struct rhizome_fetch_slot *slot)
 {
   if (slot->prefix_length<1||slot->prefix_length>32) {
@@ -1223,6 +1465,7 @@ static int rhizome_fetch_switch_to_mdp(struct rhizome_fetch_slot *slot)
     slot->alarm.poll.fd = -1;
   }
   unschedule(&slot->alarm);
+  slot->http_skip = 0;
 
   /* Begin MDP fetch process.
      1. Send initial request.
@@ -1249,6 +1492,12 @@ static int rhizome_fetch_switch_to_mdp(struct rhizome_fetch_slot *slot)
     slot->mdpIdleTimeout=config.rhizome.idle_timeout; // give up if nothing received for 5 seconds
     slot->mdpRXBitmap=0x00000000; // no blocks received yet
     slot->mdpRXBlockLength=config.rhizome.rhizome_mdp_block_size; // Rhizome over MDP block size
+    if (slot->mdpRXBlockLength > sizeof slot->mdpRXWindow / 32)
+      slot->mdpRXBlockLength = sizeof slot->mdpRXWindow / 32;
+    slot->mdpRXWindowOrigin=slot->write_state.file_offset + slot->write_state.data_size;
+    int i;
+    for (i = 0; i < slot->swarm_size; ++i)
+      slot->swarm[i].requested = 0;
     rhizome_fetch_mdp_requestblocks(slot);    
   } else {
     /* We are requesting a manifest, which is stateless, except that we eventually
@@ -1298,6 +1547,14 @@ int rhizome_write_content(struct rhizome_fetch_slot *slot, char *buffer, int byt
 {
   IN();
   
+  // Skip over the part of the payload that we already have
+  if (slot->http_skip > 0 && bytes > 0) {
+    int skip = bytes < slot->http_skip ? bytes : slot->http_skip;
+    buffer += skip;
+    bytes -= skip;
+    slot->http_skip -= skip;
+  }
+  
   if (bytes<=0)
     RETURN(0);
   
@@ -1365,6 +1622,12 @@ int rhizome_write_content(struct rhizome_fetch_slot *slot, char *buffer, int byt
 	} else {
 	  INFOF("Completed MDP request from %s  for file %s",
 		alloca_tohex_sid(slot->peer_sid), slot->manifest->fileHexHash);
+	  if (config.debug.rhizome_rx) {
+	    int i;
+	    for (i = 0; i < slot->swarm_size; ++i)
+	      DEBUGF("   received %lld bytes from %s (%d bytes/sec)", (long long)slot->swarm[i].bytes,
+		     alloca_tohex_sid(slot->swarm[i].sid), slot->swarm[i].rate);
+	  }
 	}
       }
     } else {
@@ -1405,38 +1668,78 @@ int rhizome_write_content(struct rhizome_fetch_slot *slot, char *buffer, int byt
   OUT();
 }
 
+/* Take a block of payload that arrived over MDP.  Blocks that arrive ahead of those before them are
+ * held in the window until the gap is filled, so that each peer in the swarm can deliver its share
+ * independently.
+ */
+static void rhizome_fetch_mdp_received_block(struct rhizome_fetch_slot *slot, const unsigned char *peersid,
+					     uint64_t offset, int count, unsigned char *bytes)
+{
+  int64_t start = slot->write_state.file_offset + slot->write_state.data_size;
+  int block_length = slot->mdpRXBlockLength;
+  if (count <= 0 || count > block_length || offset < start || (offset - start) % block_length)
+    return;
+  // only the last block of the payload may be short
+  if (count != block_length && offset + count != slot->write_state.file_length)
+    return;
+  int i = (offset - start) / block_length;
+  if (i >= 32 || (slot->mdpRXBitmap & WINDOW_BLOCK(i)))
+    return;
+
+  struct rhizome_fetch_peer *sender = rhizome_fetch_find_peer(slot, peersid);
+  if (sender) {
+    sender->request_bytes += count;
+    sender->bytes += count;
+  }
+  int j;
+  for (j = 0; j < slot->swarm_size; ++j)
+    slot->swarm[j].requested &= ~WINDOW_BLOCK(i);
+  rhizome_fetch_mdp_touch_timeout(slot);
+
+  if (i > 0) {
+    int ring = ((offset - slot->mdpRXWindowOrigin) / block_length) % 32;
+    bcopy(bytes, &slot->mdpRXWindow[ring * block_length], count);
+    slot->mdpRXBitmap |= WINDOW_BLOCK(i);
+    if (sender && !sender->requested)
+      rhizome_fetch_mdp_peer_ready(slot, sender);
+    return;
+  }
+
+  // write out this block and any that were waiting for it, sliding the window along
+  while (1) {
+    if (rhizome_write_content(slot, (char *)bytes, count) || slot->state != RHIZOME_FETCH_RXFILEMDP)
+      return; // finished or failed, slot is closed
+    slot->mdpRXBitmap <<= 1;
+    for (j = 0; j < slot->swarm_size; ++j)
+      slot->swarm[j].requested <<= 1;
+    if (!(slot->mdpRXBitmap & WINDOW_BLOCK(0)))
+      break;
+    offset = slot->write_state.file_offset + slot->write_state.data_size;
+    count = slot->write_state.file_length - offset;
+    if (count > block_length)
+      count = block_length;
+    bytes = &slot->mdpRXWindow[((offset - slot->mdpRXWindowOrigin) / block_length) % 32 * block_length];
+  }
+  // the window has room for more blocks now
+  for (j = 0; j < slot->swarm_size; ++j)
+    if (!slot->swarm[j].requested)
+      rhizome_fetch_mdp_peer_ready(slot, &slot->swarm[j]);
+}
+
 int rhizome_received_content(unsigned char *bidprefix,
 			     uint64_t version, uint64_t offset,
-			     int count,unsigned char *bytes,int type)
+			     int count,unsigned char *bytes,int type,
+			     const unsigned char *peersid)
 {
   IN();
   int i;
   for(i=0;i<NQUEUES;i++) {
     struct rhizome_fetch_slot *slot=&rhizome_fetch_queues[i].active;
     if (slot->state==RHIZOME_FETCH_RXFILEMDP&&slot->bidP) {
-      if (!memcmp(slot->bid,bidprefix,16))
-	{
-	  if (slot->write_state.file_offset + slot->write_state.data_size==offset) {
-	    if (!rhizome_write_content(slot,(char *)bytes,count))
-	      {
-		rhizome_fetch_mdp_touch_timeout(slot);
-		slot->mdpResponsesOutstanding--;
-		if (slot->mdpResponsesOutstanding==0) {
-		  // We have received all responses, so immediately ask for more
-		  rhizome_fetch_mdp_requestblocks(slot);
-		}
-		
-		// TODO: Try flushing out stuck packets that we have kept due to
-		// packet loss / out-of-order delivery.
-	      }
-
-	    RETURN(0);
-	  } else {
-	    // TODO: Implement out-of-order buffering so that lost packets
-	    // don't cause wastage
-	  }
-	  RETURN(0);
-	}
+      if (!memcmp(slot->bid,bidprefix,16)) {
+	rhizome_fetch_mdp_received_block(slot, peersid, offset, count, bytes);
+	RETURN(0);
+      }
     }
   }  
 
@@ -1508,12 +1811,25 @@ void rhizome_fetch_poll(struct sched_ent *alarm)
 	    rhizome_fetch_switch_to_mdp(slot);
 	    return;
 	  }
-	  if (parts.code != 200) {
+	  if (parts.code != 200 && parts.code != 206) {
 	    if (config.debug.rhizome_rx)
 	      DEBUGF("Failed HTTP request: rhizome server returned %d != 200 OK", parts.code);
 	    rhizome_fetch_switch_to_mdp(slot);
 	    return;
 	  }
+	  int64_t offset = slot->write_state.file_offset + slot->write_state.data_size;
+	  if (parts.code == 206) {
+	    if (parts.range_start != offset) {
+	      if (config.debug.rhizome_rx)
+		DEBUGF("Failed HTTP request: requested content from %lld, got %lld", (long long)offset, parts.range_start);
+	      rhizome_fetch_switch_to_mdp(slot);
+	      return;
+	    }
+	  } else {
+	    // the server ignored our Range header, so discard what we already have
+	    slot->http_skip = offset;
+	    offset = 0;
+	  }
 	  if (parts.content_length == -1) {
 	    if (config.debug.rhizome_rx)
 	      DEBUGF("Invalid HTTP reply: missing Content-Length header");
@@ -1522,7 +1838,7 @@ void rhizome_fetch_poll(struct sched_ent *alarm)
 	  }
 	  if (slot->write_state.file_length==-1)
 	    slot->write_state.file_length=parts.content_length;
-	  else if (parts.content_length != slot->write_state.file_length)
+	  else if (parts.content_length + offset != slot->write_state.file_length)
 	    WARNF("Expected content length %lld, got %lld", slot->write_state.file_length, parts.content_length);
 	  /* We have all we need.  The file is already open, so just write out any initial bytes of
 	     the body we read.
@@ -1578,6 +1894,7 @@ int unpack_http_response(char *response, struct http_response_parts *parts)
   parts->code = -1;
   parts->reason = NULL;
   parts->content_length = -1;
+  parts->range_start = -1;
   parts->content_start = NULL;
   char *p = NULL;
   if (!str_startswith(response, "HTTP/1.0 ", (const char **)&p)) {
@@ -1612,6 +1929,17 @@ int unpack_http_response(char *response, struct http_response_parts *parts)
 	  DEBUGF("Invalid HTTP reply: malformed Content-Length header");
 	RETURN(-1);
       }
+    } else if (strcase_startswith(p, "Content-Range:", (const char **)&p)) {
+      while (*p == ' ')
+	++p;
+      if (!strcase_startswith(p, "bytes ", (const char **)&p) || !isdigit(*p)) {
+	if (config.debug.rhizome_rx)
+	  DEBUGF("Invalid HTTP reply: malformed Content-Range header");
+	RETURN(-1);
+      }
+      parts->range_start = 0;
+      while (isdigit(*p))
+	parts->range_start = parts->range_start * 10 + *p++ - '0';
     }
     while (*p++ != '\n')
       ;
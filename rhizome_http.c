@@ -497,6 +497,28 @@ int http_header_complete(const char *buf, size_t len, size_t read_since_last_cal
 }
 
 int rhizome_direct_parse_http_request(rhizome_http_request *r);
+/* Parse a "Range: bytes=<start>-[<end>]" header, the only form of byte range that we serve.
+ * Returns 1 and sets *start and *end (inclusive) if the header is present and can be satisfied from
+ * content of the given length, otherwise returns 0, in which case all of the content is sent.
+ */
+static int http_request_range(char *headers, int headers_len, int64_t length, int64_t *start, int64_t *end)
+{
+  const char *range = str_str(headers, "Range: bytes=", headers_len);
+  if (!range)
+    return 0;
+  long long first, last;
+  int n = sscanf(range, "Range: bytes=%lld-%lld", &first, &last);
+  if (n < 1 || first < 0 || first >= length)
+    return 0;
+  if (n < 2 || last >= length)
+    last = length - 1;
+  if (last < first)
+    return 0;
+  *start = first;
+  *end = last;
+  return 1;
+}
+
 int rhizome_server_parse_http_request(rhizome_http_request *r)
 {
   /* Switching to writing, so update the call-back */
@@ -507,6 +529,7 @@ int rhizome_server_parse_http_request(rhizome_http_request *r)
   // Parse the HTTP "GET" line.
   char *path = NULL;
   size_t pathlen = 0;
+  char *headers = NULL;
   if (str_startswith(r->request, "POST ", (const char **)&path)) {
     return rhizome_direct_parse_http_request(r);
   } else if (str_startswith(r->request, "GET ", (const char **)&path)) {
@@ -519,9 +542,10 @@ int rhizome_server_parse_http_request(rhizome_http_request *r)
     if ( str_startswith(p, " HTTP/1.", &p)
       && (str_startswith(p, "0", &p) || str_startswith(p, "1", &p))
       && (str_startswith(p, "\r\n", &p) || str_startswith(p, "\n", &p))
-    )
+    ) {
       path[pathlen] = '\0';
-    else
+      headers = (char *)p;
+    } else
       path = NULL;
   }
   if (path) {
@@ -568,7 +592,6 @@ int rhizome_server_parse_http_request(rhizome_http_request *r)
 	if (!rhizome_str_is_file_hash(id)) {
 	  rhizome_server_simple_http_response(r, 400, "<html><h1>Invalid payload ID</h1></html>\r\n");
 	} else {
-	  // TODO: Check for Range: header and return 206 if returning partial content
 	  str_toupper_inplace(id);
 	  bzero(&r->read_state, sizeof(r->read_state));
 	  if (rhizome_open_read(&r->read_state, id, 1))
@@ -579,8 +602,21 @@ int rhizome_server_parse_http_request(rhizome_http_request *r)
 		rhizome_server_simple_http_response(r, 404, "<html><h1>Unknown length</h1></html>\r\n");
 	      }
 	    }
+	    // the fetching peer checks the payload hash, so don't read the payload through a buffer
+	    // just to check it here
+	    if (rhizome_read_can_sendfile(&r->read_state))
+	      r->read_state.hash = 0;
 	    r->read_state.offset = r->source_index = 0;
-	    if (r->read_state.length - r->read_state.offset>0){
+	    int64_t range_start, range_end;
+	    if (headers && http_request_range(headers, r->request + r->request_length - headers, r->read_state.length, &range_start, &range_end)) {
+	      // send only the requested part, so that an interrupted fetch can resume
+	      int64_t total_length = r->read_state.length;
+	      r->read_state.hash = 0;
+	      r->read_state.offset = range_start;
+	      r->read_state.length = range_end + 1;
+	      rhizome_server_http_range_response_header(r, "application/binary", range_start, range_end, total_length);
+	      r->request_type |= RHIZOME_HTTP_REQUEST_STORE;
+	    } else if (r->read_state.length - r->read_state.offset>0){
 	      rhizome_server_http_response_header(r, 200, "application/binary", r->read_state.length - r->read_state.offset);
 	      r->request_type |= RHIZOME_HTTP_REQUEST_STORE;
 	    }
@@ -669,6 +705,8 @@ static strbuf strbuf_build_http_response(strbuf sb, const struct http_response *
   strbuf_sprintf(sb, "HTTP/1.0 %03u %s\r\n", h->result_code, httpResultString(h->result_code));
   strbuf_sprintf(sb, "Content-type: %s\r\n", h->content_type);
   strbuf_sprintf(sb, "Content-length: %llu\r\n", h->content_length);
+  if (h->result_code == 206)
+    strbuf_sprintf(sb, "Content-range: bytes %llu-%llu/%llu\r\n", h->range_start, h->range_end, h->total_length);
   strbuf_puts(sb, "\r\n");
   if (h->body)
     strbuf_puts(sb, h->body);
@@ -728,6 +766,19 @@ int rhizome_server_http_response_header(rhizome_http_request *r, int result, con
   return rhizome_server_set_response(r, &hr);
 }
 
+int rhizome_server_http_range_response_header(rhizome_http_request *r, const char *mime_type, unsigned long long start, unsigned long long end, unsigned long long total)
+{
+  struct http_response hr;
+  hr.result_code = 206;
+  hr.content_type = mime_type;
+  hr.content_length = end - start + 1;
+  hr.body = NULL;
+  hr.range_start = start;
+  hr.range_end = end;
+  hr.total_length = total;
+  return rhizome_server_set_response(r, &hr);
+}
+
 /*
   return codes:
   1: connection still open.
@@ -793,6 +844,28 @@ int rhizome_server_http_send_bytes(rhizome_http_request *r)
       case RHIZOME_HTTP_REQUEST_STORE:
       {
 	r->request_type=0;
+	if (rhizome_read_can_sendfile(&r->read_state)) {
+	  // send unencrypted payload files straight to the socket, without copying them through our buffer
+	  int bytes = rhizome_read_sendfile(&r->read_state, r->alarm.poll.fd, r->read_state.length - r->read_state.offset);
+	  if (bytes == -1)
+	    break;
+	  r->request_type|=RHIZOME_HTTP_REQUEST_STORE;
+	  if (bytes == 0){
+	    // stop writing when the tcp buffer is full
+	    return 1;
+	  }
+	  
+	  // reset inactivity timer
+	  r->alarm.alarm = gettime_ms()+RHIZOME_IDLE_TIMEOUT;
+	  r->alarm.deadline = r->alarm.alarm+RHIZOME_IDLE_TIMEOUT;
+	  unschedule(&r->alarm);
+	  schedule(&r->alarm);
+	  
+	  if (r->read_state.offset >= r->read_state.length)
+	    r->request_type&=~RHIZOME_HTTP_REQUEST_STORE;
+	  break;
+	}
+	
 	int suggested_size=65536;
 	if (suggested_size > r->read_state.length - r->read_state.offset)
 	  suggested_size = r->read_state.length - r->read_state.offset;
@@ -137,7 +137,11 @@ unsigned long long rhizome_bar_bidprefix_ll(unsigned char *bar)
 static int append_bars(struct overlay_buffer *e, sqlite_retry_state *retry, const char *sql, long long *last_rowid){
   int count=0;
   
-  sqlite3_stmt *statement=sqlite_prepare(retry, sql, *last_rowid);
+  sqlite3_stmt *statement=sqlite_prepare_cached(retry, sql);
+  if (!statement)
+    return 0;
+  if (sqlite3_bind_parameter_count(statement))
+    sqlite3_bind_int64(statement, 1, *last_rowid);
   
   while(sqlite_step_retry(retry, statement) == SQLITE_ROW) {
     count++;
@@ -163,8 +167,7 @@ static int append_bars(struct overlay_buffer *e, sqlite_retry_state *retry, cons
     *last_rowid=rowid;
   }
   
-  if (statement)
-    sqlite3_finalize(statement);
+  sqlite_release(statement);
   
   return count;
 }
@@ -184,7 +187,7 @@ void overlay_rhizome_advertise(struct sched_ent *alarm){
   sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
 
   /* Get number of bundles available */
-  if (sqlite_exec_int64_retry(&retry, &bundles_available, "SELECT COUNT(BAR) FROM MANIFESTS;") != 1){
+  if (sqlite_exec_int64_prepared(&retry, &bundles_available, sqlite_prepare_cached(&retry, "SELECT COUNT(BAR) FROM MANIFESTS;")) != 1){
     WHY("Could not count BARs for advertisement");
     goto end;
   }
@@ -214,7 +217,7 @@ void overlay_rhizome_advertise(struct sched_ent *alarm){
       bundle_last_rowid=rowid;
     
     count = append_bars(frame->payload, &retry, 
-			"SELECT BAR,ROWID FROM MANIFESTS WHERE ROWID < %lld ORDER BY ROWID DESC LIMIT 17", 
+			"SELECT BAR,ROWID FROM MANIFESTS WHERE ROWID < ? ORDER BY ROWID DESC LIMIT 17", 
 			&bundle_last_rowid);
     if (count<17)
       bundle_last_rowid=INT64_MAX;
@@ -254,6 +257,21 @@ error:
   return -1;
 }
 
+/* Check the signatures of every new manifest from an advertisement in one batch, then consider
+   each of them for import.  rhizome_suggest_queue_manifest_import() will find their signatures
+   already checked. */
+static void suggest_advertised_manifests(rhizome_manifest **manifests, int *count,
+					 const struct sockaddr_in *httpaddr, const unsigned char *sid)
+{
+  int i;
+  if (*count == 0)
+    return;
+  rhizome_manifest_verify_batch(manifests, *count);
+  for (i = 0; i < *count; i++)
+    rhizome_suggest_queue_manifest_import(manifests[i], httpaddr, sid);
+  *count = 0;
+}
+
 int overlay_rhizome_saw_advertisements(int i, struct overlay_frame *f, long long now)
 {
   IN();
@@ -268,9 +286,12 @@ int overlay_rhizome_saw_advertisements(int i, struct overlay_frame *f, long long
   httpaddr.sin_port = htons(RHIZOME_HTTP_PORT);
   int manifest_length;
   rhizome_manifest *m=NULL;
+  rhizome_manifest *new_manifests[RHIZOME_VERIFY_BATCH_MAX];
+  int new_manifest_count=0;
   char httpaddrtxt[INET_ADDRSTRLEN];
   
   int (*oldfunc)() = sqlite_set_tracefunc(is_debug_rhizome_ads);
+  rhizome_version_cache_validate();
 
   if (ad_frame_type & 2){
     httpaddr.sin_port = htons(ob_get_ui16(f->payload));
@@ -303,6 +324,11 @@ int overlay_rhizome_saw_advertisements(int i, struct overlay_frame *f, long long
 	 But we do need to make sure that at least one signature is there.
       */	
       m = rhizome_new_manifest();
+      if (!m && new_manifest_count) {
+	// the ones we are holding on to might be all we need to let go of
+	suggest_advertised_manifests(new_manifests, &new_manifest_count, &httpaddr, f->source->sid);
+	m = rhizome_new_manifest();
+      }
       if (!m) {
 	WHY("Out of manifests");
 	sqlite_set_tracefunc(oldfunc);
@@ -312,6 +338,7 @@ int overlay_rhizome_saw_advertisements(int i, struct overlay_frame *f, long long
       if (rhizome_read_manifest_file(m, (char *)data, manifest_length) == -1) {
 	WHY("Error importing manifest body");
 	rhizome_manifest_free(m);
+	suggest_advertised_manifests(new_manifests, &new_manifest_count, &httpaddr, f->source->sid);
 	sqlite_set_tracefunc(oldfunc);
 	RETURN(0);
       }
@@ -320,6 +347,7 @@ int overlay_rhizome_saw_advertisements(int i, struct overlay_frame *f, long long
       if (rhizome_manifest_get(m, "id", manifest_id_prefix, sizeof manifest_id_prefix) == NULL) {
 	WHY("Manifest does not contain 'id' field");
 	rhizome_manifest_free(m);
+	suggest_advertised_manifests(new_manifests, &new_manifest_count, &httpaddr, f->source->sid);
 	sqlite_set_tracefunc(oldfunc);
 	RETURN(0);
       }
@@ -341,6 +369,7 @@ int overlay_rhizome_saw_advertisements(int i, struct overlay_frame *f, long long
 	   offering the same manifest */
 	WARN("Ignoring manifest announcment with no signature");
 	rhizome_manifest_free(m);
+	suggest_advertised_manifests(new_manifests, &new_manifest_count, &httpaddr, f->source->sid);
 	sqlite_set_tracefunc(oldfunc);
 	RETURN(0);
       }
@@ -361,8 +390,10 @@ int overlay_rhizome_saw_advertisements(int i, struct overlay_frame *f, long long
 	  } else {
 	    if (config.debug.rhizome_ads)
 	      DEBUG("Not seen before.");
-	    rhizome_suggest_queue_manifest_import(m, &httpaddr,f->source->sid);
-	    // the above function will free the manifest structure, make sure we don't free it again
+	    new_manifests[new_manifest_count++]=m;
+	    if (new_manifest_count>=RHIZOME_VERIFY_BATCH_MAX)
+	      suggest_advertised_manifests(new_manifests, &new_manifest_count, &httpaddr, f->source->sid);
+	    // rhizome_suggest_queue_manifest_import() will free the manifest structure, make sure we don't free it again
 	    m=NULL;
 	  }
 	}
@@ -380,6 +411,7 @@ int overlay_rhizome_saw_advertisements(int i, struct overlay_frame *f, long long
 	m = NULL;
       }
     }
+    suggest_advertised_manifests(new_manifests, &new_manifest_count, &httpaddr, f->source->sid);
   }
   
   overlay_mdp_frame mdp;
@@ -394,6 +426,10 @@ int overlay_rhizome_saw_advertisements(int i, struct overlay_frame *f, long long
       WARNF("Expected whole BAR @%x (only %d bytes remain)", ob_position(f->payload), ob_remaining(f->payload));
       break;
     }
+    // a node advertising a bundle we are already fetching can help with the fetch
+    if (rhizome_fetch_add_swarm_peer(&bar[RHIZOME_BAR_PREFIX_OFFSET], RHIZOME_BAR_PREFIX_BYTES,
+				     rhizome_bar_version(bar), f->source->sid))
+      continue;
     if (rhizome_is_bar_interesting(bar)==1){
       // add a request for the manifest
       if (mdp.out.payload_length==0){
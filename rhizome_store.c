@@ -1,3 +1,6 @@
+#ifdef HAVE_SYS_SENDFILE_H
+#include <sys/sendfile.h>
+#endif
 #include "serval.h"
 #include "rhizome.h"
 #include "conf.h"
@@ -7,10 +10,13 @@
 
 int rhizome_exists(const char *fileHash){
   long long gotfile = 0;
-  
-  if (sqlite_exec_int64(&gotfile, 
-	"SELECT COUNT(*) FROM FILES WHERE ID='%s' and datavalid=1;", 
-			fileHash) != 1){
+  sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
+  sqlite3_stmt *statement = sqlite_prepare_cached(&retry,
+	"SELECT COUNT(*) FROM FILES WHERE ID = ? and datavalid=1;");
+  if (!statement)
+    return 0;
+  sqlite3_bind_text(statement, 1, fileHash, -1, SQLITE_STATIC);
+  if (sqlite_exec_int64_prepared(&retry, &gotfile, statement) != 1){
     return 0;
   }
   return gotfile;
@@ -279,6 +285,166 @@ int rhizome_fail_write(struct rhizome_write *write){
   return 0; 
 }
 
+/* Payloads that were partly written when their fetch was interrupted.  The content written so far
+ * stays in the store as an invalid FILES row, and the hash state is remembered here, so that the
+ * next fetch of the same payload can carry on from where the last one stopped instead of starting
+ * again.  The oldest is discarded when the table is full.  Stale invalid files are still removed by
+ * rhizome_cleanup(), which rhizome_resume_write() detects.
+ */
+#define RHIZOME_PARTIAL_WRITES 8
+
+struct rhizome_partial_write {
+  char id[SHA512_DIGEST_STRING_LENGTH+1];
+  int64_t file_offset;
+  int64_t file_length;
+  int external;
+  SHA512_CTX sha512_context;
+  // when the write was suspended, zero if this entry is unused
+  time_ms_t suspended;
+};
+
+static struct rhizome_partial_write partial_writes[RHIZOME_PARTIAL_WRITES];
+
+/* Remove the stored content of a partial write, unless the payload has since been stored in full.
+ */
+static void rhizome_discard_partial_write(struct rhizome_partial_write *partial)
+{
+  partial->suspended = 0;
+  if (rhizome_exists(partial->id))
+    return;
+  if (partial->external)
+    rhizome_store_delete(partial->id);
+  sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
+  sqlite_exec_void_retry_loglevel(LOG_LEVEL_WARN, &retry, "DELETE FROM FILEBLOBS WHERE id='%s';", partial->id);
+  sqlite_exec_void_retry_loglevel(LOG_LEVEL_WARN, &retry, "DELETE FROM FILES WHERE id='%s' AND datavalid=0;", partial->id);
+}
+
+/* Stop writing a payload whose fetch was interrupted, but keep what has been written so far, so that
+ * rhizome_resume_write() can continue it later.  Discards the write instead if it cannot be resumed,
+ * ie, its hash is not known in advance, it is encrypted, or nothing has been written yet.
+ */
+int rhizome_suspend_write(struct rhizome_write *write)
+{
+  if (!write->id_known || write->crypt)
+    return rhizome_fail_write(write);
+  if (write->data_size > 0 && rhizome_flush(write))
+    return rhizome_fail_write(write);
+  if (write->file_offset <= 0)
+    return rhizome_fail_write(write);
+  
+  if (write->buffer)
+    free(write->buffer);
+  write->buffer=NULL;
+  if (config.rhizome.external_blobs && write->blob_fd!=-1)
+    close(write->blob_fd);
+  write->blob_fd=-1;
+  
+  // keep the stale file cleanup from removing it for a while longer
+  sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
+  sqlite_exec_void_retry_loglevel(LOG_LEVEL_WARN, &retry,
+			 "UPDATE FILES SET inserttime=%lld WHERE id='%s' AND datavalid=0;",
+			 gettime_ms(), write->id);
+  
+  struct rhizome_partial_write *partial = &partial_writes[0];
+  int i;
+  for (i = 0; i < RHIZOME_PARTIAL_WRITES; ++i) {
+    if (partial_writes[i].suspended && strcasecmp(partial_writes[i].id, write->id) == 0) {
+      partial = &partial_writes[i];
+      break;
+    }
+    if (partial->suspended && partial_writes[i].suspended < partial->suspended)
+      partial = &partial_writes[i];
+  }
+  if (partial->suspended && strcasecmp(partial->id, write->id) != 0)
+    rhizome_discard_partial_write(partial);
+  
+  strlcpy(partial->id, write->id, sizeof partial->id);
+  partial->file_offset = write->file_offset;
+  partial->file_length = write->file_length;
+  partial->external = config.rhizome.external_blobs;
+  partial->sha512_context = write->sha512_context;
+  partial->suspended = gettime_ms();
+  if (config.debug.rhizome_rx)
+    DEBUGF("Suspended write of %s at %lld of %lld bytes", write->id, (long long)write->file_offset, (long long)write->file_length);
+  return 0;
+}
+
+/* Continue writing a payload that was suspended by rhizome_suspend_write().  Returns 0 if the write
+ * was resumed, with write->file_offset set to the number of bytes already stored, 1 if there is no
+ * partial write of the payload that can be resumed, or -1 on error.
+ */
+int rhizome_resume_write(struct rhizome_write *write, const char *expectedFileHash, int64_t file_length)
+{
+  struct rhizome_partial_write *partial = NULL;
+  int i;
+  for (i = 0; i < RHIZOME_PARTIAL_WRITES; ++i) {
+    if (partial_writes[i].suspended && strcasecmp(partial_writes[i].id, expectedFileHash) == 0) {
+      partial = &partial_writes[i];
+      break;
+    }
+  }
+  if (!partial)
+    return 1;
+  // the content will either be taken over by this write or replaced by rhizome_open_write()
+  partial->suspended = 0;
+  if (partial->file_length != file_length || partial->external != config.rhizome.external_blobs)
+    return 1;
+  
+  long long datavalid = -1;
+  if (sqlite_exec_int64(&datavalid, "SELECT datavalid FROM FILES WHERE id='%s';", partial->id) != 1 || datavalid != 0) {
+    rhizome_discard_partial_write(partial);
+    return 1;
+  }
+  
+  write->blob_fd = -1;
+  if (partial->external) {
+    // no FILEBLOBS row, but the fetch logic takes a rowid of -1 to mean a manifest
+    write->blob_rowid = 0;
+    char blob_path[1024];
+    if (!FORM_RHIZOME_DATASTORE_PATH(blob_path, partial->id))
+      return -1;
+    write->blob_fd = open(blob_path, O_WRONLY);
+    if (write->blob_fd == -1) {
+      rhizome_discard_partial_write(partial);
+      return 1;
+    }
+    if (lseek(write->blob_fd, partial->file_offset, SEEK_SET) == -1) {
+      WHYF_perror("lseek(%s,%lld,SEEK_SET)", alloca_str_toprint(blob_path), (long long)partial->file_offset);
+      close(write->blob_fd);
+      write->blob_fd = -1;
+      rhizome_discard_partial_write(partial);
+      return 1;
+    }
+  } else {
+    long long rowid = -1;
+    if (sqlite_exec_int64(&rowid, "SELECT rowid FROM FILEBLOBS WHERE id='%s';", partial->id) != 1) {
+      rhizome_discard_partial_write(partial);
+      return 1;
+    }
+    write->blob_rowid = rowid;
+  }
+  
+  strlcpy(write->id, partial->id, SHA512_DIGEST_STRING_LENGTH);
+  write->id_known = 1;
+  write->crypt = 0;
+  write->file_length = partial->file_length;
+  write->file_offset = partial->file_offset;
+  write->data_size = 0;
+  write->sha512_context = partial->sha512_context;
+  
+  write->buffer_size=write->file_length;
+  if (write->buffer_size>RHIZOME_BUFFER_MAXIMUM_SIZE)
+    write->buffer_size=RHIZOME_BUFFER_MAXIMUM_SIZE;
+  write->buffer=malloc(write->buffer_size);
+  if (!write->buffer){
+    rhizome_fail_write(write);
+    return WHY("Unable to allocate write buffer");
+  }
+  if (config.debug.rhizome_rx)
+    DEBUGF("Resumed write of %s at %lld of %lld bytes", write->id, (long long)write->file_offset, (long long)write->file_length);
+  return 0;
+}
+
 int rhizome_finish_write(struct rhizome_write *write){
   if (write->data_size>0){
     if (rhizome_flush(write))
@@ -470,7 +636,9 @@ int rhizome_open_read(struct rhizome_read *read, const char *fileid, int hash)
   if (read->blob_rowid != -1) {
     read->length = -1; // discover the length on opening the db BLOB
   } else {
-    // No row in FILEBLOBS, look for an external blob file.
+    // No row in FILEBLOBS, look for an external blob file, but not one that is still being written.
+    if (!rhizome_exists(read->id))
+      return 1;
     char blob_path[1024];
     if (!FORM_RHIZOME_DATASTORE_PATH(blob_path, read->id))
       return -1;
@@ -561,6 +729,44 @@ int rhizome_read(struct rhizome_read *read_state, unsigned char *buffer, int buf
   OUT();
 }
 
+/* Return true if stored content can be sent with rhizome_read_sendfile(), ie, it is in an external
+ * blob file and is not encrypted.
+ */
+int rhizome_read_can_sendfile(struct rhizome_read *read_state)
+{
+#ifdef HAVE_SYS_SENDFILE_H
+  return read_state->blob_fd != -1 && !read_state->crypt;
+#else
+  return 0;
+#endif
+}
+
+/* Write up to 'length' bytes of stored content from the external blob file straight to the given
+ * file descriptor (normally a socket), without copying it through a buffer.  The content is not
+ * hashed, so the read must have been opened (or changed) without hashing.
+ * Returns the number of bytes written, zero if the descriptor would block, or -1 on error.
+ */
+int rhizome_read_sendfile(struct rhizome_read *read_state, int fd, int64_t length)
+{
+#ifdef HAVE_SYS_SENDFILE_H
+  if (!rhizome_read_can_sendfile(read_state) || read_state->hash)
+    return WHY("Bug! Cannot send this content from file");
+  off_t offset = read_state->offset;
+  ssize_t sent = sendfile(fd, read_state->blob_fd, &offset, length);
+  if (sent == -1) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK)
+      return 0;
+    return WHYF_perror("sendfile(%d,%d,%ld,%ld)", fd, read_state->blob_fd, (long)read_state->offset, (long)length);
+  }
+  if (sent == 0)
+    return WHYF("Unexpected end of file at %ld of %ld", (long)read_state->offset, (long)read_state->length);
+  read_state->offset += sent;
+  return sent;
+#else
+  return WHY("sendfile() not supported");
+#endif
+}
+
 int rhizome_read_close(struct rhizome_read *read)
 {
   if (read->blob_fd != -1)
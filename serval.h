@@ -290,19 +290,25 @@ void keyring_identity_extract(const keyring_identity *id, const unsigned char **
 
 extern int sock;
 
+/* Call latency histogram, with four buckets for every power of two nanoseconds, up to about 18
+   minutes.  Longer calls are counted in the last bucket. */
+#define PROFILE_HISTOGRAM_BUCKETS 160
+
+/* Times are in nanoseconds, excluding time spent in profiled child calls */
 struct profile_total {
   struct profile_total *_next;
   int _initialised;
   const char *name;
-  time_ms_t max_time;
-  time_ms_t total_time;
-  time_ms_t child_time;
+  time_ns_t max_time;
+  time_ns_t total_time;
+  time_ns_t child_time;
   int calls;
+  unsigned int histogram[PROFILE_HISTOGRAM_BUCKETS];
 };
 
 struct call_stats{
-  time_ms_t enter_time;
-  time_ms_t child_time;
+  time_ns_t enter_time;
+  time_ns_t child_time;
   struct profile_total *totals;
   struct call_stats *prev;
 };
@@ -311,9 +317,14 @@ struct sched_ent;
 
 typedef void (*ALARM_FUNCP) (struct sched_ent *alarm);
 
+struct sched_heap;
+
 struct sched_ent{
-  struct sched_ent *_next;
-  struct sched_ent *_prev;
+  // the alarm or deadline heap this entry is queued in, and its position
+  struct sched_heap *_heap;
+  unsigned int _heap_index;
+  // insertion order, so that entries with equal times are called in FIFO order
+  unsigned int _sequence;
   
   ALARM_FUNCP function;
   void *context;
@@ -342,7 +353,7 @@ struct overlay_buffer;
 struct overlay_frame;
 struct broadcast;
 
-#define STRUCT_SCHED_ENT_UNUSED ((struct sched_ent){NULL, NULL, NULL, NULL, {-1, 0, 0}, 0LL, 0LL, NULL, -1})
+#define STRUCT_SCHED_ENT_UNUSED ((struct sched_ent){NULL, 0, 0, NULL, NULL, {-1, 0, 0}, 0LL, 0LL, NULL, -1})
 
 extern int overlayMode;
 
@@ -386,6 +397,7 @@ typedef struct overlay_interface {
   char name[256];
   
   int recv_offset; /* file offset */
+  struct overlay_ring *ring; /* shared memory, for ring interfaces */
   unsigned char txbuffer[OVERLAY_INTERFACE_RX_BUFFER_SIZE];
   int tx_bytes_pending;
   
@@ -394,6 +406,8 @@ typedef struct overlay_interface {
   // copy of ifconfig flags
   char drop_broadcasts;
   char drop_unicasts;
+  int drop_packets;
+  int latency_ms;
   int port;
   int type;
   int socket_type;
@@ -429,6 +443,19 @@ typedef struct overlay_interface {
   
   struct limit_state transfer_limit;
   
+  /* How many packets to read from the socket each time it is readable, and how that has
+     gone.  A wakeup that fills the whole batch probably left more packets waiting.
+     Dropped packets are those the kernel discarded because we didn't read them in time. */
+  int recv_batch;
+  unsigned int recv_wakeups;
+  unsigned int recv_packets;
+  unsigned int recv_full_batches;
+  unsigned int recv_dropped;
+  uint32_t recv_socket_dropped; /* drop count last reported by the current socket */
+  /* How many packets we have sent, in how many batches */
+  unsigned int tx_batches;
+  unsigned int tx_packets;
+  
   /* We need to make sure that interface name and broadcast address is unique for all interfaces that are UP.
    We bind a separate socket per interface / broadcast address Broadcast address and netmask, if known
    We really only case about distinct broadcast addresses on interfaces.
@@ -521,6 +548,7 @@ int overlay_frame_build_header(struct decode_context *context, struct overlay_bu
 			       struct subscriber *destination, struct subscriber *source);
 int overlay_interface_args(const char *arg);
 void overlay_rhizome_advertise(struct sched_ent *alarm);
+void rhizome_checkpoint_db(struct sched_ent *alarm);
 int overlay_add_local_identity(unsigned char *s);
 
 extern int overlay_interface_count;
@@ -545,7 +573,9 @@ typedef struct overlay_node_observation {
 
 typedef struct overlay_node {
   struct subscriber *subscriber;
-  int neighbour_id; /* 0=not a neighbour */
+  struct overlay_neighbour *neighbour; /* NULL=not a neighbour */
+  int recalc_index; /* 1 + position in the queue of nodes waiting to be recalculated, 0=not queued */
+  time_ms_t recalc_at; /* when this node's score next needs recalculating */
   int most_recent_observation_id;
   int best_link_score;
   int best_observation;
@@ -579,6 +609,8 @@ int ovleray_route_please_advertise(overlay_node *n);
 int overlay_route_saw_advertisements(int i, struct overlay_frame *f, struct decode_context *context, time_ms_t now);
 int overlay_rhizome_saw_advertisements(int i, struct overlay_frame *f,  time_ms_t now);
 int overlay_route_please_advertise(overlay_node *n);
+int overlay_route_node_score(overlay_node *n, time_ms_t now);
+void overlay_route_reachable_changed(struct subscriber *subscriber, int old_value);
 int rhizome_server_get_fds(struct pollfd *fds,int *fdcount,int fdmax);
 int rhizome_saw_voice_traffic();
 int overlay_saw_mdp_containing_frame(struct overlay_frame *f, time_ms_t now);
@@ -594,6 +626,9 @@ int overlay_mdp_get_fds(struct pollfd *fds,int *fdcount,int fdmax);
 int overlay_mdp_reply_error(int sock,
 			    struct sockaddr_un *recvaddr,int recvaddrlen,
 			    int error_number,char *message);
+int overlay_mdp_reply_ok(int sock,
+			 struct sockaddr_un *recvaddr,int recvaddrlen,
+			 char *message);
 extern struct sched_ent mdp_abstract;
 extern struct sched_ent mdp_named;
 
@@ -602,7 +637,9 @@ typedef struct sockaddr_mdp {
   unsigned char sid[SID_SIZE];
   unsigned int port;
 } sockaddr_mdp;
-unsigned char *keyring_get_nm_bytes(unsigned char *known_sid, unsigned char *unknown_sid);
+unsigned char *keyring_get_nm_bytes(const unsigned char *known_sid, const unsigned char *unknown_sid);
+void keyring_nm_showstats();
+void keyring_nm_clearstats();
 
 typedef struct overlay_mdp_data_frame {
   sockaddr_mdp src;
@@ -707,6 +744,15 @@ overlay_broadcast_ensemble(overlay_interface *interface,
 			   struct sockaddr_in *recipientaddr,
 			   unsigned char *bytes,int len);
 
+/* One of several packets to send out the same interface together */
+struct overlay_tx_packet{
+  struct sockaddr_in recipientaddr;
+  unsigned char *bytes;
+  int len;
+  int result; /* set to 0 if the packet was sent, -1 if not */
+};
+int overlay_broadcast_ensemble_batch(overlay_interface *interface, struct overlay_tx_packet *packets, int count);
+
 int directory_registration();
 int directory_service_init();
 
@@ -716,6 +762,11 @@ int app_rhizome_direct_sync(const struct cli_parsed *parsed, void *context);
 int app_pa_phone(const struct cli_parsed *parsed, void *context);
 #endif
 int app_monitor_cli(const struct cli_parsed *parsed, void *context);
+int app_monitor_test(const struct cli_parsed *parsed, void *context);
+int app_monitor_stats(const struct cli_parsed *parsed, void *context);
+int app_route_test(const struct cli_parsed *parsed, void *context);
+int app_nm_cache_test(const struct cli_parsed *parsed, void *context);
+int app_crypto_batch_test(const struct cli_parsed *parsed, void *context);
 int app_vomp_console(const struct cli_parsed *parsed, void *context);
 
 int monitor_get_fds(struct pollfd *fds,int *fdcount,int fdmax);
@@ -795,12 +846,25 @@ void overlay_interface_discover(struct sched_ent *alarm);
 void overlay_packetradio_poll(struct sched_ent *alarm);
 int overlay_packetradio_setup_port(overlay_interface *interface);
 int overlay_packetradio_tx_packet(struct overlay_frame *frame);
+void overlay_interface_receive_simulated(struct overlay_interface *interface,
+					 struct sockaddr_in *src_addr, struct sockaddr_in *dst_addr,
+					 unsigned char *payload, int payload_length);
+int overlay_ring_open(overlay_interface *interface);
+void overlay_ring_close(overlay_interface *interface);
+int overlay_ring_send(overlay_interface *interface, struct sockaddr_in *recipientaddr,
+		      unsigned char *bytes, int len);
+int overlay_ring_read(overlay_interface *interface, unsigned int *dropped);
 void overlay_dummy_poll(struct sched_ent *alarm);
-void overlay_route_tick(struct sched_ent *alarm);
 void server_config_reload(struct sched_ent *alarm);
 void server_shutdown_check(struct sched_ent *alarm);
 void overlay_mdp_poll(struct sched_ent *alarm);
 int overlay_mdp_try_interal_services(overlay_mdp_frame *mdp);
+void overlay_mdp_process_request(int sock, overlay_mdp_frame *mdp, struct sockaddr_un *recvaddr_un, int recvaddrlen);
+int overlay_mdp_releasebindings(struct sockaddr_un *recvaddr,int recvaddrlen);
+int overlay_mdp_client_is_gone(const char *socket_name, int name_len);
+int overlay_mdp_ring_attach(struct sockaddr_un *recvaddr, int recvaddrlen, int *fds, int fd_count);
+void overlay_mdp_ring_detach(struct sockaddr_un *recvaddr, int recvaddrlen);
+int overlay_mdp_ring_deliver(struct sockaddr_un *recvaddr, int recvaddrlen, overlay_mdp_frame *mdp);
 int overlay_send_probe(struct subscriber *peer, struct sockaddr_in addr, overlay_interface *interface, int queue);
 int overlay_send_stun_request(struct subscriber *server, struct subscriber *request);
 void fd_periodicstats(struct sched_ent *alarm);
@@ -825,7 +889,11 @@ int limit_init(struct limit_state *state, int rate_micro_seconds);
 
 /* function timing routines */
 int fd_clearstats();
+void fd_tally_loop(int ready, int alarms_run, int overrun);
 int fd_showstats();
+time_ns_t fd_stat_percentile(const struct profile_total *s, int percent);
+extern struct profile_total *stats_head;
+extern time_ms_t stats_since;
 int fd_checkalarms();
 int fd_func_enter(struct __sourceloc __whence, struct call_stats *this_call);
 int fd_func_exit(struct __sourceloc __whence, struct call_stats *this_call);
@@ -119,7 +119,7 @@ executeOk_servald() {
 #     func foo bar
 set_instance_fromarg() {
    case "$1" in
-   +[A-Z]) set_instance "$1"; return 0;;
+   +[A-Z] | +[A-Z][A-Z]) set_instance "$1"; return 0;;
    esac
    return 1
 }
@@ -150,10 +150,15 @@ set_instance() {
    '')
       error "missing instance name argument"
       ;;
-   +[A-Z])
+   +[A-Z] | +[A-Z][A-Z])
       instance_arg="${1}"
       instance_name="${instance_arg#+}"
-      instance_number=$((36#$instance_name - 9))
+      # A..Z are 1..26, then AA..ZZ carry on from 27
+      if [ ${#instance_name} -eq 1 ]; then
+         instance_number=$((36#$instance_name - 9))
+      else
+         instance_number=$(((36#${instance_name:0:1} - 9) * 26 + 36#${instance_name:1:1} - 9))
+      fi
       tfw_log "# set instance = $instance_name, number = $instance_number"
       export instance_dir="${servald_instances_dir?:}/$instance_name"
       mkdir -p "$instance_dir"
@@ -162,7 +167,7 @@ set_instance() {
       instance_servald_pidfile="$SERVALINSTANCE_PATH/servald.pid"
       ;;
    *)
-      error "malformed instance name argument, must be in form +[A-Z]"
+      error "malformed instance name argument, must be in form +[A-Z] or +[A-Z][A-Z]"
       ;;
    esac
 }
@@ -186,7 +191,7 @@ foreach_instance() {
    local -a instances=()
    while [ $# -ne 0 ]; do
       case "$1" in
-      +[A-Z]) instances+=("$1"); shift;;
+      +[A-Z] | +[A-Z][A-Z]) instances+=("$1"); shift;;
       *) break;;
       esac
    done
@@ -671,7 +676,7 @@ assert_peers_are_instances() {
 # Predicate function:
 # - useful in combination with assert() and wait_until()
 # - return true if the current instance has logged that it has seen all other instances via the
-#   selfannounce mechanism
+#   selfannounce mechanism, and has a route to each of them
 has_seen_instances() {
    local I N
    executeOk_servald route print
@@ -680,7 +685,7 @@ has_seen_instances() {
       for ((N=1; 1; ++N)); do
          local sidvar=SID${I#+}$N
          [ -n "${!sidvar}" ] || break
-         if ! grep "^${!sidvar}" $_tfw_tmp/stdout; then
+         if ! grep "^${!sidvar}:\(BROADCAST\|UNICAST\|INDIRECT\)" $_tfw_tmp/stdout; then
             return 1
          fi
       done
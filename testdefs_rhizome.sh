@@ -331,7 +331,7 @@ bundle_received_by() {
             rexps+=("RHIZOME ADD MANIFEST service=.* bid=$bid version=$version")
          fi
          ;;
-      +[A-Z])
+      +[A-Z] | +[A-Z][A-Z])
          push_instance
          tfw_nolog set_instance $arg || return $?
          for ((i = 0; i < ${#bundles[*]}; ++i)); do